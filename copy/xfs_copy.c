@@ -13,6 +13,8 @@
 #include "xfs_copy.h"
 #include "libxlog.h"
 #include "libfrog/platform.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/convert.h"
 
 #define	rounddown(x, y)	(((x)/(y))*(y))
 #define uuid_equal(s,d) (platform_uuid_compare((s),(d)) == 0)
@@ -39,13 +41,14 @@ static target_control	*target;
 static wbuf		w_buf;
 static wbuf		btree_buf;
 
+#define WBUF_RING_SIZE	16		/* source buffers in flight */
+#define BTREE_BUF_SIZE	(256 * 1024)	/* free space btree read window */
+#define MAX_SCANNERS	1024		/* most -j threads we'll start */
+
 static unsigned int	kids;
 
-static thread_control	glob_masks;
 static thread_args	*targ;
 
-static pthread_mutex_t	mainwait;
-
 #define ACTIVE		1
 #define INACTIVE	2
 
@@ -220,33 +223,61 @@ do_write(
 	return error;
 }
 
+/*
+ * The source is read into a ring of buffers, and each target thread works
+ * its way around the ring at its own pace.  A buffer can't be refilled until
+ * every target that was active when it was queued has written it out, so
+ * the reader only stalls when the slowest target falls a whole ring behind.
+ */
+static pthread_mutex_t	wring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	wring_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	wring_free = PTHREAD_COND_INITIALIZER;
+static wbuf		*wring;
+static int		wring_size;
+static uint64_t		wring_queued;	/* buffers handed to the targets */
+static int		wring_done;
+
 static void *
 begin_reader(void *arg)
 {
 	thread_args	*args = arg;
+	wbuf		*buf;
+	int		error;
 
 	rcu_register_thread();
+	pthread_mutex_lock(&wring_lock);
 	for (;;) {
-		pthread_mutex_lock(&args->wait);
-		if (do_write(args, NULL))
+		while (args->next == wring_queued && !wring_done)
+			pthread_cond_wait(&wring_ready, &wring_lock);
+		if (args->next == wring_queued)
+			break;
+
+		buf = &wring[args->next % wring_size];
+		pthread_mutex_unlock(&wring_lock);
+		error = do_write(args, buf);
+		pthread_mutex_lock(&wring_lock);
+		if (error)
 			goto handle_error;
-	        pthread_mutex_lock(&glob_masks.mutex);
-		if (--glob_masks.num_working == 0)
-			pthread_mutex_unlock(&mainwait);
-		pthread_mutex_unlock(&glob_masks.mutex);
+
+		args->next++;
+		if (--buf->refs == 0)
+			pthread_cond_signal(&wring_free);
 	}
-	/* NOTREACHED */
+	pthread_mutex_unlock(&wring_lock);
+	rcu_unregister_thread();
+	return NULL;
 
 handle_error:
-	/* error will be logged by primary thread */
-
-	pthread_mutex_lock(&glob_masks.mutex);
+	/*
+	 * Error will be logged by primary thread.  Drop our references to
+	 * everything queued so far so that the reader doesn't wait for us.
+	 */
 	target[args->id].state = INACTIVE;
-	if (--glob_masks.num_working == 0)
-		pthread_mutex_unlock(&mainwait);
-	pthread_mutex_unlock(&glob_masks.mutex);
+	for (; args->next < wring_queued; args->next++)
+		wring[args->next % wring_size].refs--;
+	pthread_cond_signal(&wring_free);
+	pthread_mutex_unlock(&wring_lock);
 	rcu_unregister_thread();
-	pthread_exit(NULL);
 	return NULL;
 }
 
@@ -316,7 +347,7 @@ static void
 usage(void)
 {
 	fprintf(stderr,
-		_("Usage: %s [-bdV] [-L logfile] source target [target ...]\n"),
+	_("Usage: %s [-bdV] [-j threads] [-L logfile] source target [target ...]\n"),
 		progname);
 	exit(1);
 }
@@ -360,8 +391,6 @@ bump_bar(int tenths, uint64_t numblocks)
 	return tenths;
 }
 
-static xfs_off_t source_position = -1;
-
 static wbuf *
 wbuf_init(wbuf *buf, int data_size, int data_align, int min_io_size, int id)
 {
@@ -379,11 +408,14 @@ wbuf_init(wbuf *buf, int data_size, int data_align, int min_io_size, int id)
 	return buf;
 }
 
+/*
+ * Positioned reads, so that the AG scanners can share the source fd with
+ * the main thread.
+ */
 static void
 read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 {
 	int		res = 0;
-	xfs_off_t	lres = 0;
 	xfs_off_t	newpos;
 	size_t		diff;
 
@@ -396,17 +428,7 @@ read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 		buf->length += diff;
 	}
 
-	if (source_position != buf->position)  {
-		lres = lseek(fd, buf->position, SEEK_SET);
-		if (lres < 0LL)  {
-			do_warn(_("%s:  lseek failure at offset %lld\n"),
-				progname, source_position);
-			die_perror();
-		}
-		source_position = buf->position;
-	}
-
-	ASSERT(source_position % source_sectorsize == 0);
+	ASSERT(buf->position % source_sectorsize == 0);
 
 	/* round up length for direct I/O if necessary */
 
@@ -419,18 +441,17 @@ read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 		exit(1);
 	}
 
-	if ((res = read(fd, buf->data, buf->length)) < 0)  {
+	if ((res = pread(fd, buf->data, buf->length, buf->position)) < 0)  {
 		do_warn(_("%s:  read failure at offset %lld\n"),
-				progname, source_position);
+				progname, buf->position);
 		die_perror();
 	}
 
 	if (res < buf->length &&
-	    source_position + res == mp->m_sb.sb_dblocks * source_blocksize)
+	    buf->position + res == mp->m_sb.sb_dblocks * source_blocksize)
 		res = buf->length;
 	else
 		ASSERT(res == buf->length);
-	source_position += res;
 	buf->length = res;
 }
 
@@ -481,36 +502,135 @@ read_ag_header(int fd, xfs_agnumber_t agno, wbuf *buf, ag_header_t *ag,
 }
 
 
+/* Wait for the next buffer in the ring to be written by all targets. */
+static wbuf *
+wbuf_get(void)
+{
+	wbuf		*buf = &wring[wring_queued % wring_size];
+
+	pthread_mutex_lock(&wring_lock);
+	while (buf->refs > 0)
+		pthread_cond_wait(&wring_free, &wring_lock);
+	pthread_mutex_unlock(&wring_lock);
+	return buf;
+}
+
+/* Hand a buffer filled by wbuf_get to every active target. */
 static void
-write_wbuf(void)
+wbuf_queue(wbuf *buf)
 {
 	int		i;
-	int		badness = 0;
-
-	/* verify target threads */
-	for (i = 0; i < num_targets; i++)
-		if (target[i].state != INACTIVE)
-			glob_masks.num_working++;
+	int		active = 0;
 
-	/* release target threads */
+	pthread_mutex_lock(&wring_lock);
 	for (i = 0; i < num_targets; i++)
 		if (target[i].state != INACTIVE)
-			pthread_mutex_unlock(&targ[i].wait);	/* wake up */
-		else
-			badness++;
+			active++;
 
 	/*
-	 * If all the targets are inactive then there won't be any io
-	 * threads left to release mainwait.  We're screwed, so bail out.
+	 * If all the targets are inactive then there's nobody left to
+	 * write the data.  We're screwed, so bail out.
 	 */
-	if (badness == num_targets) {
+	if (active == 0) {
+		pthread_mutex_unlock(&wring_lock);
 		check_errors();
 		exit(1);
 	}
 
-	signal_maskfunc(SIGCHLD, SIG_UNBLOCK);
-	pthread_mutex_lock(&mainwait);
-	signal_maskfunc(SIGCHLD, SIG_BLOCK);
+	buf->refs = active;
+	wring_queued++;
+	pthread_cond_broadcast(&wring_ready);
+	pthread_mutex_unlock(&wring_lock);
+}
+
+/* Wait for the targets to write everything, then stop the threads. */
+static void
+wbuf_drain(void)
+{
+	int		i;
+
+	pthread_mutex_lock(&wring_lock);
+	for (i = 0; i < wring_size; i++)
+		while (wring[i].refs > 0)
+			pthread_cond_wait(&wring_free, &wring_lock);
+	wring_done = 1;
+	pthread_cond_broadcast(&wring_ready);
+	pthread_mutex_unlock(&wring_lock);
+
+	for (i = 0; i < num_targets; i++)
+		pthread_join(target[i].pid, NULL);
+}
+
+/*
+ * Copy the daddr range [@begin, @end) from the source to all targets, one
+ * ring buffer at a time.
+ */
+static void
+copy_range(
+	struct xfs_mount	*mp,
+	xfs_daddr_t		begin,
+	xfs_daddr_t		end,
+	int			miniosize,
+	uint64_t		*numblocks,
+	int			*howfar)
+{
+	uint64_t		sizeb = end - begin;
+	uint64_t		size = roundup(sizeb << BBSHIFT, miniosize);
+	xfs_off_t		position = (xfs_off_t)begin << BBSHIFT;
+	wbuf			*buf;
+
+	while (size > 0)  {
+		buf = wbuf_get();
+		buf->position = position;
+
+		/* let lower layer do alignment */
+		if (size > buf->size)  {
+			buf->length = buf->size;
+			size -= buf->size;
+			sizeb -= buf->size / BBSIZE;
+			*numblocks += buf->size / BBSIZE;
+		} else  {
+			buf->length = size;
+			*numblocks += sizeb;
+			size = 0;
+		}
+
+		read_wbuf(source_fd, buf, mp);
+		position = buf->position + buf->length;
+		wbuf_queue(buf);
+
+		*howfar = bump_bar(*howfar, *numblocks);
+	}
+}
+
+/*
+ * Return the btree block at @bno.  Free space btree leaves are frequently
+ * allocated next to each other, so read a large window of the AG at a time
+ * and only go back to the disk when a sibling falls outside of it.
+ */
+static struct xfs_btree_block *
+read_btree_block(
+	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		bno,
+	xfs_daddr_t		ag_end,
+	wbuf			*buf)
+{
+	xfs_off_t		pos, end;
+
+	pos = (xfs_off_t)XFS_AGB_TO_DADDR(mp, agno, bno) << BBSHIFT;
+	end = (xfs_off_t)ag_end << BBSHIFT;
+
+	if (buf->length == 0 || pos < buf->position ||
+	    pos + source_blocksize > buf->position + buf->length) {
+		/* leave room for read_wbuf to align the start */
+		buf->position = pos;
+		buf->length = min(end - pos,
+				(xfs_off_t)(buf->size - buf->min_io_size));
+		read_wbuf(source_fd, buf, mp);
+	}
+
+	return (struct xfs_btree_block *)(buf->data + pos - buf->position);
 }
 
 static void
@@ -546,6 +666,368 @@ sb_update_uuid(
 				XFS_SB_CRC_OFF);
 }
 
+/*
+ * Used space separated by a free extent no larger than this is copied in a
+ * single read, since reading the free blocks is cheaper than the extra I/O.
+ */
+#define COPY_MERGE_GAP	((64 * 1024) >> BBSHIFT)
+
+struct copy_extent {
+	xfs_agblock_t	start;
+	xfs_extlen_t	len;
+};
+
+/* The layout and free space of one AG. */
+struct copy_scan {
+	xfs_daddr_t		hdr_begin;	/* aligned start of the header */
+	xfs_daddr_t		ag_begin;	/* first daddr after the header */
+	xfs_daddr_t		ag_end;
+	struct copy_extent	*exts;		/* free extents, in order */
+	size_t			nr;
+	size_t			max;
+};
+
+/* A range of used space that may still be extended by the next one. */
+struct copy_run {
+	xfs_daddr_t		begin;
+	xfs_daddr_t		end;
+};
+
+/* Context for the parallel AG scanners. */
+struct copy_scan_ctx {
+	struct xfs_mount	*mp;
+	struct copy_scan	*scans;
+	int			align;
+	int			miniosize;
+};
+
+/*
+ * Gather all the free extents in an AG from the bnobt leaves before copying
+ * anything, so that the btree reads aren't interleaved with the data reads.
+ */
+static void
+read_free_extents(
+	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		bno,
+	uint			btree_levels,
+	struct copy_scan	*scan,
+	wbuf			*bbuf)
+{
+	struct xfs_btree_block	*block;
+	xfs_alloc_ptr_t		*ptr;
+	xfs_alloc_rec_t		*rec_ptr;
+	uint			current_level = 0;
+	int			i;
+
+	scan->nr = 0;
+
+	/* nothing from the last AG is cached */
+	bbuf->length = 0;
+
+	/* traverse btree until we get to the leftmost leaf node */
+
+	for (;;) {
+		if (current_level >= btree_levels) {
+			do_log(
+		_("Error: current level %d >= btree levels %d\n"),
+				current_level, btree_levels);
+			exit(1);
+		}
+
+		current_level++;
+
+		block = read_btree_block(mp, agno, bno, scan->ag_end, bbuf);
+		if (be32_to_cpu(block->bb_magic) !=
+		    (xfs_has_crc(mp) ? XFS_ABTB_CRC_MAGIC : XFS_ABTB_MAGIC)) {
+			do_log(_("Bad btree magic 0x%x\n"),
+				be32_to_cpu(block->bb_magic));
+			exit(1);
+		}
+
+		if (be16_to_cpu(block->bb_level) == 0)
+			break;
+
+		ptr = XFS_ALLOC_PTR_ADDR(mp, block, 1, mp->m_alloc_mxr[1]);
+		bno = be32_to_cpu(ptr[0]);
+	}
+
+	for (;;) {
+		if (be16_to_cpu(block->bb_level) != 0)  {
+			do_log(_("WARNING:  source filesystem inconsistent.\n"));
+			do_log(
+		_("  A leaf btree rec isn't a leaf.  Aborting now.\n"));
+			exit(1);
+		}
+
+		if (scan->nr + be16_to_cpu(block->bb_numrecs) > scan->max) {
+			scan->max = max(scan->max * 2,
+					scan->nr + be16_to_cpu(block->bb_numrecs));
+			scan->exts = realloc(scan->exts,
+					scan->max * sizeof(*scan->exts));
+			if (!scan->exts) {
+				do_log(_("Couldn't allocate free extent list\n"));
+				die_perror();
+			}
+		}
+
+		rec_ptr = XFS_ALLOC_REC_ADDR(mp, block, 1);
+		for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++, rec_ptr++) {
+			scan->exts[scan->nr].start =
+					be32_to_cpu(rec_ptr->ar_startblock);
+			scan->exts[scan->nr].len =
+					be32_to_cpu(rec_ptr->ar_blockcount);
+			scan->nr++;
+		}
+
+		bno = be32_to_cpu(block->bb_u.s.bb_rightsib);
+		if (bno == NULLAGBLOCK)
+			break;
+
+		/* read in next btree record block */
+
+		block = read_btree_block(mp, agno, bno, scan->ag_end, bbuf);
+		ASSERT(be32_to_cpu(block->bb_magic) == XFS_ABTB_MAGIC ||
+		       be32_to_cpu(block->bb_magic) == XFS_ABTB_CRC_MAGIC);
+	}
+}
+
+/* Copy the pending run of used space, if there is one. */
+static void
+flush_run(
+	struct xfs_mount	*mp,
+	struct copy_run		*run,
+	int			miniosize,
+	uint64_t		*numblocks,
+	int			*howfar)
+{
+	if (run->end > run->begin)
+		copy_range(mp, run->begin, run->end, miniosize, numblocks,
+				howfar);
+	run->begin = run->end = 0;
+}
+
+/*
+ * Add a used range to the pending run.  Ranges that are only separated by a
+ * small free extent are merged into one.
+ */
+static void
+queue_used(
+	struct xfs_mount	*mp,
+	struct copy_run		*run,
+	xfs_daddr_t		begin,
+	xfs_daddr_t		end,
+	int			miniosize,
+	uint64_t		*numblocks,
+	int			*howfar)
+{
+	if (end <= begin)
+		return;
+
+	if (run->end > run->begin && begin - run->end <= COPY_MERGE_GAP) {
+		run->end = max(run->end, end);
+		return;
+	}
+
+	flush_run(mp, run, miniosize, numblocks, howfar);
+	run->begin = begin;
+	run->end = end;
+}
+
+/*
+ * Queue the used ranges between the free extents of an AG, and the range
+ * after the last free extent.
+ */
+static void
+queue_ag_used(
+	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno,
+	struct copy_scan	*scan,
+	struct copy_run		*run,
+	int			miniosize,
+	uint64_t		*numblocks,
+	int			*howfar)
+{
+	xfs_daddr_t		begin, end, next_begin;
+	size_t			i;
+
+	next_begin = scan->ag_begin;
+	for (i = 0; i <= scan->nr; i++) {
+		/*
+		 * protect against pathological case of a hole right after
+		 * the ag header in a mis-aligned case
+		 */
+		begin = max(next_begin, scan->ag_begin);
+
+		if (i < scan->nr) {
+			end = XFS_AGB_TO_DADDR(mp, agno, scan->exts[i].start);
+
+			/* round next starting point down */
+			next_begin = rounddown(XFS_AGB_TO_DADDR(mp, agno,
+					scan->exts[i].start + scan->exts[i].len),
+					miniosize >> BBSHIFT);
+		} else {
+			end = scan->ag_end;
+		}
+
+		queue_used(mp, run, begin, end, miniosize, numblocks, howfar);
+	}
+}
+
+/* Copy the header and all the used space of one AG. */
+static void
+copy_ag(
+	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno,
+	int			miniosize,
+	uint64_t		*numblocks,
+	int			*howfar)
+{
+	static struct copy_scan	scan;
+	struct copy_run		run = { 0 };
+	ag_header_t		ag_hdr;
+	xfs_agblock_t		root;
+	uint			btree_levels;
+	wbuf			*buf;
+
+	/* read in first blocks of the ag */
+
+	buf = wbuf_get();
+	read_ag_header(source_fd, agno, buf, &ag_hdr, mp,
+		source_blocksize, source_sectorsize);
+
+	/* set the in_progress bit for the first AG */
+
+	if (agno == 0)
+		ag_hdr.xfs_sb->sb_inprogress = 1;
+
+	/* save what we need from the agf before the buffer is reused */
+
+	root = be32_to_cpu(ag_hdr.xfs_agf->agf_roots[XFS_BTNUM_BNOi]);
+	btree_levels = be32_to_cpu(ag_hdr.xfs_agf->agf_levels[XFS_BTNUM_BNOi]);
+	scan.ag_end = XFS_AGB_TO_DADDR(mp, agno,
+			be32_to_cpu(ag_hdr.xfs_agf->agf_length) - 1)
+			+ source_blocksize / BBSIZE;
+
+	/* align first data copy but don't overwrite ag header */
+
+	ASSERT(buf->position % source_sectorsize == 0);
+	scan.ag_begin = (buf->position + buf->length) >> BBSHIFT;
+
+	/* write the ag header out */
+
+	wbuf_queue(buf);
+
+	read_free_extents(mp, agno, root, btree_levels, &scan, &btree_buf);
+	queue_ag_used(mp, agno, &scan, &run, miniosize, numblocks, howfar);
+	flush_run(mp, &run, miniosize, numblocks, howfar);
+}
+
+/* Read the header and free space of one AG into its copy_scan. */
+static void
+scan_ag(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct copy_scan_ctx	*ctx = wq->wq_ctx;
+	struct copy_scan	*scan = &ctx->scans[agno];
+	ag_header_t		ag_hdr;
+	wbuf			hdr;
+	wbuf			bbuf;
+
+	if (wbuf_init(&hdr, roundup(first_agbno * source_blocksize,
+					ctx->miniosize) + ctx->miniosize,
+				ctx->align, ctx->miniosize, 0) == NULL ||
+	    wbuf_init(&bbuf, max(BTREE_BUF_SIZE, 2 * ctx->miniosize),
+				ctx->align, ctx->miniosize, 1) == NULL)  {
+		do_log(_("Error initializing AG %u scan buffers\n"), agno);
+		die_perror();
+	}
+
+	read_ag_header(source_fd, agno, &hdr, &ag_hdr, ctx->mp,
+		source_blocksize, source_sectorsize);
+	scan->hdr_begin = hdr.position >> BBSHIFT;
+	scan->ag_begin = (hdr.position + hdr.length) >> BBSHIFT;
+	scan->ag_end = XFS_AGB_TO_DADDR(ctx->mp, agno,
+			be32_to_cpu(ag_hdr.xfs_agf->agf_length) - 1)
+			+ source_blocksize / BBSIZE;
+
+	read_free_extents(ctx->mp, agno,
+			be32_to_cpu(ag_hdr.xfs_agf->agf_roots[XFS_BTNUM_BNOi]),
+			be32_to_cpu(ag_hdr.xfs_agf->agf_levels[XFS_BTNUM_BNOi]),
+			scan, &bbuf);
+
+	free(bbuf.data);
+	free(hdr.data);
+}
+
+/*
+ * Scan the free space of every AG in parallel, then copy all the used space
+ * in one pass over the disk.  The pending run carries across AG boundaries,
+ * so the tail of one AG and the header of the next go out together.
+ */
+static void
+copy_all_ags(
+	struct xfs_mount	*mp,
+	unsigned int		nr_threads,
+	int			align,
+	int			miniosize,
+	uint64_t		*numblocks,
+	int			*howfar)
+{
+	struct copy_scan_ctx	ctx = {
+		.mp		= mp,
+		.align		= align,
+		.miniosize	= miniosize,
+	};
+	struct copy_run		run = { 0 };
+	struct workqueue	wq;
+	ag_header_t		ag_hdr;
+	xfs_agnumber_t		agno;
+	wbuf			*buf;
+	int			error;
+
+	ctx.scans = calloc(mp->m_sb.sb_agcount, sizeof(struct copy_scan));
+	if (!ctx.scans)  {
+		do_log(_("Couldn't allocate AG scan list\n"));
+		die_perror();
+	}
+
+	error = -workqueue_create(&wq, &ctx, nr_threads);
+	for (agno = 0; !error && agno < mp->m_sb.sb_agcount; agno++)
+		error = -workqueue_add(&wq, scan_ag, agno, NULL);
+	if (!error)
+		error = -workqueue_terminate(&wq);
+	if (error)  {
+		do_log(_("Error scanning AGs: %s\n"), strerror(-error));
+		exit(1);
+	}
+	workqueue_destroy(&wq);
+
+	/* the first AG header has the in_progress bit, so do it by itself */
+
+	buf = wbuf_get();
+	read_ag_header(source_fd, 0, buf, &ag_hdr, mp,
+		source_blocksize, source_sectorsize);
+	ag_hdr.xfs_sb->sb_inprogress = 1;
+	wbuf_queue(buf);
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)  {
+		struct copy_scan	*scan = &ctx.scans[agno];
+
+		if (agno > 0)
+			queue_used(mp, &run, scan->hdr_begin, scan->ag_begin,
+					miniosize, numblocks, howfar);
+		queue_ag_used(mp, agno, scan, &run, miniosize, numblocks,
+				howfar);
+		free(scan->exts);
+	}
+	flush_run(mp, &run, miniosize, numblocks, howfar);
+
+	free(ctx.scans);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -553,12 +1035,8 @@ main(int argc, char **argv)
 	int		logfd;
 	int		howfar = 0;
 	int		open_flags;
-	xfs_off_t	pos;
-	size_t		length;
 	int		c;
-	uint64_t	size, sizeb;
 	uint64_t	numblocks = 0;
-	int		wblocks = 0;
 	int		num_threads = 0;
 	struct dioattr	d;
 	int		wbuf_size;
@@ -567,7 +1045,7 @@ main(int argc, char **argv)
 	int		source_is_file = 0;
 	int		buffered_output = 0;
 	int		duplicate = 0;
-	uint		btree_levels, current_level;
+	unsigned int	nr_scanners = 0;
 	ag_header_t	ag_hdr;
 	xfs_mount_t	*mp;
 	xfs_mount_t	mbuf;
@@ -575,11 +1053,6 @@ main(int argc, char **argv)
 	struct xfs_buf	*sbp;
 	xfs_sb_t	*sb;
 	xfs_agnumber_t	num_ags, agno;
-	xfs_agblock_t	bno;
-	xfs_daddr_t	begin, next_begin, ag_begin, new_begin, ag_end;
-	struct xfs_btree_block *block;
-	xfs_alloc_ptr_t	*ptr;
-	xfs_alloc_rec_t	*rec_ptr;
 	extern char	*optarg;
 	extern int	optind;
 	libxfs_init_t	xargs;
@@ -593,7 +1066,7 @@ main(int argc, char **argv)
 	bindtextdomain(PACKAGE, LOCALEDIR);
 	textdomain(PACKAGE);
 
-	while ((c = getopt(argc, argv, "bdL:V")) != EOF)  {
+	while ((c = getopt(argc, argv, "bdj:L:V")) != EOF)  {
 		switch (c) {
 		case 'b':
 			buffered_output = 1;
@@ -601,6 +1074,12 @@ main(int argc, char **argv)
 		case 'd':
 			duplicate = 1;
 			break;
+		case 'j':
+			nr_scanners = cvt_u32(optarg, 10);
+			if (errno || nr_scanners == 0 ||
+			    nr_scanners > MAX_SCANNERS)
+				usage();
+			break;
 		case 'L':
 			logfile_name = optarg;
 			break;
@@ -906,33 +1385,36 @@ main(int argc, char **argv)
 
 	/* initialize locks and bufs */
 
-	if (pthread_mutex_init(&glob_masks.mutex, NULL) != 0)  {
-		do_log(_("Couldn't initialize global thread mask\n"));
-		die_perror();
-	}
-	glob_masks.num_working = 0;
-
 	if (wbuf_init(&w_buf, wbuf_size, wbuf_align,
 					wbuf_miniosize, 0) == NULL)  {
 		do_log(_("Error initializing wbuf 0\n"));
 		die_perror();
 	}
 
-	wblocks = wbuf_size / BBSIZE;
-
-	if (wbuf_init(&btree_buf, max(source_blocksize, wbuf_miniosize),
+	if (wbuf_init(&btree_buf, max(BTREE_BUF_SIZE, 2 * wbuf_miniosize),
 				wbuf_align, wbuf_miniosize, 1) == NULL)  {
 		do_log(_("Error initializing btree buf 1\n"));
 		die_perror();
 	}
 
-	if (pthread_mutex_init(&mainwait,NULL) != 0)  {
-		do_log(_("Error creating first semaphore.\n"));
+	wring_size = WBUF_RING_SIZE;
+	if ((wring = calloc(wring_size, sizeof(wbuf))) == NULL)  {
+		do_log(_("Couldn't malloc space for write buffers\n"));
 		die_perror();
-		exit(1);
 	}
-	/* need to start out blocking */
-	pthread_mutex_lock(&mainwait);
+
+	for (i = 0; i < wring_size; i++)  {
+		if (wbuf_init(&wring[i], wbuf_size, wbuf_align,
+					wbuf_miniosize, i + 2) == NULL)  {
+			/* make do with the buffers we have */
+			if (i == 0)  {
+				do_log(_("Error initializing wbuf 2\n"));
+				die_perror();
+			}
+			wring_size = i;
+			break;
+		}
+	}
 
 	/* set up sigchild signal handler */
 
@@ -953,13 +1435,7 @@ main(int argc, char **argv)
 		else
 			platform_uuid_copy(&tcarg->uuid, &mp->m_sb.sb_uuid);
 
-		if (pthread_mutex_init(&tcarg->wait, NULL) != 0)  {
-			do_log(_("Error creating thread mutex %d\n"), i);
-			die_perror();
-			exit(1);
-		}
-		/* need to start out blocking */
-		pthread_mutex_lock(&tcarg->wait);
+		tcarg->next = 0;
 	}
 
 	for (i = 0, tcarg = targ; i < num_targets; i++, tcarg++)  {
@@ -988,222 +1464,17 @@ main(int argc, char **argv)
 
 	kids = num_targets;
 
-	for (agno = 0; agno < num_ags && kids > 0; agno++)  {
-		/* read in first blocks of the ag */
-
-		read_ag_header(source_fd, agno, &w_buf, &ag_hdr, mp,
-			source_blocksize, source_sectorsize);
-
-		/* set the in_progress bit for the first AG */
-
-		if (agno == 0)
-			ag_hdr.xfs_sb->sb_inprogress = 1;
-
-		/* save what we need (agf) in the btree buffer */
-
-		memmove(btree_buf.data, ag_hdr.xfs_agf, source_sectorsize);
-		ag_hdr.xfs_agf = (xfs_agf_t *) btree_buf.data;
-		btree_buf.length = source_blocksize;
-
-		/* write the ag header out */
-
-		write_wbuf();
-
-		/* traverse btree until we get to the leftmost leaf node */
-
-		bno = be32_to_cpu(ag_hdr.xfs_agf->agf_roots[XFS_BTNUM_BNOi]);
-		current_level = 0;
-		btree_levels = be32_to_cpu(ag_hdr.xfs_agf->
-						agf_levels[XFS_BTNUM_BNOi]);
-
-		ag_end = XFS_AGB_TO_DADDR(mp, agno,
-				be32_to_cpu(ag_hdr.xfs_agf->agf_length) - 1)
-				+ source_blocksize / BBSIZE;
-
-		for (;;) {
-			/* none of this touches the w_buf buffer */
-
-			if (current_level >= btree_levels) {
-				do_log(
-			_("Error: current level %d >= btree levels %d\n"),
-					current_level, btree_levels);
-				exit(1);
-			}
-
-			current_level++;
-
-			btree_buf.position = pos = (xfs_off_t)
-				XFS_AGB_TO_DADDR(mp,agno,bno) << BBSHIFT;
-			btree_buf.length = source_blocksize;
-
-			read_wbuf(source_fd, &btree_buf, mp);
-			block = (struct xfs_btree_block *)
-				 ((char *)btree_buf.data +
-				  pos - btree_buf.position);
-
-			if (be32_to_cpu(block->bb_magic) !=
-			    (xfs_has_crc(mp) ?
-			     XFS_ABTB_CRC_MAGIC : XFS_ABTB_MAGIC)) {
-				do_log(_("Bad btree magic 0x%x\n"),
-				        be32_to_cpu(block->bb_magic));
-				exit(1);
-			}
-
-			if (be16_to_cpu(block->bb_level) == 0)
-				break;
-
-			ptr = XFS_ALLOC_PTR_ADDR(mp, block, 1,
-							mp->m_alloc_mxr[1]);
-			bno = be32_to_cpu(ptr[0]);
-		}
-
-		/* align first data copy but don't overwrite ag header */
-
-		pos = w_buf.position >> BBSHIFT;
-		length = w_buf.length >> BBSHIFT;
-		next_begin = pos + length;
-		ag_begin = next_begin;
-
-		ASSERT(w_buf.position % source_sectorsize == 0);
-
-		/* handle the rest of the ag */
-
-		for (;;) {
-			if (be16_to_cpu(block->bb_level) != 0)  {
-				do_log(
-			_("WARNING:  source filesystem inconsistent.\n"));
-				do_log(
-			_("  A leaf btree rec isn't a leaf.  Aborting now.\n"));
-				exit(1);
-			}
-
-			rec_ptr = XFS_ALLOC_REC_ADDR(mp, block, 1);
-			for (i = 0; i < be16_to_cpu(block->bb_numrecs);
-							i++, rec_ptr++)  {
-				/* calculate in daddr's */
-
-				begin = next_begin;
-
-				/*
-				 * protect against pathological case of a
-				 * hole right after the ag header in a
-				 * mis-aligned case
-				 */
-
-				if (begin < ag_begin)
-					begin = ag_begin;
-
-				/*
-				 * round size up to ensure we copy a
-				 * range bigger than required
-				 */
-
-				sizeb = XFS_AGB_TO_DADDR(mp, agno,
-					be32_to_cpu(rec_ptr->ar_startblock)) -
-						begin;
-				size = roundup(sizeb <<BBSHIFT, wbuf_miniosize);
-				if (size > 0)  {
-					/* copy extent */
-
-					w_buf.position = (xfs_off_t)
-						begin << BBSHIFT;
-
-					while (size > 0)  {
-						/*
-						 * let lower layer do alignment
-						 */
-						if (size > w_buf.size)  {
-							w_buf.length = w_buf.size;
-							size -= w_buf.size;
-							sizeb -= wblocks;
-							numblocks += wblocks;
-						} else  {
-							w_buf.length = size;
-							numblocks += sizeb;
-							size = 0;
-						}
-
-						read_wbuf(source_fd, &w_buf, mp);
-						write_wbuf();
-
-						w_buf.position += w_buf.length;
-
-						howfar = bump_bar(
-							howfar, numblocks);
-					}
-				}
-
-				/* round next starting point down */
-
-				new_begin = XFS_AGB_TO_DADDR(mp, agno,
-						be32_to_cpu(rec_ptr->ar_startblock) +
-					 	be32_to_cpu(rec_ptr->ar_blockcount));
-				next_begin = rounddown(new_begin,
-						w_buf.min_io_size >> BBSHIFT);
-			}
-
-			if (be32_to_cpu(block->bb_u.s.bb_rightsib) == NULLAGBLOCK)
-				break;
-
-			/* read in next btree record block */
-
-			btree_buf.position = pos = (xfs_off_t)
-				XFS_AGB_TO_DADDR(mp, agno, be32_to_cpu(
-						block->bb_u.s.bb_rightsib)) << BBSHIFT;
-			btree_buf.length = source_blocksize;
-
-			/* let read_wbuf handle alignment */
-
-			read_wbuf(source_fd, &btree_buf, mp);
+	if (nr_scanners)
+		copy_all_ags(mp, min(nr_scanners, num_ags), wbuf_align,
+				wbuf_miniosize, &numblocks, &howfar);
+	else
+		for (agno = 0; agno < num_ags && kids > 0; agno++)
+			copy_ag(mp, agno, wbuf_miniosize, &numblocks,
+					&howfar);
 
-			block = (struct xfs_btree_block *)
-				 ((char *) btree_buf.data +
-				  pos - btree_buf.position);
+	/* the log and superblock updates below are written synchronously */
 
-			ASSERT(be32_to_cpu(block->bb_magic) == XFS_ABTB_MAGIC ||
-			       be32_to_cpu(block->bb_magic) == XFS_ABTB_CRC_MAGIC);
-		}
-
-		/*
-		 * write out range of used blocks after last range
-		 * of free blocks in AG
-		 */
-		if (next_begin < ag_end)  {
-			begin = next_begin;
-
-			sizeb = ag_end - begin;
-			size = roundup(sizeb << BBSHIFT, wbuf_miniosize);
-
-			if (size > 0)  {
-				/* copy extent */
-
-				w_buf.position = (xfs_off_t) begin << BBSHIFT;
-
-				while (size > 0)  {
-					/*
-					 * let lower layer do alignment
-					 */
-					if (size > w_buf.size)  {
-						w_buf.length = w_buf.size;
-						size -= w_buf.size;
-						sizeb -= wblocks;
-						numblocks += wblocks;
-					} else  {
-						w_buf.length = size;
-						numblocks += sizeb;
-						size = 0;
-					}
-
-					read_wbuf(source_fd, &w_buf, mp);
-					write_wbuf();
-
-					w_buf.position += w_buf.length;
-
-					howfar = bump_bar(howfar, numblocks);
-				}
-			}
-		}
-	}
+	wbuf_drain();
 
 	if (kids > 0)  {
 		if (!duplicate)
@@ -47,21 +47,16 @@ typedef struct {
 	size_t		length;		/* requested length (bytes) */
 	char		*data;		/* pointer to data buffer */
 	struct t_args	*owner;		/* for non-parallel writes */
+	int		refs;		/* targets yet to write the buffer */
 } wbuf;
 
 typedef struct t_args {
 	int		id;
 	uuid_t		uuid;
-	pthread_mutex_t	wait;
+	uint64_t	next;		/* next ring buffer to write */
 	int		fd;
 } thread_args;
 
-typedef struct {
-	pthread_mutex_t mutex;
-	int		num_working;
-	wbuf		*buffer;
-} thread_control;
-
 typedef int thread_id;
 typedef int tm_index;			/* index into thread mask array */
 typedef uint32_t thread_mask;		/* a thread mask */
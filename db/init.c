@@ -27,7 +27,7 @@ static int		force;
 static struct xfs_mount	xmount;
 struct xfs_mount	*mp;
 static struct xlog	xlog;
-xfs_agnumber_t		cur_agno = NULLAGNUMBER;
+__thread xfs_agnumber_t	cur_agno = NULLAGNUMBER;
 
 static void
 usage(void)
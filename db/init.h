@@ -10,4 +10,4 @@ extern int		exitcode;
 extern int		expert_mode;
 extern xfs_mount_t	*mp;
 extern libxfs_init_t	x;
-extern xfs_agnumber_t	cur_agno;
+extern __thread xfs_agnumber_t	cur_agno;
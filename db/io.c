@@ -51,10 +51,11 @@ static const cmdinfo_t  ring_cmd =
 	{ "ring", NULL, ring_f, 0, 1, 0, NULL,
 	  N_("show position ring or move to a specific entry"), ring_help };
 
-iocur_t	*iocur_base;
-iocur_t	*iocur_top;
-int	iocur_sp = -1;
-int	iocur_len;
+__thread iocur_t	*iocur_base;
+__thread iocur_t	*iocur_top;
+__thread int		iocur_sp = -1;
+__thread int		iocur_len;
+__thread bool		iocur_private;
 
 #define RING_ENTRIES 20
 static iocur_t iocur_ring[RING_ENTRIES];
@@ -117,6 +118,20 @@ pop_cur(void)
 	}
 }
 
+/* Pop everything off this thread's location stack and free it. */
+void
+free_cur_stack(void)
+{
+	while (iocur_sp > 0)
+		pop_cur();
+	if (iocur_sp == 0)
+		pop_cur();
+	free(iocur_base);
+	iocur_base = iocur_top = NULL;
+	iocur_sp = -1;
+	iocur_len = 0;
+}
+
 /*ARGSUSED*/
 static int
 pop_f(
@@ -508,6 +523,36 @@ write_cur(void)
 
 }
 
+/*
+ * Swap a cached buffer for a private uncached copy, so that a thread that
+ * changes the contents in place (metadump obfuscation, for one) doesn't
+ * change them for every other thread sharing the buffer cache.
+ */
+static int
+copy_cur_buf(
+	struct xfs_buf	**bpp)
+{
+	struct xfs_buf	*bp = *bpp;
+	struct xfs_buf	*copy;
+	int		error;
+
+	error = -libxfs_buf_get_uncached(bp->b_target, bp->b_length, 0, &copy);
+	if (error) {
+		libxfs_buf_relse(bp);
+		return error;
+	}
+
+	xfs_buf_set_daddr(copy, xfs_buf_daddr(bp));
+	memcpy(copy->b_addr, bp->b_addr, BBTOB(bp->b_length));
+	copy->b_ops = bp->b_ops;
+	copy->b_error = bp->b_error;
+	copy->b_flags |= LIBXFS_B_UPTODATE;
+	libxfs_buf_relse(bp);
+
+	*bpp = copy;
+	return 0;
+}
+
 void
 set_cur(
 	const typ_t	*type,
@@ -562,6 +607,8 @@ set_cur(
 	 * says the metadata is corrupt.  Therefore, the only errors we should
 	 * get are for IO errors or runtime errors.
 	 */
+	if (!error && iocur_private)
+		error = copy_cur_buf(&bp);
 	if (error)
 		return;
 	iocur_top->buf = bp->b_addr;
@@ -19,6 +19,8 @@
 #include "faddr.h"
 #include "field.h"
 #include "dir2.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/lz.h"
 
 #define DEFAULT_MAX_EXT_SIZE	MAXEXTLEN
 
@@ -37,7 +39,7 @@ static void	metadump_help(void);
 
 static const cmdinfo_t	metadump_cmd =
 	{ "metadump", NULL, metadump_f, 0, -1, 0,
-		N_("[-a] [-e] [-g] [-m max_extent] [-w] [-o] filename"),
+		N_("[-a] [-e] [-g] [-j threads] [-m max_extent] [-w] [-o] [-v version] filename"),
 		N_("dump metadata to a file"), metadump_help };
 
 static FILE		*outf;		/* metadump file */
@@ -49,8 +51,10 @@ static char		*block_buffer;
 static int		num_indices;
 static int		cur_index;
 
-static xfs_ino_t	cur_ino;
+static __thread xfs_ino_t	cur_ino;
 
+static int		md_version = 1;
+static int		nr_threads = 1;
 static int		show_progress = 0;
 static int		stop_on_read_error = 0;
 static int		max_extent_size = DEFAULT_MAX_EXT_SIZE;
@@ -78,8 +82,10 @@ metadump_help(void)
 "   -a -- Copy full metadata blocks without zeroing unused space\n"
 "   -e -- Ignore read errors and keep going\n"
 "   -g -- Display dump progress\n"
+"   -j -- Scan this many AGs in parallel\n"
 "   -m -- Specify max extent size in blocks to copy (default = %d blocks)\n"
 "   -o -- Don't obfuscate names and extended attributes\n"
+"   -v -- Image format version: 1 (default) or 2 (compressed and indexed)\n"
 "   -w -- Show warnings of bad metadata information\n"
 "\n"), DEFAULT_MAX_EXT_SIZE);
 }
@@ -150,6 +156,361 @@ write_index(void)
 	return 0;
 }
 
+/*
+ * Version 2 Images
+ *
+ * Sectors are gathered into extents of contiguous daddrs until a segment's
+ * worth of data has been collected.  The segment is then compressed with
+ * the built-in LZ codec (or stored as is if that doesn't help) and written
+ * out, and its extents are added to the index that goes at the end of the
+ * image.
+ */
+#define MD2_SEG_BYTES		(1U << 20)
+#define MD2_SEG_EXTENTS		1024
+#define MD2_RAW_BYTES		(MD2_SEG_BYTES + \
+				 MD2_SEG_EXTENTS * sizeof(struct xfs_metadump_ext))
+
+struct md2_ext {
+	int64_t			daddr;
+	unsigned int		len;		/* sectors */
+	unsigned int		off;		/* offset in segment data */
+};
+
+static struct {
+	char			*raw;		/* extent data, then records */
+	char			*zbuf;		/* compressed payload */
+	struct md2_ext		ext[MD2_SEG_EXTENTS];
+	unsigned int		nr_ext;
+	unsigned int		len;		/* bytes of extent data */
+	uint64_t		pos;		/* file offset of next segment */
+	struct xfs_metadump_idx	*index;
+	uint64_t		nr_index;
+	uint64_t		max_index;
+} md2;
+
+static int
+md2_init(
+	uint32_t		info)
+{
+	struct xfs_metadump_header	hdr = {
+		.xmh_magic		= cpu_to_be32(XFS_MD_MAGIC_V2),
+		.xmh_version		= cpu_to_be32(2),
+		.xmh_info		= cpu_to_be32(info),
+	};
+
+	md2.raw = malloc(MD2_RAW_BYTES);
+	md2.zbuf = malloc(MD2_RAW_BYTES);
+	if (!md2.raw || !md2.zbuf) {
+		print_warning("memory allocation failure");
+		return -1;
+	}
+	md2.nr_ext = 0;
+	md2.len = 0;
+	md2.nr_index = 0;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, outf) != 1) {
+		print_warning("error writing to target file");
+		return -1;
+	}
+	md2.pos = sizeof(hdr);
+	return 0;
+}
+
+static void
+md2_free(void)
+{
+	free(md2.raw);
+	free(md2.zbuf);
+	free(md2.index);
+	memset(&md2, 0, sizeof(md2));
+}
+
+static int
+md2_add_index(
+	struct md2_ext		*ext)
+{
+	struct xfs_metadump_idx	*idx;
+
+	if (md2.nr_index == md2.max_index) {
+		uint64_t	new_max = max(md2.max_index * 2, 1024ULL);
+
+		idx = realloc(md2.index, new_max * sizeof(*idx));
+		if (!idx) {
+			print_warning("memory allocation failure");
+			return -ENOMEM;
+		}
+		md2.index = idx;
+		md2.max_index = new_max;
+	}
+
+	idx = &md2.index[md2.nr_index++];
+	idx->xmi_daddr = cpu_to_be64(ext->daddr);
+	idx->xmi_seg = cpu_to_be64(md2.pos);
+	idx->xmi_len = cpu_to_be32(ext->len);
+	idx->xmi_off = cpu_to_be32(ext->off);
+	return 0;
+}
+
+/* Compress and write out the current segment.  Return 0 or -errno. */
+static int
+md2_write_seg(void)
+{
+	struct xfs_metadump_seg	seg;
+	struct xfs_metadump_ext	*rec;
+	unsigned int		rawlen;
+	unsigned int		i;
+	ssize_t			zlen;
+	char			*payload;
+	int			ret;
+
+	if (!md2.nr_ext)
+		return 0;
+
+	rec = (struct xfs_metadump_ext *)(md2.raw + md2.len);
+	for (i = 0; i < md2.nr_ext; i++, rec++) {
+		rec->xme_daddr = cpu_to_be64(md2.ext[i].daddr);
+		rec->xme_len = cpu_to_be32(md2.ext[i].len);
+		rec->xme_off = cpu_to_be32(md2.ext[i].off);
+		ret = md2_add_index(&md2.ext[i]);
+		if (ret)
+			return ret;
+	}
+	rawlen = md2.len + md2.nr_ext * sizeof(struct xfs_metadump_ext);
+
+	/* Only keep the compressed payload if it's smaller. */
+	zlen = frog_lz_compress(md2.raw, rawlen, md2.zbuf, rawlen - 1);
+	seg.xms_magic = cpu_to_be32(XFS_MD_SEG_MAGIC);
+	if (zlen > 0) {
+		seg.xms_codec = cpu_to_be32(XFS_MD_CODEC_LZ);
+		seg.xms_len = cpu_to_be32(zlen);
+		payload = md2.zbuf;
+	} else {
+		zlen = rawlen;
+		seg.xms_codec = cpu_to_be32(XFS_MD_CODEC_NONE);
+		seg.xms_len = cpu_to_be32(rawlen);
+		payload = md2.raw;
+	}
+	seg.xms_rawlen = cpu_to_be32(rawlen);
+	seg.xms_nr = cpu_to_be32(md2.nr_ext);
+	seg.xms_crc = cpu_to_be32(crc32c(XFS_CRC_SEED, md2.raw, rawlen));
+
+	if (fwrite(&seg, sizeof(seg), 1, outf) != 1 ||
+	    fwrite(payload, zlen, 1, outf) != 1) {
+		print_warning("error writing to target file");
+		return -EIO;
+	}
+
+	md2.pos += sizeof(seg) + zlen;
+	md2.nr_ext = 0;
+	md2.len = 0;
+	return 0;
+}
+
+static int
+md2_buf_segment(
+	char			*data,
+	int64_t			off,
+	int			len)
+{
+	struct md2_ext		*ext;
+	unsigned int		count;
+	int			ret;
+
+	while (len > 0) {
+		if (md2.len == MD2_SEG_BYTES) {
+			ret = md2_write_seg();
+			if (ret)
+				return ret;
+		}
+
+		/* Extend the last extent if this is contiguous with it. */
+		ext = md2.nr_ext ? &md2.ext[md2.nr_ext - 1] : NULL;
+		if (!ext || ext->daddr + ext->len != off) {
+			if (md2.nr_ext == MD2_SEG_EXTENTS) {
+				ret = md2_write_seg();
+				if (ret)
+					return ret;
+			}
+			ext = &md2.ext[md2.nr_ext++];
+			ext->daddr = off;
+			ext->len = 0;
+			ext->off = md2.len;
+		}
+
+		count = min((unsigned int)len,
+				(MD2_SEG_BYTES - md2.len) >> BBSHIFT);
+		memcpy(md2.raw + md2.len, data, count << BBSHIFT);
+		ext->len += count;
+		md2.len += count << BBSHIFT;
+		data += count << BBSHIFT;
+		off += count;
+		len -= count;
+	}
+	return 0;
+}
+
+static int
+md2_cmp_index(
+	const void		*a,
+	const void		*b)
+{
+	const struct xfs_metadump_idx	*ia = a;
+	const struct xfs_metadump_idx	*ib = b;
+	uint64_t		da = be64_to_cpu(ia->xmi_daddr);
+	uint64_t		db = be64_to_cpu(ib->xmi_daddr);
+	uint64_t		sa = be64_to_cpu(ia->xmi_seg);
+	uint64_t		sb = be64_to_cpu(ib->xmi_seg);
+
+	/* Keep extents for the same daddr in the order they were written. */
+	if (da != db)
+		return da < db ? -1 : 1;
+	if (sa != sb)
+		return sa < sb ? -1 : 1;
+	return be32_to_cpu(ia->xmi_off) < be32_to_cpu(ib->xmi_off) ? -1 : 1;
+}
+
+/* Write the last segment, the index and the trailer.  Return 0 or -1. */
+static int
+md2_finish(void)
+{
+	struct xfs_metadump_index	ihdr;
+	size_t			len;
+
+	if (md2_write_seg())
+		return -1;
+
+	qsort(md2.index, md2.nr_index, sizeof(struct xfs_metadump_idx),
+			md2_cmp_index);
+	len = md2.nr_index * sizeof(struct xfs_metadump_idx);
+
+	ihdr.xmx_magic = cpu_to_be32(XFS_MD_IDX_MAGIC);
+	ihdr.xmx_crc = cpu_to_be32(crc32c(XFS_CRC_SEED, md2.index, len));
+	ihdr.xmx_count = cpu_to_be64(md2.nr_index);
+	ihdr.xmx_pos = cpu_to_be64(md2.pos);
+
+	if (fwrite(&ihdr, sizeof(ihdr), 1, outf) != 1 ||
+	    (len && fwrite(md2.index, len, 1, outf) != 1) ||
+	    fwrite(&ihdr, sizeof(ihdr), 1, outf) != 1) {
+		print_warning("error writing to target file");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Parallel Metadump
+ *
+ * With -j, each AG is scanned by a worker thread with its own location
+ * stack and obfuscation state.  Instead of going straight into the metablock,
+ * the sectors a worker dumps are collected in chunks and queued on that AG's
+ * stream.  The main thread writes out the streams strictly in AG order, so
+ * the image is laid out exactly as a serial dump would be.
+ *
+ * To bound memory use, workers stall when too many chunks are queued, unless
+ * they are scanning the AG that is currently being written out.  That can't
+ * deadlock as long as AGs are started in ascending order, so the workers
+ * claim them from a shared counter rather than leaving the order to the
+ * workqueue, which may run its items in any order.  If the AG being written
+ * out hasn't been claimed yet, every claimed AG is below it and has already
+ * been written out, so no worker is stalled and the next one free claims
+ * it.  Once it has been claimed, its worker never stalls.
+ *
+ * The workers share the buffer cache, but obfuscation and stale data
+ * zeroing change buffers in place, so each worker gets private copies of
+ * the buffers it reads.
+ */
+#define MD_CHUNK_SECTORS	256
+#define MD_MAX_QUEUED		256	/* 32MB of chunks */
+
+struct md_chunk {
+	struct md_chunk		*next;
+	int			nr;
+	int64_t			daddr[MD_CHUNK_SECTORS];
+	char			data[MD_CHUNK_SECTORS << BBSHIFT];
+};
+
+struct md_stream {
+	xfs_agnumber_t		agno;
+	struct md_chunk		*head;
+	struct md_chunk		**tailp;
+	bool			done;
+	int			rval;		/* scan_ag() return value */
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	struct md_stream	*streams;
+	xfs_agnumber_t		next_agno;	/* next AG to claim */
+	xfs_agnumber_t		write_agno;	/* AG being written out */
+	unsigned int		nr_queued;	/* chunks queued on all streams */
+	bool			abort;
+} md_par = {
+	.lock			= PTHREAD_MUTEX_INITIALIZER,
+	.wait			= PTHREAD_COND_INITIALIZER,
+};
+
+/* The stream this worker thread dumps into, and its unqueued chunk. */
+static __thread struct md_stream	*cur_stream;
+static __thread struct md_chunk		*cur_chunk;
+
+/* Queue the current chunk for writing.  Return 0 or -errno. */
+static int
+stream_queue_chunk(void)
+{
+	struct md_stream	*s = cur_stream;
+	struct md_chunk		*chunk = cur_chunk;
+
+	cur_chunk = NULL;
+
+	pthread_mutex_lock(&md_par.lock);
+	while (!md_par.abort && md_par.nr_queued >= MD_MAX_QUEUED &&
+	       s->agno != md_par.write_agno)
+		pthread_cond_wait(&md_par.wait, &md_par.lock);
+	if (md_par.abort) {
+		pthread_mutex_unlock(&md_par.lock);
+		free(chunk);
+		return -ECANCELED;
+	}
+	chunk->next = NULL;
+	*s->tailp = chunk;
+	s->tailp = &chunk->next;
+	md_par.nr_queued++;
+	pthread_cond_broadcast(&md_par.wait);
+	pthread_mutex_unlock(&md_par.lock);
+	return 0;
+}
+
+static int
+stream_buf_segment(
+	char			*data,
+	int64_t			off,
+	int			len)
+{
+	int			i;
+	int			ret;
+
+	for (i = 0; i < len; i++, off++, data += BBSIZE) {
+		if (!cur_chunk) {
+			cur_chunk = malloc(sizeof(struct md_chunk));
+			if (!cur_chunk) {
+				print_warning("memory allocation failure");
+				return -ENOMEM;
+			}
+			cur_chunk->nr = 0;
+		}
+		cur_chunk->daddr[cur_chunk->nr] = off;
+		memcpy(&cur_chunk->data[cur_chunk->nr << BBSHIFT], data,
+				BBSIZE);
+		if (++cur_chunk->nr == MD_CHUNK_SECTORS) {
+			ret = stream_queue_chunk();
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
 /*
  * Return 0 for success, -errno for failure.
  */
@@ -162,6 +523,11 @@ write_buf_segment(
 	int		i;
 	int		ret;
 
+	if (cur_stream)
+		return stream_buf_segment(data, off, len);
+	if (md_version == 2)
+		return md2_buf_segment(data, off, len);
+
 	for (i = 0; i < len; i++, off++, data += BBSIZE) {
 		block_index[cur_index] = cpu_to_be64(off);
 		memcpy(&block_buffer[cur_index << BBSHIFT], data, BBSIZE);
@@ -680,7 +1046,7 @@ struct name_ent {
 
 #define NAME_TABLE_SIZE		4096
 
-static struct name_ent		*nametable[NAME_TABLE_SIZE];
+static __thread struct name_ent	*nametable[NAME_TABLE_SIZE];
 
 static void
 nametable_clear(void)
@@ -1690,7 +2056,7 @@ out_pop:
 
 #define MAX_REMOTE_VALS		4095
 
-static struct attr_data_s {
+static __thread struct attr_data_s {
 	int			remote_val_count;
 	xfs_dablk_t		remote_vals[MAX_REMOTE_VALS];
 } attr_data;
@@ -1940,8 +2306,8 @@ out_pop:
 /*
  * Static map to aggregate multiple extents into a single directory block.
  */
-static struct bbmap mfsb_map;
-static int mfsb_length;
+static __thread struct bbmap mfsb_map;
+static __thread int mfsb_length;
 
 static int
 process_multi_fsb_dir(
@@ -2474,7 +2840,7 @@ done:
 	return rval;
 }
 
-static uint32_t	inodes_copied;
+static uint32_t	inodes_copied;	/* updated atomically */
 
 static int
 copy_inode_chunk(
@@ -2573,7 +2939,7 @@ copy_inode_chunk(
 					XFS_INOBT_IS_FREE_DISK(rp, ioff + i)))
 				goto pop_out;
 
-			inodes_copied++;
+			uatomic_inc(&inodes_copied);
 		}
 
 		if (write_buf(iocur_top))
@@ -2835,6 +3201,168 @@ pop_out:
 	return rval;
 }
 
+/* Claim AGs in ascending order and scan them until there are none left. */
+static void
+scan_ag_worker(
+	struct workqueue	*wq,
+	xfs_agnumber_t		unused,
+	void			*arg)
+{
+	struct md_stream	*s;
+	xfs_agnumber_t		agno;
+	int			rval;
+
+	iocur_private = true;
+	for (;;) {
+		pthread_mutex_lock(&md_par.lock);
+		if (md_par.abort ||
+		    md_par.next_agno >= mp->m_sb.sb_agcount) {
+			pthread_mutex_unlock(&md_par.lock);
+			break;
+		}
+		agno = md_par.next_agno++;
+		pthread_mutex_unlock(&md_par.lock);
+
+		s = &md_par.streams[agno];
+		cur_stream = s;
+		rval = scan_ag(agno);
+		if (rval && cur_chunk)
+			rval = !stream_queue_chunk();
+		free(cur_chunk);
+		cur_chunk = NULL;
+		cur_stream = NULL;
+		free_cur_stack();
+
+		pthread_mutex_lock(&md_par.lock);
+		s->rval = rval;
+		s->done = true;
+		pthread_cond_broadcast(&md_par.wait);
+		pthread_mutex_unlock(&md_par.lock);
+	}
+	iocur_private = false;
+}
+
+/* Write out one chunk of a worker's stream.  Return 0 or -errno. */
+static int
+write_chunk(
+	struct md_chunk		*chunk)
+{
+	int			i;
+	int			ret;
+
+	for (i = 0; i < chunk->nr; i++) {
+		ret = write_buf_segment(&chunk->data[i << BBSHIFT],
+				chunk->daddr[i], 1);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Scan all the AGs with a pool of worker threads, writing their output to
+ * the dump file in AG order.  Returns 1 on success, 0 on failure.
+ */
+static int
+scan_ags_parallel(void)
+{
+	struct workqueue	wq;
+	struct md_stream	*s;
+	struct md_chunk		*chunk;
+	xfs_agnumber_t		agcount = mp->m_sb.sb_agcount;
+	xfs_agnumber_t		agno;
+	unsigned int		nr_workers;
+	unsigned int		i;
+	int			error;
+	int			rval = 1;
+
+	md_par.streams = calloc(agcount, sizeof(struct md_stream));
+	if (!md_par.streams) {
+		print_warning("memory allocation failure");
+		return 0;
+	}
+	for (agno = 0; agno < agcount; agno++) {
+		md_par.streams[agno].agno = agno;
+		md_par.streams[agno].tailp = &md_par.streams[agno].head;
+	}
+	md_par.next_agno = 0;
+	md_par.write_agno = 0;
+	md_par.nr_queued = 0;
+	md_par.abort = false;
+
+	nr_workers = min((xfs_agnumber_t)nr_threads, agcount);
+	error = -workqueue_create(&wq, NULL, nr_workers);
+	if (error) {
+		print_warning("cannot create worker threads: %s",
+				strerror(error));
+		free(md_par.streams);
+		return 0;
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		error = -workqueue_add(&wq, scan_ag_worker, i, NULL);
+		if (error) {
+			print_warning("cannot start AG scanner: %s",
+					strerror(error));
+			rval = 0;
+			break;
+		}
+	}
+
+	/* Drain the streams in AG order. */
+	pthread_mutex_lock(&md_par.lock);
+	for (agno = 0; rval && agno < agcount; agno++) {
+		s = &md_par.streams[agno];
+		md_par.write_agno = agno;
+		pthread_cond_broadcast(&md_par.wait);
+
+		for (;;) {
+			while (!s->head && !s->done)
+				pthread_cond_wait(&md_par.wait, &md_par.lock);
+			chunk = s->head;
+			if (!chunk)
+				break;
+			s->head = chunk->next;
+			if (!s->head)
+				s->tailp = &s->head;
+			md_par.nr_queued--;
+			pthread_cond_broadcast(&md_par.wait);
+			pthread_mutex_unlock(&md_par.lock);
+
+			error = write_chunk(chunk);
+			free(chunk);
+
+			pthread_mutex_lock(&md_par.lock);
+			if (error) {
+				rval = 0;
+				break;
+			}
+		}
+		if (!s->rval)
+			rval = 0;
+	}
+
+	/* Tell any workers still running to give up. */
+	if (!rval) {
+		md_par.abort = true;
+		pthread_cond_broadcast(&md_par.wait);
+	}
+	pthread_mutex_unlock(&md_par.lock);
+
+	workqueue_terminate(&wq);
+	workqueue_destroy(&wq);
+
+	for (agno = 0; agno < agcount; agno++) {
+		while ((chunk = md_par.streams[agno].head)) {
+			md_par.streams[agno].head = chunk->next;
+			free(chunk);
+		}
+	}
+	free(md_par.streams);
+	md_par.streams = NULL;
+	return rval;
+}
+
 static int
 copy_ino(
 	xfs_ino_t		ino,
@@ -2976,6 +3504,8 @@ metadump_f(
 	char		*p;
 
 	exitcode = 1;
+	md_version = 1;
+	nr_threads = 1;
 	show_progress = 0;
 	show_warnings = 0;
 	stop_on_read_error = 0;
@@ -2996,7 +3526,7 @@ metadump_f(
 		return 0;
 	}
 
-	while ((c = getopt(argc, argv, "aegm:ow")) != EOF) {
+	while ((c = getopt(argc, argv, "aegj:m:ov:w")) != EOF) {
 		switch (c) {
 			case 'a':
 				zero_stale_data = 0;
@@ -3007,6 +3537,14 @@ metadump_f(
 			case 'g':
 				show_progress = 1;
 				break;
+			case 'j':
+				nr_threads = (int)strtol(optarg, &p, 0);
+				if (*p != '\0' || nr_threads <= 0) {
+					print_warning("bad thread count %s",
+							optarg);
+					return 0;
+				}
+				break;
 			case 'm':
 				max_extent_size = (int)strtol(optarg, &p, 0);
 				if (*p != '\0' || max_extent_size <= 0) {
@@ -3018,6 +3556,15 @@ metadump_f(
 			case 'o':
 				obfuscate = 0;
 				break;
+			case 'v':
+				md_version = (int)strtol(optarg, &p, 0);
+				if (*p != '\0' ||
+				    (md_version != 1 && md_version != 2)) {
+					print_warning("bad metadump version %s",
+							optarg);
+					return 0;
+				}
+				break;
 			case 'w':
 				show_warnings = 1;
 				break;
@@ -3126,10 +3673,19 @@ metadump_f(
 
 	exitcode = 0;
 
-	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
-		if (!scan_ag(agno)) {
-			exitcode = 1;
-			break;
+	if (md_version == 2 && md2_init(metablock->mb_info) < 0) {
+		exitcode = 1;
+		goto out_close;
+	}
+
+	if (nr_threads > 1 && mp->m_sb.sb_agcount > 1) {
+		exitcode = !scan_ags_parallel();
+	} else {
+		for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+			if (!scan_ag(agno)) {
+				exitcode = 1;
+				break;
+			}
 		}
 	}
 
@@ -3142,9 +3698,12 @@ metadump_f(
 		exitcode = !copy_log();
 
 	/* write the remaining index */
-	if (!exitcode)
+	if (!exitcode && md_version == 2)
+		exitcode = md2_finish() < 0;
+	else if (!exitcode)
 		exitcode = write_index() < 0;
 
+out_close:
 	if (progress_since_warning)
 		fputc('\n', stdout_metadump ? stderr : stdout);
 
@@ -3162,6 +3721,7 @@ metadump_f(
 	while (iocur_sp > start_iocur_sp)
 		pop_cur();
 out:
+	md2_free();
 	free(metablock);
 
 	return 0;
@@ -37,7 +37,8 @@ typedef struct typ
 #define TYP_F_CRC_FUNC		(-2UL)
 	void			(*set_crc)(struct xfs_buf *);
 } typ_t;
-extern const typ_t	*typtab, *cur_typ;
+extern const typ_t	*typtab;
+extern __thread const typ_t	*cur_typ;
 
 extern void	type_init(void);
 extern void	type_set_tab_crc(void);
@@ -6,16 +6,18 @@
 
 OPTS=" "
 DBOPTS=" "
-USAGE="Usage: xfs_metadump [-aefFogwV] [-m max_extents] [-l logdev] source target"
+USAGE="Usage: xfs_metadump [-aefFogwV] [-j threads] [-m max_extents] [-l logdev] [-v version] source target"
 
-while getopts "aefgl:m:owFV" c
+while getopts "aefgj:l:m:ov:wFV" c
 do
 	case $c in
 	a)	OPTS=$OPTS"-a ";;
 	e)	OPTS=$OPTS"-e ";;
 	g)	OPTS=$OPTS"-g ";;
+	j)	OPTS=$OPTS"-j "$OPTARG" ";;
 	m)	OPTS=$OPTS"-m "$OPTARG" ";;
 	o)	OPTS=$OPTS"-o ";;
+	v)	OPTS=$OPTS"-v "$OPTARG" ";;
 	w)	OPTS=$OPTS"-w ";;
 	f)	DBOPTS=$DBOPTS" -f";;
 	l)	DBOPTS=$DBOPTS" -l "$OPTARG" ";;
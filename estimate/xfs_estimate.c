@@ -11,7 +11,11 @@
  */
 #include "libxfs.h"
 #include <sys/stat.h>
-#include <ftw.h>
+#include <dirent.h>
+#include "libfrog/fsgeom.h"
+#include "libfrog/bulkstat.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/platform.h"
 
 static unsigned long long
 cvtnum(char *s)
@@ -33,8 +37,6 @@ cvtnum(char *s)
 	return 0LL;
 }
 
-int ffn(const char *, const struct stat *, int, struct FTW *);
-
 #define BLOCKSIZE	4096
 #define INODESIZE	256
 #define PERDIRENTRY	\
@@ -43,21 +45,381 @@ int ffn(const char *, const struct stat *, int, struct FTW *);
 
 #define FBLOCKS(n)	((n)/blocksize)
 
-static unsigned long long dirsize=0;		/* bytes */
+#define NBSTAT		4096	/* inodes per bulkstat call */
+
+struct est_counts {
+	unsigned long long	dirsize;	/* bytes */
+	unsigned long long	fullblocks;	/* FS blocks */
+	unsigned long long	isize;		/* inodes bytes */
+	unsigned long long	nslinks;	/* number of symbolic links */
+	unsigned long long	nfiles;		/* number of regular files */
+	unsigned long long	ndirs;		/* number of directories */
+	unsigned long long	nspecial;	/* number of special files */
+};
+
+static struct est_counts totals;
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static unsigned long long logsize=LOGSIZE*BLOCKSIZE;	/* bytes */
-static unsigned long long fullblocks=0;	/* FS blocks */
-static unsigned long long isize=0;		/* inodes bytes */
 static unsigned long long blocksize=BLOCKSIZE;
-static unsigned long long nslinks=0;		/* number of symbolic links */
-static unsigned long long nfiles=0;		/* number of regular files */
-static unsigned long long ndirs=0;		/* number of directories */
-static unsigned long long nspecial=0;		/* number of special files */
 static unsigned long long verbose=0;		/* verbose mode TRUE/FALSE */
+char *progname;
 
 static int __debug = 0;
 static int ilog = 0;
 static  int elog = 0;
 
+/*
+ * Account for one inode.  @namelen is the length of the name it is linked
+ * under and @bytes is the space it currently has allocated.
+ */
+static void
+est_account(
+	struct est_counts	*ec,
+	size_t			namelen,
+	mode_t			mode,
+	unsigned long long	bytes,
+	unsigned long long	size)
+{
+	/* cases are in most-encountered to least-encountered order */
+	ec->dirsize += PERDIRENTRY + namelen;
+	ec->isize += INODESIZE;
+	switch (S_IFMT & mode) {
+	case S_IFREG:			/* regular files */
+		ec->fullblocks += FBLOCKS(bytes + blocksize - 1);
+		if (bytes < size)
+			ec->fullblocks++;	/* add one bmap block here */
+		ec->nfiles++;
+		break;
+	case S_IFLNK:			/* symbolic links */
+		if (size >= (INODESIZE - (sizeof(struct xfs_dinode) + 4)))
+			ec->fullblocks += FBLOCKS(size + blocksize - 1);
+		ec->nslinks++;
+		break;
+	case S_IFDIR:			/* directories */
+		ec->dirsize += blocksize;	/* fudge upwards */
+		if (size >= blocksize)
+			ec->dirsize += blocksize;
+		ec->ndirs++;
+		break;
+	case S_IFIFO:			/* named pipes */
+	case S_IFCHR:			/* Character Special device */
+	case S_IFBLK:			/* Block Special device */
+	case S_IFSOCK:			/* socket */
+		ec->nspecial++;
+		break;
+	}
+}
+
+static void
+est_account_stat(
+	struct est_counts	*ec,
+	const char		*path,
+	const struct stat	*sb)
+{
+	est_account(ec, strlen(path), sb->st_mode, sb->st_blocks * 512ULL,
+			sb->st_size);
+}
+
+/* Fold a worker's counts into the totals for this directory argument. */
+static void
+est_merge(
+	const struct est_counts	*ec)
+{
+	pthread_mutex_lock(&totals_lock);
+	totals.dirsize += ec->dirsize;
+	totals.fullblocks += ec->fullblocks;
+	totals.isize += ec->isize;
+	totals.nslinks += ec->nslinks;
+	totals.nfiles += ec->nfiles;
+	totals.ndirs += ec->ndirs;
+	totals.nspecial += ec->nspecial;
+	pthread_mutex_unlock(&totals_lock);
+}
+
+static unsigned int
+est_nr_threads(
+	unsigned int		max)
+{
+	unsigned int		nr = platform_nproc();
+
+	return nr < max ? nr : max;
+}
+
+/*
+ * Bulkstat fast path
+ *
+ * If the directory is the root of an XFS filesystem we don't need to look
+ * at any names; bulkstat hands us every inode in an AG at a time, and the
+ * AGs can be walked in parallel.  Bulkstat doesn't return names, so the
+ * space taken by names is estimated from the size of the source directories
+ * rather than the length of each path.
+ */
+struct est_bulkstat {
+	struct xfs_fd		*xfd;
+	int			error;
+};
+
+static void
+est_bulkstat_ag(
+	struct workqueue	*wq,
+	uint32_t		agno,
+	void			*arg)
+{
+	struct est_bulkstat	*eb = arg;
+	struct est_counts	ec = { 0 };
+	struct xfs_bulkstat_req	*breq;
+	int			error;
+
+	error = -xfrog_bulkstat_alloc_req(NBSTAT, 0, &breq);
+	if (error)
+		goto out;
+	xfrog_bulkstat_set_ag(breq, agno);
+
+	while ((error = -xfrog_bulkstat(eb->xfd, breq)) == 0 &&
+	       breq->hdr.ocount > 0) {
+		struct xfs_bulkstat	*bs = breq->bulkstat;
+		uint32_t		i;
+
+		for (i = 0; i < breq->hdr.ocount; i++, bs++) {
+			est_account(&ec, 0, bs->bs_mode,
+					bs->bs_blocks * bs->bs_blksize,
+					bs->bs_size);
+			if (S_ISDIR(bs->bs_mode))
+				ec.dirsize += bs->bs_size;
+		}
+	}
+	free(breq);
+out:
+	if (error) {
+		pthread_mutex_lock(&totals_lock);
+		if (!eb->error)
+			eb->error = error;
+		pthread_mutex_unlock(&totals_lock);
+		return;
+	}
+	est_merge(&ec);
+}
+
+/*
+ * Estimate @path with bulkstat if it is the root of an XFS filesystem.
+ * Returns false if the caller has to walk the directory tree instead.
+ */
+static bool
+est_try_bulkstat(
+	const char		*path)
+{
+	struct xfs_fd		xfd = XFS_FD_INIT_EMPTY;
+	struct est_bulkstat	eb = { .xfd = &xfd };
+	struct xfs_bulkstat	root;
+	struct workqueue	wq;
+	struct stat		sb;
+	xfs_agnumber_t		agno;
+	bool			ret = false;
+	int			error;
+
+	if (xfd_open(&xfd, path, O_RDONLY))
+		return false;
+	if (fstat(xfd.fd, &sb) ||
+	    xfrog_bulkstat_single(&xfd, XFS_BULK_IREQ_SPECIAL_ROOT,
+			XFS_BULK_IREQ_SPECIAL, &root) ||
+	    root.bs_ino != sb.st_ino)
+		goto out_close;
+
+	error = -workqueue_create(&wq, NULL,
+			est_nr_threads(xfd.fsgeom.agcount));
+	if (error)
+		goto out_close;
+	for (agno = 0; agno < xfd.fsgeom.agcount; agno++) {
+		error = -workqueue_add(&wq, est_bulkstat_ag, agno, &eb);
+		if (error)
+			break;
+	}
+	if (workqueue_terminate(&wq) && !error)
+		error = EIO;
+	workqueue_destroy(&wq);
+
+	if (error || eb.error) {
+		/* Don't report a partial count; walk the tree instead. */
+		memset(&totals, 0, sizeof(totals));
+		goto out_close;
+	}
+	ret = true;
+out_close:
+	xfd_close(&xfd);
+	return ret;
+}
+
+/*
+ * Directory walk
+ *
+ * Everywhere else, each directory is a work item that stats its entries and
+ * queues its subdirectories.  Like nftw with FTW_PHYS | FTW_MOUNT, we don't
+ * follow symlinks or cross mount points.
+ */
+struct est_walk {
+	pthread_mutex_t		lock;
+	pthread_cond_t		wakeup;
+	unsigned int		nr_dirs;
+	dev_t			dev;
+};
+
+struct est_walk_dir {
+	struct est_walk		*ew;
+	char			*path;
+};
+
+static void est_walk_dir(struct workqueue *wq, uint32_t agno,
+		void *arg);
+
+static void
+est_walk_done(
+	struct est_walk		*ew)
+{
+	pthread_mutex_lock(&ew->lock);
+	if (--ew->nr_dirs == 0)
+		pthread_cond_signal(&ew->wakeup);
+	pthread_mutex_unlock(&ew->lock);
+}
+
+static void
+est_queue_dir(
+	struct workqueue	*wq,
+	struct est_walk		*ew,
+	const char		*path)
+{
+	struct est_walk_dir	*ewd;
+
+	ewd = malloc(sizeof(*ewd));
+	if (!ewd)
+		goto out_err;
+	ewd->ew = ew;
+	ewd->path = strdup(path);
+	if (!ewd->path)
+		goto out_free;
+
+	pthread_mutex_lock(&ew->lock);
+	ew->nr_dirs++;
+	pthread_mutex_unlock(&ew->lock);
+
+	if (workqueue_add(wq, est_walk_dir, 0, ewd)) {
+		est_walk_done(ew);
+		free(ewd->path);
+		goto out_free;
+	}
+	return;
+out_free:
+	free(ewd);
+out_err:
+	fprintf(stderr, _("%s: cannot queue directory: %s\n"), path,
+			strerror(ENOMEM));
+}
+
+static void
+est_walk_dir(
+	struct workqueue	*wq,
+	uint32_t		agno,
+	void			*arg)
+{
+	struct est_walk_dir	*ewd = arg;
+	struct est_walk		*ew = ewd->ew;
+	struct est_counts	ec = { 0 };
+	size_t			len = strlen(ewd->path);
+	bool			slash = len && ewd->path[len - 1] == '/';
+	struct dirent		*de;
+	struct stat		sb;
+	DIR			*dir;
+	char			*path;
+
+	/* Unreadable directories were already counted by their parent. */
+	dir = opendir(ewd->path);
+	if (!dir)
+		goto out;
+
+	while ((de = readdir(dir)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (fstatat(dirfd(dir), de->d_name, &sb, AT_SYMLINK_NOFOLLOW))
+			continue;
+		if (sb.st_dev != ew->dev)
+			continue;
+
+		path = malloc(len + strlen(de->d_name) + 2);
+		if (!path) {
+			fprintf(stderr, _("%s: %s\n"), ewd->path,
+					strerror(ENOMEM));
+			break;
+		}
+		sprintf(path, "%s%s%s", ewd->path, slash ? "" : "/",
+				de->d_name);
+		est_account_stat(&ec, path, &sb);
+		if (S_ISDIR(sb.st_mode))
+			est_queue_dir(wq, ew, path);
+		free(path);
+	}
+	closedir(dir);
+out:
+	est_merge(&ec);
+	est_walk_done(ew);
+	free(ewd->path);
+	free(ewd);
+}
+
+static void
+est_walk(
+	const char		*arg)
+{
+	struct est_walk		ew = {
+		.lock		= PTHREAD_MUTEX_INITIALIZER,
+		.wakeup		= PTHREAD_COND_INITIALIZER,
+	};
+	struct est_counts	ec = { 0 };
+	struct workqueue	wq;
+	struct stat		sb;
+	char			*path;
+	size_t			len;
+	int			error;
+
+	/* nftw ignores trailing slashes on the starting point. */
+	path = strdup(arg);
+	if (!path) {
+		fprintf(stderr, _("%s: %s\n"), arg, strerror(ENOMEM));
+		return;
+	}
+	for (len = strlen(path); len > 1 && path[len - 1] == '/'; len--)
+		path[len - 1] = '\0';
+
+	if (lstat(path, &sb)) {
+		fprintf(stderr, _("%s: %s\n"), path, strerror(errno));
+		goto out;
+	}
+	est_account_stat(&ec, path, &sb);
+	est_merge(&ec);
+	if (!S_ISDIR(sb.st_mode))
+		goto out;
+	ew.dev = sb.st_dev;
+
+	/* Always use a worker thread so that we never recurse. */
+	error = -workqueue_create(&wq, NULL, est_nr_threads(UINT_MAX));
+	if (error) {
+		fprintf(stderr, _("%s: cannot create threads: %s\n"), path,
+				strerror(error));
+		goto out;
+	}
+
+	est_queue_dir(&wq, &ew, path);
+
+	pthread_mutex_lock(&ew.lock);
+	while (ew.nr_dirs > 0)
+		pthread_cond_wait(&ew.wakeup, &ew.lock);
+	pthread_mutex_unlock(&ew.lock);
+
+	workqueue_terminate(&wq);
+	workqueue_destroy(&wq);
+out:
+	free(path);
+}
+
 static void
 usage(char *progname)
 {
@@ -84,6 +446,7 @@ main(int argc, char **argv)
 	char dname[40];
 	int c;
 
+	progname = basename(argv[0]);
 	setlocale(LC_ALL, "");
 	bindtextdomain(PACKAGE, LOCALEDIR);
 	textdomain(PACKAGE);
@@ -147,32 +510,27 @@ main(int argc, char **argv)
 		printf(_("directory                               bsize   blocks    megabytes    logsize\n"));
 
 	for ( ; optind < argc; optind++) {
-		dirsize=0LL;		/* bytes */
-		fullblocks=0LL;		/* FS blocks */
-		isize=0LL;		/* inodes bytes */
-		nslinks=0LL;		/* number of symbolic links */
-		nfiles=0LL;		/* number of regular files */
-		ndirs=0LL;		/* number of directories */
-		nspecial=0LL;		/* number of special files */
+		memset(&totals, 0, sizeof(totals));
 
-		nftw(argv[optind], ffn, 40, FTW_PHYS | FTW_MOUNT);
+		if (!est_try_bulkstat(argv[optind]))
+			est_walk(argv[optind]);
 
 		if (__debug) {
-			printf(_("dirsize=%llu\n"), dirsize);
-			printf(_("fullblocks=%llu\n"), fullblocks);
-			printf(_("isize=%llu\n"), isize);
-
-			printf(_("%llu regular files\n"), nfiles);
-			printf(_("%llu symbolic links\n"), nslinks);
-			printf(_("%llu directories\n"), ndirs);
-			printf(_("%llu special files\n"), nspecial);
+			printf(_("dirsize=%llu\n"), totals.dirsize);
+			printf(_("fullblocks=%llu\n"), totals.fullblocks);
+			printf(_("isize=%llu\n"), totals.isize);
+
+			printf(_("%llu regular files\n"), totals.nfiles);
+			printf(_("%llu symbolic links\n"), totals.nslinks);
+			printf(_("%llu directories\n"), totals.ndirs);
+			printf(_("%llu special files\n"), totals.nspecial);
 		}
 
-		est = FBLOCKS(isize) + 8	/* blocks for inodes */
-			+ FBLOCKS(dirsize) + 1	/* blocks for directories */
-			+ fullblocks  		/* blocks for file contents */
+		est = FBLOCKS(totals.isize) + 8	/* blocks for inodes */
+			+ FBLOCKS(totals.dirsize) + 1	/* blocks for directories */
+			+ totals.fullblocks	/* blocks for file contents */
 			+ (8 * 16)	/* fudge for overhead blks (per ag) */
-			+ FBLOCKS(isize / INODESIZE); /* 1 byte/inode for map */
+			+ FBLOCKS(totals.isize / INODESIZE); /* 1 byte/inode map */
 
 		if (ilog)
 			est += (logsize / blocksize);
@@ -199,37 +557,3 @@ main(int argc, char **argv)
 	}
 	return 0;
 }
-
-int
-ffn(const char *path, const struct stat *stb, int flags, struct FTW *f)
-{
-	/* cases are in most-encountered to least-encountered order */
-	dirsize+=PERDIRENTRY+strlen(path);
-	isize+=INODESIZE;
-	switch (S_IFMT & stb->st_mode) {
-	case S_IFREG:			/* regular files */
-		fullblocks+=FBLOCKS(stb->st_blocks * 512 + blocksize-1);
-		if (stb->st_blocks * 512 < stb->st_size)
-			fullblocks++;	/* add one bmap block here */
-		nfiles++;
-		break;
-	case S_IFLNK:			/* symbolic links */
-		if (stb->st_size >= (INODESIZE - (sizeof(struct xfs_dinode)+4)))
-			fullblocks+=FBLOCKS(stb->st_size + blocksize-1);
-		nslinks++;
-		break;
-	case S_IFDIR:			/* directories */
-		dirsize+=blocksize;	/* fudge upwards */
-		if (stb->st_size >= blocksize)
-			dirsize+=blocksize;
-		ndirs++;
-		break;
-	case S_IFIFO:			/* named pipes */
-	case S_IFCHR:			/* Character Special device */
-	case S_IFBLK:			/* Block Special device */
-	case S_IFSOCK:			/* socket */
-		nspecial++;
-		break;
-	}
-	return 0;
-}
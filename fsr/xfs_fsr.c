@@ -13,6 +13,9 @@
 #include "libfrog/paths.h"
 #include "libfrog/fsgeom.h"
 #include "libfrog/bulkstat.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/convert.h"
+#include "libfrog/platform.h"
 
 #include <fcntl.h>
 #include <errno.h>
@@ -40,13 +43,26 @@ static int argv_blksz_dio;
 extern int max_ext_size;
 static int npasses = 10;
 static int startpass = 0;
+static int nr_threads = 1;
+static unsigned long long bandwidth;	/* bytes copied per second */
 
-static struct getbmap  *outmap = NULL;
-static int		outmap_size = 0;
+/*
+ * Each worker thread keeps its extent map and copy buffer from one file to
+ * the next, and drops them in fsr_put_buffers when it runs out of files.
+ */
+static __thread struct getbmap	*outmap = NULL;
+static __thread int		outmap_size = 0;
+static __thread void		*fsr_buf;
+static __thread size_t		fsr_buflen;
+static __thread size_t		fsr_bufalign;
 static int		RealUid;
 static int		tmp_agi;
 static int64_t		minimumfree = 2048;
 
+/* Free space promised to the tmp files that other workers are filling. */
+static pthread_mutex_t	space_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t		space_reserved;
+
 #define MNTTYPE_XFS             "xfs"
 
 #define SMBUFSZ		1024
@@ -82,7 +98,7 @@ char * getparent(char *fname);
 int fsrprintf(const char *fmt, ...);
 int read_fd_bmap(int, struct xfs_bstat *, int *);
 static void tmp_init(char *mnt);
-static char * tmp_next(char *mnt);
+static char * tmp_next(char *mnt, xfs_agnumber_t agno, char *buf);
 static void tmp_close(char *mnt);
 
 static struct xfs_fsop_geom fsgeom;	/* geometry of active mounted system */
@@ -139,7 +155,7 @@ main(int argc, char **argv)
 
 	gflag = ! isatty(0);
 
-	while ((c = getopt(argc, argv, "C:p:e:MgsdnvTt:f:m:b:N:FV")) != -1) {
+	while ((c = getopt(argc, argv, "C:p:e:MgsdnvTt:f:m:b:N:FVj:B:")) != -1) {
 		switch (c) {
 		case 'M':
 			Mflag = 1;
@@ -178,6 +194,25 @@ main(int argc, char **argv)
 		case 'p':
 			npasses = atoi(optarg);
 			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			if (nr_threads < 0) {
+				fprintf(stderr,
+					_("%s: bad number of threads: %s\n"),
+					progname, optarg);
+				usage(1);
+			}
+			if (nr_threads == 0)
+				nr_threads = platform_nproc();
+			break;
+		case 'B':
+			bandwidth = cvtnum(0, 0, optarg);
+			if ((long long)bandwidth <= 0) {
+				fprintf(stderr, _("%s: bad bandwidth: %s\n"),
+					progname, optarg);
+				usage(1);
+			}
+			break;
 		case 'C':
 			/* Testing opt: coerses frag count in result */
 			if (getenv("FSRXFSTEST") != NULL) {
@@ -276,7 +311,8 @@ usage(int ret)
 {
 	fprintf(stderr, _(
 "Usage: %s [-d] [-v] [-g] [-t time] [-p passes] [-f leftf] [-m mtab]\n"
-"       %s [-d] [-v] [-g] xfsdev | dir | file ...\n"
+"                [-j threads] [-B bandwidth]\n"
+"       %s [-d] [-v] [-g] [-j threads] [-B bandwidth] xfsdev | dir | file ...\n"
 "       %s -V\n\n"
 "Options:\n"
 "       -g              Print to syslog (default if stdout not a tty).\n"
@@ -284,6 +320,8 @@ usage(int ret)
 "       -p passes       Number of passes before terminating global re-org.\n"
 "       -f leftoff      Use this instead of %s.\n"
 "       -m mtab         Use something other than /etc/mtab.\n"
+"       -j threads      Defragment files in this many AGs at once.\n"
+"       -B bandwidth    Copy at most this many bytes per second.\n"
 "       -d              Debug, print even more.\n"
 "       -v              Verbose, more -v's more verbose.\n"
 "       -V              Print version number and exit.\n"
@@ -576,6 +614,80 @@ fsrall_cleanup(int timeout)
 	}
 }
 
+/*
+ * Get a buffer for direct I/O that is at least @len bytes long.  The same
+ * buffer is reused for every file that a thread copies.
+ */
+static void *
+fsr_get_buf(
+	size_t		align,
+	size_t		len)
+{
+	if (fsr_buf && fsr_buflen >= len && fsr_bufalign >= align)
+		return fsr_buf;
+
+	free(fsr_buf);
+	fsr_buf = memalign(align, len);
+	fsr_buflen = fsr_buf ? len : 0;
+	fsr_bufalign = align;
+	return fsr_buf;
+}
+
+static void
+fsr_put_buffers(void)
+{
+	free(fsr_buf);
+	fsr_buf = NULL;
+	fsr_buflen = 0;
+	free(outmap);
+	outmap = NULL;
+	outmap_size = 0;
+}
+
+static uint64_t
+fsr_now_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Charge @bytes of copying against the -B budget, which is shared by all
+ * threads, and wait until the budget allows the copy to go ahead.
+ */
+static void
+fsr_throttle(
+	size_t		bytes)
+{
+	static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+	static uint64_t		start_ns;
+	static unsigned long long copied;
+	uint64_t	due, now;
+	struct timespec	ts;
+
+	if (!bandwidth)
+		return;
+
+	pthread_mutex_lock(&lock);
+	now = fsr_now_ns();
+	if (!start_ns)
+		start_ns = now;
+	now -= start_ns;
+	due = copied / bandwidth * 1000000000ULL +
+	      (copied % bandwidth) * 1000000000ULL / bandwidth;
+	copied += bytes;
+	pthread_mutex_unlock(&lock);
+
+	if (due <= now)
+		return;
+	ts.tv_sec = (due - now) / 1000000000ULL;
+	ts.tv_nsec = (due - now) % 1000000000ULL;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
 /*
  * To compare bstat structs for qsort.
  */
@@ -594,50 +706,101 @@ cmp(const void *s1, const void *s2)
 }
 
 /*
- * fsrfs -- reorganize a file system
+ * State shared by the threads reorganizing a file system.  Each AG is a work
+ * item, so the files being copied at any one time are all in different AGs.
  */
-static int
-fsrfs(char *mntdir, xfs_ino_t startino, int targetrange)
+struct fsr_scan {
+	struct xfs_fd		*xfd;
+	jdm_fshandle_t		*fshandlep;
+	char			*mntdir;
+	xfs_ino_t		startino;
+	int			targetrange;
+
+	pthread_mutex_t		lock;
+	xfs_ino_t		*lastino;	/* last inode done in each AG */
+	bool			*agdone;
+	bool			timedout;
+};
+
+/*
+ * If we run out of time, the next run has to start from the lowest inode
+ * that an unfinished AG has reached.  AGs are handed out in order, so that
+ * is the first unfinished one.
+ */
+static void
+fsrfs_set_leftoff(
+	struct fsr_scan		*fss)
 {
-	struct xfs_fd	fsxfd = XFS_FD_INIT_EMPTY;
+	xfs_agnumber_t		agno;
+
+	for (agno = 0; agno < fss->xfd->fsgeom.agcount; agno++) {
+		if (!fss->agdone[agno]) {
+			leftoffino = fss->lastino[agno];
+			return;
+		}
+	}
+}
+
+static void
+fsrfs_progress(
+	struct fsr_scan		*fss,
+	xfs_agnumber_t		agno,
+	xfs_ino_t		ino,
+	bool			done)
+{
+	pthread_mutex_lock(&fss->lock);
+	fss->lastino[agno] = ino;
+	fss->agdone[agno] = done;
+	fsrfs_set_leftoff(fss);
+	pthread_mutex_unlock(&fss->lock);
+}
+
+/*
+ * fsrfs_ag -- reorganize the files in one AG
+ */
+static void
+fsrfs_ag(
+	struct workqueue	*wq,
+	uint32_t		agno,
+	void			*arg)
+{
+	struct fsr_scan		*fss = arg;
+	struct xfs_bulkstat_req	*breq;
+	xfs_ino_t		startino = 0;
+	xfs_ino_t		lastino = fss->lastino[agno];
+	bool			done = true;
 	int	fd;
 	int	count = 0;
 	int	ret;
+	int	error;
 	char	fname[64];
-	char	*tname;
-	jdm_fshandle_t	*fshandlep;
-	struct xfs_bulkstat_req	*breq;
-
-	fsrprintf(_("%s start inode=%llu\n"), mntdir,
-		(unsigned long long)startino);
+	char	tname[SMBUFSZ];
 
-	fshandlep = jdm_getfshandle( mntdir );
-	if ( ! fshandlep ) {
-		fsrprintf(_("unable to get handle: %s: %s\n"),
-		          mntdir, strerror( errno ));
-		return -1;
-	}
-
-	ret = -xfd_open(&fsxfd, mntdir, O_RDONLY);
-	if (ret) {
-		fsrprintf(_("unable to open XFS file: %s: %s\n"),
-		          mntdir, strerror(ret));
-		free(fshandlep);
-		return -1;
+	/*
+	 * Once we're out of time, leave the AGs that haven't started alone so
+	 * that the next run starts with them.
+	 */
+	pthread_mutex_lock(&fss->lock);
+	if (fss->timedout || (endtime && endtime < time(NULL))) {
+		fss->timedout = true;
+		fsrfs_set_leftoff(fss);
+		pthread_mutex_unlock(&fss->lock);
+		return;
 	}
-	memcpy(&fsgeom, &fsxfd.fsgeom, sizeof(fsgeom));
+	pthread_mutex_unlock(&fss->lock);
 
-	tmp_init(mntdir);
+	if (cvt_ino_to_agno(fss->xfd, fss->startino) == agno)
+		startino = fss->startino;
 
-	ret = -xfrog_bulkstat_alloc_req(GRABSZ, startino, &breq);
-	if (ret) {
-		fsrprintf(_("Skipping %s: %s\n"), mntdir, strerror(ret));
-		xfd_close(&fsxfd);
-		free(fshandlep);
-		return -1;
+	error = -xfrog_bulkstat_alloc_req(GRABSZ, startino, &breq);
+	if (error) {
+		fsrprintf(_("Skipping %s AG %u: %s\n"), fss->mntdir, agno,
+				strerror(error));
+		goto out;
 	}
+	xfrog_bulkstat_set_ag(breq, agno);
 
-	while ((ret = -xfrog_bulkstat(&fsxfd, breq) == 0)) {
+	while ((error = -xfrog_bulkstat(fss->xfd, breq)) == 0) {
 		struct xfs_bstat	bs1;
 		struct xfs_bulkstat	*buf = breq->bulkstat;
 		struct xfs_bulkstat	*p;
@@ -645,10 +808,10 @@ fsrfs(char *mntdir, xfs_ino_t startino, int targetrange)
 		uint32_t		buflenout = breq->hdr.ocount;
 
 		if (buflenout == 0)
-			goto out0;
+			break;
 
 		/* Each loop through, defrag targetrange percent of the files */
-		count = (buflenout * targetrange) / 100;
+		count = (buflenout * fss->targetrange) / 100;
 
 		qsort((char *)buf, buflenout, sizeof(struct xfs_bulkstat), cmp);
 
@@ -658,14 +821,14 @@ fsrfs(char *mntdir, xfs_ino_t startino, int targetrange)
 			     (p->bs_extents < 2))
 				continue;
 
-			ret = -xfrog_bulkstat_v5_to_v1(&fsxfd, &bs1, p);
+			ret = -xfrog_bulkstat_v5_to_v1(fss->xfd, &bs1, p);
 			if (ret) {
 				fsrprintf(_("bstat conversion error: %s\n"),
 						strerror(ret));
 				continue;
 			}
 
-			fd = jdm_open(fshandlep, &bs1, O_RDWR | O_DIRECT);
+			fd = jdm_open(fss->fshandlep, &bs1, O_RDWR | O_DIRECT);
 			if (fd < 0) {
 				/* This probably means the file was
 				 * removed while in progress of handling
@@ -681,34 +844,136 @@ fsrfs(char *mntdir, xfs_ino_t startino, int targetrange)
 			sprintf(fname, "ino=%lld", (long long)p->bs_ino);
 
 			/* Get a tmp file name */
-			tname = tmp_next(mntdir);
+			tmp_next(fss->mntdir, agno, tname);
 
-			ret = fsrfile_common(fname, tname, mntdir, fd, &bs1);
+			ret = fsrfile_common(fname, tname, fss->mntdir, fd,
+					&bs1);
 
-			leftoffino = p->bs_ino;
+			lastino = p->bs_ino;
+			fsrfs_progress(fss, agno, lastino, false);
 
 			close(fd);
 
+			/* Throttled copies can take a while; don't overrun. */
+			if (endtime && endtime < time(NULL))
+				break;
+
 			if (ret == 0) {
 				if (--count <= 0)
 					break;
 			}
 		}
 		if (endtime && endtime < time(NULL)) {
-			free(breq);
-			tmp_close(mntdir);
-			xfd_close(&fsxfd);
-			fsrall_cleanup(1);
-			exit(1);
+			pthread_mutex_lock(&fss->lock);
+			fss->timedout = true;
+			pthread_mutex_unlock(&fss->lock);
+			done = false;
+			break;
 		}
 	}
-	if (ret)
-		fsrprintf(_("%s: bulkstat: %s\n"), progname, strerror(ret));
-out0:
+	if (error)
+		fsrprintf(_("%s: bulkstat: %s\n"), progname, strerror(error));
 	free(breq);
+out:
+	fsr_put_buffers();
+	fsrfs_progress(fss, agno, lastino, done);
+}
+
+/*
+ * fsrfs -- reorganize a file system
+ */
+static int
+fsrfs(char *mntdir, xfs_ino_t startino, int targetrange)
+{
+	struct xfs_fd	fsxfd = XFS_FD_INIT_EMPTY;
+	struct fsr_scan	fss = {
+		.xfd		= &fsxfd,
+		.mntdir		= mntdir,
+		.startino	= startino,
+		.targetrange	= targetrange,
+		.lock		= PTHREAD_MUTEX_INITIALIZER,
+	};
+	struct workqueue	wq;
+	xfs_agnumber_t	agcount;
+	xfs_agnumber_t	start_agno;
+	xfs_agnumber_t	agno;
+	unsigned int	nr;
+	int	ret;
+
+	fsrprintf(_("%s start inode=%llu\n"), mntdir,
+		(unsigned long long)startino);
+
+	fss.fshandlep = jdm_getfshandle( mntdir );
+	if ( ! fss.fshandlep ) {
+		fsrprintf(_("unable to get handle: %s: %s\n"),
+		          mntdir, strerror( errno ));
+		return -1;
+	}
+
+	ret = -xfd_open(&fsxfd, mntdir, O_RDONLY);
+	if (ret) {
+		fsrprintf(_("unable to open XFS file: %s: %s\n"),
+		          mntdir, strerror(ret));
+		free(fss.fshandlep);
+		return -1;
+	}
+	memcpy(&fsgeom, &fsxfd.fsgeom, sizeof(fsgeom));
+	agcount = fsgeom.agcount;
+
+	fss.lastino = calloc(agcount, sizeof(xfs_ino_t));
+	fss.agdone = calloc(agcount, sizeof(bool));
+	if (!fss.lastino || !fss.agdone) {
+		fsrprintf(_("Skipping %s: %s\n"), mntdir, strerror(ENOMEM));
+		goto out;
+	}
+
+	/* Everything before the AG that we're restarting in is done. */
+	start_agno = cvt_ino_to_agno(&fsxfd, startino);
+	for (agno = 0; agno < agcount; agno++) {
+		xfs_ino_t	ino = cvt_agino_to_ino(&fsxfd, agno, 0);
+
+		if (agno == start_agno)
+			ino = startino;
+		fss.lastino[agno] = ino ? ino - 1 : 0;
+		fss.agdone[agno] = agno < start_agno;
+	}
+	fsrfs_set_leftoff(&fss);
+
+	tmp_init(mntdir);
+
+	nr = min(nr_threads, agcount);
+	ret = -workqueue_create(&wq, NULL, nr);
+	if (ret) {
+		fsrprintf(_("Skipping %s: %s\n"), mntdir, strerror(ret));
+		goto out_tmp;
+	}
+	for (agno = start_agno; agno < agcount; agno++) {
+		ret = -workqueue_add(&wq, fsrfs_ag, agno, &fss);
+		if (ret) {
+			fsrprintf(_("%s: could not queue AG %u: %s\n"),
+					mntdir, agno, strerror(ret));
+			break;
+		}
+	}
+	ret = -workqueue_terminate(&wq);
+	if (ret)
+		fsrprintf(_("%s: could not finish: %s\n"), mntdir,
+				strerror(ret));
+	workqueue_destroy(&wq);
+
+	if (fss.timedout) {
+		tmp_close(mntdir);
+		xfd_close(&fsxfd);
+		fsrall_cleanup(1);
+		exit(1);
+	}
+out_tmp:
 	tmp_close(mntdir);
+out:
+	free(fss.agdone);
+	free(fss.lastino);
 	xfd_close(&fsxfd);
-	free(fshandlep);
+	free(fss.fshandlep);
 	return 0;
 }
 
@@ -788,6 +1053,7 @@ fsrfile(
 		error = fsrfile_common(fname, tname, NULL, fd, &statbuf);
 
 out:
+	fsr_put_buffers();
 	xfd_close(&fsxfd);
 	if (fd >= 0)
 		close(fd);
@@ -823,6 +1089,7 @@ fsrfile_common(
 	struct statvfs  vfss;
 	struct fsxattr	fsx;
 	unsigned long	bsize;
+	uint64_t	need;
 
 	if (vflag)
 		fsrprintf("%s\n", fname);
@@ -871,52 +1138,67 @@ fsrfile_common(
 	 *
 	 * Note that xfs_bstat.bs_blksize returns the filesystem blocksize,
 	 * not the optimal I/O size as struct stat.
+	 *
+	 * The free space count doesn't yet reflect the tmp files that the
+	 * other workers are filling, so count what they have reserved and
+	 * reserve our own share before letting go of the lock.
 	 */
+	need = statp->bs_blksize * statp->bs_blocks;
+	pthread_mutex_lock(&space_lock);
 	if (statvfs(fsname ? fsname : fname, &vfss) < 0) {
+		pthread_mutex_unlock(&space_lock);
 		fsrprintf(_("unable to get fs stat on %s: %s\n"),
 			fname, strerror(errno));
 		return -1;
 	}
 	bsize = vfss.f_frsize ? vfss.f_frsize : vfss.f_bsize;
-	if (statp->bs_blksize * statp->bs_blocks >
-	    vfss.f_bfree * bsize - minimumfree) {
+	if (need + space_reserved > vfss.f_bfree * bsize - minimumfree) {
+		pthread_mutex_unlock(&space_lock);
 		fsrprintf(_("insufficient freespace for: %s: "
 			    "size=%lld: ignoring\n"), fname,
 			    statp->bs_blksize * statp->bs_blocks);
 		return 1;
 	}
+	space_reserved += need;
+	pthread_mutex_unlock(&space_lock);
 
 	if ((ioctl(fd, FS_IOC_FSGETXATTR, &fsx)) < 0) {
 		fsrprintf(_("failed to get inode attrs: %s\n"), fname);
-		return(-1);
+		error = -1;
+		goto out_unreserve;
 	}
 	if (fsx.fsx_xflags & (FS_XFLAG_IMMUTABLE|FS_XFLAG_APPEND)) {
 		if (vflag)
 			fsrprintf(_("%s: immutable/append, ignoring\n"), fname);
-		return(0);
+		error = 0;
+		goto out_unreserve;
 	}
 	if (fsx.fsx_xflags & FS_XFLAG_NODEFRAG) {
 		if (vflag)
 			fsrprintf(_("%s: marked as don't defrag, ignoring\n"),
 			    fname);
-		return(0);
+		error = 0;
+		goto out_unreserve;
 	}
 	if (fsx.fsx_xflags & FS_XFLAG_REALTIME) {
 		if (xfs_getrt(fd, &vfss) < 0) {
 			fsrprintf(_("cannot get realtime geometry for: %s\n"),
 				fname);
-			return(-1);
+			error = -1;
+			goto out_unreserve;
 		}
 		if (statp->bs_size > ((vfss.f_bfree * bsize) - minimumfree)) {
 			fsrprintf(_("low on realtime free space: %s: "
 				"ignoring file\n"), fname);
-			return(-1);
+			error = -1;
+			goto out_unreserve;
 		}
 	}
 
 	if ((RealUid != ROOT) && (RealUid != statp->bs_uid)) {
 		fsrprintf(_("cannot open: %s: Permission denied\n"), fname);
-		return -1;
+		error = -1;
+		goto out_unreserve;
 	}
 
 	/*
@@ -928,9 +1210,15 @@ fsrfile_common(
 	 * file we're defragging, in packfile().
 	 */
 
-	if ((error = packfile(fname, tname, fd, statp, &fsx)))
-		return error;
-	return -1; /* no error */
+	error = packfile(fname, tname, fd, statp, &fsx);
+	if (!error)
+		error = -1; /* no error */
+
+out_unreserve:
+	pthread_mutex_lock(&space_lock);
+	space_reserved -= need;
+	pthread_mutex_unlock(&space_lock);
+	return error;
 }
 
 /*
@@ -1146,7 +1434,7 @@ packfile(char *fname, char *tname, int fd,
 	unsigned	blksz_dio;
 	unsigned	dio_min;
 	struct dioattr	dio;
-	static xfs_swapext_t   sx;
+	xfs_swapext_t	sx;
 	struct xfs_flock64  space;
 	off64_t 	cnt, pos;
 	void 		*fbuf = NULL;
@@ -1219,7 +1507,7 @@ packfile(char *fname, char *tname, int fd,
 			dio.d_maxiosz, pagesize);
 	}
 
-	if (!(fbuf = (char *)memalign(dio.d_mem, blksz_dio))) {
+	if (!(fbuf = fsr_get_buf(dio.d_mem, blksz_dio))) {
 		fsrprintf(_("could not allocate buf: %s\n"), tname);
 		goto out;
 	}
@@ -1321,6 +1609,7 @@ packfile(char *fname, char *tname, int fd,
 				ct = min(cnt + dio_min - (cnt % dio_min),
 					blksz_dio);
 			}
+			fsr_throttle(ct);
 			ct = read(fd, fbuf, ct);
 			if (ct == 0) {
 				/* EOF, stop trying to read */
@@ -1438,7 +1727,6 @@ packfile(char *fname, char *tname, int fd,
 	retval = 0;
 
 out:
-	free(fbuf);
 	if (tfd != -1)
 		close(tfd);
 	if (ffd != -1)
@@ -1710,18 +1998,26 @@ tmp_init(char *mnt)
 	return;
 }
 
+/*
+ * Threads working on different AGs can ask for tmp files at the same time,
+ * so the AG being reorganized is part of the name.
+ */
 static char *
-tmp_next(char *mnt)
+tmp_next(char *mnt, xfs_agnumber_t agno, char *buf)
 {
-	static char	buf[SMBUFSZ];
-
-	sprintf(buf, "%s/.fsr/ag%d/tmp%d",
-	        ( (strcmp(mnt, "/") == 0) ? "" : mnt),
-	        tmp_agi,
-	        getpid());
+	static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+	int		agi;
 
+	pthread_mutex_lock(&lock);
+	agi = tmp_agi;
 	if (++tmp_agi == fsgeom.agcount)
 		tmp_agi = 0;
+	pthread_mutex_unlock(&lock);
+
+	sprintf(buf, "%s/.fsr/ag%d/tmp%d.%u",
+	        ( (strcmp(mnt, "/") == 0) ? "" : mnt),
+	        agi,
+	        getpid(), agno);
 
 	return(buf);
 }
@@ -16,6 +16,14 @@
  */
 #define CACHE_MISCOMPARE_PURGE	(1 << 0)
 
+/*
+ * Split the cache into per-CPU shards, each with its own reclaim clock, lock
+ * and statistics, so that many threads can look up and reclaim nodes without
+ * serialising on a single lock.
+ */
+#define CACHE_SHARDED		(1 << 1)
+#define CACHE_MAX_SHARDS	64
+
 /*
  * cache object campare return values
  */
@@ -30,14 +38,20 @@ enum {
 /*
  * Cache priorities range from BASE to MAX.
  *
+ * Reclaim uses a CLOCK (second chance) algorithm.  Every time a node is
+ * looked up or has its priority set, it is given (priority + 1) chances, and
+ * each pass of the clock hand over an unreferenced node uses up one chance.
+ * Nodes are only reclaimed once they have run out of chances, so higher
+ * priority nodes survive proportionally more sweeps than low priority ones.
+ *
  * For prefetch support, the top half of the range starts at
  * CACHE_PREFETCH_PRIORITY and everytime the buffer is fetched and is at or
  * above this priority level, it is reduced to below this level (refer to
  * libxfs_buf_get).
  *
  * If we have dirty nodes, we can't recycle them until they've been cleaned. To
- * keep these out of the reclaimable lists (as there can be lots of them) give
- * them their own priority that the shaker doesn't attempt to walk.
+ * keep these out of the reclaim clock (as there can be lots of them) give
+ * them their own priority and list that the shaker doesn't attempt to walk.
  */
 
 #define CACHE_BASE_PRIORITY	0
@@ -64,6 +78,10 @@ typedef unsigned int (*cache_node_hash_t)(cache_key_t, unsigned int,
 					  unsigned int);
 typedef int (*cache_node_compare_t)(struct cache_node *, cache_key_t);
 typedef unsigned int (*cache_bulk_relse_t)(struct cache *, struct list_head *);
+typedef void (*cache_bulk_flush_t)(struct cache_node **, unsigned int);
+
+/* Maximum number of nodes passed to a single bulkflush call. */
+#define CACHE_FLUSH_BATCH	256
 
 struct cache_operations {
 	cache_node_hash_t	hash;
@@ -72,6 +90,7 @@ struct cache_operations {
 	cache_node_relse_t	relse;
 	cache_node_compare_t	compare;
 	cache_bulk_relse_t	bulkrelse;	/* optional */
+	cache_bulk_flush_t	bulkflush;	/* optional */
 };
 
 struct cache_hash {
@@ -80,39 +99,45 @@ struct cache_hash {
 	pthread_mutex_t		ch_mutex;	/* hash chain mutex */
 };
 
-struct cache_mru {
-	struct list_head	cm_list;	/* MRU head */
-	unsigned int		cm_count;	/* MRU length */
-	pthread_mutex_t		cm_mutex;	/* MRU lock */
+struct cache_shard {
+	pthread_mutex_t		cs_mutex;	/* protects the lists below */
+	struct list_head	cs_clock;	/* reclaim clock */
+	struct list_head	cs_dirty;	/* unflushable nodes */
+	unsigned int		cs_count;	/* nodes on the clock */
+	unsigned int		cs_dirty_count;	/* nodes on the dirty list */
+	unsigned long		cs_hits;	/* cache hits */
+	unsigned long		cs_misses;	/* cache misses */
+	unsigned long		cs_contention;	/* lock waits */
 };
 
 struct cache_node {
 	struct list_head	cn_hash;	/* hash chain */
-	struct list_head	cn_mru;		/* MRU chain */
+	struct list_head	cn_mru;		/* clock or free list */
 	unsigned int		cn_count;	/* reference count */
 	unsigned int		cn_hashidx;	/* hash chain index */
 	int			cn_priority;	/* priority, -1 = free list */
 	int			cn_old_priority;/* saved pre-dirty prio */
+	unsigned int		cn_chances;	/* sweeps before reclaim */
 	pthread_mutex_t		cn_mutex;	/* node mutex */
 };
 
 struct cache {
 	int			c_flags;	/* behavioural flags */
 	unsigned int		c_maxcount;	/* max cache nodes */
-	unsigned int		c_count;	/* count of nodes */
-	pthread_mutex_t		c_mutex;	/* node count mutex */
+	unsigned int		c_count;	/* count of nodes (atomic) */
+	pthread_mutex_t		c_mutex;	/* cache expansion mutex */
 	cache_node_hash_t	hash;		/* node hash function */
 	cache_node_alloc_t	alloc;		/* allocation function */
 	cache_node_flush_t	flush;		/* flush dirty data function */
 	cache_node_relse_t	relse;		/* memory free function */
 	cache_node_compare_t	compare;	/* comparison routine */
 	cache_bulk_relse_t	bulkrelse;	/* bulk release routine */
+	cache_bulk_flush_t	bulkflush;	/* bulk flush routine */
 	unsigned int		c_hashsize;	/* hash bucket count */
 	unsigned int		c_hashshift;	/* hash key shift */
 	struct cache_hash	*c_hash;	/* hash table buckets */
-	struct cache_mru	c_mrus[CACHE_DIRTY_PRIORITY + 1];
-	unsigned long long	c_misses;	/* cache misses */
-	unsigned long long	c_hits;		/* cache hits */
+	unsigned int		c_nr_shards;	/* power of two */
+	struct cache_shard	*c_shards;	/* reclaim shards */
 	unsigned int 		c_max;		/* max nodes ever used */
 };
 
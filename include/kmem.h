@@ -11,12 +11,28 @@
 #define KM_LARGE	0x0010u
 #define KM_NOLOCKDEP	0x0020u
 
+struct kmem_slab;
+
 struct kmem_cache {
 	int		cache_unitsize;	/* Size in bytes of cache unit */
 	int		allocated;	/* debug: How many allocated? */
 	unsigned int	align;
 	const char	*cache_name;	/* tag name */
 	void		(*ctor)(void *);
+
+	/* slab allocator state, protected by cache_lock */
+	pthread_mutex_t	cache_lock;
+	pthread_key_t	cache_key;	/* this thread's magazine */
+	unsigned int	objsize;	/* unitsize rounded up to align */
+	unsigned int	slab_objs;	/* objects per slab */
+	struct kmem_slab *slabs;	/* every slab we own */
+	char		*carve_next;	/* next never-used object */
+	unsigned int	carve_left;	/* never-used objects left */
+	void		**depot;	/* objects freed to the depot */
+	unsigned long	depot_nr;	/* objects in the depot */
+	struct list_head magazines;	/* every thread's magazine */
+	unsigned long	nr_slabs;	/* stats: slabs allocated */
+	int		max_allocated;	/* stats: high water mark */
 };
 
 typedef unsigned int __bitwise gfp_t;
@@ -40,15 +56,9 @@ kmem_cache_init(unsigned int size, const char *name)
 
 extern void	*kmem_cache_alloc(struct kmem_cache *, gfp_t);
 extern void	*kmem_cache_zalloc(struct kmem_cache *, gfp_t);
+extern void	kmem_cache_free(struct kmem_cache *, void *);
 extern int	kmem_cache_destroy(struct kmem_cache *);
 
-static inline void
-kmem_cache_free(struct kmem_cache *cache, void *ptr)
-{
-	cache->allocated--;
-	free(ptr);
-}
-
 extern void	*kmem_alloc(size_t, int);
 extern void	*kvmalloc(size_t, gfp_t);
 extern void	*kmem_zalloc(size_t, int);
@@ -23,4 +23,65 @@ typedef struct xfs_metablock {
 #define XFS_METADUMP_FULLBLOCKS	(1 << 2)
 #define XFS_METADUMP_DIRTYLOG	(1 << 3)
 
+/*
+ * Version 2 images start with an xfs_metadump_header and are followed by a
+ * sequence of segments.  Each segment is an xfs_metadump_seg followed by its
+ * payload, which may be compressed.  Uncompressed, a payload is the contents
+ * of xms_nr extents followed by an array of xfs_metadump_ext records that
+ * say where each extent goes.
+ *
+ * After the last segment comes an xfs_metadump_index, the index entries for
+ * every extent in the image sorted by daddr, and a copy of the index header
+ * as a trailer.  Streaming readers stop at the index magic; readers that can
+ * seek use the trailer to find any sector without decompressing the whole
+ * image.  If extents overlap, the one written last wins.
+ */
+#define XFS_MD_MAGIC_V2		0x584d4432	/* 'XMD2' */
+#define XFS_MD_SEG_MAGIC	0x584d5347	/* 'XMSG' */
+#define XFS_MD_IDX_MAGIC	0x584d4958	/* 'XMIX' */
+
+/* Largest uncompressed payload that readers need to handle. */
+#define XFS_MD_SEG_MAX		(1U << 24)
+
+/* Segment payload encodings */
+#define XFS_MD_CODEC_NONE	0
+#define XFS_MD_CODEC_LZ		1	/* LZ4 block format */
+
+struct xfs_metadump_header {
+	__be32		xmh_magic;
+	__be32		xmh_version;	/* 2 */
+	__be32		xmh_info;	/* XFS_METADUMP_* flags */
+	__be32		xmh_pad;
+	__be64		xmh_reserved[2];
+};
+
+struct xfs_metadump_seg {
+	__be32		xms_magic;
+	__be32		xms_codec;
+	__be32		xms_len;	/* bytes stored after this header */
+	__be32		xms_rawlen;	/* uncompressed payload length */
+	__be32		xms_nr;		/* number of extents */
+	__be32		xms_crc;	/* crc32c of the uncompressed payload */
+};
+
+struct xfs_metadump_ext {
+	__be64		xme_daddr;
+	__be32		xme_len;	/* in 512 byte sectors */
+	__be32		xme_off;	/* byte offset in uncompressed payload */
+};
+
+struct xfs_metadump_idx {
+	__be64		xmi_daddr;
+	__be64		xmi_seg;	/* file offset of the segment header */
+	__be32		xmi_len;	/* in 512 byte sectors */
+	__be32		xmi_off;	/* byte offset in uncompressed payload */
+};
+
+struct xfs_metadump_index {
+	__be32		xmx_magic;
+	__be32		xmx_crc;	/* crc32c of the index entries */
+	__be64		xmx_count;	/* number of index entries */
+	__be64		xmx_pos;	/* file offset of this header */
+};
+
 #endif /* _XFS_METADUMP_H_ */
@@ -11,11 +11,132 @@
 #include "libfrog/crc32c.h"
 #include "libfrog/crc32cselftest.h"
 
+static const cmdinfo_t	crc32cselftest_cmd;
+
+#define CRC32C_CHECK_LEN	(64 * 1024)
+#define CRC32C_CHECK_RUNS	10000
+#define CRC32C_BENCH_BLOCK	4096
+#define CRC32C_BENCH_BYTES	(256ULL << 20)
+
+/* Compare @fn against the generic code for random lengths and alignments. */
+static int
+crc32c_crosscheck(
+	const struct crc32c_impl *impl,
+	unsigned char		*buf)
+{
+	int			errors = 0;
+	int			i;
+
+	for (i = 0; i < CRC32C_CHECK_RUNS; i++) {
+		uint32_t	seed = random();
+		size_t		off = random() % 64;
+		size_t		len = random() % (CRC32C_CHECK_LEN - off);
+
+		/* Bias towards the short lengths where the kernels switch. */
+		if (i & 1)
+			len %= 1024;
+		if (impl->fn(seed, buf + off, len) !=
+		    crc32c_le_generic(seed, buf + off, len))
+			errors++;
+	}
+
+	if (errors)
+		printf("%s: %d cross checks failed\n", impl->name, errors);
+	return errors;
+}
+
+/* Checksum a buffer of metadata sized blocks over and over. */
+static void
+crc32c_bench(
+	const struct crc32c_impl *impl,
+	unsigned char		*buf)
+{
+	struct timeval		start, stop;
+	unsigned long long	done;
+	uint64_t		usec;
+	uint32_t		crc = 0;
+	size_t			off;
+
+	gettimeofday(&start, NULL);
+	for (done = 0; done < CRC32C_BENCH_BYTES; done += CRC32C_CHECK_LEN) {
+		for (off = 0; off < CRC32C_CHECK_LEN; off += CRC32C_BENCH_BLOCK)
+			crc ^= impl->fn(crc, buf + off, CRC32C_BENCH_BLOCK);
+	}
+	gettimeofday(&stop, NULL);
+
+	usec = stop.tv_usec - start.tv_usec +
+		1000000 * (stop.tv_sec - start.tv_sec);
+	printf("%s: %llu MiB/s in %u byte blocks%s (0x%08x)\n",
+			impl->name,
+			usec ? (CRC32C_BENCH_BYTES >> 20) * 1000000ULL / usec : 0,
+			CRC32C_BENCH_BLOCK,
+			strcmp(impl->name, crc32c_impl_name()) ? "" : ", in use",
+			crc);
+}
+
+static int
+crc32c_test_all(void)
+{
+	const struct crc32c_impl *impls;
+	unsigned char		*buf;
+	unsigned int		nr, i;
+	int			errors = 0;
+
+	buf = malloc(CRC32C_CHECK_LEN);
+	if (!buf) {
+		perror("malloc");
+		return 1;
+	}
+	for (i = 0; i < CRC32C_CHECK_LEN; i++)
+		buf[i] = random();
+
+	nr = crc32c_impls(&impls);
+	for (i = 0; i < nr; i++) {
+		int		e;
+
+		e = crc32c_test_func(impls[i].name, impls[i].fn, 0);
+		e += crc32c_crosscheck(&impls[i], buf);
+		if (!e)
+			crc32c_bench(&impls[i], buf);
+		errors += e;
+	}
+
+	free(buf);
+	return errors;
+}
+
+static void
+crc32cselftest_help(void)
+{
+	printf(_(
+"\n"
+" Test the crc32c implementation used by the XFS tools.\n"
+"\n"
+" -a -- Test, cross check and benchmark every implementation this CPU supports\n"
+"\n"));
+}
+
 static int
 crc32cselftest_f(
 	int		argc,
 	char		**argv)
 {
+	bool		all = false;
+	int		c;
+
+	while ((c = getopt(argc, argv, "a")) != EOF) {
+		switch (c) {
+		case 'a':
+			all = true;
+			break;
+		default:
+			exitcode = 1;
+			return command_usage(&crc32cselftest_cmd);
+		}
+	}
+
+	if (all)
+		return crc32c_test_all() != 0;
 	return crc32c_test(0) != 0;
 }
 
@@ -23,11 +144,13 @@ static const cmdinfo_t	crc32cselftest_cmd = {
 	.name		= "crc32cselftest",
 	.cfunc		= crc32cselftest_f,
 	.argmin		= 0,
-	.argmax		= 0,
+	.argmax		= 1,
 	.canpush	= 0,
 	.flags		= CMD_FLAG_ONESHOT | CMD_FLAG_FOREIGN_OK |
 			  CMD_NOFILE_OK | CMD_NOMAP_OK,
+	.args		= "[-a]",
 	.oneline	= N_("self test of crc32c implementation"),
+	.help		= crc32cselftest_help,
 };
 
 void
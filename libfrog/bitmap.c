@@ -20,8 +20,28 @@
  * extent records that tell us which ranges are set; the bitmap key is
  * an arbitrary uint64_t.  The usual bitmap operations (set, clear,
  * test, test and set) are supported, plus we can iterate set ranges.
+ *
+ * Scrub and repair set ranges from many threads at once, so the key space
+ * is cut into stripes and each stripe is hashed to one of several shards,
+ * each of which has its own lock and tree.  A range that crosses a stripe
+ * boundary is stored as one extent per stripe, and the iterators glue the
+ * pieces back together so that callers still see maximal extents.
  */
 
+#define BITMAP_SHARD_BITS	4
+#define BITMAP_NR_SHARDS	(1U << BITMAP_SHARD_BITS)
+#define BITMAP_STRIPE_SHIFT	20
+#define BITMAP_STRIPE_SIZE	(1ULL << BITMAP_STRIPE_SHIFT)
+
+struct bitmap_shard {
+	pthread_mutex_t		bs_lock;
+	struct avl64tree_desc	bs_tree;
+};
+
+struct bitmap {
+	struct bitmap_shard	bt_shards[BITMAP_NR_SHARDS];
+};
+
 #define avl_for_each_range_safe(pos, n, l, first, last) \
 	for (pos = (first), n = pos->avl_nextino, l = (last)->avl_nextino; \
 			pos != (l); \
@@ -66,34 +86,77 @@ static struct avl64ops bitmap_ops = {
 	extent_end,
 };
 
+/* Which shard holds the stripe containing @key? */
+static inline struct bitmap_shard *
+bitmap_shard(
+	struct bitmap		*bmap,
+	uint64_t		key)
+{
+	uint64_t		stripe = key >> BITMAP_STRIPE_SHIFT;
+
+	/*
+	 * Hash the stripe number so that callers who lay out their key space
+	 * in power of two sized groups (AGs, for example) still spread out.
+	 */
+	return &bmap->bt_shards[(stripe * 0x9E3779B97F4A7C15ULL) >>
+			(64 - BITMAP_SHARD_BITS)];
+}
+
+/* How much of [start, start + length) lies within the first stripe? */
+static inline uint64_t
+bitmap_stripe_len(
+	uint64_t		start,
+	uint64_t		length)
+{
+	return min(length, BITMAP_STRIPE_SIZE -
+			(start & (BITMAP_STRIPE_SIZE - 1)));
+}
+
+static void
+bitmap_lock_all(
+	struct bitmap		*bmap)
+{
+	unsigned int		i;
+
+	for (i = 0; i < BITMAP_NR_SHARDS; i++)
+		pthread_mutex_lock(&bmap->bt_shards[i].bs_lock);
+}
+
+static void
+bitmap_unlock_all(
+	struct bitmap		*bmap)
+{
+	unsigned int		i;
+
+	for (i = BITMAP_NR_SHARDS; i > 0; i--)
+		pthread_mutex_unlock(&bmap->bt_shards[i - 1].bs_lock);
+}
+
 /* Initialize a bitmap. */
 int
 bitmap_alloc(
 	struct bitmap		**bmapp)
 {
 	struct bitmap		*bmap;
+	unsigned int		i;
 	int			ret;
 
 	bmap = calloc(1, sizeof(struct bitmap));
 	if (!bmap)
 		return -errno;
-	bmap->bt_tree = malloc(sizeof(struct avl64tree_desc));
-	if (!bmap->bt_tree) {
-		ret = -errno;
-		goto out;
-	}
 
-	ret = -pthread_mutex_init(&bmap->bt_lock, NULL);
-	if (ret)
-		goto out_tree;
+	for (i = 0; i < BITMAP_NR_SHARDS; i++) {
+		ret = -pthread_mutex_init(&bmap->bt_shards[i].bs_lock, NULL);
+		if (ret)
+			goto out_locks;
+		avl64_init_tree(&bmap->bt_shards[i].bs_tree, &bitmap_ops);
+	}
 
-	avl64_init_tree(bmap->bt_tree, &bitmap_ops);
 	*bmapp = bmap;
-
 	return 0;
-out_tree:
-	free(bmap->bt_tree);
-out:
+out_locks:
+	while (i-- > 0)
+		pthread_mutex_destroy(&bmap->bt_shards[i].bs_lock);
 	free(bmap);
 	return ret;
 }
@@ -107,13 +170,16 @@ bitmap_free(
 	struct avl64node	*node;
 	struct avl64node	*n;
 	struct bitmap_node	*ext;
+	unsigned int		i;
 
 	bmap = *bmapp;
-	avl_for_each_safe(bmap->bt_tree, node, n) {
-		ext = container_of(node, struct bitmap_node, btn_node);
-		free(ext);
+	for (i = 0; i < BITMAP_NR_SHARDS; i++) {
+		avl_for_each_safe(&bmap->bt_shards[i].bs_tree, node, n) {
+			ext = container_of(node, struct bitmap_node, btn_node);
+			free(ext);
+		}
+		pthread_mutex_destroy(&bmap->bt_shards[i].bs_lock);
 	}
-	free(bmap->bt_tree);
 	free(bmap);
 	*bmapp = NULL;
 }
@@ -140,7 +206,7 @@ bitmap_node_init(
 /* Create a new bitmap node and insert it. */
 static inline int
 __bitmap_insert(
-	struct bitmap		*bmap,
+	struct avl64tree_desc	*tree,
 	uint64_t		start,
 	uint64_t		length)
 {
@@ -151,7 +217,7 @@ __bitmap_insert(
 	if (!ext)
 		return -errno;
 
-	node = avl64_insert(bmap->bt_tree, &ext->btn_node);
+	node = avl64_insert(tree, &ext->btn_node);
 	if (node == NULL) {
 		free(ext);
 		return -EEXIST;
@@ -160,10 +226,10 @@ __bitmap_insert(
 	return 0;
 }
 
-/* Set a region of bits (locked). */
+/* Set a region of bits within one stripe (locked). */
 static int
 __bitmap_set(
-	struct bitmap		*bmap,
+	struct avl64tree_desc	*tree,
 	uint64_t		start,
 	uint64_t		length)
 {
@@ -177,12 +243,12 @@ __bitmap_set(
 	uint64_t		new_length;
 
 	/* Find any existing nodes adjacent or within that range. */
-	avl64_findranges(bmap->bt_tree, start - 1, start + length + 1,
+	avl64_findranges(tree, start - 1, start + length + 1,
 			&firstn, &lastn);
 
 	/* Nothing, just insert a new extent. */
 	if (firstn == NULL && lastn == NULL)
-		return __bitmap_insert(bmap, start, length);
+		return __bitmap_insert(tree, start, length);
 
 	assert(firstn != NULL && lastn != NULL);
 	new_start = start;
@@ -199,9 +265,9 @@ __bitmap_set(
 		/* Check for overlapping and adjacent extents. */
 		if (ext->btn_start + ext->btn_length >= start ||
 		    ext->btn_start <= start + length) {
-			if (ext->btn_start < start) {
+			if (ext->btn_start < new_start) {
+				new_length += new_start - ext->btn_start;
 				new_start = ext->btn_start;
-				new_length += ext->btn_length;
 			}
 
 			if (ext->btn_start + ext->btn_length >
@@ -209,12 +275,12 @@ __bitmap_set(
 				new_length = ext->btn_start + ext->btn_length -
 						new_start;
 
-			avl64_delete(bmap->bt_tree, pos);
+			avl64_delete(tree, pos);
 			free(ext);
 		}
 	}
 
-	return __bitmap_insert(bmap, new_start, new_length);
+	return __bitmap_insert(tree, new_start, new_length);
 }
 
 /* Set a region of bits. */
@@ -224,20 +290,32 @@ bitmap_set(
 	uint64_t		start,
 	uint64_t		length)
 {
-	int			res;
+	struct bitmap_shard	*bs;
+	uint64_t		len;
+	int			res = 0;
+
+	while (length > 0) {
+		len = bitmap_stripe_len(start, length);
+		bs = bitmap_shard(bmap, start);
+
+		pthread_mutex_lock(&bs->bs_lock);
+		res = __bitmap_set(&bs->bs_tree, start, len);
+		pthread_mutex_unlock(&bs->bs_lock);
+		if (res)
+			break;
 
-	pthread_mutex_lock(&bmap->bt_lock);
-	res = __bitmap_set(bmap, start, length);
-	pthread_mutex_unlock(&bmap->bt_lock);
+		start += len;
+		length -= len;
+	}
 
 	return res;
 }
 
 #if 0	/* Unused, provided for completeness. */
-/* Clear a region of bits. */
-int
-bitmap_clear(
-	struct bitmap		*bmap,
+/* Clear a region of bits within one stripe (locked). */
+static int
+__bitmap_clear(
+	struct avl64tree_desc	*tree,
 	uint64_t		start,
 	uint64_t		len)
 {
@@ -252,15 +330,12 @@ bitmap_clear(
 	struct avl64node	*node;
 	int			stat;
 
-	pthread_mutex_lock(&bmap->bt_lock);
 	/* Find any existing nodes over that range. */
-	avl64_findranges(bmap->bt_tree, start, start + len, &firstn, &lastn);
+	avl64_findranges(tree, start, start + len, &firstn, &lastn);
 
 	/* Nothing, we're done. */
-	if (firstn == NULL && lastn == NULL) {
-		pthread_mutex_unlock(&bmap->bt_lock);
+	if (firstn == NULL && lastn == NULL)
 		return 0;
-	}
 
 	assert(firstn != NULL && lastn != NULL);
 
@@ -276,7 +351,7 @@ bitmap_clear(
 		switch (stat) {
 		case 0:
 			/* Extent totally within range; delete. */
-			avl64_delete(bmap->bt_tree, pos);
+			avl64_delete(tree, pos);
 			free(ext);
 			break;
 		case 1:
@@ -297,26 +372,101 @@ bitmap_clear(
 					new_start;
 
 			ext = bitmap_node_init(new_start, new_length);
-			if (!ext) {
-				ret = -errno;
-				goto out;
-			}
+			if (!ext)
+				return -errno;
 
-			node = avl64_insert(bmap->bt_tree, &ext->btn_node);
-			if (node == NULL) {
-				ret = -EEXIST;
-				goto out;
-			}
+			node = avl64_insert(tree, &ext->btn_node);
+			if (node == NULL)
+				return -EEXIST;
 			break;
 		}
 	}
 
-out:
-	pthread_mutex_unlock(&bmap->bt_lock);
+	return 0;
+}
+
+/* Clear a region of bits. */
+int
+bitmap_clear(
+	struct bitmap		*bmap,
+	uint64_t		start,
+	uint64_t		length)
+{
+	struct bitmap_shard	*bs;
+	uint64_t		len;
+	int			ret = 0;
+
+	while (length > 0) {
+		len = bitmap_stripe_len(start, length);
+		bs = bitmap_shard(bmap, start);
+
+		pthread_mutex_lock(&bs->bs_lock);
+		ret = __bitmap_clear(&bs->bs_tree, start, len);
+		pthread_mutex_unlock(&bs->bs_lock);
+		if (ret)
+			break;
+
+		start += len;
+		length -= len;
+	}
+
 	return ret;
 }
 #endif
 
+/*
+ * Walk the extents of every shard in key order, from @pos up to (but not
+ * including) @stop, and glue together the pieces of extents that were split
+ * at stripe boundaries.  Call with all the shards locked.
+ */
+static int
+bitmap_walk(
+	struct avl64node	**pos,
+	struct avl64node	**stop,
+	int			(*fn)(uint64_t, uint64_t, void *),
+	void			*arg)
+{
+	struct bitmap_node	*ext;
+	uint64_t		cur_start = 0;
+	uint64_t		cur_len = 0;
+	int			best;
+	int			error;
+	unsigned int		i;
+
+	for (;;) {
+		best = -1;
+		for (i = 0; i < BITMAP_NR_SHARDS; i++) {
+			if (pos[i] == stop[i])
+				continue;
+			if (best < 0 ||
+			    extent_start(pos[i]) < extent_start(pos[best]))
+				best = i;
+		}
+		if (best < 0)
+			break;
+
+		ext = container_of(pos[best], struct bitmap_node, btn_node);
+		pos[best] = pos[best]->avl_nextino;
+
+		if (cur_len > 0 && cur_start + cur_len == ext->btn_start) {
+			cur_len += ext->btn_length;
+			continue;
+		}
+
+		if (cur_len > 0) {
+			error = fn(cur_start, cur_len, arg);
+			if (error)
+				return error;
+		}
+		cur_start = ext->btn_start;
+		cur_len = ext->btn_length;
+	}
+
+	if (cur_len > 0)
+		return fn(cur_start, cur_len, arg);
+	return 0;
+}
+
 /* Iterate the set regions of this bitmap. */
 int
 bitmap_iterate(
@@ -324,23 +474,25 @@ bitmap_iterate(
 	int			(*fn)(uint64_t, uint64_t, void *),
 	void			*arg)
 {
-	struct avl64node	*node;
-	struct bitmap_node	*ext;
-	int			error = 0;
+	struct avl64node	*pos[BITMAP_NR_SHARDS];
+	struct avl64node	*stop[BITMAP_NR_SHARDS] = { NULL };
+	unsigned int		i;
+	int			error;
 
-	pthread_mutex_lock(&bmap->bt_lock);
-	avl_for_each(bmap->bt_tree, node) {
-		ext = container_of(node, struct bitmap_node, btn_node);
-		error = fn(ext->btn_start, ext->btn_length, arg);
-		if (error)
-			break;
-	}
-	pthread_mutex_unlock(&bmap->bt_lock);
+	bitmap_lock_all(bmap);
+	for (i = 0; i < BITMAP_NR_SHARDS; i++)
+		pos[i] = bmap->bt_shards[i].bs_tree.avl_firstino;
+	error = bitmap_walk(pos, stop, fn, arg);
+	bitmap_unlock_all(bmap);
 
 	return error;
 }
 
-/* Iterate the set regions of part of this bitmap. */
+/*
+ * Iterate the set regions of part of this bitmap.  A region that extends
+ * outside the range may be cut short at the first stripe boundary outside
+ * the range.
+ */
 int
 bitmap_iterate_range(
 	struct bitmap		*bmap,
@@ -349,38 +501,35 @@ bitmap_iterate_range(
 	int			(*fn)(uint64_t, uint64_t, void *),
 	void			*arg)
 {
+	struct avl64node	*pos[BITMAP_NR_SHARDS];
+	struct avl64node	*stop[BITMAP_NR_SHARDS];
 	struct avl64node	*firstn;
 	struct avl64node	*lastn;
-	struct avl64node	*pos;
-	struct avl64node	*n;
-	struct avl64node	*l;
-	struct bitmap_node	*ext;
-	int			ret = 0;
-
-	pthread_mutex_lock(&bmap->bt_lock);
+	unsigned int		i;
+	int			ret;
 
-	avl64_findranges(bmap->bt_tree, start, start + length, &firstn,
-			&lastn);
+	bitmap_lock_all(bmap);
 
-	if (firstn == NULL && lastn == NULL)
-		goto out;
-
-	avl_for_each_range_safe(pos, n, l, firstn, lastn) {
-		ext = container_of(pos, struct bitmap_node, btn_node);
-		ret = fn(ext->btn_start, ext->btn_length, arg);
-		if (ret)
-			break;
+	for (i = 0; i < BITMAP_NR_SHARDS; i++) {
+		avl64_findranges(&bmap->bt_shards[i].bs_tree, start,
+				start + length, &firstn, &lastn);
+		if (firstn == NULL && lastn == NULL) {
+			pos[i] = stop[i] = NULL;
+			continue;
+		}
+		pos[i] = firstn;
+		stop[i] = lastn->avl_nextino;
 	}
+	ret = bitmap_walk(pos, stop, fn, arg);
 
-out:
-	pthread_mutex_unlock(&bmap->bt_lock);
+	bitmap_unlock_all(bmap);
 	return ret;
 }
 
 /* Do any bitmap extents overlap the given one?  (locked) */
 static bool
 __bitmap_test(
-	struct bitmap		*bmap,
+	struct avl64tree_desc	*tree,
 	uint64_t		start,
 	uint64_t		len)
 {
@@ -388,7 +537,7 @@ __bitmap_test(
 	struct avl64node	*lastn;
 
 	/* Find any existing nodes over that range. */
-	avl64_findranges(bmap->bt_tree, start, start + len, &firstn, &lastn);
+	avl64_findranges(tree, start, start + len, &firstn, &lastn);
 
 	return firstn != NULL && lastn != NULL;
 }
@@ -400,11 +549,37 @@ bitmap_test(
 	uint64_t		start,
 	uint64_t		len)
 {
-	bool			res;
+	struct bitmap_shard	*bs;
+	uint64_t		piece;
+	bool			res = false;
+	unsigned int		i;
+
+	/*
+	 * A shard only holds extents from its own stripes, so a long range
+	 * can be tested against each shard as a whole.  Otherwise, test each
+	 * stripe of the range in the shard that owns it.
+	 */
+	if (len > BITMAP_NR_SHARDS * BITMAP_STRIPE_SIZE) {
+		for (i = 0; i < BITMAP_NR_SHARDS && !res; i++) {
+			bs = &bmap->bt_shards[i];
+			pthread_mutex_lock(&bs->bs_lock);
+			res = __bitmap_test(&bs->bs_tree, start, len);
+			pthread_mutex_unlock(&bs->bs_lock);
+		}
+		return res;
+	}
+
+	while (len > 0 && !res) {
+		piece = bitmap_stripe_len(start, len);
+		bs = bitmap_shard(bmap, start);
 
-	pthread_mutex_lock(&bmap->bt_lock);
-	res = __bitmap_test(bmap, start, len);
-	pthread_mutex_unlock(&bmap->bt_lock);
+		pthread_mutex_lock(&bs->bs_lock);
+		res = __bitmap_test(&bs->bs_tree, start, piece);
+		pthread_mutex_unlock(&bs->bs_lock);
+
+		start += piece;
+		len -= piece;
+	}
 
 	return res;
 }
@@ -414,7 +589,12 @@ bool
 bitmap_empty(
 	struct bitmap		*bmap)
 {
-	return bmap->bt_tree->avl_firstino == NULL;
+	unsigned int		i;
+
+	for (i = 0; i < BITMAP_NR_SHARDS; i++)
+		if (bmap->bt_shards[i].bs_tree.avl_firstino != NULL)
+			return false;
+	return true;
 }
 
 #ifdef DEBUG
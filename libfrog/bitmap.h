@@ -6,10 +6,7 @@
 #ifndef __LIBFROG_BITMAP_H__
 #define __LIBFROG_BITMAP_H__
 
-struct bitmap {
-	pthread_mutex_t		bt_lock;
-	struct avl64tree_desc	*bt_tree;
-};
+struct bitmap;
 
 int bitmap_alloc(struct bitmap **bmap);
 void bitmap_free(struct bitmap **bmap);
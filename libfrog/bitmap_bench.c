@@ -0,0 +1,295 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 Oracle.  All Rights Reserved.
+ */
+
+/*
+ * Bitmap stress test and benchmark
+ *
+ * Several threads set random ranges in one shared bitmap with bitmap_set and
+ * then test random ranges with bitmap_test.  Every result is checked against
+ * a flat bit array, and the set regions reported by bitmap_iterate must be
+ * exactly the maximal runs of set bits.
+ *
+ * "make -C libfrog check" runs this and fails if the bitmap gets anything
+ * wrong.  Pass a thread count and a number of ranges to benchmark a
+ * different load.
+ */
+#include "xfs.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "platform_defs.h"
+#include "bitmap.h"
+
+#define BENCH_KEYSPACE		(1ULL << 26)
+#define BENCH_MAX_LEN		64
+
+struct bench_range {
+	uint64_t		start;
+	uint64_t		length;
+};
+
+struct bench_thread {
+	pthread_t		thread;
+	struct bitmap		*bmap;
+	struct bench_range	*ranges;
+	bool			*results;
+	size_t			nr;
+};
+
+static uint64_t			seed = 0x9e3779b97f4a7c15ULL;
+static uint64_t			*ref;		/* one bit per key */
+
+static uint64_t
+bench_rand(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline bool
+ref_test(
+	uint64_t		key)
+{
+	return ref[key / 64] & (1ULL << (key % 64));
+}
+
+static bool
+ref_test_range(
+	const struct bench_range *r)
+{
+	uint64_t		key;
+
+	for (key = r->start; key < r->start + r->length; key++)
+		if (ref_test(key))
+			return true;
+	return false;
+}
+
+static void
+bench_fill(
+	struct bench_range	*ranges,
+	size_t			nr)
+{
+	size_t			i;
+
+	for (i = 0; i < nr; i++) {
+		ranges[i].length = 1 + bench_rand() % BENCH_MAX_LEN;
+		ranges[i].start = bench_rand() %
+				(BENCH_KEYSPACE - ranges[i].length);
+	}
+}
+
+static void *
+bench_set_thread(
+	void			*arg)
+{
+	struct bench_thread	*bt = arg;
+	size_t			i;
+
+	for (i = 0; i < bt->nr; i++) {
+		if (bitmap_set(bt->bmap, bt->ranges[i].start,
+				bt->ranges[i].length)) {
+			fprintf(stderr, "bitmap set failed\n");
+			exit(1);
+		}
+	}
+	return NULL;
+}
+
+static void *
+bench_test_thread(
+	void			*arg)
+{
+	struct bench_thread	*bt = arg;
+	size_t			i;
+
+	for (i = 0; i < bt->nr; i++)
+		bt->results[i] = bitmap_test(bt->bmap, bt->ranges[i].start,
+				bt->ranges[i].length);
+	return NULL;
+}
+
+/* Split the ranges among the threads, run them all and return the time. */
+static uint64_t
+bench_threads(
+	struct bitmap		*bmap,
+	void			*(*fn)(void *),
+	struct bench_range	*ranges,
+	bool			*results,
+	size_t			nr,
+	unsigned int		nr_threads)
+{
+	struct bench_thread	*bts;
+	uint64_t		t0;
+	size_t			per = howmany(nr, nr_threads);
+	unsigned int		i;
+
+	bts = calloc(nr_threads, sizeof(struct bench_thread));
+	if (!bts) {
+		perror("calloc");
+		exit(1);
+	}
+
+	t0 = bench_now_ns();
+	for (i = 0; i < nr_threads; i++) {
+		size_t		first = min(i * per, nr);
+
+		bts[i].bmap = bmap;
+		bts[i].ranges = ranges + first;
+		bts[i].results = results ? results + first : NULL;
+		bts[i].nr = min(per, nr - first);
+		if (pthread_create(&bts[i].thread, NULL, fn, &bts[i])) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(bts[i].thread, NULL);
+	t0 = bench_now_ns() - t0;
+
+	free(bts);
+	return t0;
+}
+
+struct bench_check {
+	uint64_t		next;
+	uint64_t		keys;
+	int			errors;
+};
+
+/* Every region must be a maximal run of set bits, in ascending order. */
+static int
+bench_check_fn(
+	uint64_t		start,
+	uint64_t		length,
+	void			*arg)
+{
+	struct bench_check	*bc = arg;
+	uint64_t		key;
+
+	if (length == 0 || start < bc->next ||
+	    (start > 0 && ref_test(start - 1)) ||
+	    (start + length < BENCH_KEYSPACE && ref_test(start + length))) {
+		bc->errors++;
+		return 0;
+	}
+	for (key = start; key < start + length; key++)
+		if (!ref_test(key))
+			bc->errors++;
+	bc->keys += length;
+	bc->next = start + length + 1;
+	return 0;
+}
+
+static int
+bench_check_bitmap(
+	struct bitmap		*bmap,
+	uint64_t		ref_keys)
+{
+	struct bench_check	bc = { 0 };
+
+	bitmap_iterate(bmap, bench_check_fn, &bc);
+	if (bc.keys != ref_keys)
+		bc.errors++;
+	return bc.errors;
+}
+
+int
+main(
+	int			argc,
+	char			**argv)
+{
+	struct bench_range	*ranges;
+	struct bench_range	*queries;
+	struct bitmap		*bmap;
+	bool			*results;
+	uint64_t		ref_keys = 0;
+	uint64_t		t;
+	size_t			nr = 1 << 16;
+	size_t			i;
+	unsigned int		max_threads = 4;
+	unsigned int		nr_threads;
+	int			errors = 0;
+	int			wrong;
+
+	if (argc > 1)
+		max_threads = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		nr = strtoull(argv[2], NULL, 0);
+	if (argc > 3 || max_threads == 0 || nr == 0) {
+		fprintf(stderr, "Usage: bitmapbench [threads [ranges]]\n");
+		return 1;
+	}
+
+	ranges = malloc(nr * sizeof(struct bench_range));
+	queries = malloc(nr * sizeof(struct bench_range));
+	results = malloc(nr * sizeof(bool));
+	ref = calloc(BENCH_KEYSPACE / 64, sizeof(uint64_t));
+	if (!ranges || !queries || !results || !ref) {
+		perror("malloc");
+		return 1;
+	}
+
+	bench_fill(ranges, nr);
+	bench_fill(queries, nr);
+	for (i = 0; i < nr; i++) {
+		uint64_t	key;
+
+		for (key = ranges[i].start;
+		     key < ranges[i].start + ranges[i].length; key++) {
+			if (!ref_test(key)) {
+				ref[key / 64] |= 1ULL << (key % 64);
+				ref_keys++;
+			}
+		}
+	}
+
+	printf("%zu ranges, %llu keys set\n", nr,
+			(unsigned long long)ref_keys);
+	for (nr_threads = 1; nr_threads <= max_threads; nr_threads *= 2) {
+		if (bitmap_alloc(&bmap)) {
+			perror("bitmap_alloc");
+			return 1;
+		}
+
+		t = bench_threads(bmap, bench_set_thread, ranges, NULL, nr,
+				nr_threads);
+		wrong = bench_check_bitmap(bmap, ref_keys);
+		printf("%2u threads %-5s %9.2f ms%s\n", nr_threads, "set",
+				t / 1e6, wrong ? "  FAILED" : "");
+		errors += wrong;
+
+		t = bench_threads(bmap, bench_test_thread, queries, results,
+				nr, nr_threads);
+		for (i = 0, wrong = 0; i < nr; i++)
+			if (results[i] != ref_test_range(&queries[i]))
+				wrong++;
+		printf("%2u threads %-5s %9.2f ms%s\n", nr_threads, "test",
+				t / 1e6, wrong ? "  FAILED" : "");
+		errors += wrong;
+
+		bitmap_free(&bmap);
+	}
+
+	free(ref);
+	free(results);
+	free(queries);
+	free(ranges);
+	return errors != 0;
+}
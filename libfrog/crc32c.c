@@ -0,0 +1,257 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 Oracle.  All Rights Reserved.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/types.h>
+#include "crc32defs.h"
+#include "crc32c.h"
+
+/*
+ * Hardware CRC32C
+ *
+ * Every metadata block that the tools read or write is checksummed with
+ * crc32c, so we'd like to use the CPU's crc32c instructions when they exist.
+ * The kernels are built with per-function target attributes so that the
+ * rest of libfrog doesn't need special compiler flags, and we pick one at
+ * startup based on what the CPU says it supports.  The slice-by-8 code in
+ * crc32.c is the fallback and the reference that the others are tested
+ * against.
+ */
+
+#define CRC32C_MAX_IMPLS	4
+
+static struct crc32c_impl	crc32c_avail[CRC32C_MAX_IMPLS] = {
+	{ .name = "generic", .fn = crc32c_le_generic },
+};
+static unsigned int		crc32c_nr_avail = 1;
+static const struct crc32c_impl	*crc32c_best = &crc32c_avail[0];
+
+static inline uint64_t
+crc32c_load64(
+	unsigned char const	*p)
+{
+	uint64_t		v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/*
+ * Multiply a bit-reflected remainder by x^@n modulo the crc32c polynomial,
+ * one bit at a time.  Only used to set up constants.
+ */
+static uint32_t
+crc32c_mul_xpow(
+	uint32_t		crc,
+	unsigned int		n)
+{
+	while (n-- > 0)
+		crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY_LE : 0);
+	return crc;
+}
+
+static void
+crc32c_add_impl(
+	const char		*name,
+	crc32c_func_t		fn)
+{
+	if (crc32c_nr_avail == CRC32C_MAX_IMPLS)
+		return;
+	crc32c_avail[crc32c_nr_avail].name = name;
+	crc32c_avail[crc32c_nr_avail].fn = fn;
+	crc32c_best = &crc32c_avail[crc32c_nr_avail];
+	crc32c_nr_avail++;
+}
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(
+	uint32_t		crc,
+	unsigned char const	*p,
+	size_t			len)
+{
+	uint64_t		c = crc;
+
+	for (; len >= 8; len -= 8, p += 8)
+		c = _mm_crc32_u64(c, crc32c_load64(p));
+	crc = c;
+	while (len-- > 0)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+
+/*
+ * The crc32 instruction has a latency of three cycles but can issue every
+ * cycle, so a single dependency chain only gets a third of the throughput.
+ * Long buffers are split into three equal blocks that are checksummed in
+ * parallel, and the three remainders are then stitched together.  To append
+ * a block of n bytes we need the first remainder times x^(8n); a carryless
+ * multiply by x^(8n - 33) followed by a crc32 of the 64-bit product gets us
+ * exactly that, since the crc32 instruction multiplies by x^32 and the
+ * reflected product carries an extra factor of x.
+ */
+#define CRC32C_PCL_STRIDE	64
+#define CRC32C_PCL_MAX_BLOCK	4096
+#define CRC32C_PCL_NR_K		(CRC32C_PCL_MAX_BLOCK / CRC32C_PCL_STRIDE)
+
+/* x^(8 * n - 33) mod P for n = CRC32C_PCL_STRIDE * (i + 1) */
+static uint32_t			crc32c_pcl_k[CRC32C_PCL_NR_K];
+
+static void
+crc32c_pcl_init(void)
+{
+	uint32_t		k;
+	int			i;
+
+	k = crc32c_mul_xpow(1U << 31, 8 * CRC32C_PCL_STRIDE - 33);
+	for (i = 0; i < CRC32C_PCL_NR_K; i++) {
+		crc32c_pcl_k[i] = k;
+		k = crc32c_mul_xpow(k, 8 * CRC32C_PCL_STRIDE);
+	}
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static inline uint32_t
+crc32c_pcl_shift(
+	uint32_t		crc,
+	uint32_t		k)
+{
+	__m128i			prod;
+
+	prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+			_mm_cvtsi32_si128(k), 0x00);
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(prod));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t
+crc32c_pcl(
+	uint32_t		crc,
+	unsigned char const	*p,
+	size_t			len)
+{
+	while (len >= 3 * CRC32C_PCL_STRIDE) {
+		size_t		blk = len / 3;
+		unsigned char const *p1, *p2;
+		uint64_t	c0 = crc, c1 = 0, c2 = 0;
+		uint32_t	k;
+		size_t		i;
+
+		if (blk > CRC32C_PCL_MAX_BLOCK)
+			blk = CRC32C_PCL_MAX_BLOCK;
+		blk &= ~(size_t)(CRC32C_PCL_STRIDE - 1);
+		k = crc32c_pcl_k[blk / CRC32C_PCL_STRIDE - 1];
+		p1 = p + blk;
+		p2 = p1 + blk;
+
+		for (i = 0; i < blk; i += 8) {
+			c0 = _mm_crc32_u64(c0, crc32c_load64(p + i));
+			c1 = _mm_crc32_u64(c1, crc32c_load64(p1 + i));
+			c2 = _mm_crc32_u64(c2, crc32c_load64(p2 + i));
+		}
+
+		crc = crc32c_pcl_shift(c0, k) ^ c1;
+		crc = crc32c_pcl_shift(crc, k) ^ c2;
+		p += 3 * blk;
+		len -= 3 * blk;
+	}
+
+	return crc32c_sse42(crc, p, len);
+}
+
+static void
+crc32c_probe(void)
+{
+	unsigned int		eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return;
+	if (!(ecx & bit_SSE4_2))
+		return;
+	crc32c_add_impl("sse4.2", crc32c_sse42);
+
+	if (!(ecx & bit_PCLMUL))
+		return;
+	crc32c_pcl_init();
+	crc32c_add_impl("sse4.2-pclmul", crc32c_pcl);
+}
+
+#elif defined(__aarch64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <sys/auxv.h>
+#include <arm_acle.h>
+
+#ifndef HWCAP_CRC32
+# define HWCAP_CRC32		(1 << 7)
+#endif
+
+#ifdef __clang__
+# define CRC32C_ARM_TARGET	__attribute__((target("crc")))
+#else
+# define CRC32C_ARM_TARGET	__attribute__((target("+crc")))
+#endif
+
+CRC32C_ARM_TARGET
+static uint32_t
+crc32c_armv8(
+	uint32_t		crc,
+	unsigned char const	*p,
+	size_t			len)
+{
+	for (; len >= 8; len -= 8, p += 8)
+		crc = __crc32cd(crc, crc32c_load64(p));
+	while (len-- > 0)
+		crc = __crc32cb(crc, *p++);
+	return crc;
+}
+
+static void
+crc32c_probe(void)
+{
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+		crc32c_add_impl("armv8-crc", crc32c_armv8);
+}
+
+#else
+static void crc32c_probe(void) { }
+#endif
+
+/*
+ * Pick an implementation before main() runs so that we never race with
+ * threads calling crc32c_le.  Until then, the generic code is used.
+ */
+static void __attribute__((constructor))
+crc32c_select(void)
+{
+	crc32c_probe();
+}
+
+uint32_t
+crc32c_le(
+	uint32_t		crc,
+	unsigned char const	*p,
+	size_t			len)
+{
+	return crc32c_best->fn(crc, p, len);
+}
+
+unsigned int
+crc32c_impls(
+	const struct crc32c_impl **impls)
+{
+	*impls = crc32c_avail;
+	return crc32c_nr_avail;
+}
+
+const char *
+crc32c_impl_name(void)
+{
+	return crc32c_best->name;
+}
@@ -6,6 +6,21 @@
 #ifndef __LIBFROG_CRC32C_H__
 #define __LIBFROG_CRC32C_H__
 
+typedef uint32_t (*crc32c_func_t)(uint32_t crc, unsigned char const *p,
+		size_t len);
+
+struct crc32c_impl {
+	const char	*name;
+	crc32c_func_t	fn;
+};
+
+/* crc32c_le uses the fastest implementation that this CPU supports. */
 extern uint32_t crc32c_le(uint32_t crc, unsigned char const *p, size_t len);
+extern uint32_t crc32c_le_generic(uint32_t crc, unsigned char const *p,
+		size_t len);
+
+/* List the implementations usable on this CPU, slowest first. */
+extern unsigned int crc32c_impls(const struct crc32c_impl **impls);
+extern const char *crc32c_impl_name(void);
 
 #endif /* __LIBFROG_CRC32C_H__ */
@@ -665,7 +665,9 @@ static struct crc_test {
 #define CRC32CTEST_QUIET	(1U << 0)
 
 static int
-crc32c_test(
+crc32c_test_func(
+	const char	*name,
+	uint32_t	(*fn)(uint32_t crc, unsigned char const *p, size_t len),
 	unsigned int	flags)
 {
 	int		i;
@@ -682,13 +684,13 @@ crc32c_test(
 	for (i = 0; i < 100; i++) {
 		bytes += 2*test[i].length;
 
-		crc ^= crc32c_le(test[i].crc, test_buf +
+		crc ^= fn(test[i].crc, test_buf +
 		    test[i].start, test[i].length);
 	}
 
 	gettimeofday(&start, NULL);
 	for (i = 0; i < 100; i++) {
-		if (test[i].crc32c_le != crc32c_le(test[i].crc, test_buf +
+		if (test[i].crc32c_le != fn(test[i].crc, test_buf +
 		    test[i].start, test[i].length))
 			errors++;
 	}
@@ -701,13 +703,21 @@ crc32c_test(
 		return errors;
 
 	if (errors)
-		printf("crc32c: %d self tests failed\n", errors);
+		printf("%s: %d self tests failed\n", name, errors);
 	else {
-		printf("crc32c: tests passed, %d bytes in %" PRIu64 " usec\n",
-			bytes, usec);
+		printf("%s: tests passed, %d bytes in %" PRIu64 " usec\n",
+			name, bytes, usec);
 	}
 
 	return errors;
 }
 
+/* Test whichever implementation crc32c_le picked. */
+static inline int
+crc32c_test(
+	unsigned int	flags)
+{
+	return crc32c_test_func("crc32c", crc32c_le, flags);
+}
+
 #endif /* __LIBFROG_CRC32CSELFTEST_H__ */
@@ -0,0 +1,347 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 Oracle.  All Rights Reserved.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include "lz.h"
+
+/*
+ * Built-in LZ Codec
+ *
+ * This is a small greedy LZ77 compressor that emits the LZ4 block format, so
+ * that the tools can compress metadata images without linking against an
+ * external compression library.  Filesystem metadata is full of zeroed
+ * space and repeated headers, so even a single-probe hash table gets most of
+ * the available compression at memory bandwidth speeds.
+ *
+ * Each sequence is a token byte (literal count in the high nibble, match
+ * length minus four in the low nibble), extra literal length bytes, the
+ * literals, a little endian 16-bit match offset, and extra match length
+ * bytes.  The block ends with a sequence that only has literals.  As in
+ * LZ4, the last five bytes are always literals and no match starts within
+ * the last twelve bytes.
+ */
+#define LZ_HASH_BITS		12
+#define LZ_MIN_MATCH		4
+#define LZ_LAST_LITERALS	5
+#define LZ_MFLIMIT		12
+#define LZ_MAX_OFFSET		65535
+
+static inline uint32_t
+lz_read32(
+	const uint8_t		*p)
+{
+	uint32_t		v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline unsigned int
+lz_hash(
+	uint32_t		v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Bytes needed to encode a sequence with @litlen literals and a match. */
+static inline size_t
+lz_seq_bytes(
+	size_t			litlen,
+	size_t			matchlen)
+{
+	return 1 + litlen / 255 + 1 + litlen + 2 + matchlen / 255 + 1;
+}
+
+/* Encode the part of a length that didn't fit in the token. */
+static uint8_t *
+lz_put_len(
+	uint8_t			*op,
+	size_t			len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+ssize_t
+frog_lz_compress(
+	const void		*src,
+	size_t			srclen,
+	void			*dst,
+	size_t			dstlen)
+{
+	uint32_t		table[1U << LZ_HASH_BITS] = { 0 };
+	const uint8_t		*base = src;
+	const uint8_t		*ip = base;
+	const uint8_t		*anchor = base;
+	const uint8_t		*iend = base + srclen;
+	uint8_t			*op = dst;
+	uint8_t			*oend = op + dstlen;
+	uint8_t			*token;
+	size_t			litlen;
+
+	if (srclen > LZ_MFLIMIT) {
+		const uint8_t	*mflimit = iend - LZ_MFLIMIT;
+		const uint8_t	*mlimit = iend - LZ_LAST_LITERALS;
+
+		while (ip < mflimit) {
+			uint32_t	seq = lz_read32(ip);
+			unsigned int	h = lz_hash(seq);
+			const uint8_t	*ref = base + table[h];
+			size_t		matchlen;
+			unsigned int	off;
+
+			table[h] = ip - base;
+			if (ref >= ip || ip - ref > LZ_MAX_OFFSET ||
+			    lz_read32(ref) != seq) {
+				/* Skip faster through incompressible data. */
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			matchlen = LZ_MIN_MATCH;
+			while (ip + matchlen < mlimit &&
+			       ip[matchlen] == ref[matchlen])
+				matchlen++;
+
+			litlen = ip - anchor;
+			if (lz_seq_bytes(litlen, matchlen) > oend - op)
+				return 0;
+
+			token = op++;
+			*token = (litlen >= 15 ? 15 : litlen) << 4;
+			if (litlen >= 15)
+				op = lz_put_len(op, litlen - 15);
+			memcpy(op, anchor, litlen);
+			op += litlen;
+
+			off = ip - ref;
+			*op++ = off & 0xFF;
+			*op++ = off >> 8;
+
+			matchlen -= LZ_MIN_MATCH;
+			*token |= matchlen >= 15 ? 15 : matchlen;
+			if (matchlen >= 15)
+				op = lz_put_len(op, matchlen - 15);
+
+			ip += matchlen + LZ_MIN_MATCH;
+			anchor = ip;
+		}
+	}
+
+	/* Everything after the last match goes out as literals. */
+	litlen = iend - anchor;
+	if (1 + litlen / 255 + 1 + litlen > oend - op)
+		return 0;
+	token = op++;
+	*token = (litlen >= 15 ? 15 : litlen) << 4;
+	if (litlen >= 15)
+		op = lz_put_len(op, litlen - 15);
+	memcpy(op, anchor, litlen);
+	op += litlen;
+
+	return op - (uint8_t *)dst;
+}
+
+/* Decode the extra bytes of a length field.  Returns false on overrun. */
+static inline bool
+lz_get_len(
+	const uint8_t		**ipp,
+	const uint8_t		*iend,
+	size_t			*len)
+{
+	const uint8_t		*ip = *ipp;
+	uint8_t			b;
+
+	do {
+		if (ip >= iend)
+			return false;
+		b = *ip++;
+		*len += b;
+	} while (b == 255);
+
+	*ipp = ip;
+	return true;
+}
+
+ssize_t
+frog_lz_decompress(
+	const void		*src,
+	size_t			srclen,
+	void			*dst,
+	size_t			dstlen)
+{
+	const uint8_t		*ip = src;
+	const uint8_t		*iend = ip + srclen;
+	uint8_t			*op = dst;
+	uint8_t			*oend = op + dstlen;
+
+	while (ip < iend) {
+		uint8_t		token = *ip++;
+		const uint8_t	*ref;
+		size_t		len;
+		unsigned int	off;
+
+		len = token >> 4;
+		if (len == 15 && !lz_get_len(&ip, iend, &len))
+			return -EINVAL;
+		if (len > iend - ip || len > oend - op)
+			return -EINVAL;
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		/* The last sequence has no match. */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -EINVAL;
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (off == 0 || off > op - (uint8_t *)dst)
+			return -EINVAL;
+
+		len = token & 15;
+		if (len == 15 && !lz_get_len(&ip, iend, &len))
+			return -EINVAL;
+		len += LZ_MIN_MATCH;
+		if (len > oend - op)
+			return -EINVAL;
+
+		/* Matches may overlap the output, so copy forwards. */
+		ref = op - off;
+		if (off >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else {
+			while (len-- > 0)
+				*op++ = *ref++;
+		}
+	}
+
+	return op - (uint8_t *)dst;
+}
+
+#ifdef LZ_SELFTEST
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LZ_TEST_LEN		65536
+
+static uint64_t			lz_test_seed = 0x9e3779b97f4a7c15ULL;
+
+static uint8_t
+lz_test_rand(void)
+{
+	lz_test_seed ^= lz_test_seed << 13;
+	lz_test_seed ^= lz_test_seed >> 7;
+	lz_test_seed ^= lz_test_seed << 17;
+	return lz_test_seed >> 56;
+}
+
+/*
+ * Compress @len bytes of @buf, decompress the result and check that we get
+ * the same bytes back.  If @compressible, the output must also be smaller
+ * than the input.  Returns the number of failures.
+ */
+static int
+lz_test_roundtrip(
+	const char		*what,
+	const uint8_t		*buf,
+	size_t			len,
+	bool			compressible)
+{
+	size_t			zmax = len + len / 255 + 16;
+	uint8_t			*zbuf = malloc(zmax);
+	uint8_t			*out = malloc(len + 1);
+	ssize_t			zlen;
+	ssize_t			olen;
+	int			errors = 0;
+
+	if (!zbuf || !out) {
+		perror("malloc");
+		exit(1);
+	}
+
+	zlen = frog_lz_compress(buf, len, zbuf, zmax);
+	if (zlen <= 0) {
+		printf("%s: compress failed\n", what);
+		errors++;
+		goto out;
+	}
+	if (compressible && zlen >= len) {
+		printf("%s: %zu bytes compressed to %zd\n", what, len, zlen);
+		errors++;
+	}
+
+	olen = frog_lz_decompress(zbuf, zlen, out, len + 1);
+	if (olen != len || memcmp(buf, out, len)) {
+		printf("%s: round trip mismatch\n", what);
+		errors++;
+	}
+
+	/* Output that doesn't fit, or a truncated stream, must be refused. */
+	if (len > 0 && frog_lz_decompress(zbuf, zlen, out, len - 1) >= 0) {
+		printf("%s: overflowing decompress not refused\n", what);
+		errors++;
+	}
+	if (len > 0 && frog_lz_decompress(zbuf, zlen - 1, out, len + 1) >= 0) {
+		printf("%s: truncated decompress not refused\n", what);
+		errors++;
+	}
+out:
+	free(out);
+	free(zbuf);
+	return errors;
+}
+
+/*
+ * Round trip zeroes, repeated metadata-like blocks, random bytes, and every
+ * length up to a little past the point where matches are allowed.  Returns
+ * nonzero if anything fails.
+ */
+int main(int argc, char **argv)
+{
+	uint8_t			*buf = malloc(LZ_TEST_LEN);
+	uint8_t			zbuf[16];
+	char			what[32];
+	size_t			i;
+	int			errors = 0;
+
+	if (!buf) {
+		perror("malloc");
+		return 1;
+	}
+
+	memset(buf, 0, LZ_TEST_LEN);
+	errors += lz_test_roundtrip("zeroes", buf, LZ_TEST_LEN, true);
+
+	for (i = 0; i < LZ_TEST_LEN; i++)
+		buf[i] = (i % 512) < 16 ? lz_test_rand() : i % 512;
+	errors += lz_test_roundtrip("blocks", buf, LZ_TEST_LEN, true);
+
+	for (i = 0; i < LZ_TEST_LEN; i++)
+		buf[i] = lz_test_rand();
+	errors += lz_test_roundtrip("random", buf, LZ_TEST_LEN, false);
+	if (frog_lz_compress(buf, LZ_TEST_LEN, zbuf, 0) != 0 ||
+	    frog_lz_compress(buf, sizeof(zbuf), zbuf, sizeof(zbuf) - 1) != 0) {
+		printf("random: overflowing compress not refused\n");
+		errors++;
+	}
+
+	for (i = 0; i <= 2 * LZ_MFLIMIT; i++) {
+		snprintf(what, sizeof(what), "short %zu", i);
+		errors += lz_test_roundtrip(what, buf, i, false);
+	}
+
+	free(buf);
+	printf("lz selftest: %s\n", errors ? "FAILED" : "passed");
+	return errors != 0;
+}
+#endif /* LZ_SELFTEST */
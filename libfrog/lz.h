@@ -0,0 +1,24 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 Oracle.  All Rights Reserved.
+ */
+#ifndef __LIBFROG_LZ_H__
+#define __LIBFROG_LZ_H__
+
+#include <sys/types.h>
+
+/*
+ * Compress @srclen bytes into @dst.  Returns the compressed length, or zero
+ * if the output would not fit in @dstlen bytes.
+ */
+ssize_t frog_lz_compress(const void *src, size_t srclen, void *dst,
+		size_t dstlen);
+
+/*
+ * Decompress @srclen bytes into @dst.  Returns the decompressed length, or
+ * -EINVAL if the input is corrupt or would overflow @dstlen bytes.
+ */
+ssize_t frog_lz_decompress(const void *src, size_t srclen, void *dst,
+		size_t dstlen);
+
+#endif /* __LIBFROG_LZ_H__ */
@@ -0,0 +1,498 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 Oracle.  All Rights Reserved.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "platform_defs.h"
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring Driver
+ *
+ * This is just enough of an io_uring client to let the tools keep a batch of
+ * positional reads and writes in flight from a single thread.  We talk to
+ * the kernel directly so that we don't have to depend on liburing.  Each
+ * ring is owned by one thread at a time; callers that share rings between
+ * threads must provide their own locking.
+ */
+struct frog_uring {
+	int			fd;
+	unsigned int		entries;
+
+	/* Number of queued SQEs that we haven't told the kernel about. */
+	unsigned int		to_submit;
+
+	/* Number of I/Os submitted to the kernel but not yet reaped. */
+	unsigned int		inflight;
+
+	/* Submission queue */
+	void			*sq_ring;
+	size_t			sq_ring_sz;
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+	unsigned int		sqe_tail;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_sz;
+
+	/* Completion queue */
+	void			*cq_ring;
+	size_t			cq_ring_sz;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+};
+
+static inline int
+sys_io_uring_setup(
+	unsigned int		entries,
+	struct io_uring_params	*p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+sys_io_uring_enter(
+	int			fd,
+	unsigned int		to_submit,
+	unsigned int		min_complete,
+	unsigned int		flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, NULL, 0);
+}
+
+static inline int
+sys_io_uring_register(
+	int			fd,
+	unsigned int		opcode,
+	const void		*arg,
+	unsigned int		nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Set up an io_uring with space for @entries I/Os in flight. */
+int
+frog_uring_alloc(
+	unsigned int		entries,
+	struct frog_uring	**ringp)
+{
+	struct io_uring_params	p;
+	struct frog_uring	*ring;
+	int			ret;
+
+	ring = calloc(1, sizeof(struct frog_uring));
+	if (!ring)
+		return -errno;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if (ring->fd < 0) {
+		ret = -errno;
+		goto out_ring;
+	}
+
+	/*
+	 * We use IORING_OP_READ/WRITE, which arrived in the same kernel
+	 * release as the RW_CUR_POS feature flag.  Refuse older kernels so
+	 * that callers fall back to synchronous I/O.
+	 */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		ret = -EOPNOTSUPP;
+		goto out_fd;
+	}
+
+	ring->entries = p.sq_entries;
+	ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_sz = p.cq_off.cqes +
+			   p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_ring_sz = ring->cq_ring_sz =
+				max(ring->sq_ring_sz, ring->cq_ring_sz);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ret = -errno;
+		goto out_fd;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_sz,
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd,
+				IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ret = -errno;
+			goto out_sqring;
+		}
+	}
+
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ret = -errno;
+		goto out_cqring;
+	}
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->sqe_tail = *ring->sq_tail;
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+
+	*ringp = ring;
+	return 0;
+out_cqring:
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+out_sqring:
+	munmap(ring->sq_ring, ring->sq_ring_sz);
+out_fd:
+	close(ring->fd);
+out_ring:
+	free(ring);
+	return ret;
+}
+
+/* Tear down an io_uring.  All I/O must have been reaped. */
+void
+frog_uring_free(
+	struct frog_uring	*ring)
+{
+	if (!ring)
+		return;
+
+	munmap(ring->sqes, ring->sqes_sz);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+	munmap(ring->sq_ring, ring->sq_ring_sz);
+	close(ring->fd);
+	free(ring);
+}
+
+/*
+ * The completion queue is twice the size of the submission queue, but we
+ * never allow more than a submission queue's worth of I/O to be outstanding
+ * so that completions can never overflow.
+ */
+bool
+frog_uring_full(
+	struct frog_uring	*ring)
+{
+	return ring->inflight + ring->to_submit >= ring->entries;
+}
+
+unsigned int
+frog_uring_inflight(
+	struct frog_uring	*ring)
+{
+	return ring->inflight + ring->to_submit;
+}
+
+static struct io_uring_sqe *
+frog_uring_get_sqe(
+	struct frog_uring	*ring)
+{
+	struct io_uring_sqe	*sqe;
+	unsigned int		idx;
+
+	if (frog_uring_full(ring))
+		return NULL;
+
+	idx = ring->sqe_tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[idx] = idx;
+	ring->sqe_tail++;
+	ring->to_submit++;
+	return sqe;
+}
+
+int
+frog_uring_prep_rw(
+	struct frog_uring	*ring,
+	enum frog_uring_op	op,
+	int			fd,
+	void			*buf,
+	size_t			len,
+	off_t			pos,
+	void			*data)
+{
+	struct io_uring_sqe	*sqe;
+
+	sqe = frog_uring_get_sqe(ring);
+	if (!sqe)
+		return -EBUSY;
+
+	sqe->opcode = op == FROG_URING_WRITE ? IORING_OP_WRITE :
+					       IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = pos;
+	sqe->user_data = (uintptr_t)data;
+	return 0;
+}
+
+int
+frog_uring_prep_rwv(
+	struct frog_uring	*ring,
+	enum frog_uring_op	op,
+	int			fd,
+	const struct iovec	*iov,
+	int			iovcnt,
+	off_t			pos,
+	void			*data)
+{
+	struct io_uring_sqe	*sqe;
+
+	sqe = frog_uring_get_sqe(ring);
+	if (!sqe)
+		return -EBUSY;
+
+	sqe->opcode = op == FROG_URING_WRITE ? IORING_OP_WRITEV :
+					       IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)iov;
+	sqe->len = iovcnt;
+	sqe->off = pos;
+	sqe->user_data = (uintptr_t)data;
+	return 0;
+}
+
+int
+frog_uring_register_buffers(
+	struct frog_uring	*ring,
+	const struct iovec	*iov,
+	unsigned int		nr)
+{
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov,
+				nr) < 0)
+		return -errno;
+	return 0;
+}
+
+int
+frog_uring_prep_read_fixed(
+	struct frog_uring	*ring,
+	int			fd,
+	void			*buf,
+	size_t			len,
+	off_t			pos,
+	unsigned int		buf_index,
+	void			*data)
+{
+	struct io_uring_sqe	*sqe;
+
+	sqe = frog_uring_get_sqe(ring);
+	if (!sqe)
+		return -EBUSY;
+
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = pos;
+	sqe->buf_index = buf_index;
+	sqe->user_data = (uintptr_t)data;
+	return 0;
+}
+
+int
+frog_uring_submit(
+	struct frog_uring	*ring,
+	unsigned int		min_complete)
+{
+	unsigned int		flags = 0;
+	int			ret;
+
+	/* Publish the new SQEs before telling the kernel about them. */
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+	if (min_complete > ring->inflight + ring->to_submit)
+		min_complete = ring->inflight + ring->to_submit;
+	if (min_complete)
+		flags |= IORING_ENTER_GETEVENTS;
+	if (!ring->to_submit && !min_complete)
+		return 0;
+
+	do {
+		ret = sys_io_uring_enter(ring->fd, ring->to_submit,
+				min_complete, flags);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+
+	ring->to_submit -= ret;
+	ring->inflight += ret;
+	return 0;
+}
+
+unsigned int
+frog_uring_reap(
+	struct frog_uring	*ring,
+	frog_uring_done_fn	fn,
+	void			*priv)
+{
+	struct io_uring_cqe	*cqe;
+	unsigned int		head, tail;
+	unsigned int		count = 0;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		fn((void *)(uintptr_t)cqe->user_data, cqe->res, priv);
+		head++;
+		count++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	ring->inflight -= count;
+	return count;
+}
+
+/*
+ * Throw away the queued I/Os that the kernel hasn't taken yet, then wait for
+ * and reap every I/O that it has.  Callers use this after a submission error
+ * so that nothing is still reading or writing their buffers when they give
+ * up on the ring.  Returns a negative errno if we can't wait, in which case
+ * I/O may still be in flight and the ring must not be freed.
+ */
+int
+frog_uring_drain(
+	struct frog_uring	*ring,
+	frog_uring_done_fn	fn,
+	void			*priv)
+{
+	int			ret;
+
+	ring->sqe_tail -= ring->to_submit;
+	ring->to_submit = 0;
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+	while (ring->inflight > 0) {
+		do {
+			ret = sys_io_uring_enter(ring->fd, 0, 1,
+					IORING_ENTER_GETEVENTS);
+		} while (ret < 0 && errno == EINTR);
+		if (ret < 0)
+			return -errno;
+
+		frog_uring_reap(ring, fn, priv);
+	}
+
+	return 0;
+}
+
+#else /* !HAVE_IO_URING */
+
+int
+frog_uring_alloc(
+	unsigned int		entries,
+	struct frog_uring	**ringp)
+{
+	return -EOPNOTSUPP;
+}
+
+void frog_uring_free(struct frog_uring *ring) { }
+bool frog_uring_full(struct frog_uring *ring) { return true; }
+unsigned int frog_uring_inflight(struct frog_uring *ring) { return 0; }
+
+int
+frog_uring_prep_rw(
+	struct frog_uring	*ring,
+	enum frog_uring_op	op,
+	int			fd,
+	void			*buf,
+	size_t			len,
+	off_t			pos,
+	void			*data)
+{
+	return -EOPNOTSUPP;
+}
+
+int
+frog_uring_prep_rwv(
+	struct frog_uring	*ring,
+	enum frog_uring_op	op,
+	int			fd,
+	const struct iovec	*iov,
+	int			iovcnt,
+	off_t			pos,
+	void			*data)
+{
+	return -EOPNOTSUPP;
+}
+
+int
+frog_uring_register_buffers(
+	struct frog_uring	*ring,
+	const struct iovec	*iov,
+	unsigned int		nr)
+{
+	return -EOPNOTSUPP;
+}
+
+int
+frog_uring_prep_read_fixed(
+	struct frog_uring	*ring,
+	int			fd,
+	void			*buf,
+	size_t			len,
+	off_t			pos,
+	unsigned int		buf_index,
+	void			*data)
+{
+	return -EOPNOTSUPP;
+}
+
+int
+frog_uring_submit(
+	struct frog_uring	*ring,
+	unsigned int		min_complete)
+{
+	return -EOPNOTSUPP;
+}
+
+unsigned int
+frog_uring_reap(
+	struct frog_uring	*ring,
+	frog_uring_done_fn	fn,
+	void			*priv)
+{
+	return 0;
+}
+
+int
+frog_uring_drain(
+	struct frog_uring	*ring,
+	frog_uring_done_fn	fn,
+	void			*priv)
+{
+	return 0;
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 Oracle.  All Rights Reserved.
+ */
+#ifndef __LIBFROG_URING_H__
+#define __LIBFROG_URING_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct frog_uring;
+
+enum frog_uring_op {
+	FROG_URING_READ,
+	FROG_URING_WRITE,
+};
+
+int frog_uring_alloc(unsigned int entries, struct frog_uring **ringp);
+void frog_uring_free(struct frog_uring *ring);
+
+/* Can we queue another I/O without overrunning the rings? */
+bool frog_uring_full(struct frog_uring *ring);
+unsigned int frog_uring_inflight(struct frog_uring *ring);
+
+/*
+ * Queue a read or write.  Returns -EBUSY if the ring is full, in which case
+ * the caller must submit and reap some completions before trying again.
+ * The buffer (and the iovec array) must stay valid until completion.
+ */
+int frog_uring_prep_rw(struct frog_uring *ring, enum frog_uring_op op, int fd,
+		void *buf, size_t len, off_t pos, void *data);
+int frog_uring_prep_rwv(struct frog_uring *ring, enum frog_uring_op op,
+		int fd, const struct iovec *iov, int iovcnt, off_t pos,
+		void *data);
+
+/*
+ * Register @nr buffers with the kernel so that reads into them don't have to
+ * map the pages for every I/O.  Reads into a registered buffer are queued
+ * with frog_uring_prep_read_fixed and the index of the buffer.
+ */
+int frog_uring_register_buffers(struct frog_uring *ring,
+		const struct iovec *iov, unsigned int nr);
+int frog_uring_prep_read_fixed(struct frog_uring *ring, int fd, void *buf,
+		size_t len, off_t pos, unsigned int buf_index, void *data);
+
+/* Submit everything queued and wait for at least @min_complete I/Os. */
+int frog_uring_submit(struct frog_uring *ring, unsigned int min_complete);
+
+/*
+ * Call @fn for every completed I/O with the @data cookie passed at queueing
+ * time and the result (bytes transferred or negative errno).  Returns the
+ * number of completions processed.
+ */
+typedef void (*frog_uring_done_fn)(void *data, int res, void *priv);
+unsigned int frog_uring_reap(struct frog_uring *ring, frog_uring_done_fn fn,
+		void *priv);
+
+/*
+ * Drop queued I/Os that were never submitted and wait for the rest to
+ * complete, calling @fn for each as frog_uring_reap does.
+ */
+int frog_uring_drain(struct frog_uring *ring, frog_uring_done_fn fn,
+		void *priv);
+
+#endif /* __LIBFROG_URING_H__ */
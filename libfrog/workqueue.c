@@ -11,57 +11,174 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
 #include <urcu.h>
 #include "workqueue.h"
 
+/*
+ * Work Queues
+ *
+ * Each worker thread has its own queue of work items.  New items are dealt
+ * out round-robin to the workers, except that a worker that queues more work
+ * keeps it for itself.  A worker that runs out of work steals from the other
+ * workers before it goes to sleep.  This way a big pool with small items
+ * doesn't fight over a single lock, and a few expensive items don't hold up
+ * the work queued behind them.  Higher priority items are run (and stolen)
+ * before normal ones.
+ */
+
+/* The worker that this thread runs, if any. */
+static __thread struct workqueue_worker	*workqueue_self;
+
+static inline uint64_t
+workqueue_now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Add an item to the end of a worker's queue. */
+static void
+deque_push(
+	struct workqueue_deque	*dq,
+	struct workqueue_item	*wi,
+	unsigned int		prio)
+{
+	pthread_mutex_lock(&dq->lock);
+	if (dq->last[prio])
+		dq->last[prio]->next = wi;
+	else
+		dq->first[prio] = wi;
+	dq->last[prio] = wi;
+	__atomic_add_fetch(&dq->count, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&dq->lock);
+}
+
+/* Take the oldest item of a given priority from a worker's queue. */
+static struct workqueue_item *
+deque_pop(
+	struct workqueue_deque	*dq,
+	unsigned int		prio)
+{
+	struct workqueue_item	*wi;
+
+	/* Don't bother taking the lock of an empty queue. */
+	if (__atomic_load_n(&dq->count, __ATOMIC_RELAXED) == 0)
+		return NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	wi = dq->first[prio];
+	if (wi) {
+		dq->first[prio] = wi->next;
+		if (!wi->next)
+			dq->last[prio] = NULL;
+		__atomic_sub_fetch(&dq->count, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	return wi;
+}
+
+/*
+ * Find the next item to run: our own work first, then other workers' work,
+ * for each priority level in turn.
+ */
+static struct workqueue_item *
+workqueue_find_work(
+	struct workqueue_worker	*self,
+	bool			*stolen)
+{
+	struct workqueue	*wq = self->wq;
+	struct workqueue_worker	*victim;
+	struct workqueue_item	*wi;
+	unsigned int		prio;
+	unsigned int		i;
+
+	for (prio = WORKQUEUE_NR_PRIO; prio-- > 0;) {
+		wi = deque_pop(&self->deque, prio);
+		if (wi) {
+			*stolen = false;
+			return wi;
+		}
+
+		for (i = 1; i < wq->thread_count; i++) {
+			victim = &wq->workers[(self->id + i) % wq->thread_count];
+			wi = deque_pop(&victim->deque, prio);
+			if (wi) {
+				*stolen = true;
+				return wi;
+			}
+		}
+	}
+
+	return NULL;
+}
+
 /* Main processing thread */
 static void *
 workqueue_thread(void *arg)
 {
-	struct workqueue	*wq = arg;
+	struct workqueue_worker	*self = arg;
+	struct workqueue	*wq = self->wq;
 	struct workqueue_item	*wi;
+	uint64_t		start_ns;
+	bool			stolen;
+	bool			done;
 
 	/*
 	 * Loop pulling work from the passed in work queue.
 	 * Check for notification to exit after every chunk of work.
 	 */
 	rcu_register_thread();
+	workqueue_self = self;
 	while (1) {
-		pthread_mutex_lock(&wq->lock);
-
-		/*
-		 * Wait for work.
-		 */
-		while (wq->next_item == NULL && !wq->terminate) {
-			assert(wq->item_count == 0);
-			pthread_cond_wait(&wq->wakeup, &wq->lock);
-		}
-		if (wq->next_item == NULL && wq->terminate) {
+		wi = workqueue_find_work(self, &stolen);
+		if (!wi) {
+			/*
+			 * Nothing to do anywhere, so wait for work.  Callers
+			 * bump item_count before they look for idle workers,
+			 * so we can't miss a wakeup.
+			 */
+			pthread_mutex_lock(&wq->lock);
+			__atomic_add_fetch(&wq->idle_count, 1, __ATOMIC_SEQ_CST);
+			while (__atomic_load_n(&wq->item_count,
+					       __ATOMIC_SEQ_CST) == 0 &&
+			       !wq->terminate)
+				pthread_cond_wait(&wq->wakeup, &wq->lock);
+			__atomic_sub_fetch(&wq->idle_count, 1, __ATOMIC_SEQ_CST);
+			done = wq->terminate &&
+			       __atomic_load_n(&wq->item_count,
+					       __ATOMIC_SEQ_CST) == 0;
 			pthread_mutex_unlock(&wq->lock);
-			break;
+			if (done)
+				break;
+			continue;
 		}
 
 		/*
-		 *  Dequeue work from the head of the list. If the queue was
-		 *  full then send a wakeup if we're configured to do so.
+		 * If the queue was full then send a wakeup if we're configured
+		 * to do so.
 		 */
-		assert(wq->item_count > 0);
-		if (wq->max_queued)
+		__atomic_sub_fetch(&wq->item_count, 1, __ATOMIC_SEQ_CST);
+		if (wq->max_queued) {
+			pthread_mutex_lock(&wq->lock);
 			pthread_cond_broadcast(&wq->queue_full);
-
-		wi = wq->next_item;
-		wq->next_item = wi->next;
-		wq->item_count--;
-
-		if (wq->max_queued && wq->next_item) {
-			/* more work, wake up another worker */
-			pthread_cond_signal(&wq->wakeup);
+			pthread_mutex_unlock(&wq->lock);
 		}
-		pthread_mutex_unlock(&wq->lock);
 
+		start_ns = workqueue_now();
 		(wi->function)(wi->queue, wi->index, wi->arg);
+
+		self->stats.wait_ns += start_ns - wi->queued_ns;
+		self->stats.run_ns += workqueue_now() - start_ns;
+		self->stats.items++;
+		if (stolen)
+			self->stats.steals++;
 		free(wi);
 	}
+	workqueue_self = NULL;
 	rcu_unregister_thread();
 
 	return NULL;
@@ -97,12 +214,28 @@ workqueue_create_bound(
 		err = -errno;
 		goto out_mutex;
 	}
+	wq->workers = calloc(nr_workers, sizeof(struct workqueue_worker));
+	if (!wq->workers) {
+		err = -errno;
+		goto out_threads;
+	}
+	for (i = 0; i < nr_workers; i++) {
+		err = -pthread_mutex_init(&wq->workers[i].deque.lock, NULL);
+		if (err) {
+			while (i-- > 0)
+				pthread_mutex_destroy(
+						&wq->workers[i].deque.lock);
+			goto out_workers;
+		}
+		wq->workers[i].wq = wq;
+		wq->workers[i].id = i;
+	}
 	wq->terminate = false;
 	wq->terminated = false;
 
 	for (i = 0; i < nr_workers; i++) {
 		err = -pthread_create(&wq->threads[i], NULL, workqueue_thread,
-				wq);
+				&wq->workers[i]);
 		if (err)
 			break;
 	}
@@ -112,9 +245,16 @@ workqueue_create_bound(
 	 * the threads that may have been started running before we can destroy
 	 * the workqueue.
 	 */
-	if (err)
+	if (err) {
+		wq->thread_count = i;
+		workqueue_terminate(wq);
 		workqueue_destroy(wq);
+	}
 	return err;
+out_workers:
+	free(wq->workers);
+out_threads:
+	free(wq->threads);
 out_mutex:
 	pthread_mutex_destroy(&wq->lock);
 out_cond:
@@ -135,20 +275,24 @@ workqueue_create(
 
 /*
  * Create a work item consisting of a function and some arguments and schedule
- * the work item to be run via the thread pool.  Returns zero or a negative
- * error code.
+ * the work item to be run via the thread pool at the given priority.  Returns
+ * zero or a negative error code.
  */
 int
-workqueue_add(
+workqueue_add_prio(
 	struct workqueue	*wq,
 	workqueue_func_t	func,
 	uint32_t		index,
-	void			*arg)
+	void			*arg,
+	unsigned int		prio)
 {
+	struct workqueue_worker	*self = workqueue_self;
+	struct workqueue_deque	*dq;
 	struct workqueue_item	*wi;
-	int			ret;
+	unsigned int		next;
 
 	assert(!wq->terminated);
+	assert(prio < WORKQUEUE_NR_PRIO);
 
 	if (wq->thread_count == 0) {
 		func(wq, index, arg);
@@ -164,39 +308,57 @@ workqueue_add(
 	wi->arg = arg;
 	wi->queue = wq;
 	wi->next = NULL;
+	wi->queued_ns = workqueue_now();
 
-	/* Now queue the new work structure to the work queue. */
-	pthread_mutex_lock(&wq->lock);
-restart:
-	if (wq->next_item == NULL) {
-		assert(wq->item_count == 0);
-		ret = -pthread_cond_signal(&wq->wakeup);
-		if (ret) {
-			pthread_mutex_unlock(&wq->lock);
-			free(wi);
-			return ret;
-		}
-		wq->next_item = wi;
+	/* Workers keep the work they queue; everyone else deals it out. */
+	if (self && self->wq == wq) {
+		dq = &self->deque;
 	} else {
+		next = __atomic_fetch_add(&wq->next_worker, 1,
+				__ATOMIC_RELAXED);
+		dq = &wq->workers[next % wq->thread_count].deque;
+	}
+
+	/* Now queue the new work structure to the work queue. */
+	if (wq->max_queued) {
 		/* throttle on a full queue if configured */
-		if (wq->max_queued && wq->item_count == wq->max_queued) {
+		pthread_mutex_lock(&wq->lock);
+		while (__atomic_load_n(&wq->item_count, __ATOMIC_SEQ_CST) >=
+				wq->max_queued)
 			pthread_cond_wait(&wq->queue_full, &wq->lock);
-			/*
-			 * Queue might be empty or even still full by the time
-			 * we get the lock back, so restart the lookup so we do
-			 * the right thing with the current state of the queue.
-			 */
-			goto restart;
-		}
-		wq->last_item->next = wi;
+		deque_push(dq, wi, prio);
+		__atomic_add_fetch(&wq->item_count, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&wq->lock);
+	} else {
+		deque_push(dq, wi, prio);
+		__atomic_add_fetch(&wq->item_count, 1, __ATOMIC_SEQ_CST);
+	}
+
+	/* Wake up a sleeping worker to run or steal the new item. */
+	if (__atomic_load_n(&wq->idle_count, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&wq->lock);
+		pthread_cond_signal(&wq->wakeup);
+		pthread_mutex_unlock(&wq->lock);
 	}
-	wq->last_item = wi;
-	wq->item_count++;
-	pthread_mutex_unlock(&wq->lock);
 
 	return 0;
 }
 
+/*
+ * Create a work item consisting of a function and some arguments and schedule
+ * the work item to be run via the thread pool.  Returns zero or a negative
+ * error code.
+ */
+int
+workqueue_add(
+	struct workqueue	*wq,
+	workqueue_func_t	func,
+	uint32_t		index,
+	void			*arg)
+{
+	return workqueue_add_prio(wq, func, index, arg, WORKQUEUE_PRIO_NORMAL);
+}
+
 /*
  * Wait for all pending work items to be processed and tear down the
  * workqueue thread pool.  Returns zero or a negative error code.
@@ -234,11 +396,36 @@ void
 workqueue_destroy(
 	struct workqueue	*wq)
 {
+	unsigned int		i;
+
 	assert(wq->terminated);
 
+	for (i = 0; i < wq->thread_count; i++)
+		pthread_mutex_destroy(&wq->workers[i].deque.lock);
+	free(wq->workers);
 	free(wq->threads);
 	pthread_mutex_destroy(&wq->lock);
 	pthread_cond_destroy(&wq->wakeup);
 	pthread_cond_destroy(&wq->queue_full);
 	memset(wq, 0, sizeof(*wq));
 }
+
+/*
+ * Add up the statistics of every worker.  The numbers are only stable once
+ * the workqueue has been terminated.
+ */
+void
+workqueue_stats(
+	struct workqueue	*wq,
+	struct workqueue_stats	*stats)
+{
+	unsigned int		i;
+
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < wq->thread_count; i++) {
+		stats->items += wq->workers[i].stats.items;
+		stats->steals += wq->workers[i].stats.steals;
+		stats->wait_ns += wq->workers[i].stats.wait_ns;
+		stats->run_ns += wq->workers[i].stats.run_ns;
+	}
+}
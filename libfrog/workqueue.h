@@ -12,22 +12,51 @@ struct workqueue;
 
 typedef void workqueue_func_t(struct workqueue *wq, uint32_t index, void *arg);
 
+/* Work item priorities.  Higher priority items run first. */
+#define WORKQUEUE_PRIO_NORMAL	0
+#define WORKQUEUE_PRIO_HIGH	1
+#define WORKQUEUE_NR_PRIO	2
+
 struct workqueue_item {
 	struct workqueue	*queue;
 	struct workqueue_item	*next;
 	workqueue_func_t	*function;
 	void			*arg;
+	uint64_t		queued_ns;
 	uint32_t		index;
 };
 
+/* Per-worker queue of items, which other workers may steal from. */
+struct workqueue_deque {
+	pthread_mutex_t		lock;
+	struct workqueue_item	*first[WORKQUEUE_NR_PRIO];
+	struct workqueue_item	*last[WORKQUEUE_NR_PRIO];
+	unsigned int		count;
+};
+
+struct workqueue_stats {
+	uint64_t		items;		/* items run */
+	uint64_t		steals;		/* items taken from another worker */
+	uint64_t		wait_ns;	/* time spent queued */
+	uint64_t		run_ns;		/* time spent running */
+};
+
+struct workqueue_worker {
+	struct workqueue	*wq;
+	struct workqueue_deque	deque;
+	struct workqueue_stats	stats;
+	unsigned int		id;
+};
+
 struct workqueue {
 	void			*wq_ctx;
 	pthread_t		*threads;
-	struct workqueue_item	*next_item;
-	struct workqueue_item	*last_item;
+	struct workqueue_worker	*workers;
 	pthread_mutex_t		lock;
 	pthread_cond_t		wakeup;
 	unsigned int		item_count;
+	unsigned int		idle_count;
+	unsigned int		next_worker;
 	unsigned int		thread_count;
 	bool			terminate;
 	bool			terminated;
@@ -41,7 +70,10 @@ int workqueue_create_bound(struct workqueue *wq, void *wq_ctx,
 		unsigned int nr_workers, unsigned int max_queue);
 int workqueue_add(struct workqueue *wq, workqueue_func_t fn,
 		uint32_t index, void *arg);
+int workqueue_add_prio(struct workqueue *wq, workqueue_func_t fn,
+		uint32_t index, void *arg, unsigned int prio);
 int workqueue_terminate(struct workqueue *wq);
 void workqueue_destroy(struct workqueue *wq);
+void workqueue_stats(struct workqueue *wq, struct workqueue_stats *stats);
 
 #endif	/* __LIBFROG_WORKQUEUE_H__ */
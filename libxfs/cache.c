@@ -28,6 +28,24 @@
 
 static unsigned int cache_generic_bulkrelse(struct cache *, struct list_head *);
 
+/* Pick a power-of-two shard count no larger than the number of CPUs. */
+static unsigned int
+cache_nr_shards(
+	int			flags,
+	unsigned int		hashsize)
+{
+	long			nr_cpus;
+	unsigned int		nr = 1;
+
+	if (!(flags & CACHE_SHARDED))
+		return 1;
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	while (nr < nr_cpus && nr < CACHE_MAX_SHARDS && nr * 2 <= hashsize)
+		nr *= 2;
+	return nr;
+}
+
 struct cache *
 cache_init(
 	int			flags,
@@ -45,12 +63,18 @@ cache_init(
 		free(cache);
 		return NULL;
 	}
+	cache->c_nr_shards = cache_nr_shards(flags, hashsize);
+	cache->c_shards = calloc(cache->c_nr_shards,
+			sizeof(struct cache_shard));
+	if (!cache->c_shards) {
+		free(cache->c_hash);
+		free(cache);
+		return NULL;
+	}
 
 	cache->c_flags = flags;
 	cache->c_count = 0;
 	cache->c_max = 0;
-	cache->c_hits = 0;
-	cache->c_misses = 0;
 	cache->c_maxcount = maxcount;
 	cache->c_hashsize = hashsize;
 	cache->c_hashshift = libxfs_highbit32(hashsize);
@@ -61,6 +85,7 @@ cache_init(
 	cache->compare = cache_operations->compare;
 	cache->bulkrelse = cache_operations->bulkrelse ?
 		cache_operations->bulkrelse : cache_generic_bulkrelse;
+	cache->bulkflush = cache_operations->bulkflush;
 	pthread_mutex_init(&cache->c_mutex, NULL);
 
 	for (i = 0; i < hashsize; i++) {
@@ -69,14 +94,36 @@ cache_init(
 		pthread_mutex_init(&cache->c_hash[i].ch_mutex, NULL);
 	}
 
-	for (i = 0; i <= CACHE_DIRTY_PRIORITY; i++) {
-		list_head_init(&cache->c_mrus[i].cm_list);
-		cache->c_mrus[i].cm_count = 0;
-		pthread_mutex_init(&cache->c_mrus[i].cm_mutex, NULL);
+	for (i = 0; i < cache->c_nr_shards; i++) {
+		struct cache_shard	*shard = &cache->c_shards[i];
+
+		list_head_init(&shard->cs_clock);
+		list_head_init(&shard->cs_dirty);
+		pthread_mutex_init(&shard->cs_mutex, NULL);
 	}
 	return cache;
 }
 
+static inline struct cache_shard *
+cache_shard(
+	struct cache *		cache,
+	unsigned int		hashidx)
+{
+	return &cache->c_shards[hashidx & (cache->c_nr_shards - 1)];
+}
+
+/* Take a lock, counting the times we have to wait for it. */
+static inline void
+cache_lock(
+	struct cache_shard *	shard,
+	pthread_mutex_t *	mutex)
+{
+	if (pthread_mutex_trylock(mutex) == 0)
+		return;
+	uatomic_inc(&shard->cs_contention);
+	pthread_mutex_lock(mutex);
+}
+
 static void
 cache_expand(
 	struct cache *		cache)
@@ -85,7 +132,7 @@ cache_expand(
 #ifdef CACHE_DEBUG
 	fprintf(stderr, "doubling cache size to %d\n", 2 * cache->c_maxcount);
 #endif
-	cache->c_maxcount *= 2;
+	uatomic_set(&cache->c_maxcount, cache->c_maxcount * 2);
 	pthread_mutex_unlock(&cache->c_mutex);
 }
 
@@ -142,11 +189,13 @@ cache_destroy(
 		list_head_destroy(&cache->c_hash[i].ch_list);
 		pthread_mutex_destroy(&cache->c_hash[i].ch_mutex);
 	}
-	for (i = 0; i <= CACHE_DIRTY_PRIORITY; i++) {
-		list_head_destroy(&cache->c_mrus[i].cm_list);
-		pthread_mutex_destroy(&cache->c_mrus[i].cm_mutex);
+	for (i = 0; i < cache->c_nr_shards; i++) {
+		list_head_destroy(&cache->c_shards[i].cs_clock);
+		list_head_destroy(&cache->c_shards[i].cs_dirty);
+		pthread_mutex_destroy(&cache->c_shards[i].cs_mutex);
 	}
 	pthread_mutex_destroy(&cache->c_mutex);
+	free(cache->c_shards);
 	free(cache->c_hash);
 	free(cache);
 }
@@ -171,94 +220,73 @@ cache_generic_bulkrelse(
 }
 
 /*
- * Park unflushable nodes on their own special MRU so that cache_shake() doesn't
- * end up repeatedly scanning them in the futile attempt to clean them before
- * reclaim.
- */
-static void
-cache_add_to_dirty_mru(
-	struct cache		*cache,
-	struct cache_node	*node)
-{
-	struct cache_mru	*mru = &cache->c_mrus[CACHE_DIRTY_PRIORITY];
-
-	pthread_mutex_lock(&mru->cm_mutex);
-	node->cn_old_priority = node->cn_priority;
-	node->cn_priority = CACHE_DIRTY_PRIORITY;
-	list_add(&node->cn_mru, &mru->cm_list);
-	mru->cm_count++;
-	pthread_mutex_unlock(&mru->cm_mutex);
-}
-
-/*
- * We've hit the limit on cache size, so we need to start reclaiming nodes we've
- * used. The MRU specified by the priority is shaken.  Returns new priority at
- * end of the call (in case we call again). We are not allowed to reclaim dirty
- * objects, so we have to flush them first. If flushing fails, we move them to
- * the "dirty, unreclaimable" list.
+ * Sweep the clock hand over (at most) one revolution of a list of nodes,
+ * reclaiming unreferenced nodes that have run out of chances.  Every node the
+ * hand passes over without reclaiming is rotated to the head of the list.  We
+ * are not allowed to reclaim dirty objects, so we have to flush them first.
+ * If flushing fails, we park them on the shard's dirty list so that we don't
+ * waste time repeatedly trying to clean them when there's memory pressure.
  *
- * Hence we skip priorities > CACHE_MAX_PRIORITY unless "purge" is set as we
- * park unflushable (and hence unreclaimable) buffers at these priorities.
- * Trying to shake unreclaimable buffer lists when there is memory pressure is a
- * waste of time and CPU and greatly slows down cache node recycling operations.
- * Hence we only try to free them if we are being asked to purge the cache of
- * all entries.
+ * If "purge" is set, chances are ignored and dirty nodes are reclaimed even if
+ * they can't be flushed.
  */
 static unsigned int
-cache_shake(
+cache_shake_list(
 	struct cache *		cache,
-	unsigned int		priority,
+	struct cache_shard *	shard,
+	struct list_head *	list,
+	unsigned int *		list_count,
+	struct list_head *	temp,
 	bool			purge)
 {
-	struct cache_mru	*mru;
 	struct cache_hash *	hash;
-	struct list_head	temp;
-	struct list_head *	head;
-	struct list_head *	pos;
-	struct list_head *	n;
 	struct cache_node *	node;
-	unsigned int		count;
-
-	ASSERT(priority <= CACHE_DIRTY_PRIORITY);
-	if (priority > CACHE_MAX_PRIORITY && !purge)
-		priority = 0;
+	unsigned int		scan = *list_count;
+	unsigned int		count = 0;
 
-	mru = &cache->c_mrus[priority];
-	count = 0;
-	list_head_init(&temp);
-	head = &mru->cm_list;
+	for (; scan > 0 && !list_empty(list); scan--) {
+		node = list_last_entry(list, struct cache_node, cn_mru);
 
-	pthread_mutex_lock(&mru->cm_mutex);
-	for (pos = head->prev, n = pos->prev; pos != head;
-						pos = n, n = pos->prev) {
-		node = list_entry(pos, struct cache_node, cn_mru);
+		if (pthread_mutex_trylock(&node->cn_mutex) != 0) {
+			uatomic_inc(&shard->cs_contention);
+			list_move(&node->cn_mru, list);
+			continue;
+		}
 
-		if (pthread_mutex_trylock(&node->cn_mutex) != 0)
+		/* in use, or still has a second chance */
+		if (node->cn_count > 0 || (!purge && node->cn_chances > 0)) {
+			if (node->cn_count == 0)
+				node->cn_chances--;
+			list_move(&node->cn_mru, list);
+			pthread_mutex_unlock(&node->cn_mutex);
 			continue;
+		}
 
 		/* memory pressure is not allowed to release dirty objects */
 		if (cache->flush(node) && !purge) {
-			list_del(&node->cn_mru);
-			mru->cm_count--;
-			node->cn_priority = -1;
+			node->cn_old_priority = node->cn_priority;
+			node->cn_priority = CACHE_DIRTY_PRIORITY;
+			list_move(&node->cn_mru, &shard->cs_dirty);
+			(*list_count)--;
+			shard->cs_dirty_count++;
 			pthread_mutex_unlock(&node->cn_mutex);
-			cache_add_to_dirty_mru(cache, node);
 			continue;
 		}
 
 		hash = cache->c_hash + node->cn_hashidx;
 		if (pthread_mutex_trylock(&hash->ch_mutex) != 0) {
+			uatomic_inc(&shard->cs_contention);
+			list_move(&node->cn_mru, list);
 			pthread_mutex_unlock(&node->cn_mutex);
 			continue;
 		}
 		ASSERT(node->cn_count == 0);
-		ASSERT(node->cn_priority == priority);
 		node->cn_priority = -1;
 
-		list_move(&node->cn_mru, &temp);
+		list_move(&node->cn_mru, temp);
 		list_del_init(&node->cn_hash);
 		hash->ch_count--;
-		mru->cm_count--;
+		(*list_count)--;
 		pthread_mutex_unlock(&hash->ch_mutex);
 		pthread_mutex_unlock(&node->cn_mutex);
 
@@ -266,17 +294,61 @@ cache_shake(
 		if (!purge && count == CACHE_SHAKE_COUNT)
 			break;
 	}
-	pthread_mutex_unlock(&mru->cm_mutex);
+
+	return count;
+}
+
+/*
+ * We've hit the limit on cache size, so we need to start reclaiming nodes
+ * we've used.  Returns the number of nodes reclaimed from this shard.
+ *
+ * We skip the dirty list unless "purge" is set because trying to clean
+ * unflushable buffers when there is memory pressure is a waste of time and
+ * CPU and greatly slows down cache node recycling operations.  Hence we only
+ * try to free them if we are being asked to purge the cache of all entries.
+ */
+static unsigned int
+cache_shake(
+	struct cache *		cache,
+	struct cache_shard *	shard,
+	bool			purge)
+{
+	struct list_head	temp;
+	unsigned int		count;
+
+	list_head_init(&temp);
+
+	cache_lock(shard, &shard->cs_mutex);
+	count = cache_shake_list(cache, shard, &shard->cs_clock,
+			&shard->cs_count, &temp, purge);
+	if (purge)
+		count += cache_shake_list(cache, shard, &shard->cs_dirty,
+				&shard->cs_dirty_count, &temp, purge);
+	pthread_mutex_unlock(&shard->cs_mutex);
 
 	if (count > 0) {
 		cache->bulkrelse(cache, &temp);
-
-		pthread_mutex_lock(&cache->c_mutex);
-		cache->c_count -= count;
-		pthread_mutex_unlock(&cache->c_mutex);
+		uatomic_sub(&cache->c_count, count);
 	}
 
-	return (count == CACHE_SHAKE_COUNT) ? priority : ++priority;
+	return count;
+}
+
+/*
+ * Reclaim some nodes, starting with the shard that we want to insert into and
+ * moving on to the others if it has nothing to give back.
+ */
+static unsigned int
+cache_shake_any(
+	struct cache *		cache,
+	unsigned int		hashidx)
+{
+	unsigned int		i, count = 0;
+
+	for (i = 0; i < cache->c_nr_shards && count == 0; i++)
+		count = cache_shake(cache, cache_shard(cache, hashidx + i),
+				false);
+	return count;
 }
 
 /*
@@ -286,27 +358,24 @@ cache_shake(
 static struct cache_node *
 cache_node_allocate(
 	struct cache *		cache,
+	struct cache_shard *	shard,
 	cache_key_t		key)
 {
-	unsigned int		nodesfree;
 	struct cache_node *	node;
+	unsigned int		count, max;
 
-	pthread_mutex_lock(&cache->c_mutex);
-	nodesfree = (cache->c_count < cache->c_maxcount);
-	if (nodesfree) {
-		cache->c_count++;
-		if (cache->c_count > cache->c_max)
-			cache->c_max = cache->c_count;
-	}
-	cache->c_misses++;
-	pthread_mutex_unlock(&cache->c_mutex);
-	if (!nodesfree)
+	uatomic_inc(&shard->cs_misses);
+	count = uatomic_add_return(&cache->c_count, 1);
+	if (count > uatomic_read(&cache->c_maxcount)) {
+		uatomic_dec(&cache->c_count);
 		return NULL;
+	}
+	while ((max = uatomic_read(&cache->c_max)) < count)
+		uatomic_cmpxchg(&cache->c_max, max, count);
+
 	node = cache->alloc(key);
 	if (node == NULL) {	/* uh-oh */
-		pthread_mutex_lock(&cache->c_mutex);
-		cache->c_count--;
-		pthread_mutex_unlock(&cache->c_mutex);
+		uatomic_dec(&cache->c_count);
 		return NULL;
 	}
 	pthread_mutex_init(&node->cn_mutex, NULL);
@@ -314,6 +383,7 @@ cache_node_allocate(
 	node->cn_count = 1;
 	node->cn_priority = 0;
 	node->cn_old_priority = -1;
+	node->cn_chances = 1;
 	return node;
 }
 
@@ -331,7 +401,7 @@ __cache_node_purge(
 	struct cache_node *	node)
 {
 	int			count;
-	struct cache_mru *	mru;
+	struct cache_shard *	shard = cache_shard(cache, node->cn_hashidx);
 
 	pthread_mutex_lock(&node->cn_mutex);
 	count = node->cn_count;
@@ -346,11 +416,13 @@ __cache_node_purge(
 		return 1;
 	}
 
-	mru = &cache->c_mrus[node->cn_priority];
-	pthread_mutex_lock(&mru->cm_mutex);
+	cache_lock(shard, &shard->cs_mutex);
 	list_del_init(&node->cn_mru);
-	mru->cm_count--;
-	pthread_mutex_unlock(&mru->cm_mutex);
+	if (node->cn_priority == CACHE_DIRTY_PRIORITY)
+		shard->cs_dirty_count--;
+	else
+		shard->cs_count--;
+	pthread_mutex_unlock(&shard->cs_mutex);
 
 	pthread_mutex_unlock(&node->cn_mutex);
 	pthread_mutex_destroy(&node->cn_mutex);
@@ -375,20 +447,21 @@ cache_node_get(
 {
 	struct cache_node *	node = NULL;
 	struct cache_hash *	hash;
-	struct cache_mru *	mru;
+	struct cache_shard *	shard;
 	struct list_head *	head;
 	struct list_head *	pos;
 	struct list_head *	n;
 	unsigned int		hashidx;
-	int			priority = 0;
+	unsigned int		sweeps = 0;
 	int			purged = 0;
 
 	hashidx = cache->hash(key, cache->c_hashsize, cache->c_hashshift);
 	hash = cache->c_hash + hashidx;
+	shard = cache_shard(cache, hashidx);
 	head = &hash->ch_list;
 
 	for (;;) {
-		pthread_mutex_lock(&hash->ch_mutex);
+		cache_lock(shard, &hash->ch_mutex);
 		for (pos = head->next, n = pos->next; pos != head;
 						pos = n, n = pos->next) {
 			int result;
@@ -410,34 +483,33 @@ cache_node_get(
 			}
 
 			/*
-			 * node found, bump node's reference count, remove it
-			 * from its MRU list, and update stats.
+			 * node found, bump node's reference count, give it a
+			 * fresh set of chances on the clock, and update stats.
+			 * Nodes stay on the clock while they're in use, so we
+			 * only need the shard lock if the node was parked on
+			 * the dirty list.
 			 */
 			pthread_mutex_lock(&node->cn_mutex);
 
-			if (node->cn_count == 0) {
-				ASSERT(node->cn_priority >= 0);
-				ASSERT(!list_empty(&node->cn_mru));
-				mru = &cache->c_mrus[node->cn_priority];
-				pthread_mutex_lock(&mru->cm_mutex);
-				mru->cm_count--;
-				list_del_init(&node->cn_mru);
-				pthread_mutex_unlock(&mru->cm_mutex);
-				if (node->cn_old_priority != -1) {
-					ASSERT(node->cn_priority ==
-							CACHE_DIRTY_PRIORITY);
-					node->cn_priority = node->cn_old_priority;
-					node->cn_old_priority = -1;
-				}
+			if (node->cn_old_priority != -1) {
+				ASSERT(node->cn_count == 0);
+				ASSERT(node->cn_priority ==
+						CACHE_DIRTY_PRIORITY);
+				cache_lock(shard, &shard->cs_mutex);
+				list_move(&node->cn_mru, &shard->cs_clock);
+				shard->cs_dirty_count--;
+				shard->cs_count++;
+				pthread_mutex_unlock(&shard->cs_mutex);
+				node->cn_priority = node->cn_old_priority;
+				node->cn_old_priority = -1;
 			}
 			node->cn_count++;
+			node->cn_chances = node->cn_priority + 1;
 
 			pthread_mutex_unlock(&node->cn_mutex);
 			pthread_mutex_unlock(&hash->ch_mutex);
 
-			pthread_mutex_lock(&cache->c_mutex);
-			cache->c_hits++;
-			pthread_mutex_unlock(&cache->c_mutex);
+			uatomic_inc(&shard->cs_hits);
 
 			*nodep = node;
 			return 0;
@@ -448,34 +520,38 @@ next_object:
 		/*
 		 * not found, allocate a new entry
 		 */
-		node = cache_node_allocate(cache, key);
+		node = cache_node_allocate(cache, shard, key);
 		if (node)
 			break;
-		priority = cache_shake(cache, priority, false);
 		/*
-		 * We start at 0; if we free CACHE_SHAKE_COUNT we get
-		 * back the same priority, if not we get back priority+1.
-		 * If we exceed CACHE_MAX_PRIORITY all slots are full; grow it.
+		 * Each sweep of the clock takes one chance away from every
+		 * unreferenced node, so if we can't reclaim anything after
+		 * enough sweeps to exhaust the highest priority, everything
+		 * left is in use or dirty; grow the cache.
 		 */
-		if (priority > CACHE_MAX_PRIORITY) {
-			priority = 0;
+		if (cache_shake_any(cache, hashidx) > 0) {
+			sweeps = 0;
+		} else if (++sweeps > CACHE_MAX_PRIORITY + 1) {
+			sweeps = 0;
 			cache_expand(cache);
 		}
 	}
 
 	node->cn_hashidx = hashidx;
 
-	/* add new node to appropriate hash */
-	pthread_mutex_lock(&hash->ch_mutex);
+	/* start the new node on the clock, then make it visible */
+	cache_lock(shard, &shard->cs_mutex);
+	list_add(&node->cn_mru, &shard->cs_clock);
+	shard->cs_count++;
+	pthread_mutex_unlock(&shard->cs_mutex);
+
+	cache_lock(shard, &hash->ch_mutex);
 	hash->ch_count++;
 	list_add(&node->cn_hash, &hash->ch_list);
 	pthread_mutex_unlock(&hash->ch_mutex);
 
-	if (purged) {
-		pthread_mutex_lock(&cache->c_mutex);
-		cache->c_count -= purged;
-		pthread_mutex_unlock(&cache->c_mutex);
-	}
+	if (purged)
+		uatomic_sub(&cache->c_count, purged);
 
 	*nodep = node;
 	return 1;
@@ -486,8 +562,6 @@ cache_node_put(
 	struct cache *		cache,
 	struct cache_node *	node)
 {
-	struct cache_mru *	mru;
-
 	pthread_mutex_lock(&node->cn_mutex);
 #ifdef CACHE_DEBUG
 	if (node->cn_count < 1) {
@@ -495,23 +569,9 @@ cache_node_put(
 				__FUNCTION__, node->cn_count, node);
 		cache_abort();
 	}
-	if (!list_empty(&node->cn_mru)) {
-		fprintf(stderr, "%s: node put on node (%p) in MRU list\n",
-				__FUNCTION__, node);
-		cache_abort();
-	}
 #endif
+	/* unreferenced nodes are left on the clock for the shaker */
 	node->cn_count--;
-
-	if (node->cn_count == 0) {
-		/* add unreferenced node to appropriate MRU for shaker */
-		mru = &cache->c_mrus[node->cn_priority];
-		pthread_mutex_lock(&mru->cm_mutex);
-		mru->cm_count++;
-		list_add(&node->cn_mru, &mru->cm_list);
-		pthread_mutex_unlock(&mru->cm_mutex);
-	}
-
 	pthread_mutex_unlock(&node->cn_mutex);
 }
 
@@ -530,6 +590,7 @@ cache_node_set_priority(
 	ASSERT(node->cn_count > 0);
 	node->cn_priority = priority;
 	node->cn_old_priority = -1;
+	node->cn_chances = priority + 1;
 	pthread_mutex_unlock(&node->cn_mutex);
 }
 
@@ -578,11 +639,8 @@ cache_node_purge(
 	}
 	pthread_mutex_unlock(&hash->ch_mutex);
 
-	if (count == 0) {
-		pthread_mutex_lock(&cache->c_mutex);
-		cache->c_count--;
-		pthread_mutex_unlock(&cache->c_mutex);
-	}
+	if (count == 0)
+		uatomic_dec(&cache->c_count);
 #ifdef CACHE_DEBUG
 	if (count >= 1) {
 		fprintf(stderr, "%s: refcount was %u, not zero (node=%p)\n",
@@ -607,8 +665,8 @@ cache_purge(
 {
 	int			i;
 
-	for (i = 0; i <= CACHE_DIRTY_PRIORITY; i++)
-		cache_shake(cache, i, true);
+	for (i = 0; i < cache->c_nr_shards; i++)
+		cache_shake(cache, &cache->c_shards[i], true);
 
 #ifdef CACHE_DEBUG
 	if (cache->c_count != 0) {
@@ -621,6 +679,56 @@ cache_purge(
 #endif
 }
 
+static void
+cache_bulkflush_unlock(
+	struct cache *		cache,
+	struct cache_node **	batch,
+	unsigned int		nr)
+{
+	unsigned int		i;
+
+	cache->bulkflush(batch, nr);
+	for (i = 0; i < nr; i++)
+		pthread_mutex_unlock(&batch[i]->cn_mutex);
+}
+
+/*
+ * Flush all nodes in the cache to disk in batches of up to CACHE_FLUSH_BATCH
+ * nodes, so that the flush routine can write them concurrently.  Node locks
+ * are held across hash buckets until the batch is flushed; this is safe
+ * because nobody blocks on a hash chain lock while holding a node lock.
+ */
+static void
+cache_bulkflush(
+	struct cache *		cache)
+{
+	struct cache_node *	batch[CACHE_FLUSH_BATCH];
+	struct cache_hash *	hash;
+	struct list_head *	head;
+	struct list_head *	pos;
+	unsigned int		nr = 0;
+	int			i;
+
+	for (i = 0; i < cache->c_hashsize; i++) {
+		hash = &cache->c_hash[i];
+
+		pthread_mutex_lock(&hash->ch_mutex);
+		head = &hash->ch_list;
+		for (pos = head->next; pos != head; pos = pos->next) {
+			batch[nr] = (struct cache_node *)pos;
+			pthread_mutex_lock(&batch[nr]->cn_mutex);
+			if (++nr == CACHE_FLUSH_BATCH) {
+				cache_bulkflush_unlock(cache, batch, nr);
+				nr = 0;
+			}
+		}
+		pthread_mutex_unlock(&hash->ch_mutex);
+	}
+
+	if (nr)
+		cache_bulkflush_unlock(cache, batch, nr);
+}
+
 /*
  * Flush all nodes in the cache to disk.
  */
@@ -637,6 +745,11 @@ cache_flush(
 	if (!cache->flush)
 		return;
 
+	if (cache->bulkflush) {
+		cache_bulkflush(cache);
+		return;
+	}
+
 	for (i = 0; i < cache->c_hashsize; i++) {
 		hash = &cache->c_hash[i];
 
@@ -659,11 +772,22 @@ cache_report(
 	const char	*name,
 	struct cache	*cache)
 {
+	struct cache_shard *shard;
+	struct cache_node *node;
 	int		i;
 	unsigned long	count, index, total;
 	unsigned long	hash_bucket_lengths[HASH_REPORT + 2];
+	unsigned long	prio_counts[CACHE_DIRTY_PRIORITY + 1];
+	unsigned long long hits = 0, misses = 0, contention = 0;
+	unsigned int	nodes = max(cache->c_count, 1U);
+
+	for (i = 0; i < cache->c_nr_shards; i++) {
+		hits += cache->c_shards[i].cs_hits;
+		misses += cache->c_shards[i].cs_misses;
+		contention += cache->c_shards[i].cs_contention;
+	}
 
-	if ((cache->c_hits + cache->c_misses) == 0)
+	if ((hits + misses) == 0)
 		return;
 
 	/* report cache summary */
@@ -674,27 +798,49 @@ cache_report(
 			"Hash table size = %u\n"
 			"Hits = %llu\n"
 			"Misses = %llu\n"
-			"Hit ratio = %5.2f\n",
+			"Hit ratio = %5.2f\n"
+			"Lock contention = %llu\n",
 			name, cache,
 			cache->c_maxcount,
 			cache->c_max,
 			cache->c_count,
 			cache->c_hashsize,
-			cache->c_hits,
-			cache->c_misses,
-			(double)cache->c_hits * 100 /
-				(cache->c_hits + cache->c_misses)
+			hits,
+			misses,
+			(double)hits * 100 / (hits + misses),
+			contention
 	);
 
+	/* report per-shard counters, and tally up node priorities */
+	bzero(prio_counts, sizeof(prio_counts));
+	for (i = 0; i < cache->c_nr_shards; i++) {
+		shard = &cache->c_shards[i];
+
+		pthread_mutex_lock(&shard->cs_mutex);
+		list_for_each_entry(node, &shard->cs_clock, cn_mru)
+			if (node->cn_priority >= 0 &&
+			    node->cn_priority <= CACHE_MAX_PRIORITY)
+				prio_counts[node->cn_priority]++;
+		prio_counts[CACHE_DIRTY_PRIORITY] += shard->cs_dirty_count;
+		pthread_mutex_unlock(&shard->cs_mutex);
+
+		if (cache->c_nr_shards == 1)
+			continue;
+		fprintf(fp,
+	"Shard %2d entries = %6u dirty = %6u hits = %llu misses = %llu contention = %llu\n",
+			i, shard->cs_count, shard->cs_dirty_count,
+			(unsigned long long)shard->cs_hits,
+			(unsigned long long)shard->cs_misses,
+			(unsigned long long)shard->cs_contention);
+	}
+
 	for (i = 0; i <= CACHE_MAX_PRIORITY; i++)
-		fprintf(fp, "MRU %d entries = %6u (%3u%%)\n",
-			i, cache->c_mrus[i].cm_count,
-			cache->c_mrus[i].cm_count * 100 / cache->c_count);
+		fprintf(fp, "Priority %d entries = %6lu (%3lu%%)\n",
+			i, prio_counts[i], prio_counts[i] * 100 / nodes);
 
 	i = CACHE_DIRTY_PRIORITY;
-	fprintf(fp, "Dirty MRU %d entries = %6u (%3u%%)\n",
-		i, cache->c_mrus[i].cm_count,
-		cache->c_mrus[i].cm_count * 100 / cache->c_count);
+	fprintf(fp, "Dirty priority %d entries = %6lu (%3lu%%)\n",
+		i, prio_counts[i], prio_counts[i] * 100 / nodes);
 
 	/* report hash bucket lengths */
 	bzero(hash_bucket_lengths, sizeof(hash_bucket_lengths));
@@ -715,10 +861,10 @@ cache_report(
 			continue;
 		fprintf(fp, "Hash buckets with  %2d entries %6ld (%3ld%%)\n",
 			i, hash_bucket_lengths[i],
-			(i * hash_bucket_lengths[i] * 100) / cache->c_count);
+			(i * hash_bucket_lengths[i] * 100) / nodes);
 	}
 	if (hash_bucket_lengths[i])	/* last report bucket is the overflow bucket */
 		fprintf(fp, "Hash buckets with >%2d entries %6ld (%3ld%%)\n",
 			i - 1, hash_bucket_lengths[i],
-			((cache->c_count - total) * 100) / cache->c_count);
+			((cache->c_count - total) * 100) / nodes);
 }
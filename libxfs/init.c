@@ -592,7 +592,8 @@ static struct xfs_buftarg *
 libxfs_buftarg_alloc(
 	struct xfs_mount	*mp,
 	dev_t			dev,
-	unsigned long		write_fails)
+	unsigned long		write_fails,
+	unsigned int		uring_depth)
 {
 	struct xfs_buftarg	*btp;
 
@@ -605,9 +606,14 @@ libxfs_buftarg_alloc(
 	btp->bt_mount = mp;
 	btp->bt_bdev = dev;
 	btp->flags = 0;
+	btp->bt_uring_depth = uring_depth;
+	btp->bt_nr_rings = 0;
+	btp->bt_rings = NULL;
 	if (write_fails) {
 		btp->writes_left = write_fails;
 		btp->flags |= XFS_BUFTARG_INJECT_WRITE_FAIL;
+		/* Batched writes would make the simulated crash inexact. */
+		btp->bt_uring_depth = 0;
 	}
 	pthread_mutex_init(&btp->lock, NULL);
 
@@ -636,7 +642,13 @@ libxfs_buftarg_init(
 	dev_t			rtdev)
 {
 	char			*p = getenv("LIBXFS_DEBUG_WRITE_CRASH");
+	char			*uring = getenv("LIBXFS_IO_URING");
 	unsigned long		dfail = 0, lfail = 0, rfail = 0;
+	unsigned int		uring_depth = 0;
+
+	/* Use io_uring for batched buffer I/O with this queue depth. */
+	if (uring)
+		uring_depth = strtoul(uring, NULL, 0);
 
 	/* Simulate utility crash after a certain number of writes. */
 	while (p && *p) {
@@ -708,12 +720,14 @@ libxfs_buftarg_init(
 		return;
 	}
 
-	mp->m_ddev_targp = libxfs_buftarg_alloc(mp, dev, dfail);
+	mp->m_ddev_targp = libxfs_buftarg_alloc(mp, dev, dfail, uring_depth);
 	if (!logdev || logdev == dev)
 		mp->m_logdev_targp = mp->m_ddev_targp;
 	else
-		mp->m_logdev_targp = libxfs_buftarg_alloc(mp, logdev, lfail);
-	mp->m_rtdev_targp = libxfs_buftarg_alloc(mp, rtdev, rfail);
+		mp->m_logdev_targp = libxfs_buftarg_alloc(mp, logdev, lfail,
+				uring_depth);
+	mp->m_rtdev_targp = libxfs_buftarg_alloc(mp, rtdev, rfail,
+			uring_depth);
 }
 
 /* Compute maximum possible height for per-AG btree types for this fs. */
@@ -1018,9 +1032,13 @@ libxfs_umount(
 	kmem_free(mp->m_attr_geo);
 	kmem_free(mp->m_dir_geo);
 
+	libxfs_buftarg_free_rings(mp->m_rtdev_targp);
 	kmem_free(mp->m_rtdev_targp);
-	if (mp->m_logdev_targp != mp->m_ddev_targp)
+	if (mp->m_logdev_targp != mp->m_ddev_targp) {
+		libxfs_buftarg_free_rings(mp->m_logdev_targp);
 		kmem_free(mp->m_logdev_targp);
+	}
+	libxfs_buftarg_free_rings(mp->m_ddev_targp);
 	kmem_free(mp->m_ddev_targp);
 
 	return error;
@@ -4,13 +4,174 @@
 #include "libxfs_priv.h"
 
 /*
- * Simple memory interface
+ * Slab allocator for kmem caches
+ *
+ * Each cache carves fixed size objects out of large slabs so that we don't
+ * pay for a malloc/free (and the malloc chunk overhead) on every inode,
+ * buffer, cursor and intent item.  Freed objects go onto a small per-thread
+ * magazine, and allocations are served from that magazine first, so most
+ * calls take no locks at all.  When a magazine overflows, half of it is
+ * returned to the cache's depot; when it runs dry, it is refilled from the
+ * depot and then from never-used slab space.  Slabs are only given back to
+ * the system when the cache is destroyed.
+ *
+ * The depot is an array of object pointers rather than a list threaded
+ * through the free objects, so a freed object is never written to and
+ * whatever the constructor set up survives until the next allocation.  It
+ * grows with the slabs, so it can always hold every object we own.
  */
+#define KMEM_MAGAZINE_SIZE	64
+#define KMEM_SLAB_SIZE		(64 * 1024)
+#define KMEM_SLAB_MIN_OBJS	8
+
+struct kmem_slab {
+	struct kmem_slab	*next;
+	void			*mem;
+};
+
+struct kmem_magazine {
+	struct kmem_cache	*cache;
+	struct list_head	list;
+	unsigned int		nr;
+	void			*objs[KMEM_MAGAZINE_SIZE];
+};
+
+/* Push @nr objects from the top of a magazine back to the depot. */
+static void
+kmem_magazine_drain(
+	struct kmem_cache	*cache,
+	struct kmem_magazine	*mag,
+	unsigned int		nr)
+{
+	void			*obj;
+
+	pthread_mutex_lock(&cache->cache_lock);
+	while (nr-- > 0 && mag->nr > 0) {
+		obj = mag->objs[--mag->nr];
+		cache->depot[cache->depot_nr++] = obj;
+	}
+	pthread_mutex_unlock(&cache->cache_lock);
+}
+
+/* Give a thread's magazine back to the cache when the thread exits. */
+static void
+kmem_magazine_release(
+	void			*arg)
+{
+	struct kmem_magazine	*mag = arg;
+	struct kmem_cache	*cache = mag->cache;
+
+	kmem_magazine_drain(cache, mag, KMEM_MAGAZINE_SIZE);
+	pthread_mutex_lock(&cache->cache_lock);
+	list_del(&mag->list);
+	pthread_mutex_unlock(&cache->cache_lock);
+	free(mag);
+}
+
+static struct kmem_magazine *
+kmem_magazine_get(
+	struct kmem_cache	*cache)
+{
+	struct kmem_magazine	*mag;
+
+	mag = pthread_getspecific(cache->cache_key);
+	if (mag)
+		return mag;
+
+	mag = calloc(1, sizeof(struct kmem_magazine));
+	if (mag == NULL) {
+		fprintf(stderr, _("%s: cache alloc failed (%s, %d bytes): %s\n"),
+			progname, cache->cache_name,
+			(int)sizeof(struct kmem_magazine), strerror(errno));
+		exit(1);
+	}
+	mag->cache = cache;
+	pthread_mutex_lock(&cache->cache_lock);
+	list_add(&mag->list, &cache->magazines);
+	pthread_mutex_unlock(&cache->cache_lock);
+	pthread_setspecific(cache->cache_key, mag);
+	return mag;
+}
+
+/* Grab a fresh slab.  Caller must hold cache_lock. */
+static void
+kmem_slab_grow(
+	struct kmem_cache	*cache)
+{
+	struct kmem_slab	*slab;
+	size_t			align = max_t(size_t, cache->align,
+					      sizeof(void *));
+	size_t			len = (size_t)cache->slab_objs * cache->objsize;
+	size_t			depot_len;
+	void			**depot;
+	int			error;
+
+	depot_len = (cache->nr_slabs + 1) * cache->slab_objs * sizeof(void *);
+	depot = realloc(cache->depot, depot_len);
+	if (depot == NULL) {
+		error = errno;
+		len = depot_len;
+		goto fail;
+	}
+	cache->depot = depot;
+
+	slab = malloc(sizeof(struct kmem_slab));
+	if (slab == NULL) {
+		error = errno;
+		goto fail;
+	}
+	error = posix_memalign(&slab->mem, roundup_pow_of_two(align), len);
+	if (error) {
+		free(slab);
+		goto fail;
+	}
+
+	slab->next = cache->slabs;
+	cache->slabs = slab;
+	cache->nr_slabs++;
+	cache->carve_next = slab->mem;
+	cache->carve_left = cache->slab_objs;
+	return;
+fail:
+	fprintf(stderr, _("%s: cache alloc failed (%s, %d bytes): %s\n"),
+		progname, cache->cache_name, (int)len, strerror(error));
+	exit(1);
+}
+
+/* Fill half of an empty magazine from the depot or from new slab space. */
+static void
+kmem_magazine_refill(
+	struct kmem_cache	*cache,
+	struct kmem_magazine	*mag)
+{
+	void			*obj;
+
+	pthread_mutex_lock(&cache->cache_lock);
+	while (mag->nr < KMEM_MAGAZINE_SIZE / 2) {
+		if (cache->depot_nr) {
+			obj = cache->depot[--cache->depot_nr];
+		} else {
+			if (!cache->carve_left)
+				kmem_slab_grow(cache);
+			obj = cache->carve_next;
+			cache->carve_next += cache->objsize;
+			cache->carve_left--;
+			if (cache->ctor)
+				cache->ctor(obj);
+		}
+		mag->objs[mag->nr++] = obj;
+	}
+	pthread_mutex_unlock(&cache->cache_lock);
+}
+
 struct kmem_cache *
 kmem_cache_create(const char *name, unsigned int size, unsigned int align,
 		unsigned int slab_flags, void (*ctor)(void *))
 {
 	struct kmem_cache	*ptr = malloc(sizeof(struct kmem_cache));
+	unsigned int		objalign = max_t(unsigned int, align,
+						 sizeof(void *));
+	int			error;
 
 	if (ptr == NULL) {
 		fprintf(stderr, _("%s: cache init failed (%s, %d bytes): %s\n"),
@@ -24,19 +185,70 @@ kmem_cache_create(const char *name, unsigned int size, unsigned int align,
 	ptr->align = align;
 	ptr->ctor = ctor;
 
+	ptr->objsize = roundup(max_t(unsigned int, size, sizeof(void *)),
+			       objalign);
+	ptr->slab_objs = max_t(unsigned int, KMEM_SLAB_SIZE / ptr->objsize,
+			       KMEM_SLAB_MIN_OBJS);
+	ptr->slabs = NULL;
+	ptr->carve_next = NULL;
+	ptr->carve_left = 0;
+	ptr->depot = NULL;
+	ptr->depot_nr = 0;
+	ptr->nr_slabs = 0;
+	ptr->max_allocated = 0;
+	INIT_LIST_HEAD(&ptr->magazines);
+	pthread_mutex_init(&ptr->cache_lock, NULL);
+	error = pthread_key_create(&ptr->cache_key, kmem_magazine_release);
+	if (error) {
+		fprintf(stderr, _("%s: cache init failed (%s, %d bytes): %s\n"),
+			progname, name, (int)sizeof(struct kmem_cache),
+			strerror(error));
+		exit(1);
+	}
+
 	return ptr;
 }
 
 int
 kmem_cache_destroy(struct kmem_cache *cache)
 {
-	int	leaked = 0;
+	struct kmem_magazine	*mag, *n;
+	struct kmem_slab	*slab;
+	int			leaked = 0;
+
+	if (cache == NULL)
+		return 0;
 
-	if (getenv("LIBXFS_LEAK_CHECK") && cache->allocated) {
-		leaked = 1;
-		fprintf(stderr, "cache %s freed with %d items allocated\n",
-				cache->cache_name, cache->allocated);
+	if (getenv("LIBXFS_LEAK_CHECK")) {
+		if (cache->allocated) {
+			leaked = 1;
+			fprintf(stderr, "cache %s freed with %d items allocated\n",
+					cache->cache_name, cache->allocated);
+		}
+		if (cache->nr_slabs)
+			fprintf(stderr,
+	"cache %s: %lu slabs, %lu bytes, %u byte objects, peak %d allocated\n",
+				cache->cache_name, cache->nr_slabs,
+				cache->nr_slabs * cache->slab_objs *
+						cache->objsize,
+				cache->objsize, cache->max_allocated);
 	}
+
+	/*
+	 * Every object lives in a slab, so we can throw away all the
+	 * magazines and slabs without walking the depot.  Deleting the
+	 * key first means that exiting threads won't touch this cache.
+	 */
+	pthread_key_delete(cache->cache_key);
+	list_for_each_entry_safe(mag, n, &cache->magazines, list)
+		free(mag);
+	while ((slab = cache->slabs) != NULL) {
+		cache->slabs = slab->next;
+		free(slab->mem);
+		free(slab);
+	}
+	free(cache->depot);
+	pthread_mutex_destroy(&cache->cache_lock);
 	free(cache);
 	return leaked;
 }
@@ -44,16 +256,15 @@ kmem_cache_destroy(struct kmem_cache *cache)
 void *
 kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags)
 {
-	void	*ptr = malloc(cache->cache_unitsize);
+	struct kmem_magazine	*mag = kmem_magazine_get(cache);
+	int			count, max;
 
-	if (ptr == NULL) {
-		fprintf(stderr, _("%s: cache alloc failed (%s, %d bytes): %s\n"),
-			progname, cache->cache_name, cache->cache_unitsize,
-			strerror(errno));
-		exit(1);
-	}
-	cache->allocated++;
-	return ptr;
+	if (mag->nr == 0)
+		kmem_magazine_refill(cache, mag);
+	count = uatomic_add_return(&cache->allocated, 1);
+	while ((max = uatomic_read(&cache->max_allocated)) < count)
+		uatomic_cmpxchg(&cache->max_allocated, max, count);
+	return mag->objs[--mag->nr];
 }
 
 void *
@@ -65,6 +276,21 @@ kmem_cache_zalloc(struct kmem_cache *cache, gfp_t flags)
 	return ptr;
 }
 
+void
+kmem_cache_free(struct kmem_cache *cache, void *ptr)
+{
+	struct kmem_magazine	*mag;
+
+	if (ptr == NULL)
+		return;
+
+	mag = kmem_magazine_get(cache);
+	if (mag->nr == KMEM_MAGAZINE_SIZE)
+		kmem_magazine_drain(cache, mag, KMEM_MAGAZINE_SIZE / 2);
+	mag->objs[mag->nr++] = ptr;
+	uatomic_dec(&cache->allocated);
+}
+
 void *
 kmem_alloc(size_t size, int flags)
 {
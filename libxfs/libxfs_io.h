@@ -14,6 +14,7 @@
 struct xfs_buf;
 struct xfs_mount;
 struct xfs_perag;
+struct frog_uring;
 
 /*
  * IO verifier callbacks need the xfs_mount pointer, so we have to behave
@@ -26,6 +27,15 @@ struct xfs_buftarg {
 	unsigned long		writes_left;
 	dev_t			bt_bdev;
 	unsigned int		flags;
+
+	/*
+	 * Queue depth of the io_uring batch I/O engine, or zero to do all
+	 * I/O synchronously.  Idle rings are cached in bt_rings (protected
+	 * by @lock) so that concurrent threads never share a ring.
+	 */
+	unsigned int		bt_uring_depth;
+	unsigned int		bt_nr_rings;
+	struct frog_uring	**bt_rings;
 };
 
 /* We purged a dirty buffer and lost a write. */
@@ -53,6 +63,7 @@ xfs_buftarg_trip_write(
 extern void	libxfs_buftarg_init(struct xfs_mount *mp, dev_t ddev,
 				    dev_t logdev, dev_t rtdev);
 int libxfs_blkdev_issue_flush(struct xfs_buftarg *btp);
+void libxfs_buftarg_free_rings(struct xfs_buftarg *btp);
 
 #define LIBXFS_BBTOOFF64(bbs)	(((xfs_off_t)(bbs)) << BBSHIFT)
 
@@ -18,6 +18,7 @@
 #include "xfs_inode.h"
 #include "xfs_trans.h"
 #include "libfrog/platform.h"
+#include "libfrog/uring.h"
 
 #include "libxfs.h"
 
@@ -163,9 +164,9 @@ libxfs_getsb(
 
 struct kmem_cache			*xfs_buf_cache;
 
-static struct cache_mru		xfs_buf_freelist =
-	{{&xfs_buf_freelist.cm_list, &xfs_buf_freelist.cm_list},
-	 0, PTHREAD_MUTEX_INITIALIZER };
+/* Released buffers, kept around for reuse by libxfs_getbufr. */
+static LIST_HEAD(xfs_buf_freelist);
+static pthread_mutex_t	xfs_buf_freelist_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * The bufkey is used to pass the new buffer information to the cache object
@@ -308,16 +309,16 @@ __libxfs_getbufr(int blen)
 	 * and if so, free its buffer and set b_addr to NULL
 	 * before calling libxfs_initbuf.
 	 */
-	pthread_mutex_lock(&xfs_buf_freelist.cm_mutex);
-	if (!list_empty(&xfs_buf_freelist.cm_list)) {
-		list_for_each_entry(bp, &xfs_buf_freelist.cm_list, b_node.cn_mru) {
+	pthread_mutex_lock(&xfs_buf_freelist_lock);
+	if (!list_empty(&xfs_buf_freelist)) {
+		list_for_each_entry(bp, &xfs_buf_freelist, b_node.cn_mru) {
 			if (bp->b_length == BTOBB(blen)) {
 				list_del_init(&bp->b_node.cn_mru);
 				break;
 			}
 		}
-		if (&bp->b_node.cn_mru == &xfs_buf_freelist.cm_list) {
-			bp = list_entry(xfs_buf_freelist.cm_list.next,
+		if (&bp->b_node.cn_mru == &xfs_buf_freelist) {
+			bp = list_entry(xfs_buf_freelist.next,
 					struct xfs_buf, b_node.cn_mru);
 			list_del_init(&bp->b_node.cn_mru);
 			free(bp->b_addr);
@@ -328,7 +329,7 @@ __libxfs_getbufr(int blen)
 		}
 	} else
 		bp = kmem_cache_zalloc(xfs_buf_cache, 0);
-	pthread_mutex_unlock(&xfs_buf_freelist.cm_mutex);
+	pthread_mutex_unlock(&xfs_buf_freelist_lock);
 	bp->b_ops = NULL;
 	if (bp->b_flags & LIBXFS_B_DIRTY)
 		fprintf(stderr, "found dirty buffer (bulk) on free list!\n");
@@ -578,6 +579,220 @@ __read_buf(int fd, void *buf, int len, off64_t offset, int flags)
 	return 0;
 }
 
+/*
+ * Batched Buffer I/O
+ *
+ * If the buffer target has an io_uring queue depth set (LIBXFS_IO_URING=N in
+ * the environment), discontiguous buffer reads, delwri list submission and
+ * buffer cache flushes push every map segment of every buffer into a ring
+ * and reap the completions as they arrive, instead of waiting for each
+ * pread/pwrite in turn.  Idle rings are cached on the buftarg so that each
+ * thread doing I/O gets a ring to itself.  If we can't get a ring for any
+ * reason, the callers fall back to synchronous I/O.
+ */
+struct xfs_buf_ioseg {
+	struct xfs_buf		*bp;
+	void			*buf;
+	off64_t			offset;
+	int			len;
+};
+
+static struct frog_uring *
+libxfs_buftarg_get_ring(
+	struct xfs_buftarg	*btp)
+{
+	struct frog_uring	*ring = NULL;
+	unsigned int		depth;
+	int			error;
+
+	pthread_mutex_lock(&btp->lock);
+	depth = btp->bt_uring_depth;
+	if (btp->bt_nr_rings > 0)
+		ring = btp->bt_rings[--btp->bt_nr_rings];
+	pthread_mutex_unlock(&btp->lock);
+	if (ring || !depth)
+		return ring;
+
+	error = frog_uring_alloc(depth, &ring);
+	if (error) {
+		/* The kernel won't give us a ring, so stop asking. */
+		pthread_mutex_lock(&btp->lock);
+		btp->bt_uring_depth = 0;
+		pthread_mutex_unlock(&btp->lock);
+		return NULL;
+	}
+	return ring;
+}
+
+static void
+libxfs_buftarg_put_ring(
+	struct xfs_buftarg	*btp,
+	struct frog_uring	*ring)
+{
+	struct frog_uring	**rings;
+
+	pthread_mutex_lock(&btp->lock);
+	rings = realloc(btp->bt_rings,
+			(btp->bt_nr_rings + 1) * sizeof(struct frog_uring *));
+	if (rings) {
+		btp->bt_rings = rings;
+		btp->bt_rings[btp->bt_nr_rings++] = ring;
+		ring = NULL;
+	}
+	pthread_mutex_unlock(&btp->lock);
+	frog_uring_free(ring);
+}
+
+/* Free all the idle io_uring rings attached to a buffer target. */
+void
+libxfs_buftarg_free_rings(
+	struct xfs_buftarg	*btp)
+{
+	while (btp->bt_nr_rings > 0)
+		frog_uring_free(btp->bt_rings[--btp->bt_nr_rings]);
+	free(btp->bt_rings);
+	btp->bt_rings = NULL;
+}
+
+static void
+libxfs_buf_ioseg_done(
+	void			*data,
+	int			res,
+	void			*priv)
+{
+	struct xfs_buf_ioseg	*seg = data;
+	enum frog_uring_op	*op = priv;
+	bool			write = *op == FROG_URING_WRITE;
+	int			error = 0;
+
+	if (res < 0) {
+		error = res;
+		fprintf(stderr, write ? _("%s: pwrite failed: %s\n") :
+					_("%s: read failed: %s\n"),
+			progname, strerror(-error));
+	} else if (res != seg->len) {
+		error = -EIO;
+		fprintf(stderr,
+			write ? _("%s: error - pwrite only %d of %d bytes\n") :
+				_("%s: error - read only %d of %d bytes\n"),
+			progname, res, seg->len);
+	}
+
+	if (error && !seg->bp->b_error)
+		seg->bp->b_error = error;
+}
+
+/*
+ * Read or write every map segment of @nr buffers on the same buffer target
+ * through an io_uring.  Buffers that already have b_error set are skipped;
+ * I/O errors are recorded in b_error.  Returns -EOPNOTSUPP if the caller has
+ * to do the I/O synchronously, or a negative errno if the ring failed so
+ * badly that we couldn't wait for the I/O already submitted.
+ */
+static int
+libxfs_buf_ioseg_submit(
+	struct xfs_buftarg	*btp,
+	struct xfs_buf		**bps,
+	unsigned int		nr,
+	enum frog_uring_op	op)
+{
+	struct frog_uring	*ring;
+	struct xfs_buf_ioseg	*segs, *seg;
+	unsigned int		nr_segs = 0;
+	unsigned int		queued = 0;
+	unsigned int		i;
+	int			fd = libxfs_device_to_fd(btp->bt_bdev);
+	int			error = 0;
+
+	if (!btp->bt_uring_depth)
+		return -EOPNOTSUPP;
+
+	for (i = 0; i < nr; i++) {
+		if (bps[i]->b_target != btp)
+			return -EOPNOTSUPP;
+		if (!bps[i]->b_error)
+			nr_segs += bps[i]->b_nmaps;
+	}
+	if (nr_segs == 0)
+		return 0;
+
+	segs = calloc(nr_segs, sizeof(struct xfs_buf_ioseg));
+	if (!segs)
+		return -EOPNOTSUPP;
+
+	ring = libxfs_buftarg_get_ring(btp);
+	if (!ring) {
+		free(segs);
+		return -EOPNOTSUPP;
+	}
+
+	seg = segs;
+	for (i = 0; i < nr; i++) {
+		struct xfs_buf	*bp = bps[i];
+		void		*buf = bp->b_addr;
+		int		j;
+
+		if (bp->b_error)
+			continue;
+		for (j = 0; j < bp->b_nmaps; j++, seg++) {
+			seg->bp = bp;
+			seg->buf = buf;
+			seg->offset = LIBXFS_BBTOOFF64(bp->b_maps[j].bm_bn);
+			seg->len = BBTOB(bp->b_maps[j].bm_len);
+			buf += seg->len;
+		}
+	}
+
+	while (queued < nr_segs || frog_uring_inflight(ring) > 0) {
+		while (queued < nr_segs) {
+			seg = &segs[queued];
+			if (frog_uring_prep_rw(ring, op, fd, seg->buf,
+					seg->len, seg->offset, seg))
+				break;
+			queued++;
+		}
+
+		error = frog_uring_submit(ring, 1);
+		if (error)
+			break;
+		frog_uring_reap(ring, libxfs_buf_ioseg_done, &op);
+	}
+
+	if (!error) {
+		libxfs_buftarg_put_ring(btp, ring);
+		free(segs);
+		return 0;
+	}
+
+	fprintf(stderr, _("%s: io_uring submit failed: %s\n"),
+		progname, strerror(-error));
+
+	/*
+	 * Some of the segments may still be in flight.  Wait for all of them
+	 * before we touch the buffers again or free the ring.  If we can't
+	 * even wait, the buffers may still change under us, so fail them and
+	 * leak the ring rather than free it from under the kernel.
+	 */
+	error = frog_uring_drain(ring, libxfs_buf_ioseg_done, &op);
+	if (error) {
+		for (i = 0; i < nr; i++)
+			if (!bps[i]->b_error)
+				bps[i]->b_error = error;
+		free(segs);
+		return error;
+	}
+
+	/*
+	 * Nothing is in flight now, so throw away the broken ring and have
+	 * the caller redo all the I/O synchronously.
+	 */
+	for (i = 0; i < nr_segs; i++)
+		segs[i].bp->b_error = 0;
+	frog_uring_free(ring);
+	free(segs);
+	return -EOPNOTSUPP;
+}
+
 int
 libxfs_readbufr(struct xfs_buftarg *btp, xfs_daddr_t blkno, struct xfs_buf *bp,
 		int len, int flags)
@@ -620,6 +835,15 @@ libxfs_readbufr_map(struct xfs_buftarg *btp, struct xfs_buf *bp, int flags)
 	void	*buf;
 	int	i;
 
+	/* Issue all the map segments at once if we can. */
+	bp->b_error = 0;
+	error = libxfs_buf_ioseg_submit(btp, &bp, 1, FROG_URING_READ);
+	if (error != -EOPNOTSUPP) {
+		error = bp->b_error;
+		goto out;
+	}
+	error = 0;
+
 	fd = libxfs_device_to_fd(btp->bt_bdev);
 	buf = bp->b_addr;
 	for (i = 0; i < bp->b_nmaps; i++) {
@@ -634,6 +858,7 @@ libxfs_readbufr_map(struct xfs_buftarg *btp, struct xfs_buf *bp, int flags)
 		buf += len;
 	}
 
+out:
 	if (!error)
 		bp->b_flags |= LIBXFS_B_UPTODATE;
 	return error;
@@ -800,12 +1025,15 @@ __write_buf(int fd, void *buf, int len, off64_t offset, int flags)
 	return 0;
 }
 
-int
-libxfs_bwrite(
+/*
+ * Run the writeback hook and the write verifier on a buffer that is about to
+ * be written.  Returns nonzero (and sets b_error) if the buffer must not be
+ * written.
+ */
+static int
+libxfs_bwrite_prep(
 	struct xfs_buf	*bp)
 {
-	int		fd = libxfs_device_to_fd(bp->b_target->bt_bdev);
-
 	/*
 	 * we never write buffers that are marked stale. This indicates they
 	 * contain data that has been invalidated, and even if the buffer is
@@ -839,6 +1067,15 @@ libxfs_bwrite(
 		}
 	}
 
+	return 0;
+}
+
+static void
+libxfs_bwrite_sync(
+	struct xfs_buf	*bp)
+{
+	int		fd = libxfs_device_to_fd(bp->b_target->bt_bdev);
+
 	if (!(bp->b_flags & LIBXFS_B_DISCONTIG)) {
 		bp->b_error = __write_buf(fd, bp->b_addr, BBTOB(bp->b_length),
 				    LIBXFS_BBTOOFF64(xfs_buf_daddr(bp)),
@@ -858,7 +1095,13 @@ libxfs_bwrite(
 			buf += len;
 		}
 	}
+}
 
+/* Report a write error or mark the buffer clean after a write. */
+static void
+libxfs_bwrite_done(
+	struct xfs_buf	*bp)
+{
 	if (bp->b_error) {
 		fprintf(stderr,
 	_("%s: write failed on %s bno 0x%llx/0x%x, err=%d\n"),
@@ -870,9 +1113,63 @@ libxfs_bwrite(
 		bp->b_flags &= ~(LIBXFS_B_DIRTY | LIBXFS_B_UNCHECKED);
 		xfs_buftarg_trip_write(bp->b_target);
 	}
+}
+
+int
+libxfs_bwrite(
+	struct xfs_buf	*bp)
+{
+	if (libxfs_bwrite_prep(bp))
+		return bp->b_error;
+
+	libxfs_bwrite_sync(bp);
+	libxfs_bwrite_done(bp);
 	return bp->b_error;
 }
 
+/*
+ * Write out an array of buffers, all at once if the buffer target supports
+ * batched I/O.  Returns the first error encountered; per-buffer errors are
+ * left in b_error just like libxfs_bwrite.  The array is reordered so that
+ * the buffers that failed the write verifiers come last.
+ */
+static int
+libxfs_bwrite_batch(
+	struct xfs_buf	**bps,
+	unsigned int	nr)
+{
+	struct xfs_buf	*bp;
+	unsigned int	i, nr_ok = 0;
+	int		error = 0;
+
+	for (i = 0; i < nr; i++) {
+		bp = bps[i];
+		if (libxfs_bwrite_prep(bp)) {
+			if (!error)
+				error = bp->b_error;
+			continue;
+		}
+		bps[i] = bps[nr_ok];
+		bps[nr_ok++] = bp;
+	}
+	if (nr_ok == 0)
+		return error;
+
+	if (libxfs_buf_ioseg_submit(bps[0]->b_target, bps, nr_ok,
+				FROG_URING_WRITE) == -EOPNOTSUPP) {
+		for (i = 0; i < nr_ok; i++)
+			libxfs_bwrite_sync(bps[i]);
+	}
+
+	for (i = 0; i < nr_ok; i++) {
+		libxfs_bwrite_done(bps[i]);
+		if (!error)
+			error = bps[i]->b_error;
+	}
+
+	return error;
+}
+
 /*
  * Mark a buffer dirty.  The dirty data will be written out when the cache
  * is flushed (or at release time if the buffer is uncached).
@@ -922,9 +1219,9 @@ libxfs_brelse(
 		return;
 	libxfs_buf_prepare_mru(bp);
 
-	pthread_mutex_lock(&xfs_buf_freelist.cm_mutex);
-	list_add(&bp->b_node.cn_mru, &xfs_buf_freelist.cm_list);
-	pthread_mutex_unlock(&xfs_buf_freelist.cm_mutex);
+	pthread_mutex_lock(&xfs_buf_freelist_lock);
+	list_add(&bp->b_node.cn_mru, &xfs_buf_freelist);
+	pthread_mutex_unlock(&xfs_buf_freelist_lock);
 }
 
 static unsigned int
@@ -943,24 +1240,22 @@ libxfs_bulkrelse(
 		count++;
 	}
 
-	pthread_mutex_lock(&xfs_buf_freelist.cm_mutex);
-	list_splice(list, &xfs_buf_freelist.cm_list);
-	pthread_mutex_unlock(&xfs_buf_freelist.cm_mutex);
+	pthread_mutex_lock(&xfs_buf_freelist_lock);
+	list_splice(list, &xfs_buf_freelist);
+	pthread_mutex_unlock(&xfs_buf_freelist_lock);
 
 	return count;
 }
 
 /*
- * Free everything from the xfs_buf_freelist MRU, used at final teardown
+ * Free everything from the xfs_buf_freelist, used at final teardown
  */
 void
 libxfs_bcache_free(void)
 {
-	struct list_head	*cm_list;
 	struct xfs_buf		*bp, *next;
 
-	cm_list = &xfs_buf_freelist.cm_list;
-	list_for_each_entry_safe(bp, next, cm_list, b_node.cn_mru) {
+	list_for_each_entry_safe(bp, next, &xfs_buf_freelist, b_node.cn_mru) {
 		free(bp->b_addr);
 		if (bp->b_maps != &bp->__b_map)
 			free(bp->b_maps);
@@ -987,6 +1282,26 @@ libxfs_bflush(
 	return bp->b_error;
 }
 
+/* Flush a batch of locked cache nodes with as much concurrent I/O as we can. */
+static void
+libxfs_bulkflush(
+	struct cache_node	**nodes,
+	unsigned int		nr)
+{
+	struct xfs_buf		*bps[CACHE_FLUSH_BATCH];
+	struct xfs_buf		*bp;
+	unsigned int		i, nr_dirty = 0;
+
+	ASSERT(nr <= CACHE_FLUSH_BATCH);
+	for (i = 0; i < nr; i++) {
+		bp = container_of(nodes[i], struct xfs_buf, b_node);
+		if (!bp->b_error && bp->b_flags & LIBXFS_B_DIRTY)
+			bps[nr_dirty++] = bp;
+	}
+
+	libxfs_bwrite_batch(bps, nr_dirty);
+}
+
 void
 libxfs_bcache_purge(void)
 {
@@ -1011,7 +1326,8 @@ struct cache_operations libxfs_bcache_operations = {
 	.flush		= libxfs_bflush,
 	.relse		= libxfs_brelse,
 	.compare	= libxfs_bcompare,
-	.bulkrelse	= libxfs_bulkrelse
+	.bulkrelse	= libxfs_bulkrelse,
+	.bulkflush	= libxfs_bulkflush
 };
 
 /*
@@ -1169,15 +1485,23 @@ int
 xfs_buf_delwri_submit(
 	struct list_head	*buffer_list)
 {
+	struct xfs_buf		*bps[CACHE_FLUSH_BATCH];
 	struct xfs_buf		*bp, *n;
+	unsigned int		i, nr = 0;
 	int			error = 0, error2;
 
 	list_for_each_entry_safe(bp, n, buffer_list, b_list) {
 		list_del_init(&bp->b_list);
-		error2 = libxfs_bwrite(bp);
+		bps[nr++] = bp;
+		if (nr < CACHE_FLUSH_BATCH && !list_empty(buffer_list))
+			continue;
+
+		error2 = libxfs_bwrite_batch(bps, nr);
 		if (!error)
 			error = error2;
-		libxfs_buf_relse(bp);
+		for (i = 0; i < nr; i++)
+			libxfs_buf_relse(bps[i]);
+		nr = 0;
 	}
 
 	return error;
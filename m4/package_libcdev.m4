@@ -146,6 +146,29 @@ preadv(0, 0, 0, 0);
     AC_SUBST(have_preadv)
   ])
 
+#
+# Check if we have the io_uring system calls and ABI headers (Linux)
+#
+AC_DEFUN([AC_HAVE_IO_URING],
+  [ AC_MSG_CHECKING([for io_uring])
+    AC_COMPILE_IFELSE(
+    [	AC_LANG_PROGRAM([[
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+	]], [[
+struct io_uring_params p = { .features = IORING_FEAT_RW_CUR_POS };
+struct io_uring_sqe sqe = { .opcode = IORING_OP_READ };
+syscall(__NR_io_uring_setup, 1, &p);
+syscall(__NR_io_uring_enter, 0, 0, 0, IORING_ENTER_GETEVENTS, 0, 0);
+	]])
+    ], have_io_uring=yes
+       AC_MSG_RESULT(yes),
+       AC_MSG_RESULT(no))
+    AC_SUBST(have_io_uring)
+  ])
+
 #
 # Check if we have a pwritev2 libc call (Linux)
 #
@@ -4,12 +4,19 @@
  * All Rights Reserved.
  */
 
+#if defined(HAVE_FALLOCATE)
+#include <linux/falloc.h>
+#endif
 #include "libxfs.h"
+#include <sys/uio.h>
 #include "xfs_metadump.h"
+#include "libfrog/lz.h"
 
 static int	show_progress = 0;
 static int	show_info = 0;
 static int	progress_since_warning = 0;
+static int	nr_writers = 1;
+static int	zero_target = 0;
 
 static void
 fatal(const char *msg, ...)
@@ -38,6 +45,403 @@ print_progress(const char *fmt, ...)
 	progress_since_warning = 1;
 }
 
+/*
+ * Restore Write Pipeline
+ *
+ * The main thread reads and decodes the metadump and hands each run of
+ * contiguous sectors to restore_write().  With a single writer, runs are
+ * written out straight away.  With more, the target is divided into stripes
+ * that are dealt out to the writer threads, and each writer issues its runs
+ * in the order they were queued, merging adjacent ones into one pwritev().
+ * Since a stripe is only ever written by one thread, a sector that appears
+ * more than once in the metadump still ends up with its last copy.
+ *
+ * Runs point into the buffer that the metadump was read into, which is
+ * reference counted and freed by whoever finishes with it last.  The reader
+ * stalls when too much data is waiting to be written.
+ */
+#define MDR_STRIPE_SHIFT	22		/* 4MB stripes */
+#define MDR_MAX_QUEUED		(64ULL << 20)
+#define MDR_MAX_IOVS		64
+
+struct mdr_buf {
+	int			refs;
+	size_t			size;
+	char			data[];
+};
+
+struct mdr_write {
+	struct mdr_write	*next;
+	struct mdr_buf		*buf;
+	char			*data;
+	off64_t			pos;
+	size_t			len;
+};
+
+struct mdr_writer {
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	struct mdr_write	*head;
+	struct mdr_write	**tailp;
+	bool			done;
+};
+
+static struct {
+	int			dst_fd;
+	struct mdr_writer	*writers;
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	uint64_t		queued;		/* bytes of buffers in flight */
+	uint64_t		written;	/* bytes written to the target */
+	struct timeval		start;
+	time_t			last_report;
+} mdr = {
+	.lock			= PTHREAD_MUTEX_INITIALIZER,
+	.wait			= PTHREAD_COND_INITIALIZER,
+};
+
+/* Report how much we've restored, at most once a second unless @force. */
+static void
+report_progress(
+	int64_t			bytes_read,
+	bool			force)
+{
+	struct timeval		now;
+	uint64_t		written = uatomic_read(&mdr.written);
+	double			elapsed;
+
+	if (!show_progress)
+		return;
+
+	gettimeofday(&now, NULL);
+	if (!force && now.tv_sec == mdr.last_report)
+		return;
+	mdr.last_report = now.tv_sec;
+
+	elapsed = (now.tv_sec - mdr.start.tv_sec) +
+		  (now.tv_usec - mdr.start.tv_usec) / 1000000.0;
+	print_progress("%lld MB read, %llu MB written, %.0f MB/s",
+			(long long)bytes_read >> 20, written >> 20,
+			elapsed > 0 ? (written >> 20) / elapsed : 0);
+}
+
+static struct mdr_buf *
+mdr_buf_alloc(
+	size_t			size)
+{
+	struct mdr_buf		*buf;
+
+	pthread_mutex_lock(&mdr.lock);
+	while (mdr.queued >= MDR_MAX_QUEUED)
+		pthread_cond_wait(&mdr.wait, &mdr.lock);
+	mdr.queued += size;
+	pthread_mutex_unlock(&mdr.lock);
+
+	buf = calloc(1, sizeof(struct mdr_buf) + size);
+	if (!buf)
+		fatal("memory allocation failure\n");
+	buf->refs = 1;
+	buf->size = size;
+	return buf;
+}
+
+static void
+mdr_buf_put(
+	struct mdr_buf		*buf)
+{
+	if (uatomic_sub_return(&buf->refs, 1) > 0)
+		return;
+
+	pthread_mutex_lock(&mdr.lock);
+	mdr.queued -= buf->size;
+	pthread_cond_signal(&mdr.wait);
+	pthread_mutex_unlock(&mdr.lock);
+	free(buf);
+}
+
+/* Write out @nr iovecs totalling @len bytes at @pos, coping with short IO. */
+static void
+write_iovs(
+	struct iovec		*iov,
+	int			nr,
+	off64_t			pos,
+	size_t			len)
+{
+	ssize_t			ret;
+
+	uatomic_add(&mdr.written, len);
+	while (len > 0) {
+		ret = pwritev(mdr.dst_fd, iov, nr, pos);
+		if (ret < 0)
+			fatal("error writing block %llu: %s\n",
+				(unsigned long long)pos, strerror(errno));
+		if (ret == 0)
+			fatal("error writing block %llu: short write\n",
+				(unsigned long long)pos);
+		pos += ret;
+		len -= ret;
+		while (nr > 0 && ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			nr--;
+		}
+		if (nr > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+}
+
+/* Write a list of runs, merging the ones that are adjacent on disk. */
+static void
+write_runs(
+	struct mdr_write	*wr)
+{
+	struct iovec		iov[MDR_MAX_IOVS];
+	struct mdr_write	*next;
+	off64_t			pos;
+	size_t			len;
+	int			nr;
+
+	while (wr) {
+		pos = wr->pos;
+		len = 0;
+		nr = 0;
+		for (next = wr;
+		     next && nr < MDR_MAX_IOVS && next->pos == pos + len;
+		     next = next->next) {
+			iov[nr].iov_base = next->data;
+			iov[nr].iov_len = next->len;
+			len += next->len;
+			nr++;
+		}
+		write_iovs(iov, nr, pos, len);
+
+		while (wr != next) {
+			struct mdr_write	*done = wr;
+
+			wr = wr->next;
+			mdr_buf_put(done->buf);
+			free(done);
+		}
+	}
+}
+
+static void *
+writer_thread(
+	void			*arg)
+{
+	struct mdr_writer	*w = arg;
+	struct mdr_write	*wr;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (!w->head && !w->done)
+			pthread_cond_wait(&w->wait, &w->lock);
+		if (!w->head)
+			break;
+
+		wr = w->head;
+		w->head = NULL;
+		w->tailp = &w->head;
+		pthread_mutex_unlock(&w->lock);
+
+		write_runs(wr);
+
+		pthread_mutex_lock(&w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+static void
+start_writers(
+	int			dst_fd)
+{
+	struct mdr_writer	*w;
+	int			i;
+	int			error;
+
+	mdr.dst_fd = dst_fd;
+	gettimeofday(&mdr.start, NULL);
+	if (nr_writers < 2)
+		return;
+
+	mdr.writers = calloc(nr_writers, sizeof(struct mdr_writer));
+	if (!mdr.writers)
+		fatal("memory allocation failure\n");
+
+	for (i = 0, w = mdr.writers; i < nr_writers; i++, w++) {
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->wait, NULL);
+		w->tailp = &w->head;
+		error = pthread_create(&w->thread, NULL, writer_thread, w);
+		if (error)
+			fatal("cannot create writer thread: %s\n",
+					strerror(error));
+	}
+}
+
+/* Wait for everything queued to be written. */
+static void
+stop_writers(void)
+{
+	struct mdr_writer	*w;
+	int			i;
+
+	if (!mdr.writers)
+		return;
+
+	for (i = 0, w = mdr.writers; i < nr_writers; i++, w++) {
+		pthread_mutex_lock(&w->lock);
+		w->done = true;
+		pthread_cond_signal(&w->wait);
+		pthread_mutex_unlock(&w->lock);
+	}
+	for (i = 0, w = mdr.writers; i < nr_writers; i++, w++) {
+		pthread_join(w->thread, NULL);
+		pthread_cond_destroy(&w->wait);
+		pthread_mutex_destroy(&w->lock);
+	}
+	free(mdr.writers);
+	mdr.writers = NULL;
+}
+
+static void
+queue_run(
+	struct mdr_buf		*buf,
+	char			*data,
+	off64_t			pos,
+	size_t			len)
+{
+	struct mdr_writer	*w;
+	struct mdr_write	*wr;
+
+	wr = malloc(sizeof(struct mdr_write));
+	if (!wr)
+		fatal("memory allocation failure\n");
+	uatomic_inc(&buf->refs);
+	wr->next = NULL;
+	wr->buf = buf;
+	wr->data = data;
+	wr->pos = pos;
+	wr->len = len;
+
+	w = &mdr.writers[(pos >> MDR_STRIPE_SHIFT) % nr_writers];
+	pthread_mutex_lock(&w->lock);
+	*w->tailp = wr;
+	w->tailp = &wr->next;
+	pthread_cond_signal(&w->wait);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Write @len bytes of @buf starting at @data to byte offset @pos. */
+static void
+restore_write(
+	struct mdr_buf		*buf,
+	char			*data,
+	off64_t			pos,
+	size_t			len)
+{
+	struct iovec		iov;
+	size_t			count;
+
+	if (!mdr.writers) {
+		iov.iov_base = data;
+		iov.iov_len = len;
+		write_iovs(&iov, 1, pos, len);
+		return;
+	}
+
+	/* Split the run at stripe boundaries. */
+	while (len > 0) {
+		count = min(len, (size_t)(round_up(pos + 1,
+				1ULL << MDR_STRIPE_SHIFT) - pos));
+		queue_run(buf, data, pos, count);
+		data += count;
+		pos += count;
+		len -= count;
+	}
+}
+
+/*
+ * Get rid of whatever was on the target device beforehand, so that stale
+ * metadata outside the dump can't confuse repair.  Thin provisioned devices
+ * can unmap the space; otherwise have the device zero it.
+ */
+static void
+zero_target_device(
+	int			dst_fd,
+	off64_t			len)
+{
+#if defined(HAVE_FALLOCATE)
+	if (!fallocate(dst_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				0, len))
+		return;
+	if (!fallocate(dst_fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+				0, len))
+		return;
+	fatal("cannot zero target device: %s\n", strerror(errno));
+#else
+	fatal("cannot zero target device: %s\n", strerror(EOPNOTSUPP));
+#endif
+}
+
+/* Make sure the target is big enough to hold the filesystem. */
+static void
+set_target_size(
+	int			dst_fd,
+	int			is_target_file,
+	struct xfs_sb		*sb)
+{
+	if (is_target_file)  {
+		/* ensure regular files are correctly sized */
+
+		if (ftruncate(dst_fd, sb->sb_dblocks * sb->sb_blocksize))
+			fatal("cannot set filesystem image size: %s\n",
+				strerror(errno));
+	} else  {
+		/* ensure device is sufficiently large enough */
+
+		char		*lb[XFS_MAX_SECTORSIZE] = { NULL };
+		off64_t		off;
+
+		off = sb->sb_dblocks * sb->sb_blocksize - sizeof(lb);
+		if (pwrite(dst_fd, lb, sizeof(lb), off) < 0)
+			fatal("failed to write last block, is target too "
+				"small? (error: %s)\n", strerror(errno));
+	}
+
+	if (zero_target && !is_target_file)
+		zero_target_device(dst_fd, sb->sb_dblocks * sb->sb_blocksize);
+}
+
+/* Rewrite the primary superblock with sb_inprogress cleared. */
+static void
+write_primary_sb(
+	int			dst_fd,
+	struct xfs_sb		*sb)
+{
+	char			*block_buffer;
+
+	block_buffer = calloc(1, sb->sb_sectsize);
+	if (!block_buffer)
+		fatal("memory allocation failure\n");
+
+	sb->sb_inprogress = 0;
+	libxfs_sb_to_disk((struct xfs_dsb *)block_buffer, sb);
+	if (xfs_sb_version_hascrc(sb)) {
+		xfs_update_cksum(block_buffer, sb->sb_sectsize,
+				 offsetof(struct xfs_sb, sb_crc));
+	}
+
+	if (pwrite(dst_fd, block_buffer, sb->sb_sectsize, 0) < 0)
+		fatal("error writing primary superblock: %s\n", strerror(errno));
+
+	free(block_buffer);
+}
+
 /*
  * perform_restore() -- do the actual work to restore the metadump
  *
@@ -55,12 +459,14 @@ perform_restore(
 	int			is_target_file,
 	const struct xfs_metablock	*mbp)
 {
+	struct mdr_buf		*buf;
 	struct xfs_metablock	*metablock;	/* header + index + blocks */
 	__be64			*block_index;
 	char			*block_buffer;
 	int			block_size;
 	int			max_indices;
 	int			cur_index;
+	int			run;
 	int			mb_count;
 	xfs_sb_t		sb;
 	int64_t			bytes_read;
@@ -68,9 +474,8 @@ perform_restore(
 	block_size = 1 << mbp->mb_blocklog;
 	max_indices = (block_size - sizeof(xfs_metablock_t)) / sizeof(__be64);
 
-	metablock = (xfs_metablock_t *)calloc(max_indices + 1, block_size);
-	if (metablock == NULL)
-		fatal("memory allocation failure\n");
+	buf = mdr_buf_alloc((max_indices + 1) * block_size);
+	metablock = (xfs_metablock_t *)buf->data;
 
 	mb_count = be16_to_cpu(mbp->mb_count);
 	if (mb_count == 0 || mb_count > max_indices)
@@ -106,42 +511,39 @@ perform_restore(
 
 	((struct xfs_dsb*)block_buffer)->sb_inprogress = 1;
 
-	if (is_target_file)  {
-		/* ensure regular files are correctly sized */
-
-		if (ftruncate(dst_fd, sb.sb_dblocks * sb.sb_blocksize))
-			fatal("cannot set filesystem image size: %s\n",
-				strerror(errno));
-	} else  {
-		/* ensure device is sufficiently large enough */
-
-		char		*lb[XFS_MAX_SECTORSIZE] = { NULL };
-		off64_t		off;
-
-		off = sb.sb_dblocks * sb.sb_blocksize - sizeof(lb);
-		if (pwrite(dst_fd, lb, sizeof(lb), off) < 0)
-			fatal("failed to write last block, is target too "
-				"small? (error: %s)\n", strerror(errno));
-	}
+	set_target_size(dst_fd, is_target_file, &sb);
+	start_writers(dst_fd);
 
 	bytes_read = 0;
 
 	for (;;) {
-		if (show_progress && (bytes_read & ((1 << 20) - 1)) == 0)
-			print_progress("%lld MB read", bytes_read >> 20);
-
-		for (cur_index = 0; cur_index < mb_count; cur_index++) {
-			if (pwrite(dst_fd, &block_buffer[cur_index <<
-					mbp->mb_blocklog], block_size,
-					be64_to_cpu(block_index[cur_index]) <<
-						BBSHIFT) < 0)
-				fatal("error writing block %llu: %s\n",
-					be64_to_cpu(block_index[cur_index]) << BBSHIFT,
-					strerror(errno));
+		report_progress(bytes_read, false);
+
+		/* Write out runs of blocks that are contiguous on disk. */
+		for (cur_index = 0; cur_index < mb_count; cur_index += run) {
+			int64_t	daddr = be64_to_cpu(block_index[cur_index]);
+
+			for (run = 1; cur_index + run < mb_count; run++) {
+				if (be64_to_cpu(block_index[cur_index + run]) !=
+				    daddr + ((int64_t)run << (mbp->mb_blocklog -
+							       BBSHIFT)))
+					break;
+			}
+			restore_write(buf, &block_buffer[cur_index <<
+					mbp->mb_blocklog], daddr << BBSHIFT,
+					run << mbp->mb_blocklog);
 		}
+		mdr_buf_put(buf);
+		buf = NULL;
 		if (mb_count < max_indices)
 			break;
 
+		buf = mdr_buf_alloc((max_indices + 1) * block_size);
+		metablock = (xfs_metablock_t *)buf->data;
+		block_index = (__be64 *)((char *)metablock +
+					sizeof(xfs_metablock_t));
+		block_buffer = (char *)metablock + block_size;
+
 		if (fread(metablock, block_size, 1, src_f) != 1)
 			fatal("error reading from metadump file\n");
 
@@ -157,28 +559,155 @@ perform_restore(
 
 		bytes_read += block_size + (mb_count << mbp->mb_blocklog);
 	}
+	if (buf)
+		mdr_buf_put(buf);
 
+	stop_writers();
+	report_progress(bytes_read, true);
 	if (progress_since_warning)
 		putchar('\n');
 
-	memset(block_buffer, 0, sb.sb_sectsize);
-	sb.sb_inprogress = 0;
-	libxfs_sb_to_disk((struct xfs_dsb *)block_buffer, &sb);
-	if (xfs_sb_version_hascrc(&sb)) {
-		xfs_update_cksum(block_buffer, sb.sb_sectsize,
-				 offsetof(struct xfs_sb, sb_crc));
+	write_primary_sb(dst_fd, &sb);
+}
+
+/*
+ * perform_restore_v2() -- restore a version 2 metadump
+ *
+ * @src_f: A FILE pointer to the source metadump, positioned after the header
+ * @dst_fd: the file descriptor for the target file
+ * @is_target_file: designates whether the target is a regular file
+ *
+ * Segments are decompressed and written out in the order they appear in the
+ * image, so we can restore from a pipe.  A full restore stops at the index;
+ * it's only needed by readers that want to look up individual sectors.
+ */
+static void
+perform_restore_v2(
+	FILE			*src_f,
+	int			dst_fd,
+	int			is_target_file)
+{
+	struct xfs_metadump_seg	seg;
+	struct xfs_metadump_ext	*rec;
+	struct xfs_sb		sb;
+	struct mdr_buf		*buf;
+	char			*raw;
+	char			*zbuf;
+	unsigned int		len;
+	unsigned int		rawlen;
+	unsigned int		datalen;
+	unsigned int		nr;
+	unsigned int		i;
+	int64_t			bytes_read = 0;
+	bool			have_sb = false;
+
+	zbuf = malloc(XFS_MD_SEG_MAX);
+	if (!zbuf)
+		fatal("memory allocation failure\n");
+
+	for (;;) {
+		report_progress(bytes_read, false);
+
+		if (fread(&seg.xms_magic, sizeof(seg.xms_magic), 1,
+					src_f) != 1)
+			fatal("error reading from metadump file\n");
+		if (seg.xms_magic == cpu_to_be32(XFS_MD_IDX_MAGIC))
+			break;
+		if (seg.xms_magic != cpu_to_be32(XFS_MD_SEG_MAGIC))
+			fatal("bad segment magic in metadump file\n");
+		if (fread(&seg.xms_codec, sizeof(seg) - sizeof(seg.xms_magic),
+					1, src_f) != 1)
+			fatal("error reading from metadump file\n");
+
+		len = be32_to_cpu(seg.xms_len);
+		rawlen = be32_to_cpu(seg.xms_rawlen);
+		nr = be32_to_cpu(seg.xms_nr);
+		if (len > XFS_MD_SEG_MAX || rawlen > XFS_MD_SEG_MAX ||
+		    nr == 0 || nr > rawlen / sizeof(*rec))
+			fatal("bad segment header in metadump file\n");
+		datalen = rawlen - nr * sizeof(*rec);
+		if (datalen & (BBSIZE - 1))
+			fatal("bad segment header in metadump file\n");
+
+		buf = mdr_buf_alloc(rawlen);
+		raw = buf->data;
+
+		switch (be32_to_cpu(seg.xms_codec)) {
+		case XFS_MD_CODEC_NONE:
+			if (len != rawlen)
+				fatal("bad segment header in metadump file\n");
+			if (fread(raw, rawlen, 1, src_f) != 1)
+				fatal("error reading from metadump file\n");
+			break;
+		case XFS_MD_CODEC_LZ:
+			if (fread(zbuf, len, 1, src_f) != 1)
+				fatal("error reading from metadump file\n");
+			if (frog_lz_decompress(zbuf, len, raw, rawlen) != rawlen)
+				fatal("corrupt segment in metadump file\n");
+			break;
+		default:
+			fatal("unknown segment encoding %u\n",
+					be32_to_cpu(seg.xms_codec));
+		}
+
+		if (crc32c(XFS_CRC_SEED, raw, rawlen) != be32_to_cpu(seg.xms_crc))
+			fatal("segment checksum mismatch in metadump file\n");
+
+		rec = (struct xfs_metadump_ext *)(raw + datalen);
+		for (i = 0; i < nr; i++, rec++) {
+			int64_t		daddr = be64_to_cpu(rec->xme_daddr);
+			unsigned int	elen = be32_to_cpu(rec->xme_len);
+			unsigned int	off = be32_to_cpu(rec->xme_off);
+
+			if (elen == 0 || off > datalen ||
+			    elen > (datalen - off) >> BBSHIFT)
+				fatal("bad extent in metadump file\n");
+
+			if (!have_sb) {
+				if (daddr != 0)
+					fatal("first block is not the primary superblock\n");
+
+				libxfs_sb_from_disk(&sb,
+						(struct xfs_dsb *)(raw + off));
+				if (sb.sb_magicnum != XFS_SB_MAGIC)
+					fatal("bad magic number for primary superblock\n");
+				if (sb.sb_sectsize < XFS_MIN_SECTORSIZE ||
+				    sb.sb_sectsize > XFS_MAX_SECTORSIZE)
+					fatal("bad sector size %u in metadump image\n",
+							sb.sb_sectsize);
+
+				((struct xfs_dsb *)(raw + off))->sb_inprogress = 1;
+				set_target_size(dst_fd, is_target_file, &sb);
+				start_writers(dst_fd);
+				have_sb = true;
+			}
+
+			restore_write(buf, raw + off, daddr << BBSHIFT,
+					(size_t)elen << BBSHIFT);
+		}
+		mdr_buf_put(buf);
+
+		bytes_read += sizeof(seg) + len;
 	}
 
-	if (pwrite(dst_fd, block_buffer, sb.sb_sectsize, 0) < 0)
-		fatal("error writing primary superblock: %s\n", strerror(errno));
+	if (!have_sb)
+		fatal("metadump file contains no metadata\n");
+
+	stop_writers();
+	report_progress(bytes_read, true);
+	if (progress_since_warning)
+		putchar('\n');
+
+	write_primary_sb(dst_fd, &sb);
 
-	free(metablock);
+	free(zbuf);
 }
 
 static void
 usage(void)
 {
-	fprintf(stderr, "Usage: %s [-V] [-g] [-i] source target\n", progname);
+	fprintf(stderr, "Usage: %s [-V] [-g] [-i] [-z] [-j threads] source target\n",
+			progname);
 	exit(1);
 }
 
@@ -192,14 +721,18 @@ main(
 	FILE		*src_f;
 	int		dst_fd;
 	int		c;
+	char		*p;
 	int		open_flags;
 	struct stat	statbuf;
 	int		is_target_file;
 	struct xfs_metablock	mb;
+	struct xfs_metadump_header	hdr;
+	uint32_t	info;
+	int		version = 1;
 
 	progname = basename(argv[0]);
 
-	while ((c = getopt(argc, argv, "giV")) != EOF) {
+	while ((c = getopt(argc, argv, "gij:zV")) != EOF) {
 		switch (c) {
 			case 'g':
 				show_progress = 1;
@@ -207,6 +740,14 @@ main(
 			case 'i':
 				show_info = 1;
 				break;
+			case 'j':
+				nr_writers = (int)strtol(optarg, &p, 0);
+				if (*p != '\0' || nr_writers <= 0)
+					fatal("bad thread count %s\n", optarg);
+				break;
+			case 'z':
+				zero_target = 1;
+				break;
 			case 'V':
 				printf("%s version %s\n", progname, VERSION);
 				exit(0);
@@ -240,16 +781,31 @@ main(
 
 	if (fread(&mb, sizeof(mb), 1, src_f) != 1)
 		fatal("error reading from metadump file\n");
-	if (mb.mb_magic != cpu_to_be32(XFS_MD_MAGIC))
+	if (mb.mb_magic == cpu_to_be32(XFS_MD_MAGIC_V2)) {
+		/* the metablock we just read is the start of the v2 header */
+		memcpy(&hdr, &mb, sizeof(mb));
+		if (fread((char *)&hdr + sizeof(mb), sizeof(hdr) - sizeof(mb),
+					1, src_f) != 1)
+			fatal("error reading from metadump file\n");
+		if (be32_to_cpu(hdr.xmh_version) != 2)
+			fatal("unsupported metadump version %u\n",
+					be32_to_cpu(hdr.xmh_version));
+		version = 2;
+		info = be32_to_cpu(hdr.xmh_info);
+	} else if (mb.mb_magic == cpu_to_be32(XFS_MD_MAGIC)) {
+		info = mb.mb_info;
+	} else {
 		fatal("specified file is not a metadata dump\n");
+	}
 
 	if (show_info) {
-		if (mb.mb_info & XFS_METADUMP_INFO_FLAGS) {
-			printf("%s: %sobfuscated, %s log, %s metadata blocks\n",
+		if (info & XFS_METADUMP_INFO_FLAGS) {
+			printf("%s: %sobfuscated, %s log, %s metadata blocks%s\n",
 			argv[optind],
-			mb.mb_info & XFS_METADUMP_OBFUSCATED ? "":"not ",
-			mb.mb_info & XFS_METADUMP_DIRTYLOG ? "dirty":"clean",
-			mb.mb_info & XFS_METADUMP_FULLBLOCKS ? "full":"zeroed");
+			info & XFS_METADUMP_OBFUSCATED ? "":"not ",
+			info & XFS_METADUMP_DIRTYLOG ? "dirty":"clean",
+			info & XFS_METADUMP_FULLBLOCKS ? "full":"zeroed",
+			version == 2 ? ", compressed and indexed" : "");
 		} else {
 			printf("%s: no informational flags present\n",
 				argv[optind]);
@@ -285,7 +841,10 @@ main(
 	if (dst_fd < 0)
 		fatal("couldn't open target \"%s\"\n", argv[optind]);
 
-	perform_restore(src_f, dst_fd, is_target_file, &mb);
+	if (version == 2)
+		perform_restore_v2(src_f, dst_fd, is_target_file);
+	else
+		perform_restore(src_f, dst_fd, is_target_file, &mb);
 
 	close(dst_fd);
 	if (src_f != stdin)
@@ -14,6 +14,7 @@
 #include "libfrog/logging.h"
 #include "libfrog/fsgeom.h"
 #include "libfrog/bulkstat.h"
+#include "libfrog/workqueue.h"
 
 typedef struct du {
 	struct du	*next;
@@ -35,7 +36,28 @@ static du_t		du[3][NDU];
 static du_t		*duhash[3][DUHASH];
 static int		ndu[3];	/* #usr/grp/prj */
 
-#define NBSTAT 		4069
+#define NBSTAT 		8192
+
+/*
+ * Usage tables filled in by one scanning thread.  Every AG is bulkstatted by
+ * a separate work item, and the threads' tables are folded into the global
+ * ones once all the AGs have been scanned.
+ */
+struct quot_acct {
+	struct quot_acct	*next;
+	struct xfs_bulkstat_req	*breq;
+	uint64_t		sizes[TSIZE];
+	uint64_t		overflow;
+	du_t			*duhash[3][DUHASH];
+};
+
+struct quot_scan {
+	struct xfs_fd		*xfd;
+	unsigned int		flags;
+	pthread_mutex_t		lock;
+	struct quot_acct	*idle;		/* tables not being filled */
+	int			error;
+};
 
 static time_t now;
 static cmdinfo_t quot_cmd;
@@ -70,6 +92,7 @@ quot_help(void)
 
 static void
 quot_bulkstat_add(
+	struct quot_acct	*acct,
 	struct xfs_bulkstat	*p,
 	uint		flags)
 {
@@ -86,31 +109,26 @@ quot_bulkstat_add(
 		if (!(S_ISDIR(p->bs_mode) || S_ISREG(p->bs_mode)))
 			return;
 		if (size >= TSIZE) {
-			overflow += size;
+			acct->overflow += size;
 			size = TSIZE - 1;
 		}
-		sizes[(int)size]++;
+		acct->sizes[(int)size]++;
 		return;
 	}
 	for (i = 0; i < 3; i++) {
 		id = (i == 0) ? p->bs_uid : ((i == 1) ?
 			p->bs_gid : p->bs_projectid);
-		hp = &duhash[i][id % DUHASH];
+		hp = &acct->duhash[i][id % DUHASH];
 		for (dp = *hp; dp; dp = dp->next)
 			if (dp->id == id)
 				break;
 		if (dp == NULL) {
-			if (ndu[i] >= NDU)
+			dp = calloc(1, sizeof(*dp));
+			if (!dp)
 				return;
-			dp = &du[i][(ndu[i]++)];
 			dp->next = *hp;
 			*hp = dp;
 			dp->id = id;
-			dp->nfiles = 0;
-			dp->blocks = 0;
-			dp->blocks30 = 0;
-			dp->blocks60 = 0;
-			dp->blocks90 = 0;
 		}
 		dp->blocks += size;
 
@@ -124,13 +142,116 @@ quot_bulkstat_add(
 	}
 }
 
+/* Fold one thread's usage tables into the global ones. */
+static void
+quot_acct_merge(
+	struct quot_acct	*acct)
+{
+	du_t			*sp, *dp;
+	du_t			**hp;
+	int			i, j;
+
+	for (i = 0; i < TSIZE; i++)
+		sizes[i] += acct->sizes[i];
+	overflow += acct->overflow;
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < DUHASH; j++) {
+			for (sp = acct->duhash[i][j]; sp; sp = sp->next) {
+				hp = &duhash[i][j];
+				for (dp = *hp; dp; dp = dp->next)
+					if (dp->id == sp->id)
+						break;
+				if (dp == NULL && ndu[i] < NDU) {
+					dp = &du[i][(ndu[i]++)];
+					memset(dp, 0, sizeof(*dp));
+					dp->next = *hp;
+					*hp = dp;
+					dp->id = sp->id;
+				}
+				if (dp) {
+					dp->blocks += sp->blocks;
+					dp->blocks30 += sp->blocks30;
+					dp->blocks60 += sp->blocks60;
+					dp->blocks90 += sp->blocks90;
+					dp->nfiles += sp->nfiles;
+				}
+			}
+		}
+	}
+}
+
+static void
+quot_acct_free(
+	struct quot_acct	*acct)
+{
+	du_t			*dp, *next;
+	int			i, j;
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < DUHASH; j++) {
+			for (dp = acct->duhash[i][j]; dp; dp = next) {
+				next = dp->next;
+				free(dp);
+			}
+		}
+	}
+	free(acct->breq);
+}
+
+static void
+quot_scan_ag(
+	struct workqueue	*wq,
+	uint32_t		agno,
+	void			*arg)
+{
+	struct quot_scan	*qs = arg;
+	struct quot_acct	*acct;
+	struct xfs_bulkstat_req	*breq;
+	int			i, ret;
+
+	pthread_mutex_lock(&qs->lock);
+	acct = qs->idle;
+	qs->idle = acct->next;
+	pthread_mutex_unlock(&qs->lock);
+
+	breq = acct->breq;
+	memset(&breq->hdr, 0, sizeof(breq->hdr));
+	breq->hdr.icount = NBSTAT;
+	xfrog_bulkstat_set_ag(breq, agno);
+
+	while ((ret = -xfrog_bulkstat(qs->xfd, breq)) == 0) {
+		if (breq->hdr.ocount == 0)
+			break;
+		for (i = 0; i < breq->hdr.ocount; i++)
+			quot_bulkstat_add(acct, &breq->bulkstat[i], qs->flags);
+	}
+
+	pthread_mutex_lock(&qs->lock);
+	if (ret && !qs->error) {
+		xfrog_perror(ret, "XFS_IOC_FSBULKSTAT");
+		qs->error = ret;
+	}
+	acct->next = qs->idle;
+	qs->idle = acct;
+	pthread_mutex_unlock(&qs->lock);
+}
+
 static void
 quot_bulkstat_mount(
 	char			*fsdir,
 	unsigned int		flags)
 {
 	struct xfs_fd		fsxfd = XFS_FD_INIT_EMPTY;
-	struct xfs_bulkstat_req	*breq;
+	struct quot_scan	qs = {
+		.xfd		= &fsxfd,
+		.flags		= flags,
+	};
+	struct workqueue	wq;
+	struct quot_acct	*accts;
+	unsigned int		nr_threads;
+	unsigned int		nr_accts;
+	uint32_t		agno;
 	int			i, sts, ret;
 	du_t			**dp;
 
@@ -152,22 +273,51 @@ quot_bulkstat_mount(
 		return;
 	}
 
-	ret = -xfrog_bulkstat_alloc_req(NBSTAT, 0, &breq);
-	if (ret) {
-		xfrog_perror(ret, "calloc");
+	/* Scan one AG per work item, each thread into its own tables. */
+	nr_threads = min(platform_nproc(), fsxfd.fsgeom.agcount);
+	nr_accts = max(nr_threads, 1);
+	accts = calloc(nr_accts, sizeof(*accts));
+	if (!accts) {
+		xfrog_perror(ENOMEM, "calloc");
 		xfd_close(&fsxfd);
 		return;
 	}
+	for (i = 0; i < nr_accts; i++) {
+		ret = -xfrog_bulkstat_alloc_req(NBSTAT, 0, &accts[i].breq);
+		if (ret) {
+			xfrog_perror(ret, "calloc");
+			goto out_free;
+		}
+		accts[i].next = qs.idle;
+		qs.idle = &accts[i];
+	}
+	pthread_mutex_init(&qs.lock, NULL);
 
-	while ((sts = -xfrog_bulkstat(&fsxfd, breq)) == 0) {
-		if (breq->hdr.ocount == 0)
+	ret = -workqueue_create(&wq, NULL, nr_threads > 1 ? nr_threads : 0);
+	if (ret) {
+		xfrog_perror(ret, "workqueue_create");
+		goto out_lock;
+	}
+	for (agno = 0; agno < fsxfd.fsgeom.agcount; agno++) {
+		ret = -workqueue_add(&wq, quot_scan_ag, agno, &qs);
+		if (ret) {
+			xfrog_perror(ret, "workqueue_add");
 			break;
-		for (i = 0; i < breq->hdr.ocount; i++)
-			quot_bulkstat_add(&breq->bulkstat[i], flags);
+		}
 	}
-	if (sts < 0)
-		xfrog_perror(sts, "XFS_IOC_FSBULKSTAT");
-	free(breq);
+	ret = -workqueue_terminate(&wq);
+	if (ret)
+		xfrog_perror(ret, "workqueue_terminate");
+	workqueue_destroy(&wq);
+
+	for (i = 0; i < nr_accts; i++)
+		quot_acct_merge(&accts[i]);
+out_lock:
+	pthread_mutex_destroy(&qs.lock);
+out_free:
+	for (i = 0; i < nr_accts; i++)
+		quot_acct_free(&accts[i]);
+	free(accts);
 	xfd_close(&fsxfd);
 }
 
@@ -0,0 +1,407 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 Oracle.  All Rights Reserved.
+ */
+
+/*
+ * Block state map benchmark
+ *
+ * Replays a space map into repair's incore block state map three times:
+ * with every AG kept as extents in the btree, with the adaptive hybrid that
+ * repair uses, and with every AG converted to the dense array right away.
+ * Each run sets the extents in a shuffled order, like the scanners do, walks
+ * every AG extent by extent, like phases 4 and 5 do, and looks up random
+ * single blocks, like the duplicate checks do.  The results are checked
+ * against a plain byte-per-block map.
+ *
+ * With no arguments, a synthetic fragmented filesystem is used; that is what
+ * "make -C repair bench" runs.  To benchmark a real layout, dump it with
+ *
+ *	xfs_io -c 'fsmap -m' /mnt > map.csv
+ *
+ * and run "bmapbench -b blocksize -a agblocks -c agcount map.csv".
+ */
+#include "libxfs.h"
+#include <time.h>
+#include "btree.h"
+#include "globals.h"
+#include "incore.h"
+#include "err_protos.h"
+
+#define BENCH_LOOKUPS		1000000
+#define SYNTH_AGCOUNT		4
+#define SYNTH_AGBLOCKS		262144
+#define SYNTH_LOOKUPS		100000
+
+struct bench_ext {
+	xfs_agnumber_t		agno;
+	xfs_agblock_t		agbno;
+	xfs_extlen_t		len;
+	int			state;
+};
+
+static struct xfs_mount		mount;
+static struct bench_ext		*exts;
+static size_t			nr_exts;
+static size_t			max_exts;
+static uint8_t			*ref;		/* one state per block */
+static xfs_agblock_t		hdr_blocks;
+static unsigned int		nr_lookups = BENCH_LOOKUPS;
+static uint64_t			seed = 0x9e3779b97f4a7c15ULL;
+
+struct aglock			*ag_locks;
+struct aglock			rt_lock;
+
+void
+do_error(
+	char const		*msg,
+	...)
+{
+	va_list			args;
+
+	va_start(args, msg);
+	vfprintf(stderr, msg, args);
+	va_end(args);
+	exit(1);
+}
+
+static uint64_t
+bench_rand(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+bench_add(
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		agbno,
+	xfs_extlen_t		len,
+	int			state)
+{
+	if (nr_exts == max_exts) {
+		max_exts = max_exts ? max_exts * 2 : 65536;
+		exts = realloc(exts, max_exts * sizeof(struct bench_ext));
+		if (!exts)
+			do_error("out of memory\n");
+	}
+	exts[nr_exts].agno = agno;
+	exts[nr_exts].agbno = agbno;
+	exts[nr_exts].len = len;
+	exts[nr_exts].state = state;
+	nr_exts++;
+}
+
+/* Map an fsmap owner to the state that repair would record for it. */
+static int
+bench_owner_state(
+	const char		*owner)
+{
+	unsigned int		type, code;
+
+	if (sscanf(owner, "special_%u:%u", &type, &code) == 2) {
+		switch (code) {
+		case 1:		/* free space */
+			return XR_E_FREE;
+		case 3:		/* static fs metadata */
+		case 4:		/* journalling log */
+		case 5:		/* per-AG metadata */
+			return XR_E_INUSE_FS;
+		case 6:		/* inode btree */
+			return XR_E_FS_MAP;
+		case 7:		/* inodes */
+			return XR_E_INO;
+		case 8:		/* refcount btree */
+			return XR_E_REFC;
+		case 9:		/* cow reservation */
+			return XR_E_COW;
+		default:
+			return XR_E_INUSE;
+		}
+	}
+	if (strstr(owner, "_bmbt"))
+		return XR_E_FS_MAP;
+	return XR_E_INUSE;
+}
+
+/* Load an "xfs_io -c 'fsmap -m'" dump, splitting extents at AG ends. */
+static void
+bench_load(
+	const char		*path,
+	unsigned int		blocksize)
+{
+	char			line[512];
+	char			owner[128];
+	long long		pstart, pend;
+	uint64_t		fsb, end;
+	FILE			*fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		do_error("%s: %s\n", path, strerror(errno));
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%*u,%*u,%*u,%lld,%lld,%127[^,]",
+				&pstart, &pend, owner) != 3)
+			continue;
+
+		fsb = pstart * BBSIZE / blocksize;
+		end = (pend + 1) * BBSIZE / blocksize;
+		while (fsb < end) {
+			xfs_agnumber_t	agno = fsb / mount.m_sb.sb_agblocks;
+			xfs_agblock_t	agbno = fsb % mount.m_sb.sb_agblocks;
+			xfs_extlen_t	len;
+
+			if (agno >= mount.m_sb.sb_agcount)
+				break;
+			len = min(end - fsb,
+				  (uint64_t)mount.m_sb.sb_agblocks - agbno);
+			fsb += len;
+
+			/*
+			 * update_bmap only splits the extent that the start
+			 * lands in, so leave the AG headers alone like the
+			 * scanners do.
+			 */
+			if (agbno < hdr_blocks) {
+				if (agbno + len <= hdr_blocks)
+					continue;
+				len -= hdr_blocks - agbno;
+				agbno = hdr_blocks;
+			}
+			bench_add(agno, agbno, len, bench_owner_state(owner));
+		}
+	}
+	fclose(fp);
+}
+
+/* Chop every AG into short extents of random states. */
+static void
+bench_synth(void)
+{
+	static const int	synth_states[] = {
+		XR_E_FREE, XR_E_INUSE, XR_E_INO, XR_E_FS_MAP, XR_E_MULT,
+	};
+	xfs_agnumber_t		agno;
+	xfs_agblock_t		agbno;
+	xfs_extlen_t		len;
+
+	for (agno = 0; agno < mount.m_sb.sb_agcount; agno++) {
+		/* Leave one AG mostly uniform so the hybrid keeps the btree. */
+		if (agno == 0) {
+			bench_add(agno, 64, mount.m_sb.sb_agblocks - 64,
+					XR_E_FREE);
+			continue;
+		}
+		for (agbno = hdr_blocks; agbno < mount.m_sb.sb_agblocks;
+		     agbno += len) {
+			len = 1 + bench_rand() % 32;
+			len = min(len, mount.m_sb.sb_agblocks - agbno);
+			bench_add(agno, agbno, len,
+				  synth_states[bench_rand() %
+					ARRAY_SIZE(synth_states)]);
+		}
+	}
+}
+
+/* Shuffle the extents so that they aren't set in disk order. */
+static void
+bench_shuffle(void)
+{
+	struct bench_ext	tmp;
+	size_t			i, j;
+
+	for (i = nr_exts; i > 1; i--) {
+		j = bench_rand() % i;
+		tmp = exts[i - 1];
+		exts[i - 1] = exts[j];
+		exts[j] = tmp;
+	}
+}
+
+/* Build the reference map the same way reset_bmaps and the replay do. */
+static void
+bench_init_ref(void)
+{
+	xfs_agnumber_t		agno;
+	size_t			i;
+	uint64_t		nblocks = mount.m_sb.sb_dblocks;
+
+	ref = malloc(nblocks);
+	if (!ref)
+		do_error("out of memory\n");
+	memset(ref, XR_E_UNKNOWN, nblocks);
+
+	for (agno = 0; agno < mount.m_sb.sb_agcount; agno++)
+		memset(ref + (uint64_t)agno * mount.m_sb.sb_agblocks,
+				XR_E_INUSE_FS, hdr_blocks);
+
+	for (i = 0; i < nr_exts; i++)
+		memset(ref + (uint64_t)exts[i].agno * mount.m_sb.sb_agblocks +
+				exts[i].agbno, exts[i].state, exts[i].len);
+}
+
+static inline int
+bench_ref(
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		agbno)
+{
+	return ref[(uint64_t)agno * mount.m_sb.sb_agblocks + agbno];
+}
+
+/* Walk every AG and check each extent against the reference map. */
+static int
+bench_check(void)
+{
+	xfs_agnumber_t		agno;
+	xfs_agblock_t		agbno, b;
+	xfs_extlen_t		blen;
+	int			state;
+
+	for (agno = 0; agno < mount.m_sb.sb_agcount; agno++) {
+		for (agbno = 0; agbno < mount.m_sb.sb_agblocks; agbno += blen) {
+			state = get_bmap_ext(agno, agbno,
+					mount.m_sb.sb_agblocks, &blen);
+			if (state < 0 || blen == 0) {
+				printf("AG %u block %u: no extent\n",
+						agno, agbno);
+				return 1;
+			}
+			for (b = agbno; b < agbno + blen; b++) {
+				if (bench_ref(agno, b) != state) {
+					printf(
+			"AG %u block %u: state %d, should be %d\n",
+						agno, b, state,
+						bench_ref(agno, b));
+					return 1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+static int
+bench_run(
+	const char		*name,
+	unsigned int		ratio)
+{
+	uint64_t		t0, t_set, t_walk, t_lookup;
+	xfs_agnumber_t		agno;
+	xfs_agblock_t		agbno;
+	xfs_extlen_t		blen;
+	unsigned int		i;
+	int			errors;
+
+	bmap_dense_ratio = ratio;
+	init_bmaps(&mount);
+
+	t0 = bench_now_ns();
+	for (i = 0; i < nr_exts; i++)
+		set_bmap_ext(exts[i].agno, exts[i].agbno, exts[i].len,
+				exts[i].state);
+	t_set = bench_now_ns() - t0;
+
+	t0 = bench_now_ns();
+	for (agno = 0; agno < mount.m_sb.sb_agcount; agno++) {
+		for (agbno = 0; agbno < mount.m_sb.sb_agblocks; agbno += blen)
+			get_bmap_ext(agno, agbno, mount.m_sb.sb_agblocks,
+					&blen);
+	}
+	t_walk = bench_now_ns() - t0;
+
+	t0 = bench_now_ns();
+	for (i = 0; i < nr_lookups; i++) {
+		uint64_t	fsb = bench_rand() % mount.m_sb.sb_dblocks;
+
+		get_bmap(fsb / mount.m_sb.sb_agblocks,
+				fsb % mount.m_sb.sb_agblocks);
+	}
+	t_lookup = bench_now_ns() - t0;
+
+	errors = bench_check();
+	free_bmaps(&mount);
+
+	printf("%-8s set %9.2f ms  walk %9.2f ms  %u lookups %9.2f ms%s\n",
+			name, t_set / 1e6, t_walk / 1e6, nr_lookups,
+			t_lookup / 1e6, errors ? "  FAILED" : "");
+	return errors;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+"Usage: bmapbench [-b blocksize -a agblocks -c agcount fsmap.csv]\n");
+	exit(1);
+}
+
+int
+main(
+	int			argc,
+	char			**argv)
+{
+	unsigned int		blocksize = 4096;
+	unsigned int		agblocks = 0;
+	unsigned int		agcount = 0;
+	int			errors = 0;
+	int			c;
+
+	while ((c = getopt(argc, argv, "a:b:c:")) != EOF) {
+		switch (c) {
+		case 'a':
+			agblocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			blocksize = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			agcount = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind == argc) {
+		agblocks = SYNTH_AGBLOCKS;
+		agcount = SYNTH_AGCOUNT;
+		nr_lookups = SYNTH_LOOKUPS;
+	} else if (optind != argc - 1 || !agblocks || !agcount ||
+		   blocksize < BBSIZE) {
+		usage();
+	}
+
+	mount.m_sb.sb_blocksize = blocksize;
+	mount.m_sb.sb_sectsize = BBSIZE;
+	mount.m_sb.sb_agblocks = agblocks;
+	mount.m_sb.sb_agcount = agcount;
+	mount.m_sb.sb_dblocks = (uint64_t)agblocks * agcount;
+	hdr_blocks = howmany(4 * mount.m_sb.sb_sectsize, blocksize);
+
+	if (optind == argc)
+		bench_synth();
+	else
+		bench_load(argv[optind], blocksize);
+	bench_init_ref();
+	bench_shuffle();
+
+	printf("%zu extents in %u AGs of %u blocks\n", nr_exts, agcount,
+			agblocks);
+	errors += bench_run("btree", 0);
+	errors += bench_run("hybrid", 64);
+	errors += bench_run("dense", UINT_MAX);
+
+	return errors != 0;
+}
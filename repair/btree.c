@@ -6,6 +6,7 @@
 
 #include "libxfs.h"
 #include "btree.h"
+#include "scratch.h"
 
 /*
  * Maximum number of keys per node.  Must be greater than 2 for the code
@@ -68,14 +69,14 @@ struct btree_root {
 static struct btree_node *
 btree_node_alloc(void)
 {
-	return calloc(1, sizeof(struct btree_node));
+	return scratch_zalloc(sizeof(struct btree_node));
 }
 
 static void
 btree_node_free(
 	struct btree_node 	*node)
 {
-	free(node);
+	scratch_free(node, sizeof(struct btree_node));
 }
 
 static void
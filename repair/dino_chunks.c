@@ -15,6 +15,8 @@
 #include "versions.h"
 #include "prefetch.h"
 #include "progress.h"
+#include "threads.h"
+#include "bmap.h"
 
 /*
  * validates inode block or chunk, returns # of good inodes
@@ -1023,35 +1025,114 @@ process_next:
 }
 
 /*
- * check all inodes mentioned in the ag's incore inode maps.
- * the map may be incomplete.  If so, we'll catch the missing
- * inodes (hopefully) when we traverse the directory tree.
- * check_dirs is set to 1 if directory inodes should be
- * processed for internal consistency, parent setting and
- * discovery of unknown inodes.  this only happens
- * in phase 3.  check_dups is set to 1 if we're looking for
- * inodes that reference duplicate blocks so we can trash
- * the inode right then and there.  this is set only in
- * phase 4 after we've run through and set the bitmap once.
+ * Splitting AGs
+ *
+ * A filesystem with a few huge AGs would only keep a few CPUs busy if each
+ * AG were processed by a single thread, so when we're running multithreaded
+ * we cut big AGs into ranges of inode chunks and hand the ranges to a pool of
+ * threads.  The ranges are small and queued in disk order, so the threads
+ * all work just behind the AG's prefetch thread, which still reads the inode
+ * clusters in disk order.
+ *
+ * The inode tree must not change while the ranges are being processed, so
+ * bogus inode chunks are remembered and freed after all the ranges are done.
  */
-void
-process_aginodes(
-	xfs_mount_t		*mp,
+#define XR_INO_RANGE_CHUNKS	32	/* inode allocation chunks per range */
+
+struct aginode_split {
+	struct xfs_mount	*mp;
+	prefetch_args_t		*pf_args;
+	int			ino_discovery;
+	int			check_dups;
+	int			extra_attr_check;
+
+	pthread_mutex_t		lock;
+	ino_tree_node_t		**bogus;	/* first irec of bogus chunks */
+	size_t			nr_bogus;
+	size_t			max_bogus;
+};
+
+struct aginode_range {
+	struct aginode_split	*split;
+	ino_tree_node_t		*first;
+	ino_tree_node_t		*end;		/* first irec of next range */
+};
+
+/* Remember a bogus inode chunk so that we can free it later. */
+static void
+remember_bogus_chunk(
+	struct aginode_split	*split,
+	ino_tree_node_t		*first_ino_rec)
+{
+	pthread_mutex_lock(&split->lock);
+	if (split->nr_bogus == split->max_bogus) {
+		split->max_bogus = max(split->max_bogus * 2, 16);
+		split->bogus = realloc(split->bogus,
+				split->max_bogus * sizeof(ino_tree_node_t *));
+		if (!split->bogus)
+			do_error(_("could not allocate bogus inode chunk list\n"));
+	}
+	split->bogus[split->nr_bogus++] = first_ino_rec;
+	pthread_mutex_unlock(&split->lock);
+}
+
+/*
+ * Throw away the inode records of a bogus inode chunk.  The inode block(s)
+ * will get reclaimed in phase 4 when the block map is reconstructed after
+ * inodes claiming duplicate blocks are deleted.  Returns the first record
+ * after the chunk.
+ */
+static ino_tree_node_t *
+free_bogus_chunk(
+	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno,
+	ino_tree_node_t		*ino_rec,
+	int			*num_inos)
+{
+	struct xfs_ino_geometry *igeo = M_IGEO(mp);
+	ino_tree_node_t		*prev_ino_rec;
+
+	*num_inos = 0;
+	while (*num_inos < igeo->ialloc_inos && ino_rec != NULL)  {
+		prev_ino_rec = ino_rec;
+
+		if ((ino_rec = next_ino_rec(ino_rec)) != NULL)
+			*num_inos += XFS_INODES_PER_CHUNK;
+
+		get_inode_rec(mp, agno, prev_ino_rec);
+		free_inode_rec(agno, prev_ino_rec);
+	}
+
+	return ino_rec;
+}
+
+/*
+ * Process the inode chunks from @first_ino_rec up to (but not including)
+ * @end_ino_rec.  If @split is set, we're one of several threads working on
+ * this AG, so bogus chunks are left in the tree for the caller to free.
+ */
+static void
+process_aginode_range(
+	struct xfs_mount	*mp,
 	prefetch_args_t		*pf_args,
 	xfs_agnumber_t		agno,
-	int 			ino_discovery,
-	int 			check_dups,
-	int 			extra_attr_check)
+	ino_tree_node_t		*first_ino_rec,
+	ino_tree_node_t		*end_ino_rec,
+	int			ino_discovery,
+	int			check_dups,
+	int			extra_attr_check,
+	struct aginode_split	*split)
 {
 	int 			num_inos, bogus;
-	ino_tree_node_t 	*ino_rec, *first_ino_rec, *prev_ino_rec;
+	ino_tree_node_t 	*ino_rec;
 	struct xfs_ino_geometry *igeo = M_IGEO(mp);
+	uint64_t		done = 0;
 #ifdef XR_PF_TRACE
 	int			count;
 #endif
-	first_ino_rec = ino_rec = findfirst_inode_rec(agno);
+	ino_rec = first_ino_rec;
 
-	while (ino_rec != NULL)  {
+	while (ino_rec != end_ino_rec)  {
 		/*
 		 * paranoia - step through inode records until we step
 		 * through a full allocation of inodes.  this could
@@ -1088,35 +1169,160 @@ process_aginodes(
 			abort();
 		}
 
-		if (!bogus)
+		if (!bogus) {
+			first_ino_rec = ino_rec = next_ino_rec(ino_rec);
+		} else if (split) {
+			remember_bogus_chunk(split, first_ino_rec);
 			first_ino_rec = ino_rec = next_ino_rec(ino_rec);
-		else  {
+		} else {
 			/*
 			 * inodes pointed to by this record are
 			 * completely bogus, blow the records for
 			 * this chunk out.
-			 * the inode block(s) will get reclaimed
-			 * in phase 4 when the block map is
-			 * reconstructed after inodes claiming
-			 * duplicate blocks are deleted.
 			 */
-			num_inos = 0;
-			ino_rec = first_ino_rec;
-			while (num_inos < igeo->ialloc_inos &&
-					ino_rec != NULL)  {
-				prev_ino_rec = ino_rec;
+			ino_rec = free_bogus_chunk(mp, agno, first_ino_rec,
+					&num_inos);
+			first_ino_rec = ino_rec;
+		}
+
+		if (split)
+			done += num_inos;
+		else
+			PROG_RPT_INC(prog_rpt_done[agno], num_inos);
+	}
+
+	if (split) {
+		pthread_mutex_lock(&split->lock);
+		PROG_RPT_INC(prog_rpt_done[agno], done);
+		pthread_mutex_unlock(&split->lock);
+	}
+}
 
-				if ((ino_rec = next_ino_rec(ino_rec)) != NULL)
-					num_inos += XFS_INODES_PER_CHUNK;
+static void
+do_aginode_range(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct aginode_range	*range = arg;
+	struct aginode_split	*split = range->split;
+
+	process_aginode_range(split->mp, split->pf_args, agno, range->first,
+			range->end, split->ino_discovery, split->check_dups,
+			split->extra_attr_check, split);
+	blkmap_free_final();
+	free(range);
+}
 
-				get_inode_rec(mp, agno, prev_ino_rec);
-				free_inode_rec(agno, prev_ino_rec);
+/*
+ * Cut the AG's inode chunks into ranges and process them with @nr_threads
+ * threads.  Returns false if the AG is too small to be worth splitting.
+ */
+static bool
+process_aginodes_split(
+	struct xfs_mount	*mp,
+	prefetch_args_t		*pf_args,
+	xfs_agnumber_t		agno,
+	int			ino_discovery,
+	int			check_dups,
+	int			extra_attr_check,
+	unsigned int		nr_threads)
+{
+	struct xfs_ino_geometry *igeo = M_IGEO(mp);
+	struct aginode_split	split = {
+		.mp			= mp,
+		.pf_args		= pf_args,
+		.ino_discovery		= ino_discovery,
+		.check_dups		= check_dups,
+		.extra_attr_check	= extra_attr_check,
+	};
+	struct aginode_range	*range = NULL;
+	struct workqueue	wq;
+	ino_tree_node_t		*ino_rec;
+	unsigned int		nr_chunks = 0;
+	size_t			i;
+	int			num_inos;
+
+	for (ino_rec = findfirst_inode_rec(agno);
+	     ino_rec != NULL && nr_chunks < 2 * XR_INO_RANGE_CHUNKS;
+	     ino_rec = next_ino_rec(ino_rec))
+		nr_chunks++;
+	if (nr_chunks < 2 * XR_INO_RANGE_CHUNKS)
+		return false;
+
+	pthread_mutex_init(&split.lock, NULL);
+	create_work_queue(&wq, mp, nr_threads);
+
+	/*
+	 * Start a new range every XR_INO_RANGE_CHUNKS inode allocations.  We
+	 * can only cut the list where an allocation starts.
+	 */
+	nr_chunks = 0;
+	num_inos = 0;
+	for (ino_rec = findfirst_inode_rec(agno); ino_rec != NULL;
+	     ino_rec = next_ino_rec(ino_rec)) {
+		if (num_inos == 0 && nr_chunks % XR_INO_RANGE_CHUNKS == 0) {
+			if (range) {
+				range->end = ino_rec;
+				queue_work(&wq, do_aginode_range, agno, range);
 			}
+			range = malloc(sizeof(struct aginode_range));
+			if (!range)
+				do_error(
+	_("could not allocate inode range for AG %u\n"), agno);
+			range->split = &split;
+			range->first = ino_rec;
+		}
 
-			first_ino_rec = ino_rec;
+		num_inos += XFS_INODES_PER_CHUNK;
+		if (num_inos >= igeo->ialloc_inos) {
+			num_inos = 0;
+			nr_chunks++;
 		}
-		PROG_RPT_INC(prog_rpt_done[agno], num_inos);
 	}
+	range->end = NULL;
+	queue_work(&wq, do_aginode_range, agno, range);
+	destroy_work_queue(&wq);
+
+	/* Now that nobody's walking the inode tree, free the bogus chunks. */
+	for (i = 0; i < split.nr_bogus; i++)
+		free_bogus_chunk(mp, agno, split.bogus[i], &num_inos);
+	free(split.bogus);
+	pthread_mutex_destroy(&split.lock);
+	return true;
+}
+
+/*
+ * check all inodes mentioned in the ag's incore inode maps.
+ * the map may be incomplete.  If so, we'll catch the missing
+ * inodes (hopefully) when we traverse the directory tree.
+ * check_dirs is set to 1 if directory inodes should be
+ * processed for internal consistency, parent setting and
+ * discovery of unknown inodes.  this only happens
+ * in phase 3.  check_dups is set to 1 if we're looking for
+ * inodes that reference duplicate blocks so we can trash
+ * the inode right then and there.  this is set only in
+ * phase 4 after we've run through and set the bitmap once.
+ */
+void
+process_aginodes(
+	xfs_mount_t		*mp,
+	prefetch_args_t		*pf_args,
+	xfs_agnumber_t		agno,
+	int 			ino_discovery,
+	int 			check_dups,
+	int 			extra_attr_check)
+{
+	unsigned int		nr_threads = ag_worker_threads();
+
+	if (nr_threads > 1 &&
+	    process_aginodes_split(mp, pf_args, agno, ino_discovery,
+			check_dups, extra_attr_check, nr_threads))
+		return;
+
+	process_aginode_range(mp, pf_args, agno, findfirst_inode_rec(agno),
+			NULL, ino_discovery, check_dups, extra_attr_check,
+			NULL);
 }
 
 /*
@@ -13,20 +13,150 @@
 #include "protos.h"
 #include "err_protos.h"
 #include "threads.h"
+#include "scratch.h"
 
 /*
- * The following manages the in-core bitmap of the entire filesystem
- * using extents in a btree.
+ * The following manages the in-core bitmap of the entire filesystem.
  *
- * The btree items will point to one of the state values below,
- * rather than storing the value itself in the pointer.
+ * Each AG starts out tracking its block states as extents in a btree, which
+ * is very compact for the mostly uniform AGs that make up most filesystems.
+ * The btree items will point to one of the state values below, rather than
+ * storing the value itself in the pointer.
+ *
+ * Badly fragmented AGs can end up with so many state changes that the btree
+ * is bigger and slower than a flat array of per-block states would be, so
+ * once the number of extents in an AG crosses bmap_dense_ratio blocks per
+ * extent, we convert that AG to a 4-bit-per-block array for the rest of the
+ * phase.  reset_bmaps() puts every AG back to the extent representation.
  */
 static int states[16] =
 	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
 
-static struct btree_root	**ag_bmap;
+/* block records fit into uint64_t's units */
+#define XR_BB_UNIT	64			/* number of bits/unit */
+#define XR_BB		4			/* bits per block record */
+#define XR_BB_NUM	(XR_BB_UNIT/XR_BB)	/* number of records per unit */
+#define XR_BB_MASK	0xF			/* block record mask */
+
+/*
+ * A btree node is about 150 bytes and holds a handful of extents, so the
+ * dense array (half a byte per block) wins once extents average fewer than
+ * this many blocks.  Zero keeps every AG in the btree; the block map
+ * benchmark uses that to compare the two.
+ */
+unsigned int			bmap_dense_ratio = 64;
+
+struct ag_bmap {
+	struct btree_root	*runs;		/* state extents */
+	uint64_t		*dense;		/* per-block states, or NULL */
+	xfs_agblock_t		size;		/* blocks in this AG */
+	unsigned long		nr_runs;	/* extents in @runs */
+};
+
+static struct ag_bmap		*ag_bmaps;
+
+static inline size_t
+dense_bmap_size(
+	xfs_agblock_t		size)
+{
+	return howmany(size, XR_BB_NUM) * sizeof(uint64_t);
+}
+
+static inline int
+dense_get(
+	uint64_t		*dense,
+	xfs_agblock_t		bno)
+{
+	return (dense[bno / XR_BB_NUM] >> ((bno % XR_BB_NUM) * XR_BB)) &
+			XR_BB_MASK;
+}
 
+/* Set the state of blocks [@start, @end) in a dense map. */
 static void
+dense_set(
+	uint64_t		*dense,
+	xfs_agblock_t		start,
+	xfs_agblock_t		end,
+	int			state)
+{
+	uint64_t		pattern = (uint64_t)state * 0x1111111111111111ULL;
+	uint64_t		*p;
+	unsigned int		shift;
+
+	while (start < end && (start % XR_BB_NUM)) {
+		p = &dense[start / XR_BB_NUM];
+		shift = (start % XR_BB_NUM) * XR_BB;
+		*p = (*p & ~((uint64_t)XR_BB_MASK << shift)) |
+		     ((uint64_t)state << shift);
+		start++;
+	}
+
+	for (; start + XR_BB_NUM <= end; start += XR_BB_NUM)
+		dense[start / XR_BB_NUM] = pattern;
+
+	for (; start < end; start++) {
+		p = &dense[start / XR_BB_NUM];
+		shift = (start % XR_BB_NUM) * XR_BB;
+		*p = (*p & ~((uint64_t)XR_BB_MASK << shift)) |
+		     ((uint64_t)state << shift);
+	}
+}
+
+/* Find the first block at or after @bno, but before @end, not in @state. */
+static xfs_agblock_t
+dense_run_end(
+	uint64_t		*dense,
+	xfs_agblock_t		bno,
+	xfs_agblock_t		end,
+	int			state)
+{
+	uint64_t		pattern = (uint64_t)state * 0x1111111111111111ULL;
+
+	while (bno < end && (bno % XR_BB_NUM)) {
+		if (dense_get(dense, bno) != state)
+			return bno;
+		bno++;
+	}
+
+	while (bno + XR_BB_NUM <= end && dense[bno / XR_BB_NUM] == pattern)
+		bno += XR_BB_NUM;
+
+	while (bno < end && dense_get(dense, bno) == state)
+		bno++;
+
+	return bno;
+}
+
+/* Replace the extent btree of a fragmented AG with a dense array. */
+static void
+convert_to_dense(
+	struct ag_bmap		*bm)
+{
+	unsigned long		key, next_key;
+	int			*state, *next_state;
+
+	bm->dense = scratch_alloc(dense_bmap_size(bm->size));
+	if (!bm->dense)
+		do_error(_("couldn't allocate dense block map\n"));
+
+	state = btree_find(bm->runs, 0, &key);
+	while (state) {
+		next_state = btree_lookup_next(bm->runs, &next_key);
+		if (!next_state)
+			break;
+		dense_set(bm->dense, key, next_key, *state);
+		key = next_key;
+		state = next_state;
+	}
+
+	btree_clear(bm->runs);
+	bm->nr_runs = 0;
+}
+
+/*
+ * Update the extent btree and return the change in the number of extents.
+ */
+static int
 update_bmap(
 	struct btree_root	*bmap,
 	unsigned long		offset,
@@ -42,12 +172,12 @@ update_bmap(
 
 	cur_state = btree_find(bmap, offset, &cur_key);
 	if (!cur_state)
-		return;
+		return 0;
 
 	if (offset == cur_key) {
 		/* if the start is the same as the "item" extent */
 		if (cur_state == new_state)
-			return;
+			return 0;
 
 		/*
 		 * Note: this may be NULL if we are updating the map for
@@ -61,13 +191,13 @@ update_bmap(
 			if (new_state == prev_state) {
 				/* #1: prev has same state, move offset up */
 				btree_update_key(bmap, offset, end);
-				return;
+				return 0;
 			}
 
 			/* #4: insert new extent after, update current value */
 			btree_update_value(bmap, offset, new_state);
 			btree_insert(bmap, end, cur_state);
-			return;
+			return 1;
 		}
 
 		/* same end (and same start) */
@@ -77,49 +207,50 @@ update_bmap(
 				/* #3: merge prev & next */
 				btree_delete(bmap, offset);
 				btree_delete(bmap, end);
-				return;
+				return -2;
 			}
 
 			/* #8: merge next */
 			btree_update_value(bmap, offset, new_state);
 			btree_delete(bmap, end);
-			return;
+			return -1;
 		}
 
 		/* same start, same end, next has different state */
 		if (new_state == prev_state) {
 			/* #5: prev has same state */
 			btree_delete(bmap, offset);
-			return;
+			return -1;
 		}
 
 		/* #6: update value only */
 		btree_update_value(bmap, offset, new_state);
-		return;
+		return 0;
 	}
 
 	/* different start, offset is in the middle of "cur" */
 	prev_state = btree_peek_prev(bmap, NULL);
 	ASSERT(prev_state != NULL);
 	if (prev_state == new_state)
-		return;
+		return 0;
 
 	if (end == cur_key) {
 		/* end is at the same point as the current extent */
 		if (new_state == cur_state) {
 			/* #7: move next extent down */
 			btree_update_key(bmap, end, offset);
-			return;
+			return 0;
 		}
 
 		/* #9: different start, same end, add new extent */
 		btree_insert(bmap, offset, new_state);
-		return;
+		return 1;
 	}
 
 	/* #2: insert an extent into the middle of another extent */
 	btree_insert(bmap, offset, new_state);
 	btree_insert(bmap, end, prev_state);
+	return 2;
 }
 
 void
@@ -129,7 +260,18 @@ set_bmap_ext(
 	xfs_extlen_t		blen,
 	int			state)
 {
-	update_bmap(ag_bmap[agno], agbno, blen, &states[state]);
+	struct ag_bmap		*bm = &ag_bmaps[agno];
+
+	if (bm->dense) {
+		if (agbno < bm->size)
+			dense_set(bm->dense, agbno,
+					min(agbno + blen, bm->size), state);
+		return;
+	}
+
+	bm->nr_runs += update_bmap(bm->runs, agbno, blen, &states[state]);
+	if (bmap_dense_ratio && bm->nr_runs > bm->size / bmap_dense_ratio)
+		convert_to_dense(bm);
 }
 
 int
@@ -139,23 +281,39 @@ get_bmap_ext(
 	xfs_agblock_t		maxbno,
 	xfs_extlen_t		*blen)
 {
+	struct ag_bmap		*bm = &ag_bmaps[agno];
 	int			*statep;
 	unsigned long		key;
+	int			state;
+
+	if (bm->dense) {
+		/* Everything past the end of the AG is one bad extent. */
+		if (agbno >= bm->size) {
+			if (agbno > bm->size || blen)
+				return -1;
+			return XR_E_BAD_STATE;
+		}
+		state = dense_get(bm->dense, agbno);
+		if (blen)
+			*blen = dense_run_end(bm->dense, agbno,
+					min(maxbno, bm->size), state) - agbno;
+		return state;
+	}
 
-	statep = btree_find(ag_bmap[agno], agbno, &key);
+	statep = btree_find(bm->runs, agbno, &key);
 	if (!statep)
 		return -1;
 
 	if (key == agbno) {
 		if (blen) {
-			if (!btree_peek_next(ag_bmap[agno], &key))
+			if (!btree_peek_next(bm->runs, &key))
 				return -1;
 			*blen = min(maxbno, key) - agbno;
 		}
 		return *statep;
 	}
 
-	statep = btree_peek_prev(ag_bmap[agno], NULL);
+	statep = btree_peek_prev(bm->runs, NULL);
 	if (!statep)
 		return -1;
 	if (blen)
@@ -167,12 +325,6 @@ get_bmap_ext(
 static uint64_t		*rt_bmap;
 static size_t		rt_bmap_size;
 
-/* block records fit into uint64_t's units */
-#define XR_BB_UNIT	64			/* number of bits/unit */
-#define XR_BB		4			/* bits per block record */
-#define XR_BB_NUM	(XR_BB_UNIT/XR_BB)	/* number of records per unit */
-#define XR_BB_MASK	0xF			/* block record mask */
-
 /*
  * these work in real-time extents (e.g. fsbno == rt extent number)
  */
@@ -244,11 +396,19 @@ reset_bmaps(xfs_mount_t *mp)
 			ag_size = (xfs_extlen_t)(mp->m_sb.sb_dblocks -
 				   (xfs_rfsblock_t)mp->m_sb.sb_agblocks * agno);
 #ifdef BTREE_STATS
-		if (btree_find(ag_bmap[agno], 0, NULL)) {
+		if (btree_find(ag_bmaps[agno].runs, 0, NULL)) {
 			printf("ag_bmap[%d] btree stats:\n", i);
-			btree_print_stats(ag_bmap[agno], stdout);
+			btree_print_stats(ag_bmaps[agno].runs, stdout);
 		}
 #endif
+		if (ag_bmaps[agno].dense) {
+			scratch_free(ag_bmaps[agno].dense,
+					dense_bmap_size(ag_bmaps[agno].size));
+			ag_bmaps[agno].dense = NULL;
+		}
+		ag_bmaps[agno].size = ag_size;
+		ag_bmaps[agno].nr_runs = 3;
+
 		/*
 		 * We always insert an item for the first block having a
 		 * given state.  So the code below means:
@@ -257,11 +417,12 @@ reset_bmaps(xfs_mount_t *mp)
 		 *	ag_hdr_block..ag_size:		XR_E_UNKNOWN
 		 *	ag_size...			XR_E_BAD_STATE
 		 */
-		btree_clear(ag_bmap[agno]);
-		btree_insert(ag_bmap[agno], 0, &states[XR_E_INUSE_FS]);
-		btree_insert(ag_bmap[agno],
+		btree_clear(ag_bmaps[agno].runs);
+		btree_insert(ag_bmaps[agno].runs, 0, &states[XR_E_INUSE_FS]);
+		btree_insert(ag_bmaps[agno].runs,
 				ag_hdr_block, &states[XR_E_UNKNOWN]);
-		btree_insert(ag_bmap[agno], ag_size, &states[XR_E_BAD_STATE]);
+		btree_insert(ag_bmaps[agno].runs, ag_size,
+				&states[XR_E_BAD_STATE]);
 	}
 
 	if (mp->m_sb.sb_logstart != 0) {
@@ -278,8 +439,8 @@ init_bmaps(xfs_mount_t *mp)
 {
 	xfs_agnumber_t i;
 
-	ag_bmap = calloc(mp->m_sb.sb_agcount, sizeof(struct btree_root *));
-	if (!ag_bmap)
+	ag_bmaps = calloc(mp->m_sb.sb_agcount, sizeof(struct ag_bmap));
+	if (!ag_bmaps)
 		do_error(_("couldn't allocate block map btree roots\n"));
 
 	ag_locks = calloc(mp->m_sb.sb_agcount, sizeof(struct aglock));
@@ -287,7 +448,7 @@ init_bmaps(xfs_mount_t *mp)
 		do_error(_("couldn't allocate block map locks\n"));
 
 	for (i = 0; i < mp->m_sb.sb_agcount; i++)  {
-		btree_init(&ag_bmap[i]);
+		btree_init(&ag_bmaps[i].runs);
 		pthread_mutex_init(&ag_locks[i].lock, NULL);
 	}
 	pthread_mutex_init(&rt_lock.lock, NULL);
@@ -301,10 +462,14 @@ free_bmaps(xfs_mount_t *mp)
 {
 	xfs_agnumber_t i;
 
-	for (i = 0; i < mp->m_sb.sb_agcount; i++)
-		btree_destroy(ag_bmap[i]);
-	free(ag_bmap);
-	ag_bmap = NULL;
+	for (i = 0; i < mp->m_sb.sb_agcount; i++) {
+		btree_destroy(ag_bmaps[i].runs);
+		if (ag_bmaps[i].dense)
+			scratch_free(ag_bmaps[i].dense,
+					dense_bmap_size(ag_bmaps[i].size));
+	}
+	free(ag_bmaps);
+	ag_bmaps = NULL;
 
 	free_rt_bmap(mp);
 }
@@ -19,6 +19,8 @@
  * block map -- track state of each filesystem block.
  */
 
+extern unsigned int	bmap_dense_ratio;
+
 void		init_bmaps(xfs_mount_t *mp);
 void		reset_bmaps(xfs_mount_t *mp);
 void		free_bmaps(xfs_mount_t *mp);
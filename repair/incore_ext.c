@@ -14,6 +14,7 @@
 #include "err_protos.h"
 #include "libfrog/avl64.h"
 #include "threads.h"
+#include "scratch.h"
 
 /*
  * note:  there are 4 sets of incore things handled here:
@@ -118,7 +119,7 @@ mk_extent_tree_nodes(xfs_agblock_t new_startblock,
 {
 	extent_tree_node_t *new;
 
-	new = malloc(sizeof(*new));
+	new = scratch_alloc(sizeof(*new));
 	if (!new)
 		do_error(_("couldn't allocate new extent descriptor.\n"));
 
@@ -135,7 +136,7 @@ mk_extent_tree_nodes(xfs_agblock_t new_startblock,
 void
 release_extent_tree_node(extent_tree_node_t *node)
 {
-	free(node);
+	scratch_free(node, sizeof(*node));
 }
 
 /*
@@ -12,6 +12,7 @@
 #include "protos.h"
 #include "threads.h"
 #include "err_protos.h"
+#include "scratch.h"
 
 /*
  * array of inode tree ptrs, one per ag
@@ -30,12 +31,18 @@ alloc_nlink_array(uint8_t nlink_size)
 {
 	void *ptr;
 
-	ptr = calloc(XFS_INODES_PER_CHUNK, nlink_size);
+	ptr = scratch_zalloc(XFS_INODES_PER_CHUNK * nlink_size);
 	if (!ptr)
 		do_error(_("could not allocate nlink array\n"));
 	return ptr;
 }
 
+static void
+free_nlink_buf(void *ptr, uint8_t nlink_size)
+{
+	scratch_free(ptr, XFS_INODES_PER_CHUNK * nlink_size);
+}
+
 static void
 nlink_grow_8_to_16(ino_tree_node_t *irec)
 {
@@ -47,7 +54,7 @@ nlink_grow_8_to_16(ino_tree_node_t *irec)
 	new_nlinks = alloc_nlink_array(irec->nlink_size);
 	for (i = 0; i < XFS_INODES_PER_CHUNK; i++)
 		new_nlinks[i] = irec->disk_nlinks.un8[i];
-	free(irec->disk_nlinks.un8);
+	free_nlink_buf(irec->disk_nlinks.un8, sizeof(uint8_t));
 	irec->disk_nlinks.un16 = new_nlinks;
 
 	if (full_ino_ex_data) {
@@ -56,7 +63,8 @@ nlink_grow_8_to_16(ino_tree_node_t *irec)
 			new_nlinks[i] =
 				irec->ino_un.ex_data->counted_nlinks.un8[i];
 		}
-		free(irec->ino_un.ex_data->counted_nlinks.un8);
+		free_nlink_buf(irec->ino_un.ex_data->counted_nlinks.un8,
+				sizeof(uint8_t));
 		irec->ino_un.ex_data->counted_nlinks.un16 = new_nlinks;
 	}
 }
@@ -72,7 +80,7 @@ nlink_grow_16_to_32(ino_tree_node_t *irec)
 	new_nlinks = alloc_nlink_array(irec->nlink_size);
 	for (i = 0; i < XFS_INODES_PER_CHUNK; i++)
 		new_nlinks[i] = irec->disk_nlinks.un16[i];
-	free(irec->disk_nlinks.un16);
+	free_nlink_buf(irec->disk_nlinks.un16, sizeof(uint16_t));
 	irec->disk_nlinks.un32 = new_nlinks;
 
 	if (full_ino_ex_data) {
@@ -82,7 +90,8 @@ nlink_grow_16_to_32(ino_tree_node_t *irec)
 			new_nlinks[i] =
 				irec->ino_un.ex_data->counted_nlinks.un16[i];
 		}
-		free(irec->ino_un.ex_data->counted_nlinks.un16);
+		free_nlink_buf(irec->ino_un.ex_data->counted_nlinks.un16,
+				sizeof(uint16_t));
 		irec->ino_un.ex_data->counted_nlinks.un32 = new_nlinks;
 	}
 }
@@ -214,7 +223,7 @@ alloc_ftypes_array(
 	if (!xfs_has_ftype(mp))
 		return NULL;
 
-	ptr = calloc(XFS_INODES_PER_CHUNK, sizeof(*ptr));
+	ptr = scratch_zalloc(XFS_INODES_PER_CHUNK * sizeof(*ptr));
 	if (!ptr)
 		do_error(_("could not allocate ftypes array\n"));
 	return ptr;
@@ -240,7 +249,7 @@ alloc_ino_node(
 {
 	struct ino_tree_node 	*irec;
 
-	irec = malloc(sizeof(*irec));
+	irec = scratch_alloc(sizeof(*irec));
 	if (!irec)
 		do_error(_("inode map malloc failed\n"));
 
@@ -268,13 +277,13 @@ free_nlink_array(union ino_nlink nlinks, uint8_t nlink_size)
 {
 	switch (nlink_size) {
 	case sizeof(uint8_t):
-		free(nlinks.un8);
+		free_nlink_buf(nlinks.un8, nlink_size);
 		break;
 	case sizeof(uint16_t):
-		free(nlinks.un16);
+		free_nlink_buf(nlinks.un16, nlink_size);
 		break;
 	case sizeof(uint32_t):
-		free(nlinks.un32);
+		free_nlink_buf(nlinks.un32, nlink_size);
 		break;
 	default:
 		ASSERT(0);
@@ -296,13 +305,15 @@ free_ino_tree_node(
 			free_nlink_array(irec->ino_un.ex_data->counted_nlinks,
 					 irec->nlink_size);
 		}
-		free(irec->ino_un.ex_data);
+		scratch_free(irec->ino_un.ex_data, sizeof(ino_ex_data_t));
 
 	}
 
-	free(irec->ftypes);
+	if (irec->ftypes)
+		scratch_free(irec->ftypes,
+				XFS_INODES_PER_CHUNK * sizeof(*irec->ftypes));
 	pthread_mutex_destroy(&irec->lock);
-	free(irec);
+	scratch_free(irec, sizeof(*irec));
 }
 
 /*
@@ -310,6 +321,12 @@ free_ino_tree_node(
  */
 static ino_tree_node_t **last_rec;
 
+/*
+ * Directories in any AG can add uncertain inodes to any other AG's tree
+ * while the AGs are being processed in parallel.
+ */
+static pthread_mutex_t	uncertain_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  * ok, the uncertain inodes are a set of trees just like the
  * good inodes but all starting inode records are (arbitrarily)
@@ -335,6 +352,8 @@ add_aginode_uncertain(
 
 	s_ino = rounddown(ino, XFS_INODES_PER_CHUNK);
 
+	pthread_mutex_lock(&uncertain_lock);
+
 	/*
 	 * check for a cache hit
 	 */
@@ -345,6 +364,7 @@ add_aginode_uncertain(
 		else
 			set_inode_used(last_rec[agno], offset);
 
+		pthread_mutex_unlock(&uncertain_lock);
 		return;
 	}
 
@@ -372,6 +392,7 @@ add_aginode_uncertain(
 	 * set cache entry
 	 */
 	last_rec[agno] = ino_rec;
+	pthread_mutex_unlock(&uncertain_lock);
 }
 
 /*
@@ -736,7 +757,7 @@ alloc_ex_data(ino_tree_node_t *irec)
 	parent_list_t 	*ptbl;
 
 	ptbl = irec->ino_un.plist;
-	irec->ino_un.ex_data  = (ino_ex_data_t *)calloc(1, sizeof(ino_ex_data_t));
+	irec->ino_un.ex_data = scratch_zalloc(sizeof(ino_ex_data_t));
 	if (irec->ino_un.ex_data == NULL)
 		do_error(_("could not malloc inode extra data\n"));
 
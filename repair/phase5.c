@@ -377,11 +377,6 @@ build_agf_agfl(
 	libxfs_buf_mark_dirty(agf_buf);
 	libxfs_buf_relse(agf_buf);
 
-	/*
-	 * now fix up the free list appropriately
-	 */
-	fix_freelist(mp, agno, true);
-
 #ifdef XR_BLD_FREE_TRACE
 	fprintf(stderr, "wrote agf for ag %u\n", agno);
 #endif
@@ -579,6 +574,71 @@ _("unable to rebuild AG %u.  Not enough free space in on-disk AG.\n"),
 	PROG_RPT_INC(prog_rpt_done[agno], 1);
 }
 
+static void
+phase5_worker(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct xfs_mount	*mp = wq->wq_ctx;
+	struct xfs_perag	*pag = libxfs_perag_get(mp, agno);
+
+	phase5_func(mp, pag, arg);
+	libxfs_perag_put(pag);
+}
+
+/*
+ * Rebuild the AG btrees.  Each AG only touches its own incore free space
+ * trees, rmap slabs and summary counter slots, and the lost blocks bitmap
+ * does its own locking, so we can rebuild as many AGs at once as we have
+ * threads.  Like the other phases, this only goes parallel when the user
+ * asked for it with -o ag_stride.
+ *
+ * AGs with more inodes than average (as counted in phase 2) are queued at
+ * high priority so that they start first and don't end up running alone at
+ * the end.
+ */
+static void
+rebuild_ags(
+	struct xfs_mount	*mp,
+	struct bitmap		*lost_blocks)
+{
+	struct workqueue	wq;
+	struct xfs_perag	*pag;
+	xfs_agnumber_t		agno;
+	uint64_t		icount = 0;
+	unsigned int		nr_threads;
+	unsigned int		prio;
+
+	nr_threads = min(thread_count, mp->m_sb.sb_agcount);
+
+	if (nr_threads <= 1) {
+		for_each_perag(mp, agno, pag)
+			phase5_func(mp, pag, lost_blocks);
+		goto fix_freelists;
+	}
+
+	for_each_perag(mp, agno, pag)
+		icount += pag->pagi_count;
+
+	create_work_queue(&wq, mp, nr_threads);
+	for_each_perag(mp, agno, pag) {
+		prio = (uint64_t)pag->pagi_count * mp->m_sb.sb_agcount > icount ?
+				WORKQUEUE_PRIO_HIGH : WORKQUEUE_PRIO_NORMAL;
+		queue_work_prio(&wq, phase5_worker, agno, lost_blocks, prio);
+	}
+	destroy_work_queue_stats(&wq, _("AG rebuild"));
+
+fix_freelists:
+	/*
+	 * Now fix up the free lists.  This allocates and commits
+	 * transactions, which update the incore superblock counters without
+	 * any locking, so do it one AG at a time after the rebuild.
+	 */
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
+		fix_freelist(mp, agno, true);
+}
+
 /* Inject this unused space back into the filesystem. */
 static int
 inject_lost_extent(
@@ -606,7 +666,6 @@ void
 phase5(xfs_mount_t *mp)
 {
 	struct bitmap		*lost_blocks = NULL;
-	struct xfs_perag	*pag;
 	xfs_agnumber_t		agno;
 	int			error;
 
@@ -653,8 +712,7 @@ phase5(xfs_mount_t *mp)
 	if (error)
 		do_error(_("cannot alloc lost block bitmap\n"));
 
-	for_each_perag(mp, agno, pag)
-		phase5_func(mp, pag, lost_blocks);
+	rebuild_ags(mp, lost_blocks);
 
 	print_final_rpt();
 
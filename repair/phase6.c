@@ -3141,12 +3141,10 @@ traverse_function(
 		do_log(_("        - agno = %d\n"), agno);
 
 	/*
-	 * The more AGs we have in flight at once, the fewer processing threads
-	 * per AG. This means we don't overwhelm the machine with hundreds of
-	 * threads when we start acting on lots of AGs at once. We just want
-	 * enough that we can keep multiple CPUs busy across multiple AGs.
+	 * Spread the directories in this AG over enough threads to keep the
+	 * CPUs busy, given how many other AGs are in flight.
 	 */
-	workqueue_create_bound(&lwq, mp, ag_stride, 1000);
+	workqueue_create_bound(&lwq, mp, ag_worker_threads(), 1000);
 
 	for (irec = findfirst_inode_rec(agno); irec; irec = next_ino_rec(irec)) {
 		if (irec->ino_isa_dir == 0)
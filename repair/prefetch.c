@@ -2,6 +2,7 @@
 
 #include "libxfs.h"
 #include <pthread.h>
+#include <sys/uio.h>
 #include "avl.h"
 #include "btree.h"
 #include "globals.h"
@@ -18,6 +19,7 @@
 #include "progress.h"
 
 int do_prefetch = 1;
+int pf_max_gap = -1;
 
 /*
  * Performs prefetching by priming the libxfs cache by using a dedicate thread
@@ -35,6 +37,8 @@ static int		pf_batch_bytes;
 static int		pf_batch_fsbs;
 
 static void		pf_read_inode_dirs(prefetch_args_t *, struct xfs_buf *);
+static void		pf_queue_io(prefetch_args_t *, struct xfs_buf_map *,
+				    int, int);
 
 /*
  * Buffer priorities for the libxfs cache
@@ -78,6 +82,235 @@ typedef enum pf_which {
 	PF_META_ONLY
 } pf_which_t;
 
+/*
+ * Readahead plans
+ *
+ * Phases 3, 4 and 6 all prefetch the same inode clusters, and each time they
+ * parse every cluster, walk the bmap btrees with synchronous reads and queue
+ * the directory blocks they find.  Phase 3 records the metadata it discovers
+ * for each inode cluster in a per-AG plan, which is then sorted by inode and
+ * disk address.  Phases 4 and 6 replay the plan as they walk the inode
+ * records, so they can queue all of the metadata for a chunk at once instead
+ * of rediscovering it a cluster at a time.  Directory free index blocks are
+ * only read by phase 6, so phase 3 records them without queueing them.
+ *
+ * If phase 3 can't look at every inode cluster in an AG, the plan for that
+ * AG is thrown away and the later phases fall back to discovering the
+ * metadata themselves.
+ */
+enum pf_plan_state {
+	PF_PLAN_EMPTY = 0,
+	PF_PLAN_RECORDING,
+	PF_PLAN_READY,
+};
+
+struct pf_plan_ent {
+	xfs_agino_t		owner;		/* first inode of the cluster */
+	uint8_t			flag;		/* cache priority */
+	uint8_t			dirs_only;	/* only read by phase 6 */
+	uint16_t		nmaps;
+	union {
+		struct xfs_buf_map	map;	/* nmaps == 1 */
+		struct xfs_buf_map	*maps;	/* nmaps > 1 */
+	};
+};
+
+struct pf_plan {
+	enum pf_plan_state	state;
+	bool			broken;
+	unsigned int		nr;
+	unsigned int		max;
+	struct pf_plan_ent	*ents;
+};
+
+static struct pf_plan	*pf_plans;
+
+/* inode cluster that this thread is finding metadata for */
+static __thread xfs_agino_t	pf_plan_owner;
+
+static inline bool
+pf_plan_recording(
+	prefetch_args_t		*args)
+{
+	return args->plan && args->plan->state == PF_PLAN_RECORDING;
+}
+
+static inline bool
+pf_plan_replaying(
+	prefetch_args_t		*args)
+{
+	return args->plan && args->plan->state == PF_PLAN_READY;
+}
+
+static void
+pf_plan_free(
+	struct pf_plan		*plan)
+{
+	unsigned int		i;
+
+	for (i = 0; i < plan->nr; i++)
+		if (plan->ents[i].nmaps > 1)
+			free(plan->ents[i].maps);
+	free(plan->ents);
+	memset(plan, 0, sizeof(*plan));
+}
+
+static void
+pf_plan_break(
+	prefetch_args_t		*args)
+{
+	pthread_mutex_lock(&args->lock);
+	args->plan->broken = true;
+	pthread_mutex_unlock(&args->lock);
+}
+
+static void
+pf_plan_add(
+	prefetch_args_t		*args,
+	struct xfs_buf_map	*map,
+	int			nmaps,
+	int			flag,
+	bool			dirs_only)
+{
+	struct pf_plan		*plan = args->plan;
+	struct pf_plan_ent	*ent;
+
+	pthread_mutex_lock(&args->lock);
+	if (plan->broken)
+		goto out_unlock;
+
+	if (plan->nr == plan->max) {
+		unsigned int	max = plan->max ? plan->max * 2 : 256;
+
+		ent = realloc(plan->ents, max * sizeof(*ent));
+		if (!ent) {
+			plan->broken = true;
+			goto out_unlock;
+		}
+		plan->ents = ent;
+		plan->max = max;
+	}
+
+	ent = &plan->ents[plan->nr];
+	ent->owner = pf_plan_owner;
+	ent->flag = flag;
+	ent->dirs_only = dirs_only;
+	ent->nmaps = nmaps;
+	if (nmaps == 1) {
+		ent->map = map[0];
+	} else {
+		ent->maps = malloc(nmaps * sizeof(*map));
+		if (!ent->maps) {
+			plan->broken = true;
+			goto out_unlock;
+		}
+		memcpy(ent->maps, map, nmaps * sizeof(*map));
+	}
+	plan->nr++;
+out_unlock:
+	pthread_mutex_unlock(&args->lock);
+}
+
+static inline xfs_daddr_t
+pf_plan_ent_daddr(
+	const struct pf_plan_ent *ent)
+{
+	return ent->nmaps == 1 ? ent->map.bm_bn : ent->maps[0].bm_bn;
+}
+
+static int
+pf_plan_ent_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct pf_plan_ent *pa = a;
+	const struct pf_plan_ent *pb = b;
+	xfs_daddr_t		da, db;
+
+	if (pa->owner != pb->owner)
+		return pa->owner < pb->owner ? -1 : 1;
+	da = pf_plan_ent_daddr(pa);
+	db = pf_plan_ent_daddr(pb);
+	if (da != db)
+		return da < db ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Pick the plan for an AG when its prefetch starts.  A finished plan is
+ * replayed; otherwise phases 3 and 4 record a new one and phase 6 does
+ * without.
+ */
+static struct pf_plan *
+pf_plan_start(
+	xfs_agnumber_t		agno,
+	int			dirs_only)
+{
+	struct pf_plan		*plan;
+
+	if (!pf_plans)
+		return NULL;
+
+	plan = &pf_plans[agno];
+	if (plan->state == PF_PLAN_READY)
+		return plan;
+
+	pf_plan_free(plan);
+	if (dirs_only)
+		return NULL;
+	plan->state = PF_PLAN_RECORDING;
+	return plan;
+}
+
+/* Called once all of the prefetch I/O for an AG has been done. */
+static void
+pf_plan_finish(
+	prefetch_args_t		*args)
+{
+	struct pf_plan		*plan = args->plan;
+
+	if (pf_plan_recording(args)) {
+		if (plan->broken) {
+			pf_plan_free(plan);
+			return;
+		}
+		qsort(plan->ents, plan->nr, sizeof(*plan->ents),
+				pf_plan_ent_cmp);
+		plan->state = PF_PLAN_READY;
+	} else if (pf_plan_replaying(args) && args->dirs_only) {
+		/* phase 6 is the last user of the plan */
+		pf_plan_free(plan);
+	}
+}
+
+/*
+ * Queue the planned metadata for the inode chunks in [first, last), starting
+ * from plan entry @i.  Returns the first entry past the chunks.
+ */
+static unsigned int
+pf_plan_replay(
+	prefetch_args_t		*args,
+	unsigned int		i,
+	xfs_agino_t		first,
+	xfs_agino_t		last)
+{
+	struct pf_plan		*plan = args->plan;
+	struct pf_plan_ent	*ent;
+
+	for (; i < plan->nr; i++) {
+		ent = &plan->ents[i];
+		if (ent->owner >= last)
+			break;
+		if (ent->owner < first)
+			continue;
+		if (args->dirs_only ? ent->flag == B_BMAP : ent->dirs_only)
+			continue;
+		pf_queue_io(args, ent->nmaps == 1 ? &ent->map : ent->maps,
+				ent->nmaps, ent->flag);
+	}
+	return i;
+}
+
 
 static inline void
 pf_start_processing(
@@ -115,6 +348,9 @@ pf_queue_io(
 	xfs_fsblock_t		fsbno = XFS_DADDR_TO_FSB(mp, map[0].bm_bn);
 	int			error;
 
+	if (!B_IS_INODE(flag) && pf_plan_recording(args))
+		pf_plan_add(args, map, nmaps, flag, false);
+
 	/*
 	 * Never block on a buffer lock here, given that the actual repair
 	 * code might lock buffers in a different order from us.  Given that
@@ -123,8 +359,12 @@ pf_queue_io(
 	 */
 	error = -libxfs_buf_get_map(mp->m_dev, map, nmaps,
 			LIBXFS_GETBUF_TRYLOCK, &bp);
-	if (error)
+	if (error) {
+		/* we won't see what's in this cluster, so the plan is no good */
+		if (B_IS_INODE(flag) && pf_plan_recording(args))
+			pf_plan_break(args);
 		return;
+	}
 
 	if (bp->b_flags & LIBXFS_B_UPTODATE) {
 		if (B_IS_INODE(flag))
@@ -178,7 +418,7 @@ pf_read_bmbt_reclist(
 	int			nmaps = 0;
 	unsigned int		len = 0;
 	int			ret = 0;
-
+	bool			free_index = false;
 
 	for (i = 0; i < numrecs; i++) {
 		libxfs_bmbt_disk_get_all(rp + i, &irec);
@@ -194,8 +434,12 @@ pf_read_bmbt_reclist(
 			goto out_free;
 
 		if (!args->dirs_only && ((irec.br_startoff +
-				irec.br_blockcount) >= mp->m_dir_geo->freeblk))
-			break;	/* only Phase 6 reads the free blocks */
+				irec.br_blockcount) >= mp->m_dir_geo->freeblk)) {
+			/* only Phase 6 reads the free blocks */
+			if (!pf_plan_recording(args))
+				break;
+			free_index = true;
+		}
 
 		op = irec.br_startoff;
 		cp = irec.br_blockcount;
@@ -217,7 +461,12 @@ pf_read_bmbt_reclist(
 			nmaps++;
 
 			if (len == mp->m_dir_geo->fsbcount) {
-				pf_queue_io(args, map, nmaps, B_DIR_META);
+				if (free_index)
+					pf_plan_add(args, map, nmaps,
+							B_DIR_META, true);
+				else
+					pf_queue_io(args, map, nmaps,
+							B_DIR_META);
 				len = 0;
 				nmaps = 0;
 			}
@@ -275,6 +524,14 @@ pf_scan_lbtree(
 	int			rc;
 	int			error;
 
+	if (pf_plan_recording(args)) {
+		DEFINE_SINGLE_BUF_MAP(map, XFS_FSB_TO_DADDR(mp, dbno),
+				XFS_FSB_TO_BB(mp, 1));
+
+		pf_plan_add(args, &map, 1, isadir ? B_DIR_BMAP : B_BMAP,
+				false);
+	}
+
 	error = -libxfs_buf_read(mp->m_dev, XFS_FSB_TO_DADDR(mp, dbno),
 			XFS_FSB_TO_BB(mp, 1), LIBXFS_READBUF_SALVAGE, &bp,
 			&xfs_bmbt_buf_ops);
@@ -407,10 +664,18 @@ pf_read_inode_dirs(
 	int			isadir;
 	int			error;
 
+	/* the plan already queued everything we would find here */
+	if (pf_plan_replaying(args))
+		return;
+
 	error = -libxfs_readbuf_verify(bp, &xfs_inode_buf_ops);
 	if (error)
 		return;
 
+	pf_plan_owner = XFS_OFFBNO_TO_AGINO(mp,
+			XFS_FSB_TO_AGBNO(mp, XFS_DADDR_TO_FSB(mp,
+					xfs_buf_daddr(bp))), 0);
+
 	for (icnt = 0;
 	     icnt < (BBTOB(bp->b_length) >> mp->m_sb.sb_inodelog);
 	     icnt++) {
@@ -464,6 +729,47 @@ pf_read_inode_dirs(
 		libxfs_buf_set_priority(bp, B_DIR_INODE);
 }
 
+/*
+ * Read a batch of buffers sorted by disk address with a single preadv that
+ * points straight at each buffer's memory, so that the data doesn't have to
+ * be copied out of a bounce buffer afterwards.  Holes between the buffers
+ * are read into @scratch, which is pf_max_bytes long and so can take any
+ * hole in a batch; the data there is thrown away.
+ *
+ * Returns the number of bytes read from @first_off, or -EINVAL if the
+ * buffers overlap and the caller has to fall back to a bounce buffer.
+ */
+static ssize_t
+pf_readv_bufs(
+	struct xfs_buf		**bplist,
+	unsigned int		num,
+	off64_t			first_off,
+	void			*scratch)
+{
+	struct iovec		iov[MAX_BUFS * 2];
+	off64_t			pos = first_off;
+	off64_t			off;
+	unsigned int		nr = 0;
+	unsigned int		i;
+
+	for (i = 0; i < num; i++) {
+		off = LIBXFS_BBTOOFF64(xfs_buf_daddr(bplist[i]));
+		if (off < pos)
+			return -EINVAL;
+		if (off > pos) {
+			iov[nr].iov_base = scratch;
+			iov[nr].iov_len = off - pos;
+			nr++;
+		}
+		iov[nr].iov_base = bplist[i]->b_addr;
+		iov[nr].iov_len = BBTOB(bplist[i]->b_length);
+		pos = off + iov[nr].iov_len;
+		nr++;
+	}
+
+	return preadv(mp_fd, iov, nr, first_off);
+}
+
 /*
  * pf_batch_read must be called with the lock locked.
  */
@@ -476,12 +782,14 @@ pf_batch_read(
 	struct xfs_buf		*bplist[MAX_BUFS];
 	unsigned int		num;
 	off64_t			first_off, last_off, next_off;
-	int			len, size;
+	ssize_t			len;
+	int			size;
 	int			i;
 	int			inode_bufs;
 	unsigned long		fsbno = 0;
 	unsigned long		max_fsbno;
-	char			*pbuf;
+	off64_t			off;
+	bool			copy;
 
 	for (;;) {
 		num = 0;
@@ -572,11 +880,6 @@ pf_batch_read(
 #endif
 		pthread_mutex_unlock(&args->lock);
 
-		/*
-		 * now read the data and put into the xfs_but_t's
-		 */
-		len = pread(mp_fd, buf, (int)(last_off - first_off), first_off);
-
 		/*
 		 * Check the last buffer on the list to see if we need to
 		 * process a discontiguous buffer. The gather above loop
@@ -588,23 +891,43 @@ pf_batch_read(
 			bplist[num - 1]->b_flags |= LIBXFS_B_UNCHECKED;
 			libxfs_buf_relse(bplist[num - 1]);
 			num--;
+			last_off = num ? LIBXFS_BBTOOFF64(
+					xfs_buf_daddr(bplist[num - 1])) +
+					BBTOB(bplist[num - 1]->b_length) : 0;
 		}
 
+		/*
+		 * now read the data straight into the xfs_buf's, or through
+		 * the bounce buffer if they can't be mapped by an iovec
+		 */
+		len = 0;
+		copy = false;
+		if (num) {
+			len = pf_readv_bufs(bplist, num, first_off, buf);
+			if (len == -EINVAL) {
+				len = pread(mp_fd, buf, (int)(last_off - first_off),
+						first_off);
+				copy = true;
+			}
+		}
+
+		i = 0;
 		if (len > 0) {
 			/*
-			 * go through the struct xfs_buf list copying from the
-			 * read buffer into the struct xfs_buf's and release them.
+			 * go through the struct xfs_buf list marking the ones
+			 * that were completely read as up to date.
 			 */
-			for (i = 0; i < num; i++) {
-
-				pbuf = ((char *)buf) + (LIBXFS_BBTOOFF64(xfs_buf_daddr(bplist[i])) - first_off);
+			for (; i < num; i++) {
+				off = LIBXFS_BBTOOFF64(xfs_buf_daddr(bplist[i])) -
+						first_off;
 				size = BBTOB(bplist[i]->b_length);
-				if (len < size)
+				if (off + size > len)
 					break;
-				memcpy(bplist[i]->b_addr, pbuf, size);
+				if (copy)
+					memcpy(bplist[i]->b_addr,
+							(char *)buf + off, size);
 				bplist[i]->b_flags |= (LIBXFS_B_UPTODATE |
 						       LIBXFS_B_UNCHECKED);
-				len -= size;
 				if (B_IS_INODE(libxfs_buf_priority(bplist[i])))
 					pf_read_inode_dirs(args, bplist[i]);
 				else if (which == PF_META_ONLY)
@@ -615,6 +938,8 @@ pf_batch_read(
 								B_DIR_META_S);
 			}
 		}
+		if (i < num && pf_plan_recording(args))
+			pf_plan_break(args);
 		for (i = 0; i < num; i++) {
 			pftrace("putbuf %c %p (%llu) in AG %d",
 				B_IS_INODE(libxfs_buf_priority(bplist[i])) ?
@@ -727,6 +1052,7 @@ pf_queuing_worker(
 	uint64_t		sparse;
 	struct xfs_ino_geometry	*igeo = M_IGEO(mp);
 	unsigned long long	cluster_mask;
+	unsigned int		plan_idx = 0;
 
 	rcu_register_thread();
 
@@ -813,6 +1139,11 @@ pf_queuing_worker(
 			num_inos += igeo->inodes_per_cluster;
 			sparse >>= igeo->inodes_per_cluster;
 		} while (num_inos < igeo->ialloc_inos);
+
+		if (pf_plan_replaying(args))
+			plan_idx = pf_plan_replay(args, plan_idx,
+					cur_irec->ino_startnum,
+					cur_irec->ino_startnum + num_inos);
 	}
 
 	pthread_mutex_lock(&args->lock);
@@ -836,6 +1167,7 @@ pf_queuing_worker(
 
 	ASSERT(btree_is_empty(args->io_queue));
 
+	pf_plan_finish(args);
 	args->prefetch_done = 1;
 	next_args = args->next_args;
 	args->next_args = NULL;
@@ -881,7 +1213,29 @@ init_prefetch(
 	pf_max_bbs = pf_max_bytes >> BBSHIFT;
 	pf_max_fsbs = pf_max_bytes >> mp->m_sb.sb_blocklog;
 	pf_batch_bytes = DEF_BATCH_BYTES;
-	pf_batch_fsbs = DEF_BATCH_BYTES >> (mp->m_sb.sb_blocklog + 1);
+	if (pf_max_gap >= 0)
+		pf_batch_bytes = min(pf_max_gap, pf_max_bytes);
+	pf_batch_fsbs = pf_batch_bytes >> (mp->m_sb.sb_blocklog + 1);
+	pf_plans = calloc(mp->m_sb.sb_agcount, sizeof(struct pf_plan));
+}
+
+/*
+ * Free the prefetch plans.  Phase 6 frees each AG's plan once it has been
+ * replayed, but plans are left over if phase 6 is skipped or doesn't get to
+ * an AG.
+ */
+void
+prefetch_teardown(void)
+{
+	xfs_agnumber_t		agno;
+
+	if (!pf_plans)
+		return;
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
+		pf_plan_free(&pf_plans[agno]);
+	free(pf_plans);
+	pf_plans = NULL;
 }
 
 prefetch_args_t *
@@ -908,6 +1262,7 @@ start_inode_prefetch(
 		do_error(_("failed to initialize prefetch cond var\n"));
 	args->agno = agno;
 	args->dirs_only = dirs_only;
+	args->plan = pf_plan_start(agno, dirs_only);
 
 	/*
 	 * use only 1/8 of the libxfs cache as we are only counting inodes
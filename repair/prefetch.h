@@ -7,8 +7,10 @@
 #include "incore.h"
 
 struct workqueue;
+struct pf_plan;
 
 extern int 	do_prefetch;
+extern int	pf_max_gap;
 
 #define PF_THREAD_COUNT	4
 
@@ -28,6 +30,7 @@ typedef struct prefetch_args {
 	volatile int		inode_bufs_queued;
 	volatile xfs_fsblock_t	last_bno_read;
 	sem_t			ra_count;
+	struct pf_plan		*plan;
 	struct prefetch_args	*next_args;
 } prefetch_args_t;
 
@@ -37,6 +40,9 @@ void
 init_prefetch(
 	xfs_mount_t		*pmp);
 
+void
+prefetch_teardown(void);
+
 prefetch_args_t *
 start_inode_prefetch(
 	xfs_agnumber_t		agno,
@@ -2665,10 +2665,20 @@ scan_ags(
 	for (i = 0; i < mp->m_sb.sb_agcount; i++)
 		queue_work(&wq, scan_ag, i, &agcnts[i]);
 
-	destroy_work_queue(&wq);
+	destroy_work_queue_stats(&wq, _("AG scan"));
 
-	/* tally up the counts */
+	/*
+	 * Tally up the counts.  Stash each AG's inode count in the perag so
+	 * that phase 5 can schedule the biggest AGs first; libxfs replaces it
+	 * with the on-disk value when it first reads the AGI.
+	 */
 	for (i = 0; i < mp->m_sb.sb_agcount; i++) {
+		struct xfs_perag	*pag = libxfs_perag_get(mp, i);
+
+		if (!pag->pagi_init)
+			pag->pagi_count = agcnts[i].agicount;
+		libxfs_perag_put(pag);
+
 		fdblocks += agcnts[i].fdblocks;
 		icount += agcnts[i].agicount;
 		ifreecount += agcnts[i].ifreecount;
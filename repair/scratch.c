@@ -0,0 +1,256 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 Oracle.  All Rights Reserved.
+ */
+#if defined(HAVE_FALLOCATE)
+#include <linux/falloc.h>
+#endif
+#include "libxfs.h"
+#include <sys/mman.h>
+#include "err_protos.h"
+#include "scratch.h"
+
+/*
+ * Scratch File Spill Space
+ *
+ * On filesystems with billions of inodes, the incore inode records, the
+ * extent and block state trees, and the rmap slabs can outgrow physical
+ * memory.  If the user gives us a scratch directory, we carve those
+ * structures out of shared mappings of an unlinked file in that directory
+ * instead of the heap.  The kernel can then write cold pages back to the
+ * file and reclaim them, rather than pushing us into swap or the OOM killer.
+ * Repair walks these structures in AG and block order, so the pages are read
+ * back in mostly sequentially.
+ *
+ * Small objects are carved out of large chunks and recycled through
+ * per-size freelists.  Large objects (slab arrays) get a mapping of their own
+ * so that their space can be punched out of the file when they're freed.
+ * Without a scratch directory everything falls through to malloc and free.
+ */
+
+#define SCRATCH_ALIGN		16
+#define SCRATCH_MAX_SMALL	4096
+#define SCRATCH_NR_CLASSES	(SCRATCH_MAX_SMALL / SCRATCH_ALIGN)
+#define SCRATCH_CHUNK_SIZE	(16U << 20)
+
+/* Header in front of each large allocation. */
+struct scratch_large {
+	off_t			pos;
+	size_t			len;
+} __attribute__((aligned(SCRATCH_ALIGN)));
+
+struct scratch_obj {
+	struct scratch_obj	*next;
+};
+
+static struct scratch {
+	pthread_mutex_t		lock;
+	int			fd;
+	off_t			size;		/* end of the scratch file */
+	char			*next;		/* unused part of current chunk */
+	size_t			left;
+	uint64_t		bytes;		/* bytes handed out */
+	struct scratch_obj	*freelist[SCRATCH_NR_CLASSES];
+} scratch = {
+	.lock			= PTHREAD_MUTEX_INITIALIZER,
+	.fd			= -1,
+};
+
+/* Create an unlinked scratch file in @dir. */
+int
+scratch_init(
+	const char		*dir)
+{
+	char			*path;
+	int			fd;
+
+	if (asprintf(&path, "%s/xfs_repair.XXXXXX", dir) < 0)
+		return -ENOMEM;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		free(path);
+		return -errno;
+	}
+	unlink(path);
+	free(path);
+
+	scratch.fd = fd;
+	return 0;
+}
+
+bool
+scratch_active(void)
+{
+	return scratch.fd >= 0;
+}
+
+uint64_t
+scratch_bytes(void)
+{
+	return scratch.bytes;
+}
+
+/* Extend the scratch file by @len bytes and map the new space. */
+static void *
+scratch_map(
+	size_t			len,
+	off_t			*posp)
+{
+	off_t			pos = scratch.size;
+	void			*p;
+	int			error = -1;
+
+#if defined(HAVE_FALLOCATE)
+	/*
+	 * Allocate the space up front so that running out of room in the
+	 * scratch directory is an error here and not a SIGBUS later.
+	 */
+	error = fallocate(scratch.fd, 0, pos, len);
+	if (error && errno != EOPNOTSUPP)
+		do_error(_("cannot extend scratch file: %s\n"), strerror(errno));
+#endif
+	if (error && ftruncate(scratch.fd, pos + len))
+		do_error(_("cannot extend scratch file: %s\n"), strerror(errno));
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, scratch.fd,
+			pos);
+	if (p == MAP_FAILED)
+		do_error(_("cannot map scratch file: %s\n"), strerror(errno));
+
+	scratch.size += len;
+	*posp = pos;
+	return p;
+}
+
+static void *
+scratch_alloc_large(
+	size_t			size)
+{
+	struct scratch_large	*hdr;
+	size_t			len;
+	off_t			pos;
+
+	len = round_up(size + sizeof(*hdr), getpagesize());
+
+	pthread_mutex_lock(&scratch.lock);
+	hdr = scratch_map(len, &pos);
+	scratch.bytes += len;
+	pthread_mutex_unlock(&scratch.lock);
+
+	hdr->pos = pos;
+	hdr->len = len;
+	return hdr + 1;
+}
+
+static void
+scratch_free_large(
+	void			*ptr)
+{
+	struct scratch_large	*hdr = (struct scratch_large *)ptr - 1;
+	off_t			pos = hdr->pos;
+	size_t			len = hdr->len;
+
+	munmap(hdr, len);
+#if defined(HAVE_FALLOCATE)
+	fallocate(scratch.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			pos, len);
+#endif
+
+	pthread_mutex_lock(&scratch.lock);
+	scratch.bytes -= len;
+	pthread_mutex_unlock(&scratch.lock);
+}
+
+static inline unsigned int
+scratch_class(
+	size_t			size)
+{
+	return (size + SCRATCH_ALIGN - 1) / SCRATCH_ALIGN - 1;
+}
+
+/*
+ * Allocate @size bytes of scratch space, or heap memory if we're not
+ * spilling.  Returns NULL only if malloc fails.
+ */
+void *
+scratch_alloc(
+	size_t			size)
+{
+	struct scratch_obj	*obj;
+	unsigned int		idx;
+	off_t			pos;
+
+	if (!scratch_active())
+		return malloc(size);
+
+	if (size > SCRATCH_MAX_SMALL)
+		return scratch_alloc_large(size);
+
+	idx = scratch_class(size);
+	size = (idx + 1) * SCRATCH_ALIGN;
+
+	pthread_mutex_lock(&scratch.lock);
+	obj = scratch.freelist[idx];
+	if (obj) {
+		scratch.freelist[idx] = obj->next;
+	} else {
+		/* Whatever is left of the old chunk is too small; drop it. */
+		if (scratch.left < size) {
+			scratch.next = scratch_map(SCRATCH_CHUNK_SIZE, &pos);
+			scratch.left = SCRATCH_CHUNK_SIZE;
+		}
+		obj = (struct scratch_obj *)scratch.next;
+		scratch.next += size;
+		scratch.left -= size;
+	}
+	scratch.bytes += size;
+	pthread_mutex_unlock(&scratch.lock);
+
+	return obj;
+}
+
+void *
+scratch_zalloc(
+	size_t			size)
+{
+	void			*ptr;
+
+	if (!scratch_active())
+		return calloc(1, size);
+
+	ptr = scratch_alloc(size);
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+/* Free something allocated with scratch_alloc(@size). */
+void
+scratch_free(
+	void			*ptr,
+	size_t			size)
+{
+	struct scratch_obj	*obj = ptr;
+	unsigned int		idx;
+
+	if (!scratch_active()) {
+		free(ptr);
+		return;
+	}
+
+	if (!ptr)
+		return;
+
+	if (size > SCRATCH_MAX_SMALL) {
+		scratch_free_large(ptr);
+		return;
+	}
+
+	idx = scratch_class(size);
+
+	pthread_mutex_lock(&scratch.lock);
+	obj->next = scratch.freelist[idx];
+	scratch.freelist[idx] = obj;
+	scratch.bytes -= (idx + 1) * SCRATCH_ALIGN;
+	pthread_mutex_unlock(&scratch.lock);
+}
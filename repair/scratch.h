@@ -0,0 +1,16 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 Oracle.  All Rights Reserved.
+ */
+#ifndef SCRATCH_H_
+#define SCRATCH_H_
+
+extern int scratch_init(const char *dir);
+extern bool scratch_active(void);
+extern uint64_t scratch_bytes(void);
+
+extern void *scratch_alloc(size_t size);
+extern void *scratch_zalloc(size_t size);
+extern void scratch_free(void *ptr, size_t size);
+
+#endif /* SCRATCH_H_ */
@@ -5,6 +5,7 @@
  */
 #include "libxfs.h"
 #include "slab.h"
+#include "scratch.h"
 
 #undef SLAB_DEBUG
 
@@ -126,7 +127,8 @@ free_slab(
 	hdr = ptr->s_first;
 	while (hdr) {
 		nhdr = hdr->sh_next;
-		free(hdr);
+		scratch_free(hdr, sizeof(struct xfs_slab_hdr) +
+				(hdr->sh_nr * ptr->s_item_sz));
 		hdr = nhdr;
 	}
 	free(ptr);
@@ -165,7 +167,8 @@ slab_add(
 		n = (hdr ? hdr->sh_nr * 2 : MIN_SLAB_NR);
 		if (n * slab->s_item_sz > MAX_SLAB_SIZE)
 			n = MAX_SLAB_SIZE / slab->s_item_sz;
-		hdr = malloc(sizeof(struct xfs_slab_hdr) + (n * slab->s_item_sz));
+		hdr = scratch_alloc(sizeof(struct xfs_slab_hdr) +
+				(n * slab->s_item_sz));
 		if (!hdr)
 			return -ENOMEM;
 		hdr->sh_nr = n;
@@ -22,6 +22,21 @@ thread_init(void)
 	pthread_sigmask(SIG_BLOCK, &blocked, NULL);
 }
 
+/*
+ * How many threads should work on a single AG?  The more AGs we have in
+ * flight at once, the fewer processing threads per AG.  This means we don't
+ * overwhelm the machine with hundreds of threads when we start acting on lots
+ * of AGs at once, but a filesystem with a few huge AGs can still keep all the
+ * CPUs busy.  Returns zero if we're running single threaded.
+ */
+unsigned int
+ag_worker_threads(void)
+{
+	if (!ag_stride)
+		return 0;
+	return max(ag_stride, platform_nproc() / thread_count);
+}
+
 
 void
 create_work_queue(
@@ -38,20 +53,31 @@ create_work_queue(
 }
 
 void
-queue_work(
+queue_work_prio(
 	struct workqueue	*wq,
 	workqueue_func_t	func,
 	xfs_agnumber_t		agno,
-	void			*arg)
+	void			*arg,
+	unsigned int		prio)
 {
 	int			err;
 
-	err = -workqueue_add(wq, func, agno, arg);
+	err = -workqueue_add_prio(wq, func, agno, arg, prio);
 	if (err)
 		do_error(_("cannot allocate worker item, error = [%d] %s\n"),
 				err, strerror(err));
 }
 
+void
+queue_work(
+	struct workqueue	*wq,
+	workqueue_func_t	func,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	queue_work_prio(wq, func, agno, arg, WORKQUEUE_PRIO_NORMAL);
+}
+
 void
 destroy_work_queue(
 	struct workqueue	*wq)
@@ -64,3 +90,32 @@ destroy_work_queue(
 				err, strerror(err));
 	workqueue_destroy(wq);
 }
+
+/*
+ * Like destroy_work_queue, but in verbose mode also report how the work was
+ * spread over the workers.
+ */
+void
+destroy_work_queue_stats(
+	struct workqueue	*wq,
+	const char		*what)
+{
+	struct workqueue_stats	stats;
+	int			err;
+
+	err = -workqueue_terminate(wq);
+	if (err)
+		do_error(_("cannot terminate worker item, error = [%d] %s\n"),
+				err, strerror(err));
+
+	workqueue_stats(wq, &stats);
+	if (verbose && stats.items)
+		do_log(
+_("        - %s: %llu items on %u threads, %llu stolen, %llu ms queued, %llu ms running\n"),
+				what, (unsigned long long)stats.items,
+				wq->thread_count,
+				(unsigned long long)stats.steals,
+				(unsigned long long)stats.wait_ns / 1000000,
+				(unsigned long long)stats.run_ns / 1000000);
+	workqueue_destroy(wq);
+}
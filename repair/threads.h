@@ -6,6 +6,7 @@
 #include "libfrog/workqueue.h"
 
 void	thread_init(void);
+unsigned int	ag_worker_threads(void);
 
 void
 create_work_queue(
@@ -20,8 +21,21 @@ queue_work(
 	xfs_agnumber_t 		agno,
 	void			*arg);
 
+void
+queue_work_prio(
+	struct workqueue	*wq,
+	workqueue_func_t	func,
+	xfs_agnumber_t 		agno,
+	void			*arg,
+	unsigned int		prio);
+
 void
 destroy_work_queue(
 	struct workqueue	*wq);
 
+void
+destroy_work_queue_stats(
+	struct workqueue	*wq,
+	const char		*what);
+
 #endif	/* _XFS_REPAIR_THREADS_H_ */
@@ -26,6 +26,7 @@
 #include "libfrog/platform.h"
 #include "bulkload.h"
 #include "quotacheck.h"
+#include "scratch.h"
 
 /*
  * option tables for getsubopt calls
@@ -44,6 +45,8 @@ enum o_opt_nums {
 	BLOAD_LEAF_SLACK,
 	BLOAD_NODE_SLACK,
 	NOQUOTA,
+	SPILL_DIR,
+	PF_MAX_GAP,
 	O_MAX_OPTS,
 };
 
@@ -57,6 +60,8 @@ static char *o_opts[] = {
 	[BLOAD_LEAF_SLACK]	= "debug_bload_leaf_slack",
 	[BLOAD_NODE_SLACK]	= "debug_bload_node_slack",
 	[NOQUOTA]		= "noquota",
+	[SPILL_DIR]		= "spill_dir",
+	[PF_MAX_GAP]		= "pf_max_gap",
 	[O_MAX_OPTS]		= NULL,
 };
 
@@ -82,6 +87,7 @@ static int	bhash_option_used;
 static long	max_mem_specified;	/* in megabytes */
 static int	phase2_threads = 32;
 static bool	report_corrected;
+static char	*spill_dir;
 
 static void
 usage(void)
@@ -230,6 +236,8 @@ process_args(int argc, char **argv)
 			p = optarg;
 			while (*p != '\0')  {
 				char *val;
+				char *end;
+				long gap;
 
 				switch (getsubopt(&p, o_opts, &val))  {
 				case ASSUME_XFS:
@@ -287,6 +295,25 @@ process_args(int argc, char **argv)
 				case NOQUOTA:
 					quotacheck_skip();
 					break;
+				case SPILL_DIR:
+					if (!val)
+						do_abort(
+		_("-o spill_dir requires a parameter\n"));
+					spill_dir = val;
+					break;
+				case PF_MAX_GAP:
+					if (!val)
+						do_abort(
+		_("-o pf_max_gap requires a parameter\n"));
+					errno = 0;
+					gap = strtol(val, &end, 0);
+					if (errno || end == val || *end != '\0' ||
+					    gap < 0 || gap > INT_MAX)
+						do_abort(
+		_("-o pf_max_gap requires a byte count between 0 and %d\n"),
+							INT_MAX);
+					pf_max_gap = gap;
+					break;
 				default:
 					unknown('o', val);
 					break;
@@ -385,6 +412,14 @@ process_args(int argc, char **argv)
 	if (report_corrected && no_modify)
 		usage();
 
+	if (spill_dir) {
+		int	error = scratch_init(spill_dir);
+
+		if (error)
+			do_abort(_("cannot create scratch file in %s: %s\n"),
+					spill_dir, strerror(-error));
+	}
+
 	p = getenv("XFS_REPAIR_FAIL_AFTER_PHASE");
 	if (p)
 		fail_after_phase = (int)strtol(p, NULL, 0);
@@ -1077,9 +1112,20 @@ main(int argc, char **argv)
 		libxfs_bcache_purge();
 		cache_destroy(libxfs_bcache);
 
-		mem_used = (mp->m_sb.sb_icount >> (10 - 2)) +
-					(mp->m_sb.sb_dblocks >> (10 + 1)) +
-					50000;	/* rough estimate of 50MB overhead */
+		mem_used = 50000;	/* rough estimate of 50MB overhead */
+
+		/*
+		 * If we're spilling, the inode and block usage trees live in
+		 * the scratch file and don't count against memory.
+		 */
+		if (scratch_active()) {
+			if (verbose)
+				do_log(
+	_("        - spilling incore metadata to %s\n"), spill_dir);
+		} else {
+			mem_used += (mp->m_sb.sb_icount >> (10 - 2)) +
+					(mp->m_sb.sb_dblocks >> (10 + 1));
+		}
 		max_mem = max_mem_specified ? max_mem_specified * 1024 :
 					      platform_physmem() * 3 / 4;
 
@@ -1135,7 +1181,7 @@ main(int argc, char **argv)
 			do_log(_("        - block cache size set to %d entries\n"),
 				libxfs_bhash_size * HASH_CACHE_RATIO);
 
-		libxfs_bcache = cache_init(0, libxfs_bhash_size,
+		libxfs_bcache = cache_init(CACHE_SHARDED, libxfs_bhash_size,
 						&libxfs_bcache_operations);
 	}
 
@@ -1198,6 +1244,8 @@ main(int argc, char **argv)
 _("Inode allocation btrees are too corrupted, skipping phases 6 and 7\n"));
 	}
 
+	prefetch_teardown();
+
 	if (lost_quotas && !have_uquotino && !have_gquotino && !have_pquotino) {
 		if (!no_modify)  {
 			do_warn(
@@ -437,6 +437,19 @@ kill_bulkstat:
 		si.aborted = true;
 		str_liberror(ctx, ret, _("finishing bulkstat work"));
 	}
+	if (verbose) {
+		struct workqueue_stats	stats;
+
+		workqueue_stats(&si.wq_bulkstat, &stats);
+		if (stats.items)
+			str_info(ctx, ctx->mntpoint,
+_("scanned %llu inode chunks on %u threads, %llu stolen, %llu ms queued, %llu ms running."),
+				(unsigned long long)stats.items,
+				si.wq_bulkstat.thread_count,
+				(unsigned long long)stats.steals,
+				(unsigned long long)stats.wait_ns / 1000000,
+				(unsigned long long)stats.run_ns / 1000000);
+	}
 	workqueue_destroy(&si.wq_bulkstat);
 
 	return si.aborted ? -1 : 0;
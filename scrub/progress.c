@@ -5,6 +5,7 @@
  */
 #include "xfs.h"
 #include <dirent.h>
+#include <stdarg.h>
 #include <pthread.h>
 #include <sys/statvfs.h>
 #include <time.h>
@@ -38,6 +39,7 @@ struct progress_tracker {
 	bool			isatty;
 	bool			terminate;
 	pthread_t		thread;
+	char			note[24];	/* shown next to the bar */
 
 	/* static state */
 	pthread_mutex_t		lock;
@@ -58,6 +60,24 @@ progress_add(
 		ptcounter_add(pt.ptc, x);
 }
 
+/* Show a short note about how the phase is running next to the bar. */
+void
+progress_set_note(
+	const char		*fmt,
+	...)
+{
+	va_list			args;
+
+	if (!pt.fp || !pt.isatty)
+		return;
+
+	pthread_mutex_lock(&pt.lock);
+	va_start(args, fmt);
+	vsnprintf(pt.note, sizeof(pt.note), fmt, args);
+	va_end(args);
+	pthread_mutex_unlock(&pt.lock);
+}
+
 static const char twiddles[] = "|/-\\";
 
 static void
@@ -88,15 +108,17 @@ progress_report(
 	/* Interactive twiddle progress bar. */
 	if (debug) {
 		num_len = snprintf(buf, sizeof(buf),
-				"%c %"PRIu64"/%"PRIu64" (%.1f%%)",
+				"%c %s%s%"PRIu64"/%"PRIu64" (%.1f%%)",
 				twiddles[pt.twiddle],
+				pt.note, pt.note[0] ? " " : "",
 				sum >> pt.rshift,
 				pt.max >> pt.rshift,
 				100.0 * sum / pt.max);
 	} else {
 		num_len = snprintf(buf, sizeof(buf),
-				"%c (%.1f%%)",
+				"%c %s%s(%.1f%%)",
 				twiddles[pt.twiddle],
+				pt.note, pt.note[0] ? " " : "",
 				100.0 * sum / pt.max);
 	}
 	memmove(buf + sizeof(buf) - (num_len + 1), buf, num_len + 1);
@@ -196,6 +218,7 @@ progress_init_phase(
 	pt.rshift = rshift;
 	pt.twiddle = 0;
 	pt.terminate = false;
+	pt.note[0] = 0;
 
 	ret = ptcounter_alloc(nr_threads, &pt.ptc);
 	if (ret) {
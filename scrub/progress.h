@@ -15,5 +15,7 @@ int progress_init_phase(struct scrub_ctx *ctx, FILE *progress_fp,
 			 unsigned int nr_threads);
 void progress_end_phase(void);
 void progress_add(uint64_t x);
+void progress_set_note(const char *fmt, ...)
+		__attribute__((format(printf, 1, 2)));
 
 #endif /* XFS_SCRUB_PROGRESS_H_ */
@@ -10,6 +10,7 @@
 #include "libfrog/ptvar.h"
 #include "libfrog/workqueue.h"
 #include "libfrog/paths.h"
+#include "libfrog/uring.h"
 #include "xfs_scrub.h"
 #include "common.h"
 #include "counter.h"
@@ -25,6 +26,13 @@
  * pool worker.  Adjacent (or nearly adjacent) requests can be combined
  * to reduce overhead when free space fragmentation is high.  The thread
  * pool takes care of issuing multiple IOs to the device, if possible.
+ *
+ * Requests arrive from many threads in whatever order the space map scan
+ * finds them, so we don't start any IO until the caller forces it.  At that
+ * point we sort every request by disk address, merge them into the longest
+ * runs that we can, and cut the sorted runs into one contiguous share per
+ * disk head.  Each verifier thread then streams through its own part of the
+ * disk instead of seeking back and forth between the other threads' reads.
  */
 
 /*
@@ -49,6 +57,52 @@ rvp_io_max_size(void)
 /* Tolerate 64k holes in adjacent read verify requests. */
 #define RVP_IO_BATCH_LOCALITY	(65536)
 
+/*
+ * Adaptive IO Control
+ *
+ * If the user gave us a bandwidth target or a latency budget, each pool
+ * times the verify IOs that it issues and retunes the IO size and the number
+ * of IOs in flight twice a second.  If the slowest IO of the last interval
+ * blew the latency budget, we halve the queue depth and then the IO size.
+ * If it was well under budget and we're short of the bandwidth target, we
+ * double the IO size and then add to the queue depth.  Bandwidth above the
+ * target is trimmed by pacing the IOs.  We start at the smallest size and
+ * depth so that scrub ramps up into whatever idle bandwidth the disk has.
+ */
+#define RVP_CTL_INTERVAL_NS	(NSEC_PER_SEC / 2)
+#define RVP_CTL_MIN_IO_SIZE	(65536)
+
+struct rvp_ctl {
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;		/* waiting for an IO slot */
+	bool			enabled;
+	unsigned int		inflight;
+	unsigned int		depth;		/* max IOs in flight */
+	unsigned int		max_depth;
+	size_t			io_size;	/* bytes */
+	size_t			min_io_size;
+	size_t			max_io_size;
+
+	/* Statistics for the current sampling interval. */
+	uint64_t		start_ns;
+	uint64_t		bytes;
+	uint64_t		max_lat_ns;
+};
+
+/*
+ * If the kernel supports io_uring, each verifier thread keeps this many
+ * reads of this size in flight instead of issuing one pread at a time.  This
+ * keeps every spindle of a big array busy without needing a thread per IO.
+ */
+#define RVP_URING_DEPTH		(32)
+#define RVP_URING_IO_SIZE	(1048576)
+
+struct rvp_uring {
+	struct frog_uring	*ring;
+	bool			fixed;		/* readbuf is registered */
+	bool			failed;		/* use synchronous reads */
+};
+
 struct read_verify {
 	void			*io_end_arg;
 	struct disk		*io_disk;
@@ -56,15 +110,36 @@ struct read_verify {
 	uint64_t		io_length;	/* bytes */
 };
 
+/*
+ * Each submitter thread combines nearby requests in @rv and parks the
+ * combined requests on its own list until the caller forces the IO.
+ */
+struct rvp_stash {
+	struct read_verify	rv;
+	struct read_verify	*list;
+	size_t			nr;
+	size_t			max;
+};
+
+/* A verifier thread's share of the sorted runs. */
+struct rvp_batch {
+	struct read_verify	*runs;
+	size_t			nr;
+};
+
 struct read_verify_pool {
 	struct workqueue	wq;		/* thread pool */
 	struct scrub_ctx	*ctx;		/* scrub context */
 	void			*readbuf;	/* read buffer */
 	struct ptcounter	*verified_bytes;
 	struct ptvar		*rvstate;	/* combines read requests */
+	struct ptvar		*rings;		/* per-thread io_uring */
+	struct read_verify	*runs;		/* sorted requests */
 	struct disk		*disk;		/* which disk? */
 	read_verify_ioerr_fn_t	ioerr_fn;	/* io error callback */
 	size_t			miniosz;	/* minimum io size, bytes */
+	unsigned int		nr_heads;	/* verifier threads */
+	struct rvp_ctl		ctl;		/* adaptive io control */
 
 	/*
 	 * Store a runtime error code here so that we can stop the pool and
@@ -73,6 +148,164 @@ struct read_verify_pool {
 	int			runtime_error;
 };
 
+static inline uint64_t
+rvp_ctl_now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void
+rvp_ctl_init(
+	struct read_verify_pool	*rvp,
+	unsigned int		verifier_threads)
+{
+	struct rvp_ctl		*ctl = &rvp->ctl;
+
+	pthread_mutex_init(&ctl->lock, NULL);
+	pthread_cond_init(&ctl->wait, NULL);
+	ctl->enabled = verify_target_bw > 0 || verify_max_latency > 0;
+	ctl->max_depth = max(verifier_threads, 1U);
+	ctl->max_io_size = rvp_io_max_size();
+	ctl->min_io_size = min(ctl->max_io_size,
+			roundup(RVP_CTL_MIN_IO_SIZE, rvp->miniosz));
+	if (ctl->enabled) {
+		ctl->depth = 1;
+		ctl->io_size = ctl->min_io_size;
+	} else {
+		ctl->depth = ctl->max_depth;
+		ctl->io_size = ctl->max_io_size;
+	}
+	ctl->start_ns = rvp_ctl_now();
+}
+
+static void
+rvp_ctl_destroy(
+	struct read_verify_pool	*rvp)
+{
+	pthread_cond_destroy(&rvp->ctl.wait);
+	pthread_mutex_destroy(&rvp->ctl.lock);
+}
+
+/*
+ * Wait for an IO slot and for the bandwidth target to allow another IO.
+ * Returns the size of the IO to issue.
+ */
+static size_t
+rvp_ctl_begin(
+	struct read_verify_pool	*rvp)
+{
+	struct rvp_ctl		*ctl = &rvp->ctl;
+	uint64_t		due_ns = 0;
+	uint64_t		now;
+	size_t			io_size;
+
+	if (!ctl->enabled)
+		return ctl->io_size;
+
+	pthread_mutex_lock(&ctl->lock);
+	while (ctl->inflight >= ctl->depth)
+		pthread_cond_wait(&ctl->wait, &ctl->lock);
+	ctl->inflight++;
+	io_size = ctl->io_size;
+	if (verify_target_bw)
+		due_ns = ctl->start_ns +
+			ctl->bytes * NSEC_PER_SEC / verify_target_bw;
+	pthread_mutex_unlock(&ctl->lock);
+
+	now = rvp_ctl_now();
+	if (due_ns > now) {
+		struct timespec	tv = {
+			.tv_sec		= (due_ns - now) / NSEC_PER_SEC,
+			.tv_nsec	= (due_ns - now) % NSEC_PER_SEC,
+		};
+
+		nanosleep(&tv, NULL);
+	}
+	return io_size;
+}
+
+/* Retune the IO size and queue depth from the last interval's numbers. */
+static void
+rvp_ctl_adjust(
+	struct read_verify_pool	*rvp,
+	uint64_t		now)
+{
+	struct rvp_ctl		*ctl = &rvp->ctl;
+	uint64_t		bw;
+
+	bw = ctl->bytes * NSEC_PER_SEC / (now - ctl->start_ns);
+
+	if (verify_max_latency && ctl->max_lat_ns > verify_max_latency) {
+		if (ctl->depth > 1)
+			ctl->depth /= 2;
+		else if (ctl->io_size > ctl->min_io_size)
+			ctl->io_size = max(ctl->io_size / 2, ctl->min_io_size);
+	} else if ((!verify_max_latency ||
+		    ctl->max_lat_ns < verify_max_latency / 2) &&
+		   (!verify_target_bw || bw < verify_target_bw)) {
+		if (ctl->io_size < ctl->max_io_size)
+			ctl->io_size = min(ctl->io_size * 2, ctl->max_io_size);
+		else if (ctl->depth < ctl->max_depth)
+			ctl->depth++;
+	}
+
+	dbg_printf("rvp fd %d bw %"PRIu64" maxlat %lluus io %zu depth %u\n",
+			rvp->disk->d_fd, bw,
+			(unsigned long long)ctl->max_lat_ns / NSEC_PER_USEC,
+			ctl->io_size, ctl->depth);
+	progress_set_note("%zuk x%u", ctl->io_size >> 10, ctl->depth);
+
+	ctl->start_ns = now;
+	ctl->bytes = 0;
+	ctl->max_lat_ns = 0;
+	pthread_cond_broadcast(&ctl->wait);
+}
+
+/* Account for a finished IO and release its slot. */
+static void
+rvp_ctl_end(
+	struct read_verify_pool	*rvp,
+	ssize_t			bytes,
+	uint64_t		start_ns)
+{
+	struct rvp_ctl		*ctl = &rvp->ctl;
+	uint64_t		now;
+
+	if (!ctl->enabled)
+		return;
+
+	now = rvp_ctl_now();
+	pthread_mutex_lock(&ctl->lock);
+	ctl->inflight--;
+	if (bytes > 0)
+		ctl->bytes += bytes;
+	ctl->max_lat_ns = max(ctl->max_lat_ns, now - start_ns);
+	if (now - ctl->start_ns >= RVP_CTL_INTERVAL_NS)
+		rvp_ctl_adjust(rvp, now);
+	else
+		pthread_cond_signal(&ctl->wait);
+	pthread_mutex_unlock(&ctl->lock);
+}
+
+#ifdef HAVE_IO_URING
+/* Free the ring of each thread. */
+static int
+rvp_free_uring(
+	struct ptvar			*ptv,
+	void				*data,
+	void				*foreach_arg)
+{
+	struct rvp_uring		*ru = data;
+
+	frog_uring_free(ru->ring);
+	ru->ring = NULL;
+	return 0;
+}
+#endif
+
 /*
  * Create a thread pool to run read verifiers.
  *
@@ -119,20 +352,39 @@ read_verify_pool_alloc(
 	rvp->ctx = ctx;
 	rvp->disk = disk;
 	rvp->ioerr_fn = ioerr_fn;
-	ret = -ptvar_alloc(submitter_threads, sizeof(struct read_verify),
+	rvp->nr_heads = max(verifier_threads, 1U);
+	rvp_ctl_init(rvp, verifier_threads);
+	ret = -ptvar_alloc(submitter_threads, sizeof(struct rvp_stash),
 			&rvp->rvstate);
 	if (ret)
 		goto out_counter;
+#ifdef HAVE_IO_URING
+	/*
+	 * SCSI VERIFY, error injection, background mode and the adaptive
+	 * controller all want to see each IO, so they stick to preads.
+	 */
+	if (!(disk->d_flags & DISK_FLAG_SCSI_VERIFY) && !debug && !bg_mode &&
+	    !rvp->ctl.enabled) {
+		ret = -ptvar_alloc(max(verifier_threads, submitter_threads),
+				sizeof(struct rvp_uring), &rvp->rings);
+		if (ret)
+			goto out_rvstate;
+	}
+#endif
 	ret = -workqueue_create(&rvp->wq, (struct xfs_mount *)rvp,
 			verifier_threads == 1 ? 0 : verifier_threads);
 	if (ret)
-		goto out_rvstate;
+		goto out_rings;
 	*prvp = rvp;
 	return 0;
 
+out_rings:
+	if (rvp->rings)
+		ptvar_free(rvp->rings);
 out_rvstate:
 	ptvar_free(rvp->rvstate);
 out_counter:
+	rvp_ctl_destroy(rvp);
 	ptcounter_free(rvp->verified_bytes);
 out_buf:
 	free(rvp->readbuf);
@@ -159,49 +411,69 @@ read_verify_pool_flush(
 	return -workqueue_terminate(&rvp->wq);
 }
 
+/* Free the requests that a submitter thread stashed. */
+static int
+rvp_free_stash(
+	struct ptvar			*ptv,
+	void				*data,
+	void				*foreach_arg)
+{
+	struct rvp_stash		*stash = data;
+
+	free(stash->list);
+	return 0;
+}
+
 /* Finish up any read verification work and tear it down. */
 void
 read_verify_pool_destroy(
 	struct read_verify_pool		*rvp)
 {
 	workqueue_destroy(&rvp->wq);
+	free(rvp->runs);
+	ptvar_foreach(rvp->rvstate, rvp_free_stash, NULL);
+#ifdef HAVE_IO_URING
+	if (rvp->rings) {
+		ptvar_foreach(rvp->rings, rvp_free_uring, NULL);
+		ptvar_free(rvp->rings);
+	}
+#endif
 	ptvar_free(rvp->rvstate);
+	rvp_ctl_destroy(rvp);
 	ptcounter_free(rvp->verified_bytes);
 	free(rvp->readbuf);
 	free(rvp);
 }
 
 /*
- * Issue a read-verify IO in big batches.
+ * Verify a range with synchronous reads, one at a time.  Returns the number
+ * of bytes verified, or -1 if we hit a runtime error.
  */
-static void
-read_verify(
-	struct workqueue		*wq,
-	xfs_agnumber_t			agno,
-	void				*arg)
+static long long
+read_verify_range(
+	struct read_verify_pool		*rvp,
+	struct read_verify		*rv)
 {
-	struct read_verify		*rv = arg;
-	struct read_verify_pool		*rvp;
 	unsigned long long		verified = 0;
 	ssize_t				io_max_size;
+	ssize_t				io_size;
 	ssize_t				sz;
 	ssize_t				len;
+	uint64_t			start_ns;
 	int				read_error;
-	int				ret;
-
-	rvp = (struct read_verify_pool *)wq->wq_ctx;
-	if (rvp->runtime_error)
-		return;
 
 	io_max_size = rvp_io_max_size();
 
 	while (rv->io_length > 0) {
 		read_error = 0;
-		len = min(rv->io_length, io_max_size);
+		io_size = rvp_ctl_begin(rvp);
+		len = min(rv->io_length, min(io_max_size, io_size));
 		dbg_printf("diskverify %d %"PRIu64" %zu\n", rvp->disk->d_fd,
 				rv->io_start, len);
+		start_ns = rvp_ctl_now();
 		sz = disk_read_verify(rvp->disk, rvp->readbuf, rv->io_start,
 				len);
+		rvp_ctl_end(rvp, sz, start_ns);
 		if (sz == len && io_max_size < rvp->miniosz) {
 			/*
 			 * If the verify request was 100% successful and less
@@ -218,7 +490,7 @@ read_verify(
 			/* Runtime error, bail out... */
 			if (read_error != EIO && read_error != EILSEQ) {
 				rvp->runtime_error = read_error;
-				return;
+				return -1;
 			}
 
 			/*
@@ -272,45 +544,280 @@ read_verify(
 		background_sleep();
 	}
 
-	free(rv);
+	return verified;
+}
+
+#ifdef HAVE_IO_URING
+struct rvp_chunk {
+	struct read_verify		*rv;
+	uint64_t			start;
+	size_t				len;
+};
+
+struct rvp_uring_state {
+	struct read_verify_pool		*rvp;
+	struct rvp_chunk		*free[RVP_URING_DEPTH];
+	unsigned int			nr_free;
+	long long			verified;
+};
+
+/* Set up this thread's ring, or return NULL to use synchronous reads. */
+static struct rvp_uring *
+rvp_get_uring(
+	struct read_verify_pool		*rvp)
+{
+	struct rvp_uring		*ru;
+	struct iovec			iov = {
+		.iov_base		= rvp->readbuf,
+		.iov_len		= rvp_io_max_size(),
+	};
+	int				ret;
+
+	if (!rvp->rings)
+		return NULL;
+
+	ru = ptvar_get(rvp->rings, &ret);
+	if (ret || ru->failed)
+		return NULL;
+	if (ru->ring)
+		return ru;
+
+	ret = frog_uring_alloc(RVP_URING_DEPTH, &ru->ring);
+	if (ret) {
+		ru->failed = true;
+		return NULL;
+	}
+
+	/* Registering the buffer can fail if we can't lock that much memory. */
+	ru->fixed = frog_uring_register_buffers(ru->ring, &iov, 1) == 0;
+	return ru;
+}
+
+/*
+ * A chunk finished.  Chunks that come back short or with a media error are
+ * verified again synchronously, which single-steps through the chunk to find
+ * exactly which blocks are bad.
+ */
+static void
+read_verify_chunk_done(
+	void				*data,
+	int				res,
+	void				*priv)
+{
+	struct rvp_uring_state		*st = priv;
+	struct read_verify_pool		*rvp = st->rvp;
+	struct rvp_chunk		*chunk = data;
+	struct read_verify		rv = {
+		.io_end_arg		= chunk->rv->io_end_arg,
+		.io_disk		= chunk->rv->io_disk,
+		.io_start		= chunk->start,
+		.io_length		= chunk->len,
+	};
+	long long			verified;
+
+	st->free[st->nr_free++] = chunk;
+
+	if (res == chunk->len) {
+		progress_add(res);
+		st->verified += res;
+		return;
+	}
+
+	if (res < 0 && res != -EIO && res != -EILSEQ) {
+		rvp->runtime_error = -res;
+		return;
+	}
+
+	dbg_printf("URING %d @ %"PRIu64" %zu res %d\n", rvp->disk->d_fd,
+			chunk->start, chunk->len, res);
+	verified = read_verify_range(rvp, &rv);
+	if (verified > 0)
+		st->verified += verified;
+}
+
+/*
+ * Verify @nr runs with up to RVP_URING_DEPTH reads in flight.  The ring stays
+ * full across the ends of the runs, so short runs don't drain the queue.  The
+ * data is thrown away, so every read lands in the same registered buffer.
+ * Returns the number of bytes verified, or -1 if we hit a runtime error.
+ */
+static long long
+read_verify_uring(
+	struct read_verify_pool		*rvp,
+	struct rvp_uring		*ru,
+	struct read_verify		*runs,
+	size_t				nr)
+{
+	struct rvp_chunk		chunks[RVP_URING_DEPTH];
+	struct rvp_uring_state		st = {
+		.rvp			= rvp,
+	};
+	struct read_verify		*rv = runs;
+	struct read_verify		*end = runs + nr;
+	struct rvp_chunk		*chunk;
+	unsigned int			i;
+	int				ret;
+
+	for (i = 0; i < RVP_URING_DEPTH; i++)
+		st.free[st.nr_free++] = &chunks[i];
+
+	while (rv < end || frog_uring_inflight(ru->ring) > 0) {
+		while (rv < end && st.nr_free > 0 && !rvp->runtime_error) {
+			if (rv->io_length == 0) {
+				rv++;
+				continue;
+			}
+
+			chunk = st.free[--st.nr_free];
+			chunk->rv = rv;
+			chunk->start = rv->io_start;
+			chunk->len = min(rv->io_length, RVP_URING_IO_SIZE);
+
+			if (ru->fixed)
+				ret = frog_uring_prep_read_fixed(ru->ring,
+						rvp->disk->d_fd, rvp->readbuf,
+						chunk->len, chunk->start, 0,
+						chunk);
+			else
+				ret = frog_uring_prep_rw(ru->ring,
+						FROG_URING_READ,
+						rvp->disk->d_fd, rvp->readbuf,
+						chunk->len, chunk->start,
+						chunk);
+			if (ret) {
+				st.free[st.nr_free++] = chunk;
+				break;
+			}
+
+			rv->io_start += chunk->len;
+			rv->io_length -= chunk->len;
+		}
+
+		/* Don't queue more after a runtime error, but drain the ring. */
+		if (rvp->runtime_error)
+			rv = end;
+
+		ret = frog_uring_submit(ru->ring, 1);
+		if (ret) {
+			/*
+			 * The ring is unusable, but reads may still be landing
+			 * in the read buffer, so wait for them before giving
+			 * up.  If we can't, leak the ring rather than free it
+			 * from under the kernel.
+			 */
+			rvp->runtime_error = -ret;
+			ru->failed = true;
+			if (frog_uring_drain(ru->ring, read_verify_chunk_done,
+					&st))
+				ru->ring = NULL;
+			return -1;
+		}
+		frog_uring_reap(ru->ring, read_verify_chunk_done, &st);
+	}
+
+	return rvp->runtime_error ? -1 : st.verified;
+}
+#else
+# define rvp_get_uring(rvp)			(NULL)
+# define read_verify_uring(rvp, ru, runs, nr)	(-1)
+#endif /* HAVE_IO_URING */
+
+/*
+ * Verify one thread's share of the sorted runs, in disk order.
+ */
+static void
+read_verify_batch(
+	struct workqueue		*wq,
+	xfs_agnumber_t			agno,
+	void				*arg)
+{
+	struct rvp_batch		*batch = arg;
+	struct read_verify_pool		*rvp;
+	struct rvp_uring		*ru;
+	long long			verified = 0;
+	long long			ret;
+	size_t				i;
+
+	rvp = (struct read_verify_pool *)wq->wq_ctx;
+	if (rvp->runtime_error)
+		goto out;
+
+	ru = rvp_get_uring(rvp);
+	if (ru) {
+		verified = read_verify_uring(rvp, ru, batch->runs, batch->nr);
+	} else {
+		for (i = 0; i < batch->nr && !rvp->runtime_error; i++) {
+			ret = read_verify_range(rvp, &batch->runs[i]);
+			if (ret < 0)
+				break;
+			verified += ret;
+		}
+	}
+	if (verified <= 0)
+		goto out;
+
 	ret = ptcounter_add(rvp->verified_bytes, verified);
 	if (ret)
 		rvp->runtime_error = ret;
+out:
+	free(batch);
 }
 
-/* Queue a read verify request. */
+/* Queue one verifier thread's share of the sorted runs. */
 static int
 read_verify_queue(
 	struct read_verify_pool		*rvp,
-	struct read_verify		*rv)
+	struct read_verify		*runs,
+	size_t				nr,
+	unsigned int			index)
 {
-	struct read_verify		*tmp;
-	bool				ret;
+	struct rvp_batch		*batch;
+	int				ret;
 
-	dbg_printf("verify fd %d start %"PRIu64" len %"PRIu64"\n",
-			rvp->disk->d_fd, rv->io_start, rv->io_length);
+	dbg_printf("verify fd %d batch %u start %"PRIu64" runs %zu\n",
+			rvp->disk->d_fd, index, runs->io_start, nr);
 
 	/* Worker thread saw a runtime error, don't queue more. */
 	if (rvp->runtime_error)
 		return rvp->runtime_error;
 
-	/* Otherwise clone the request and queue the copy. */
-	tmp = malloc(sizeof(struct read_verify));
-	if (!tmp) {
+	batch = malloc(sizeof(struct rvp_batch));
+	if (!batch) {
 		rvp->runtime_error = errno;
 		return errno;
 	}
+	batch->runs = runs;
+	batch->nr = nr;
 
-	memcpy(tmp, rv, sizeof(*tmp));
-
-	ret = -workqueue_add(&rvp->wq, read_verify, 0, tmp);
+	ret = -workqueue_add(&rvp->wq, read_verify_batch, index, batch);
 	if (ret) {
-		free(tmp);
+		free(batch);
 		rvp->runtime_error = ret;
 		return ret;
 	}
 
-	rv->io_length = 0;
+	return 0;
+}
+
+/* Park a combined request until the caller forces the IO. */
+static int
+rvp_stash_push(
+	struct rvp_stash		*stash)
+{
+	struct read_verify		*list;
+	size_t				max;
+
+	if (stash->nr == stash->max) {
+		max = stash->max ? stash->max * 2 : 1024;
+		list = realloc(stash->list, max * sizeof(struct read_verify));
+		if (!list)
+			return errno;
+		stash->list = list;
+		stash->max = max;
+	}
+
+	stash->list[stash->nr++] = stash->rv;
+	stash->rv.io_length = 0;
 	return 0;
 }
 
@@ -325,6 +832,7 @@ read_verify_schedule_io(
 	uint64_t			length,
 	void				*end_arg)
 {
+	struct rvp_stash		*stash;
 	struct read_verify		*rv;
 	uint64_t			req_end;
 	uint64_t			rv_end;
@@ -332,13 +840,18 @@ read_verify_schedule_io(
 
 	assert(rvp->readbuf);
 
+	/* Worker thread saw a runtime error, don't queue more. */
+	if (rvp->runtime_error)
+		return rvp->runtime_error;
+
 	/* Round up and down to the start of a miniosz chunk. */
 	start &= ~(rvp->miniosz - 1);
 	length = roundup(length, rvp->miniosz);
 
-	rv = ptvar_get(rvp->rvstate, &ret);
+	stash = ptvar_get(rvp->rvstate, &ret);
 	if (ret)
 		return -ret;
+	rv = &stash->rv;
 	req_end = start + length;
 	rv_end = rv->io_start + rv->io_length;
 
@@ -355,13 +868,13 @@ read_verify_schedule_io(
 		rv->io_start = min(rv->io_start, start);
 		rv->io_length = max(req_end, rv_end) - rv->io_start;
 	} else  {
-		/* Otherwise, issue the stashed IO (if there is one) */
+		/* Otherwise, park the stashed IO (if there is one) */
 		if (rv->io_length > 0) {
-			int	res;
-
-			res = read_verify_queue(rvp, rv);
-			if (res)
-				return res;
+			ret = rvp_stash_push(stash);
+			if (ret) {
+				rvp->runtime_error = ret;
+				return ret;
+			}
 		}
 
 		/* Stash the new IO. */
@@ -373,30 +886,182 @@ read_verify_schedule_io(
 	return 0;
 }
 
-/* Force any per-thread stashed IOs into the verifier. */
+struct rvp_gather {
+	struct read_verify		*runs;
+	size_t				nr;
+};
+
+/* Count the requests that a submitter thread stashed. */
 static int
-force_one_io(
-	struct ptvar		*ptv,
-	void			*data,
-	void			*foreach_arg)
+rvp_count_stash(
+	struct ptvar			*ptv,
+	void				*data,
+	void				*foreach_arg)
 {
-	struct read_verify_pool	*rvp = foreach_arg;
-	struct read_verify	*rv = data;
+	struct rvp_stash		*stash = data;
+	size_t				*nr = foreach_arg;
 
-	if (rv->io_length == 0)
-		return 0;
+	*nr += stash->nr + (stash->rv.io_length > 0);
+	return 0;
+}
+
+/* Move a submitter thread's stashed requests into the big array. */
+static int
+rvp_gather_stash(
+	struct ptvar			*ptv,
+	void				*data,
+	void				*foreach_arg)
+{
+	struct rvp_stash		*stash = data;
+	struct rvp_gather		*gather = foreach_arg;
 
-	return -read_verify_queue(rvp, rv);
+	memcpy(gather->runs + gather->nr, stash->list,
+			stash->nr * sizeof(struct read_verify));
+	gather->nr += stash->nr;
+	if (stash->rv.io_length > 0)
+		gather->runs[gather->nr++] = stash->rv;
+
+	free(stash->list);
+	stash->list = NULL;
+	stash->nr = stash->max = 0;
+	stash->rv.io_length = 0;
+	return 0;
 }
 
-/* Force any stashed IOs into the verifier. */
+static int
+rvp_cmp_start(
+	const void			*a,
+	const void			*b)
+{
+	const struct read_verify	*ra = a;
+	const struct read_verify	*rb = b;
+
+	if (ra->io_start < rb->io_start)
+		return -1;
+	if (ra->io_start > rb->io_start)
+		return 1;
+	return 0;
+}
+
+/*
+ * Merge sorted requests that overlap or sit within a batch locality of each
+ * other into maximal runs.  Returns the new number of runs.
+ */
+static size_t
+rvp_merge_runs(
+	struct read_verify		*runs,
+	size_t				nr)
+{
+	struct read_verify		*rv = runs;
+	uint64_t			rv_end;
+	size_t				i;
+
+	for (i = 1; i < nr; i++) {
+		rv_end = rv->io_start + rv->io_length;
+		if (runs[i].io_end_arg == rv->io_end_arg &&
+		    runs[i].io_start <= rv_end + RVP_IO_BATCH_LOCALITY) {
+			rv->io_length = max(rv_end,
+					runs[i].io_start + runs[i].io_length) -
+					rv->io_start;
+			continue;
+		}
+		*(++rv) = runs[i];
+	}
+
+	return rv - runs + 1;
+}
+
+/*
+ * Force all stashed IOs into the verifier.  Call this once, after the last
+ * request has been scheduled.  We sort every stashed request by disk address,
+ * merge them into maximal runs, and cut the runs into one contiguous share of
+ * the bytes per disk head, splitting a run if it straddles a boundary.
+ */
 int
 read_verify_force_io(
 	struct read_verify_pool		*rvp)
 {
+	struct rvp_gather		gather = { NULL };
+	struct read_verify		*runs;
+	struct read_verify		rv;
+	uint64_t			total = 0;
+	uint64_t			share;
+	uint64_t			batch_bytes = 0;
+	uint64_t			len;
+	size_t				nr = 0;
+	size_t				cap;
+	size_t				r, w = 0;
+	size_t				batch_start = 0;
+	unsigned int			nr_batches = 0;
+	int				ret;
+
 	assert(rvp->readbuf);
+	assert(rvp->runs == NULL);
+
+	if (rvp->runtime_error)
+		return rvp->runtime_error;
+
+	ret = -ptvar_foreach(rvp->rvstate, rvp_count_stash, &nr);
+	if (ret)
+		return ret;
+	if (nr == 0)
+		return 0;
+
+	/* Leave room to split a run at each share boundary. */
+	cap = nr + rvp->nr_heads;
+	gather.runs = malloc(cap * sizeof(struct read_verify));
+	if (!gather.runs) {
+		rvp->runtime_error = errno;
+		return errno;
+	}
+	ret = -ptvar_foreach(rvp->rvstate, rvp_gather_stash, &gather);
+	if (ret) {
+		free(gather.runs);
+		return ret;
+	}
+	runs = gather.runs;
+
+	qsort(runs, gather.nr, sizeof(struct read_verify), rvp_cmp_start);
+	nr = rvp_merge_runs(runs, gather.nr);
+	for (r = 0; r < nr; r++)
+		total += runs[r].io_length;
+	share = roundup((total + rvp->nr_heads - 1) / rvp->nr_heads,
+			rvp->miniosz);
+
+	/*
+	 * Move the merged runs to the end of the array so that we can write
+	 * the split runs from the front without overwriting anything that we
+	 * haven't read yet.  There's at least one free slot per head.
+	 */
+	memmove(runs + cap - nr, runs, nr * sizeof(struct read_verify));
+	rvp->runs = runs;
 
-	return -ptvar_foreach(rvp->rvstate, force_one_io, rvp);
+	for (r = cap - nr; r < cap; r++) {
+		rv = runs[r];
+		while (batch_bytes + rv.io_length > share &&
+		       nr_batches < rvp->nr_heads - 1) {
+			len = share - batch_bytes;
+			if (len > 0) {
+				runs[w] = rv;
+				runs[w++].io_length = len;
+				rv.io_start += len;
+				rv.io_length -= len;
+			}
+			ret = read_verify_queue(rvp, runs + batch_start,
+					w - batch_start, nr_batches++);
+			if (ret)
+				return ret;
+			batch_start = w;
+			batch_bytes = 0;
+		}
+		runs[w++] = rv;
+		batch_bytes += rv.io_length;
+	}
+
+	if (w > batch_start)
+		return read_verify_queue(rvp, runs + batch_start,
+				w - batch_start, nr_batches);
+	return 0;
 }
 
 /* How many bytes has this process verified? */
@@ -135,6 +135,10 @@ unsigned int			bg_mode;
 /* Number of threads we're allowed to use. */
 unsigned int			force_nr_threads;
 
+/* Media verify bandwidth target (bytes/sec) and latency budget (ns). */
+unsigned long long		verify_target_bw;
+unsigned long long		verify_max_latency;
+
 /* Verbosity; higher values print more information. */
 bool				verbose;
 
@@ -176,6 +180,7 @@ usage(void)
 	fprintf(stderr, _("  -k           Do not FITRIM the free space.\n"));
 	fprintf(stderr, _("  -m path      Path to /etc/mtab.\n"));
 	fprintf(stderr, _("  -n           Dry run.  Do not modify anything.\n"));
+	fprintf(stderr, _("  -o subopts   Extra options, see the manual page.\n"));
 	fprintf(stderr, _("  -T           Display timing/usage information.\n"));
 	fprintf(stderr, _("  -v           Verbose output.\n"));
 	fprintf(stderr, _("  -V           Print version.\n"));
@@ -184,6 +189,63 @@ usage(void)
 	exit(SCRUB_RET_SYNTAX);
 }
 
+enum o_opt_nums {
+	VERIFY_BW = 0,
+	VERIFY_LAT,
+	O_MAX_OPTS,
+};
+
+static char *o_opts[] = {
+	[VERIFY_BW]		= "verify_bw",
+	[VERIFY_LAT]		= "verify_lat",
+	[O_MAX_OPTS]		= NULL,
+};
+
+/* Parse the -o suboptions. */
+static void
+parse_o_opts(
+	char			*p)
+{
+	while (*p != '\0') {
+		char		*val;
+		unsigned long long x;
+
+		switch (getsubopt(&p, o_opts, &val)) {
+		case VERIFY_BW:
+			if (!val) {
+				fprintf(stderr,
+	_("-o verify_bw requires a parameter\n"));
+				usage();
+			}
+			x = cvt_u64(val, 10);
+			if (errno || x == 0) {
+				fprintf(stderr,
+	_("-o verify_bw must be a positive number of MiB/s\n"));
+				usage();
+			}
+			verify_target_bw = x << 20;
+			break;
+		case VERIFY_LAT:
+			if (!val) {
+				fprintf(stderr,
+	_("-o verify_lat requires a parameter\n"));
+				usage();
+			}
+			x = cvt_u64(val, 10);
+			if (errno || x == 0) {
+				fprintf(stderr,
+	_("-o verify_lat must be a positive number of milliseconds\n"));
+				usage();
+			}
+			verify_max_latency = x * 1000 * NSEC_PER_USEC;
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+}
+
 #ifndef RUSAGE_BOTH
 # define RUSAGE_BOTH		(-2)
 #endif
@@ -632,7 +694,7 @@ main(
 	pthread_mutex_init(&ctx.lock, NULL);
 	ctx.mode = SCRUB_MODE_REPAIR;
 	ctx.error_action = ERRORS_CONTINUE;
-	while ((c = getopt(argc, argv, "a:bC:de:km:nTvxV")) != EOF) {
+	while ((c = getopt(argc, argv, "a:bC:de:km:no:TvxV")) != EOF) {
 		switch (c) {
 		case 'a':
 			ctx.max_errors = cvt_u64(optarg, 10);
@@ -682,6 +744,9 @@ main(
 		case 'n':
 			ctx.mode = SCRUB_MODE_DRY_RUN;
 			break;
+		case 'o':
+			parse_o_opts(optarg);
+			break;
 		case 'T':
 			display_rusage = true;
 			break;
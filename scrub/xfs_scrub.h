@@ -14,6 +14,8 @@ extern char *progname;
 
 extern unsigned int		force_nr_threads;
 extern unsigned int		bg_mode;
+extern unsigned long long	verify_target_bw;
+extern unsigned long long	verify_max_latency;
 extern unsigned int		debug;
 extern bool			verbose;
 extern long			page_size;
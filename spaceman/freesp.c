@@ -10,6 +10,7 @@
 #include <linux/fiemap.h>
 #include <linux/fsmap.h>
 #include "libfrog/fsgeom.h"
+#include "libfrog/workqueue.h"
 #include "command.h"
 #include "init.h"
 #include "libfrog/paths.h"
@@ -24,6 +25,30 @@ struct histent
 	long long	blocks;
 };
 
+struct histbin {
+	long long	count;
+	long long	blocks;
+};
+
+/*
+ * Free space found in one AG (or the realtime device).  Each scan keeps its
+ * own histogram so that AGs can be scanned in parallel; they are merged into
+ * the global one once all the scans are done.
+ */
+struct agscan {
+	xfs_agnumber_t		agno;
+	unsigned long long	freeexts;
+	unsigned long long	freeblks;
+	struct histbin		*bins;
+	int			error;
+};
+
+enum freesp_fmt {
+	FREESP_TEXT,
+	FREESP_JSON,
+	FREESP_CSV,
+};
+
 static int		agcount;
 static xfs_agnumber_t	*aglist;
 static struct histent	*hist;
@@ -37,6 +62,8 @@ static int		gflag;
 static bool		rtflag;
 static long long	totblocks;
 static long long	totexts;
+static unsigned int	nr_threads;
+static enum freesp_fmt	outfmt;
 
 static cmdinfo_t freesp_cmd;
 
@@ -60,22 +87,29 @@ addhistent(
 
 static void
 addtohist(
-	xfs_agnumber_t	agno,
+	struct agscan	*scan,
 	xfs_agblock_t	agbno,
 	off64_t		len)
 {
-	long		i;
+	long		lo = 0, hi = histcount;
 
 	if (dumpflag)
-		printf("%8d %8d %8"PRId64"\n", agno, agbno, len);
-	totexts++;
-	totblocks += len;
-	for (i = 0; i < histcount; i++) {
-		if (hist[i].high >= len) {
-			hist[i].count++;
-			hist[i].blocks += len;
-			break;
-		}
+		printf("%8d %8d %8"PRId64"\n", scan->agno, agbno, len);
+	scan->freeexts++;
+	scan->freeblks += len;
+
+	/* Find the first bucket whose upper bound covers len. */
+	while (lo < hi) {
+		long	mid = lo + (hi - lo) / 2;
+
+		if (hist[mid].high >= len)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	if (lo < histcount) {
+		scan->bins[lo].count++;
+		scan->bins[lo].blocks += len;
 	}
 }
 
@@ -115,15 +149,126 @@ histinit(
 static void
 printhist(void)
 {
-	int	i;
+	const char	*sep = "";
+	int		i;
 
-	printf("%7s %7s %7s %7s %6s\n",
-		_("from"), _("to"), _("extents"), _("blocks"), _("pct"));
+	switch (outfmt) {
+	case FREESP_TEXT:
+		printf("%7s %7s %7s %7s %6s\n",
+			_("from"), _("to"), _("extents"), _("blocks"),
+			_("pct"));
+		break;
+	case FREESP_JSON:
+		printf(" \"histogram\": [");
+		break;
+	case FREESP_CSV:
+		printf("from,to,extents,blocks,pct\n");
+		break;
+	}
 	for (i = 0; i < histcount; i++) {
-		if (hist[i].count)
+		if (!hist[i].count)
+			continue;
+		switch (outfmt) {
+		case FREESP_TEXT:
 			printf("%7lld %7lld %7lld %7lld %6.2f\n", hist[i].low,
 				hist[i].high, hist[i].count, hist[i].blocks,
 				hist[i].blocks * 100.0 / totblocks);
+			break;
+		case FREESP_JSON:
+			printf(
+"%s\n  {\"from\": %lld, \"to\": %lld, \"extents\": %lld, \"blocks\": %lld, \"pct\": %.2f}",
+				sep, hist[i].low, hist[i].high, hist[i].count,
+				hist[i].blocks,
+				hist[i].blocks * 100.0 / totblocks);
+			sep = ",";
+			break;
+		case FREESP_CSV:
+			printf("%lld,%lld,%lld,%lld,%.2f\n", hist[i].low,
+				hist[i].high, hist[i].count, hist[i].blocks,
+				hist[i].blocks * 100.0 / totblocks);
+			break;
+		}
+	}
+	if (outfmt == FREESP_JSON)
+		printf("\n ]");
+}
+
+static void
+printagsum(
+	struct agscan	*scans,
+	unsigned int	nr)
+{
+	const char	*sep = "";
+	unsigned int	i;
+
+	switch (outfmt) {
+	case FREESP_TEXT:
+		printf(_("        AG    extents     blocks\n"));
+		break;
+	case FREESP_JSON:
+		printf(" \"ags\": [");
+		break;
+	case FREESP_CSV:
+		printf("agno,extents,blocks\n");
+		break;
+	}
+	for (i = 0; i < nr; i++) {
+		struct agscan	*scan = &scans[i];
+
+		switch (outfmt) {
+		case FREESP_TEXT:
+			if (scan->agno == NULLAGNUMBER)
+				printf(_("     rtdev %10llu %10llu\n"),
+						scan->freeexts, scan->freeblks);
+			else
+				printf(_("%10u %10llu %10llu\n"), scan->agno,
+						scan->freeexts, scan->freeblks);
+			break;
+		case FREESP_JSON:
+			printf("%s\n  {\"agno\": ", sep);
+			if (scan->agno == NULLAGNUMBER)
+				printf("\"rtdev\"");
+			else
+				printf("%u", scan->agno);
+			printf(", \"extents\": %llu, \"blocks\": %llu}",
+					scan->freeexts, scan->freeblks);
+			sep = ",";
+			break;
+		case FREESP_CSV:
+			if (scan->agno == NULLAGNUMBER)
+				printf("rtdev");
+			else
+				printf("%u", scan->agno);
+			printf(",%llu,%llu\n", scan->freeexts,
+					scan->freeblks);
+			break;
+		}
+	}
+	if (outfmt == FREESP_JSON)
+		printf("\n ]");
+}
+
+static void
+printsummary(void)
+{
+	double		avg = totexts ? (double)totblocks / totexts : 0;
+
+	switch (outfmt) {
+	case FREESP_TEXT:
+		printf(_("total free extents %lld\n"), totexts);
+		printf(_("total free blocks %lld\n"), totblocks);
+		printf(_("average free extent size %g\n"),
+			(double)totblocks / (double)totexts);
+		break;
+	case FREESP_JSON:
+		printf(
+" \"summary\": {\"extents\": %lld, \"blocks\": %lld, \"average\": %g}",
+			totexts, totblocks, avg);
+		break;
+	case FREESP_CSV:
+		printf("extents,blocks,average\n");
+		printf("%lld,%lld,%g\n", totexts, totblocks, avg);
+		break;
 	}
 }
 
@@ -141,12 +286,21 @@ inaglist(
 	return 0;
 }
 
-#define NR_EXTENTS 128
+/*
+ * Start with small fsmap batches so that mostly full AGs don't pay for a big
+ * buffer, and double the batch every time the kernel fills it up.
+ */
+#define NR_EXTENTS	128
+#define NR_EXTENTS_MAX	8192
 
 static void
 scan_ag(
-	xfs_agnumber_t		agno)
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
 {
+	struct agscan		*scan = arg;
+	xfs_agnumber_t		agno = scan->agno;
 	struct fsmap_head	*fsmap;
 	struct fsmap		*extent;
 	struct fsmap		*l, *h;
@@ -154,20 +308,19 @@ scan_ag(
 	struct xfs_fd		*xfd = &file->xfd;
 	off64_t			aglen;
 	xfs_agblock_t		agbno;
-	unsigned long long	freeblks = 0;
-	unsigned long long	freeexts = 0;
+	unsigned int		nr = NR_EXTENTS;
 	int			ret;
 	int			i;
 
-	fsmap = malloc(fsmap_sizeof(NR_EXTENTS));
+	fsmap = malloc(fsmap_sizeof(nr));
 	if (!fsmap) {
 		fprintf(stderr, _("%s: fsmap malloc failed.\n"), progname);
-		exitcode = 1;
+		scan->error = 1;
 		return;
 	}
 
 	memset(fsmap, 0, sizeof(*fsmap));
-	fsmap->fmh_count = NR_EXTENTS;
+	fsmap->fmh_count = nr;
 	l = fsmap->fmh_keys;
 	h = fsmap->fmh_keys + 1;
 	if (agno != NULLAGNUMBER) {
@@ -189,7 +342,7 @@ scan_ag(
 			fprintf(stderr, _("%s: FS_IOC_GETFSMAP [\"%s\"]: %s\n"),
 				progname, file->name, strerror(errno));
 			free(fsmap);
-			exitcode = 1;
+			scan->error = 1;
 			return;
 		}
 
@@ -205,27 +358,123 @@ scan_ag(
 				continue;
 			agbno = cvt_b_to_agbno(xfd, extent->fmr_physical);
 			aglen = cvt_b_to_off_fsbt(xfd, extent->fmr_length);
-			freeblks += aglen;
-			freeexts++;
 
-			addtohist(agno, agbno, aglen);
+			addtohist(scan, agbno, aglen);
 		}
 
 		p = &fsmap->fmh_recs[fsmap->fmh_entries - 1];
 		if (p->fmr_flags & FMR_OF_LAST)
 			break;
 		fsmap_advance(fsmap);
+
+		if (fsmap->fmh_entries == nr && nr < NR_EXTENTS_MAX) {
+			struct fsmap_head	*bigger;
+
+			bigger = realloc(fsmap, fsmap_sizeof(nr * 2));
+			if (bigger) {
+				fsmap = bigger;
+				nr *= 2;
+				fsmap->fmh_count = nr;
+			}
+		}
+	}
+
+	free(fsmap);
+}
+
+/* Scan the AGs (or the rt device), merge the results, and report them. */
+static int
+scan_all(void)
+{
+	struct xfs_fsop_geom	*fsgeom = &file->xfd.fsgeom;
+	struct workqueue	wq;
+	struct agscan		*scans;
+	struct histbin		*bins;
+	xfs_agnumber_t		agno;
+	unsigned int		nr = 0;
+	unsigned int		i;
+	int			j;
+	int			ret;
+
+	scans = calloc(rtflag ? 1 : fsgeom->agcount, sizeof(*scans));
+	bins = calloc((rtflag ? 1 : fsgeom->agcount) * max(histcount, 1),
+			sizeof(*bins));
+	if (!scans || !bins) {
+		fprintf(stderr, _("%s: scan malloc failed.\n"), progname);
+		free(scans);
+		free(bins);
+		return 1;
 	}
 
+	if (rtflag) {
+		scans[nr].bins = bins;
+		scans[nr++].agno = NULLAGNUMBER;
+	}
+	for (agno = 0; !rtflag && agno < fsgeom->agcount; agno++) {
+		if (!inaglist(agno))
+			continue;
+		scans[nr].bins = bins + nr * max(histcount, 1);
+		scans[nr++].agno = agno;
+	}
+
+	/* The debug dump prints every extent, so keep it in order. */
+	ret = -workqueue_create(&wq, NULL,
+			dumpflag || nr_threads < 2 ? 0 : min(nr_threads, nr));
+	if (ret) {
+		fprintf(stderr, _("%s: could not create workqueue: %s\n"),
+				progname, strerror(ret));
+		goto out;
+	}
+	for (i = 0; i < nr; i++) {
+		ret = -workqueue_add(&wq, scan_ag, i, &scans[i]);
+		if (ret) {
+			fprintf(stderr, _("%s: could not queue AG scan: %s\n"),
+					progname, strerror(ret));
+			break;
+		}
+	}
+	if (workqueue_terminate(&wq) && !ret)
+		ret = 1;
+	workqueue_destroy(&wq);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < nr; i++) {
+		if (scans[i].error)
+			ret = 1;
+		totexts += scans[i].freeexts;
+		totblocks += scans[i].freeblks;
+		for (j = 0; j < histcount; j++) {
+			hist[j].count += scans[i].bins[j].count;
+			hist[j].blocks += scans[i].bins[j].blocks;
+		}
+	}
+
+	if (outfmt == FREESP_JSON)
+		printf("{\n \"blocksize\": %u", fsgeom->blocksize);
 	if (gflag) {
-		if (agno == NULLAGNUMBER)
-			printf(_("     rtdev %10llu %10llu\n"), freeexts,
-					freeblks);
-		else
-			printf(_("%10u %10llu %10llu\n"), agno, freeexts,
-					freeblks);
+		if (outfmt == FREESP_JSON)
+			printf(",\n");
+		printagsum(scans, nr);
 	}
-	free(fsmap);
+	if (histcount && !gflag) {
+		if (outfmt == FREESP_JSON)
+			printf(",\n");
+		printhist();
+	}
+	if (summaryflag) {
+		if (outfmt == FREESP_JSON)
+			printf(",\n");
+		else if (outfmt == FREESP_CSV && (gflag || histcount))
+			printf("\n");
+		printsummary();
+	}
+	if (outfmt == FREESP_JSON)
+		printf("\n}\n");
+out:
+	free(bins);
+	free(scans);
+	return ret;
 }
 
 static void
@@ -260,8 +509,10 @@ init(
 	aglist = NULL;
 	hist = NULL;
 	rtflag = false;
+	nr_threads = 1;
+	outfmt = FREESP_TEXT;
 
-	while ((c = getopt(argc, argv, "a:bde:gh:m:rs")) != EOF) {
+	while ((c = getopt(argc, argv, "a:bde:gh:j:m:o:rs")) != EOF) {
 		switch (c) {
 		case 'a':
 			aglistadd(optarg);
@@ -297,6 +548,13 @@ init(
 			addhistent(x);
 			speced = 1;
 			break;
+		case 'j':
+			nr_threads = cvt_u32(optarg, 0);
+			if (errno)
+				return command_usage(&freesp_cmd);
+			if (nr_threads == 0)
+				nr_threads = platform_nproc();
+			break;
 		case 'm':
 			if (speced)
 				goto many_spec;
@@ -305,6 +563,16 @@ init(
 				return command_usage(&freesp_cmd);
 			speced = 1;
 			break;
+		case 'o':
+			if (!strcmp(optarg, "json"))
+				outfmt = FREESP_JSON;
+			else if (!strcmp(optarg, "csv"))
+				outfmt = FREESP_CSV;
+			else if (!strcmp(optarg, "text"))
+				outfmt = FREESP_TEXT;
+			else
+				return command_usage(&freesp_cmd);
+			break;
 		case 'r':
 			rtflag = true;
 			break;
@@ -317,6 +585,10 @@ init(
 	}
 	if (optind != argc)
 		return 0;
+	if (dumpflag && outfmt != FREESP_TEXT) {
+		printf(_("-d cannot be combined with -o.\n"));
+		return 0;
+	}
 	if (!speced)
 		multsize = 2;
 	histinit(fsgeom->agblocks);
@@ -333,27 +605,10 @@ freesp_f(
 	int			argc,
 	char			**argv)
 {
-	struct xfs_fsop_geom	*fsgeom = &file->xfd.fsgeom;
-	xfs_agnumber_t		agno;
-
 	if (!init(argc, argv))
 		return 0;
-	if (gflag)
-		printf(_("        AG    extents     blocks\n"));
-	if (rtflag)
-		scan_ag(NULLAGNUMBER);
-	for (agno = 0; !rtflag && agno < fsgeom->agcount; agno++) {
-		if (inaglist(agno))
-			scan_ag(agno);
-	}
-	if (histcount && !gflag)
-		printhist();
-	if (summaryflag) {
-		printf(_("total free extents %lld\n"), totexts);
-		printf(_("total free blocks %lld\n"), totblocks);
-		printf(_("average free extent size %g\n"),
-			(double)totblocks / (double)totexts);
-	}
+	if (scan_all())
+		exitcode = 1;
 	if (aglist)
 		free(aglist);
 	if (hist)
@@ -375,7 +630,9 @@ freesp_help(void)
 " -g       -- Print only a per-AG summary.\n"
 " -h hbsz  -- Use custom histogram bin size of h1.\n"
 "             Multiple specifications are allowed.\n"
+" -j nr    -- Scan nr AGs in parallel (0 means one per CPU).\n"
 " -m bmult -- Use histogram bin size multiplier of bmult.\n"
+" -o fmt   -- Print the report as text, json, or csv.\n"
 " -r       -- Display realtime device free space information.\n"
 " -s       -- Emit freespace summary information.\n"
 "\n"
@@ -392,7 +649,7 @@ freesp_init(void)
 	freesp_cmd.cfunc = freesp_f;
 	freesp_cmd.argmin = 0;
 	freesp_cmd.argmax = -1;
-	freesp_cmd.args = "[-dgrs] [-a agno]... [ -b | -e bsize | -h h1... | -m bmult ]";
+	freesp_cmd.args = "[-dgrs] [-a agno]... [-j nr] [-o fmt] [ -b | -e bsize | -h h1... | -m bmult ]";
 	freesp_cmd.flags = CMD_FLAG_ONESHOT;
 	freesp_cmd.oneline = _("Examine filesystem free space");
 	freesp_cmd.help = freesp_help;
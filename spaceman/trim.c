@@ -14,6 +14,256 @@
 
 static cmdinfo_t trim_cmd;
 
+/*
+ * Incremental trim
+ *
+ * A single FITRIM over a big range can keep thin provisioned storage busy
+ * for minutes, stalling everything else.  Instead, walk the range one AG at
+ * a time in chunks of at most chunk bytes, optionally pacing the calls to
+ * stay under a bandwidth limit and shrinking the chunks when a call takes
+ * longer than the latency target.  Progress is recorded in a state file
+ * after each chunk so that an interrupted trim can pick up where it left
+ * off.
+ */
+#define TRIM_MIN_CHUNK		(1ULL << 20)
+#define TRIM_STATE_MAGIC	"xfs_spaceman-trim-v1"
+
+struct trim_sched {
+	unsigned long long	chunk;		/* current bytes per FITRIM */
+	unsigned long long	max_chunk;	/* chunk size limit */
+	unsigned long long	bandwidth;	/* bytes trimmed per second */
+	unsigned int		latency_ms;	/* target time per FITRIM */
+	unsigned long long	minfree;	/* skip AGs with less free space */
+	const char		*statefile;
+	unsigned long long	trimmed;
+};
+
+static uint64_t
+trim_now_ns(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+trim_sleep_ns(
+	uint64_t		ns)
+{
+	struct timespec		ts = {
+		.tv_sec		= ns / 1000000000ULL,
+		.tv_nsec	= ns % 1000000000ULL,
+	};
+
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+static void
+trim_state_key(
+	char			*key,
+	size_t			keylen,
+	off64_t			offset,
+	ssize_t			length,
+	ssize_t			minlen)
+{
+	unsigned char		*uuid = file->xfd.fsgeom.uuid;
+	char			*p;
+	int			i;
+
+	p = key + snprintf(key, keylen, "%s ", TRIM_STATE_MAGIC);
+	for (i = 0; i < 16 && p < key + keylen - 2; i++)
+		p += sprintf(p, "%02x", uuid[i]);
+	snprintf(p, keylen - (p - key), " %lld %lld %lld",
+			(long long)offset, (long long)length,
+			(long long)minlen);
+}
+
+/*
+ * Find out where a previous run of the same trim stopped.  A state file for
+ * a different filesystem or range is ignored.
+ */
+static off64_t
+trim_state_load(
+	const char		*path,
+	const char		*key,
+	off64_t			offset)
+{
+	char			line[256];
+	long long		next;
+	FILE			*fp;
+	size_t			len = strlen(key);
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return offset;
+	if (fgets(line, sizeof(line), fp) &&
+	    !strncmp(line, key, len) && line[len] == '\n' &&
+	    fscanf(fp, "%lld", &next) == 1 && next >= offset) {
+		fclose(fp);
+		return next;
+	}
+	fclose(fp);
+	fprintf(stderr, _("%s: ignoring stale trim state file \"%s\"\n"),
+			progname, path);
+	return offset;
+}
+
+static int
+trim_state_save(
+	const char		*path,
+	const char		*key,
+	off64_t			next)
+{
+	char			tmp[PATH_MAX];
+	FILE			*fp;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (!fp)
+		goto fail;
+	fprintf(fp, "%s\n%lld\n", key, (long long)next);
+	if (fflush(fp) || fsync(fileno(fp))) {
+		fclose(fp);
+		goto fail;
+	}
+	if (fclose(fp) || rename(tmp, path))
+		goto fail;
+	return 0;
+fail:
+	fprintf(stderr, _("%s: cannot write trim state file \"%s\": %s\n"),
+			progname, path, strerror(errno));
+	return -1;
+}
+
+/* Does this AG have enough free space to be worth trimming? */
+static bool
+trim_ag_worthwhile(
+	struct trim_sched	*ts,
+	xfs_agnumber_t		agno)
+{
+	struct xfs_fd		*xfd = &file->xfd;
+	struct xfs_ag_geometry	ageo = { 0 };
+
+	if (!ts->minfree)
+		return true;
+	/* If the kernel can't tell us, trim it anyway. */
+	if (xfrog_ag_geometry(xfd->fd, agno, &ageo))
+		return true;
+	return cvt_off_fsb_to_b(xfd, ageo.ag_freeblks) >= ts->minfree;
+}
+
+/* Adjust the chunk size so that each FITRIM takes about latency_ms. */
+static void
+trim_adjust_chunk(
+	struct trim_sched	*ts,
+	uint64_t		elapsed_ns)
+{
+	uint64_t		target_ns = ts->latency_ms * 1000000ULL;
+
+	if (!ts->latency_ms)
+		return;
+	if (elapsed_ns > target_ns)
+		ts->chunk = max(ts->chunk / 2, TRIM_MIN_CHUNK);
+	else if (elapsed_ns < target_ns / 2)
+		ts->chunk = min(ts->chunk * 2, ts->max_chunk);
+}
+
+static int
+trim_incremental(
+	struct trim_sched	*ts,
+	off64_t			offset,
+	ssize_t			length,
+	ssize_t			minlen)
+{
+	struct xfs_fd		*xfd = &file->xfd;
+	struct fstrim_range	trim;
+	char			key[256];
+	off64_t			agbytes;
+	off64_t			pos = offset;
+	off64_t			end = offset + length;
+	xfs_agnumber_t		agno = NULLAGNUMBER;
+	xfs_agnumber_t		next_ag;
+	uint64_t		start_ns;
+	uint64_t		t0, elapsed;
+	int			ret;
+
+	agbytes = cvt_off_fsb_to_b(xfd, xfd->fsgeom.agblocks);
+	if (!ts->max_chunk)
+		ts->max_chunk = agbytes;
+	ts->max_chunk = max(ts->max_chunk, TRIM_MIN_CHUNK);
+
+	/*
+	 * With a latency target, start small and let the controller grow the
+	 * chunks, so that the very first call can't stall the device for as
+	 * long as a whole AG takes to trim.
+	 */
+	if (ts->latency_ms)
+		ts->chunk = TRIM_MIN_CHUNK;
+	else
+		ts->chunk = ts->max_chunk;
+
+	if (ts->statefile) {
+		trim_state_key(key, sizeof(key), offset, length, minlen);
+		pos = trim_state_load(ts->statefile, key, offset);
+	}
+
+	start_ns = trim_now_ns();
+	while (pos < end) {
+		off64_t		ag_end;
+		off64_t		chunk_end;
+
+		next_ag = cvt_daddr_to_agno(xfd, cvt_btobbt(pos));
+		ag_end = cvt_agbno_to_b(xfd, next_ag + 1, 0);
+		if (next_ag != agno) {
+			agno = next_ag;
+			if (!trim_ag_worthwhile(ts, agno)) {
+				pos = min(ag_end, end);
+				goto checkpoint;
+			}
+		}
+
+		chunk_end = min(pos + (off64_t)ts->chunk, min(ag_end, end));
+		trim.start = pos;
+		trim.len = chunk_end - pos;
+		trim.minlen = minlen;
+
+		t0 = trim_now_ns();
+		ret = ioctl(xfd->fd, FITRIM, (unsigned long)&trim);
+		if (ret < 0) {
+			fprintf(stderr, "%s: ioctl(FITRIM) [\"%s\"]: %s\n",
+				progname, file->name, strerror(errno));
+			return -1;
+		}
+		elapsed = trim_now_ns() - t0;
+
+		/* FITRIM tells us how many bytes it actually discarded. */
+		ts->trimmed += trim.len;
+		pos = chunk_end;
+		trim_adjust_chunk(ts, elapsed);
+
+		if (ts->bandwidth) {
+			/* Split the division so that big trims don't overflow. */
+			uint64_t	due = ts->trimmed / ts->bandwidth *
+						1000000000ULL +
+					(ts->trimmed % ts->bandwidth) *
+						1000000000ULL / ts->bandwidth;
+			uint64_t	now = trim_now_ns() - start_ns;
+
+			if (due > now)
+				trim_sleep_ns(due - now);
+		}
+checkpoint:
+		if (ts->statefile && trim_state_save(ts->statefile, key, pos))
+			return -1;
+	}
+
+	if (ts->statefile)
+		unlink(ts->statefile);
+	return 0;
+}
+
 /*
  * Trim unused space in xfs filesystem.
  */
@@ -29,12 +279,14 @@ trim_f(
 	off64_t			offset = 0;
 	ssize_t			length = 0;
 	ssize_t			minlen = 0;
+	struct trim_sched	ts = { 0 };
+	bool			incremental = false;
 	int			aflag = 0;
 	int			fflag = 0;
 	int			ret;
 	int			c;
 
-	while ((c = getopt(argc, argv, "a:fm:")) != EOF) {
+	while ((c = getopt(argc, argv, "a:b:c:fg:m:s:t:")) != EOF) {
 		switch (c) {
 		case 'a':
 			aflag = 1;
@@ -44,13 +296,52 @@ trim_f(
 				return command_usage(&trim_cmd);
 			}
 			break;
+		case 'b':
+			ts.bandwidth = cvtnum(fsgeom->blocksize,
+					fsgeom->sectsize, optarg);
+			if ((long long)ts.bandwidth <= 0) {
+				printf(_("bad bandwidth value %s\n"), optarg);
+				return command_usage(&trim_cmd);
+			}
+			incremental = true;
+			break;
+		case 'c':
+			ts.max_chunk = cvtnum(fsgeom->blocksize,
+					fsgeom->sectsize, optarg);
+			if ((long long)ts.max_chunk <= 0) {
+				printf(_("bad chunk size %s\n"), optarg);
+				return command_usage(&trim_cmd);
+			}
+			incremental = true;
+			break;
 		case 'f':
 			fflag = 1;
 			break;
+		case 'g':
+			ts.minfree = cvtnum(fsgeom->blocksize,
+					fsgeom->sectsize, optarg);
+			if ((long long)ts.minfree < 0) {
+				printf(_("bad free space value %s\n"), optarg);
+				return command_usage(&trim_cmd);
+			}
+			incremental = true;
+			break;
 		case 'm':
 			minlen = cvtnum(fsgeom->blocksize, fsgeom->sectsize,
 					optarg);
 			break;
+		case 's':
+			ts.statefile = optarg;
+			incremental = true;
+			break;
+		case 't':
+			ts.latency_ms = cvt_u32(optarg, 10);
+			if (errno || !ts.latency_ms) {
+				printf(_("bad latency target %s\n"), optarg);
+				return command_usage(&trim_cmd);
+			}
+			incremental = true;
+			break;
 		default:
 			return command_usage(&trim_cmd);
 		}
@@ -66,7 +357,7 @@ trim_f(
 				argv[optind]);
 		length = cvtnum(fsgeom->blocksize, fsgeom->sectsize,
 				argv[optind + 1]);
-	} else if (agno) {
+	} else if (aflag) {
 		offset = cvt_agbno_to_b(xfd, agno, 0);
 		length = cvt_off_fsb_to_b(xfd, fsgeom->agblocks);
 	} else {
@@ -74,6 +365,12 @@ trim_f(
 		length = cvt_off_fsb_to_b(xfd, fsgeom->datablocks);
 	}
 
+	if (incremental) {
+		if (trim_incremental(&ts, offset, length, minlen))
+			exitcode = 1;
+		return 0;
+	}
+
 	trim.start = offset;
 	trim.len = length;
 	trim.minlen = minlen;
@@ -100,6 +397,13 @@ trim_help(void)
 " -m minlen     -- skip freespace extents smaller than minlen\n"
 "\n"
 "One of -a, -f, or the offset/length pair are required.\n"
+"\n"
+"The following options trim the range an AG at a time in smaller pieces:\n"
+" -b bandwidth  -- trim at most bandwidth bytes per second\n"
+" -c chunk      -- trim at most chunk bytes per call\n"
+" -g minfree    -- skip AGs with less than minfree bytes of free space\n"
+" -s statefile  -- record progress in statefile and resume from it\n"
+" -t msec       -- shrink the chunks if a call takes longer than msec\n"
 "\n"));
 
 }
@@ -111,8 +415,8 @@ trim_init(void)
 	trim_cmd.altname = "tr";
 	trim_cmd.cfunc = trim_f;
 	trim_cmd.argmin = 1;
-	trim_cmd.argmax = 4;
-	trim_cmd.args = "[-m minlen] ( -a agno | -f | offset length )";
+	trim_cmd.argmax = -1;
+	trim_cmd.args = "[-m minlen] [-b bw] [-c chunk] [-g minfree] [-s file] [-t msec] ( -a agno | -f | offset length )";
 	trim_cmd.flags = CMD_FLAG_ONESHOT;
 	trim_cmd.oneline = _("Discard filesystem free space");
 	trim_cmd.help = trim_help;